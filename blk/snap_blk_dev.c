@@ -1,5 +1,9 @@
+#include "config.h"
 #include "snap_blk_dev.h"
 #include "snap_null_blk_dev.h"
+#if HAVE_LIBURING
+#include "snap_uring_blk_dev.h"
+#endif
 
 /**
  * snap_blk_dev_open() - Opens a block device
@@ -15,6 +19,10 @@ struct snap_blk_dev *snap_blk_dev_open(const char *name,
 
 	if (attrs->type == SNAP_BLOCK_DEVICE_NULL)
 		bdev = snap_null_blk_dev_open(name, attrs);
+#if HAVE_LIBURING
+	else if (attrs->type == SNAP_BLOCK_DEVICE_URING)
+		bdev = snap_uring_blk_dev_open(name, attrs);
+#endif
 	else
 		printf("Invalid block device type %d\n", attrs->type);
 
@@ -29,6 +37,10 @@ void snap_blk_dev_close(struct snap_blk_dev *bdev)
 {
 	if (bdev->attrs.type == SNAP_BLOCK_DEVICE_NULL)
 		snap_null_blk_dev_close(bdev);
+#if HAVE_LIBURING
+	else if (bdev->attrs.type == SNAP_BLOCK_DEVICE_URING)
+		snap_uring_blk_dev_close(bdev);
+#endif
 	else
 		printf("Invalid block device type %d\n", bdev->attrs.type);
 }
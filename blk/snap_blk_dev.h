@@ -10,21 +10,38 @@
 /*
  * enum snap_blk_dev_type - bdev types
  * @SNAP_BLOCK_DEVICE_NULL:	NULL Block device
+ * @SNAP_BLOCK_DEVICE_URING:	io_uring over a local file or block device,
+ *				available when built with liburing
  */
 enum snap_blk_dev_type {
 	SNAP_BLOCK_DEVICE_NULL,
+	SNAP_BLOCK_DEVICE_URING,
 };
 
+struct ibv_pd;
+
 /**
  * struct snap_blk_dev_attrs
  * @type:	Type of the bdev
- * @size_b:	Size in blocks
- * @blk_size:	Block size
+ * @size_b:	Size in blocks, 0 - use the size of @path (io_uring only)
+ * @blk_size:	Block size, 0 - use the logical block size of @path
+ *		(io_uring only)
+ * @path:	File or block device to open (io_uring only)
+ * @pd:		Protection domain to register the dma pool with, NULL
+ *		disables the dma pool (io_uring only)
+ * @queue_depth:	Max outstanding requests per thread (io_uring only)
+ * @pool_buf_size:	Size of a dma pool buffer (io_uring only)
+ * @pool_num_bufs:	Number of dma pool buffers (io_uring only)
  */
 struct snap_blk_dev_attrs {
 	enum snap_blk_dev_type type;
 	uint64_t size_b;
 	uint32_t blk_size;
+	const char *path;
+	struct ibv_pd *pd;
+	uint32_t queue_depth;
+	uint32_t pool_buf_size;
+	uint32_t pool_num_bufs;
 };
 
 /**
@@ -66,6 +66,10 @@ struct snap_blk_mempool_ctx {
  *			ZCOPY
  * @is_zcopy_aligned:	pointer to function which returns true if address is
  *			ZCOPY and bdev aligned
+ * @progress:		optional, pointer to function which completes bdev
+ *			operations of the given thread. Called from the
+ *			thread polling the queues that submitted them, with
+ *			the same thread_id.
  *
  * operations provided by the block device given to the virtio controller
  * ToDo: add mechanism to tell which block operations are supported
@@ -103,6 +107,7 @@ struct snap_bdev_ops {
 	void (*dma_pool_cancel)(struct snap_blk_mempool_ctx *mem_ctx);
 	void (*dma_pool_free)(struct snap_blk_mempool_ctx *ctx, void *buf);
 	bool (*dma_pool_enabled)(void *ctx);
+	int (*progress)(void *ctx, int thread_id);
 };
 
 #endif
@@ -0,0 +1,982 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <liburing.h>
+#include <infiniband/verbs.h>
+
+#include "snap_uring_blk_dev.h"
+
+#define SNAP_URING_BLK_MAX_THREADS	64
+#define SNAP_URING_BLK_MAX_FIXED_BUFS	64
+#define SNAP_URING_BLK_QUEUE_DEPTH	1024
+#define SNAP_URING_BLK_POOL_BUF_SIZE	(128 * 1024)
+#define SNAP_URING_BLK_POOL_NUM_BUFS	256
+#define SNAP_URING_BLK_REAP_BATCH	64
+#define SNAP_URING_BLK_BUF_ALIGN	4096
+
+/*
+ * dma_malloc() has no bdev context, so buffers it returns are kept in a
+ * process wide table. Every ring registers the table as io_uring fixed
+ * buffers and re-syncs its copy when the table generation changes, so that
+ * read/write on these buffers use READ_FIXED/WRITE_FIXED and skip page
+ * pinning on each request.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct iovec bufs[SNAP_URING_BLK_MAX_FIXED_BUFS];
+	uint64_t gen;
+} snap_uring_fixed = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.gen = 1,
+};
+
+/**
+ * struct snap_uring_blk_req - outstanding operation
+ * @done_ctx:	user completion context
+ * @len:	expected result of the operation
+ * @bounce:	aligned copy of the user buffers, only used with O_DIRECT when
+ *		the user buffers are not aligned to the logical block size
+ * @iov:	user buffers, data is copied back to them when a bounced read
+ *		completes
+ * @iovcnt:	number of entries in @iov
+ * @buf:	user buffer of read/write, @iov points to it
+ * @read:	operation is a read
+ * @next_free:	next free request slot
+ */
+struct snap_uring_blk_req {
+	struct snap_bdev_io_done_ctx *done_ctx;
+	uint64_t len;
+	void *bounce;
+	const struct iovec *iov;
+	int iovcnt;
+	struct iovec buf;
+	bool read;
+	struct snap_uring_blk_req *next_free;
+};
+
+struct snap_uring_blk_pool_wait {
+	struct snap_blk_mempool_ctx *mem_ctx;
+	TAILQ_ENTRY(snap_uring_blk_pool_wait) entry;
+};
+
+/**
+ * struct snap_uring_blk_thread - per thread io_uring instance
+ * @ring:	  io_uring used by all bdev ops of the thread
+ * @fixed:	  fixed buffer table is registered with @ring
+ * @bufs_gen:	  generation of the fixed buffer table copy in @bufs
+ * @bufs:	  fixed buffer table as registered with @ring
+ * @reqs:	  request slots, one per possible outstanding operation
+ * @free_reqs:	  free request slots
+ * @inflight:	  number of outstanding operations
+ * @pool_waiters: dma pool allocations waiting for a free buffer
+ */
+struct snap_uring_blk_thread {
+	struct io_uring ring;
+	bool fixed;
+	uint64_t bufs_gen;
+	struct iovec bufs[SNAP_URING_BLK_MAX_FIXED_BUFS];
+	struct snap_uring_blk_req *reqs;
+	struct snap_uring_blk_req *free_reqs;
+	uint32_t inflight;
+	TAILQ_HEAD(, snap_uring_blk_pool_wait) pool_waiters;
+};
+
+struct snap_uring_blk_dev {
+	struct snap_blk_dev bdev;
+	char *path;
+	int fd;
+	bool direct;
+	uint32_t queue_depth;
+	struct snap_uring_blk_thread *threads[SNAP_URING_BLK_MAX_THREADS];
+
+	struct ibv_pd *pool_pd;
+	void *pool_buf;
+	struct ibv_mr *pool_mr;
+	uint32_t pool_buf_size;
+	uint32_t pool_num_bufs;
+	pthread_spinlock_t pool_lock;
+	uint32_t *pool_free;
+	uint32_t pool_nfree;
+};
+
+struct snap_uring_blk_io {
+	struct snap_uring_blk_thread *t;
+	struct io_uring_sqe *sqe;
+	struct snap_uring_blk_req *req;
+};
+
+static inline struct snap_uring_blk_dev *to_uring_blk_dev(void *ctx)
+{
+	return (struct snap_uring_blk_dev *)ctx;
+}
+
+static void snap_uring_blk_fixed_add(void *buf, size_t size)
+{
+	int i;
+
+	pthread_mutex_lock(&snap_uring_fixed.lock);
+	for (i = 0; i < SNAP_URING_BLK_MAX_FIXED_BUFS; i++) {
+		if (snap_uring_fixed.bufs[i].iov_base)
+			continue;
+		snap_uring_fixed.bufs[i].iov_base = buf;
+		snap_uring_fixed.bufs[i].iov_len = size;
+		__atomic_add_fetch(&snap_uring_fixed.gen, 1, __ATOMIC_RELEASE);
+		break;
+	}
+	pthread_mutex_unlock(&snap_uring_fixed.lock);
+	/* buffer is still usable, just not as a fixed one */
+	if (i == SNAP_URING_BLK_MAX_FIXED_BUFS)
+		printf("uring_blk: fixed buffer table is full, buffer %p is not registered\n", buf);
+}
+
+static void snap_uring_blk_fixed_del(void *buf)
+{
+	int i;
+
+	pthread_mutex_lock(&snap_uring_fixed.lock);
+	for (i = 0; i < SNAP_URING_BLK_MAX_FIXED_BUFS; i++) {
+		if (snap_uring_fixed.bufs[i].iov_base != buf)
+			continue;
+		snap_uring_fixed.bufs[i].iov_base = NULL;
+		snap_uring_fixed.bufs[i].iov_len = 0;
+		__atomic_add_fetch(&snap_uring_fixed.gen, 1, __ATOMIC_RELEASE);
+		break;
+	}
+	pthread_mutex_unlock(&snap_uring_fixed.lock);
+}
+
+static void snap_uring_blk_fixed_sync(struct snap_uring_blk_thread *t)
+{
+	int ret;
+
+	pthread_mutex_lock(&snap_uring_fixed.lock);
+	memcpy(t->bufs, snap_uring_fixed.bufs, sizeof(t->bufs));
+	t->bufs_gen = snap_uring_fixed.gen;
+	pthread_mutex_unlock(&snap_uring_fixed.lock);
+
+	if (!t->fixed)
+		return;
+
+	ret = io_uring_register_buffers_update_tag(&t->ring, 0, t->bufs, NULL,
+						   SNAP_URING_BLK_MAX_FIXED_BUFS);
+	if (ret < 0) {
+		printf("uring_blk: failed to update fixed buffers (%d), using plain read/write\n", ret);
+		io_uring_unregister_buffers(&t->ring);
+		t->fixed = false;
+	}
+}
+
+static int snap_uring_blk_fixed_idx(struct snap_uring_blk_thread *t, void *buf,
+				    uint64_t len)
+{
+	char *base;
+	int i;
+
+	if (!t->fixed)
+		return -1;
+
+	for (i = 0; i < SNAP_URING_BLK_MAX_FIXED_BUFS; i++) {
+		base = t->bufs[i].iov_base;
+		if (base && (char *)buf >= base &&
+		    (char *)buf + len <= base + t->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static struct snap_uring_blk_thread *
+snap_uring_blk_thread_create(struct snap_uring_blk_dev *dev)
+{
+	struct snap_uring_blk_thread *t;
+	uint32_t i;
+	int ret;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->reqs = calloc(dev->queue_depth, sizeof(*t->reqs));
+	if (!t->reqs)
+		goto free_thread;
+
+	for (i = 0; i < dev->queue_depth; i++) {
+		t->reqs[i].next_free = t->free_reqs;
+		t->free_reqs = &t->reqs[i];
+	}
+	TAILQ_INIT(&t->pool_waiters);
+
+	ret = io_uring_queue_init(dev->queue_depth, &t->ring, 0);
+	if (ret) {
+		printf("uring_blk: failed to create io_uring (%d)\n", ret);
+		goto free_reqs;
+	}
+
+	pthread_mutex_lock(&snap_uring_fixed.lock);
+	memcpy(t->bufs, snap_uring_fixed.bufs, sizeof(t->bufs));
+	t->bufs_gen = snap_uring_fixed.gen;
+	pthread_mutex_unlock(&snap_uring_fixed.lock);
+
+	/* empty slots keep the table sparse, so it can be updated in place */
+	ret = io_uring_register_buffers_tags(&t->ring, t->bufs, NULL,
+					     SNAP_URING_BLK_MAX_FIXED_BUFS);
+	if (ret)
+		printf("uring_blk: failed to register fixed buffers (%d), using plain read/write\n", ret);
+	t->fixed = !ret;
+
+	return t;
+
+free_reqs:
+	free(t->reqs);
+free_thread:
+	free(t);
+	return NULL;
+}
+
+static void snap_uring_blk_thread_destroy(struct snap_uring_blk_thread *t)
+{
+	struct snap_uring_blk_pool_wait *w;
+
+	while ((w = TAILQ_FIRST(&t->pool_waiters))) {
+		TAILQ_REMOVE(&t->pool_waiters, w, entry);
+		free(w);
+	}
+	io_uring_queue_exit(&t->ring);
+	free(t->reqs);
+	free(t);
+}
+
+static struct snap_uring_blk_thread *
+snap_uring_blk_get_thread(struct snap_uring_blk_dev *dev, int thread_id)
+{
+	struct snap_uring_blk_thread *t;
+
+	if (thread_id < 0 || thread_id >= SNAP_URING_BLK_MAX_THREADS) {
+		printf("uring_blk: thread id %d is out of range\n", thread_id);
+		return NULL;
+	}
+
+	/* a thread id is only used by one thread at a time, no locking */
+	t = dev->threads[thread_id];
+	if (!t) {
+		t = snap_uring_blk_thread_create(dev);
+		dev->threads[thread_id] = t;
+	} else if (__atomic_load_n(&snap_uring_fixed.gen, __ATOMIC_ACQUIRE) != t->bufs_gen)
+		snap_uring_blk_fixed_sync(t);
+
+	return t;
+}
+
+/*
+ * Operations are only queued to the submission ring here, they are
+ * submitted in batch by snap_uring_blk_progress() or when the ring is full.
+ */
+static int snap_uring_blk_io_start(struct snap_uring_blk_dev *dev, int thread_id,
+				   struct snap_bdev_io_done_ctx *done_ctx,
+				   uint64_t len, struct snap_uring_blk_io *io)
+{
+	io->t = snap_uring_blk_get_thread(dev, thread_id);
+	if (!io->t)
+		return -ENOMEM;
+
+	if (!io->t->free_reqs)
+		return -EAGAIN;
+
+	io->sqe = io_uring_get_sqe(&io->t->ring);
+	if (!io->sqe) {
+		io_uring_submit(&io->t->ring);
+		io->sqe = io_uring_get_sqe(&io->t->ring);
+		if (!io->sqe)
+			return -EAGAIN;
+	}
+
+	io->req = io->t->free_reqs;
+	io->t->free_reqs = io->req->next_free;
+	io->req->done_ctx = done_ctx;
+	io->req->len = len;
+	io->req->bounce = NULL;
+	return 0;
+}
+
+static inline void snap_uring_blk_io_commit(struct snap_uring_blk_io *io)
+{
+	io_uring_sqe_set_data(io->sqe, io->req);
+	io->t->inflight++;
+}
+
+/*
+ * O_DIRECT needs buffers aligned to the logical block size. Buffers that
+ * are not, like the ones of a virtq command array whose stride is not a
+ * block multiple, go through an aligned bounce buffer.
+ */
+static bool snap_uring_blk_aligned(struct snap_uring_blk_dev *dev,
+				   const struct iovec *iov, int iovcnt)
+{
+	uintptr_t mask = dev->bdev.attrs.blk_size - 1;
+	int i;
+
+	if (!dev->direct)
+		return true;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & mask)
+			return false;
+	}
+
+	return true;
+}
+
+static void *snap_uring_blk_bounce_alloc(const struct iovec *iov, int iovcnt,
+					 uint64_t len, bool write)
+{
+	uint64_t off = 0, n;
+	char *bounce;
+	int i;
+
+	if (posix_memalign((void **)&bounce, SNAP_URING_BLK_BUF_ALIGN, len))
+		return NULL;
+
+	for (i = 0; write && i < iovcnt && off < len; i++) {
+		n = iov[i].iov_len < len - off ? iov[i].iov_len : len - off;
+		memcpy(bounce + off, iov[i].iov_base, n);
+		off += n;
+	}
+
+	return bounce;
+}
+
+static void snap_uring_blk_bounce_done(struct snap_uring_blk_req *req,
+				       bool copy)
+{
+	uint64_t off = 0, n;
+	int i;
+
+	for (i = 0; copy && i < req->iovcnt && off < req->len; i++) {
+		n = req->iov[i].iov_len < req->len - off ?
+			req->iov[i].iov_len : req->len - off;
+		memcpy(req->iov[i].iov_base, (char *)req->bounce + off, n);
+		off += n;
+	}
+
+	free(req->bounce);
+	req->bounce = NULL;
+}
+
+static int snap_uring_blk_rw(struct snap_uring_blk_dev *dev, bool write,
+			     void *buf, uint64_t offset, uint64_t len,
+			     struct snap_bdev_io_done_ctx *done_ctx, int thread_id)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct snap_uring_blk_io io;
+	void *bounce = NULL;
+	int ret, idx;
+
+	if (!snap_uring_blk_aligned(dev, &iov, 1)) {
+		bounce = snap_uring_blk_bounce_alloc(&iov, 1, len, write);
+		if (!bounce)
+			return -ENOMEM;
+	}
+
+	ret = snap_uring_blk_io_start(dev, thread_id, done_ctx, len, &io);
+	if (ret) {
+		free(bounce);
+		return ret;
+	}
+
+	if (bounce) {
+		io.req->buf = iov;
+		io.req->iov = &io.req->buf;
+		io.req->iovcnt = 1;
+		io.req->read = !write;
+		io.req->bounce = bounce;
+		buf = bounce;
+	}
+
+	idx = snap_uring_blk_fixed_idx(io.t, buf, len);
+	if (idx >= 0 && write)
+		io_uring_prep_write_fixed(io.sqe, dev->fd, buf, len, offset, idx);
+	else if (idx >= 0)
+		io_uring_prep_read_fixed(io.sqe, dev->fd, buf, len, offset, idx);
+	else if (write)
+		io_uring_prep_write(io.sqe, dev->fd, buf, len, offset);
+	else
+		io_uring_prep_read(io.sqe, dev->fd, buf, len, offset);
+
+	snap_uring_blk_io_commit(&io);
+	return 0;
+}
+
+static int snap_uring_blk_rwv(struct snap_uring_blk_dev *dev, bool write,
+			      struct iovec *iov, int iovcnt,
+			      uint64_t offset_blocks, uint64_t num_blocks,
+			      struct snap_bdev_io_done_ctx *done_ctx, int thread_id)
+{
+	uint32_t blk_size = dev->bdev.attrs.blk_size;
+	uint64_t len = num_blocks * blk_size;
+	struct snap_uring_blk_io io;
+	void *bounce = NULL;
+	int ret;
+
+	if (!snap_uring_blk_aligned(dev, iov, iovcnt)) {
+		bounce = snap_uring_blk_bounce_alloc(iov, iovcnt, len, write);
+		if (!bounce)
+			return -ENOMEM;
+	}
+
+	ret = snap_uring_blk_io_start(dev, thread_id, done_ctx, len, &io);
+	if (ret) {
+		free(bounce);
+		return ret;
+	}
+
+	if (bounce) {
+		io.req->iov = iov;
+		io.req->iovcnt = iovcnt;
+		io.req->read = !write;
+		io.req->bounce = bounce;
+		if (write)
+			io_uring_prep_write(io.sqe, dev->fd, bounce, len, offset_blocks * blk_size);
+		else
+			io_uring_prep_read(io.sqe, dev->fd, bounce, len, offset_blocks * blk_size);
+	} else if (write)
+		io_uring_prep_writev(io.sqe, dev->fd, iov, iovcnt, offset_blocks * blk_size);
+	else
+		io_uring_prep_readv(io.sqe, dev->fd, iov, iovcnt, offset_blocks * blk_size);
+
+	snap_uring_blk_io_commit(&io);
+	return 0;
+}
+
+static int snap_uring_blk_fallocate(struct snap_uring_blk_dev *dev, int mode,
+				    uint64_t offset_blocks, uint64_t num_blocks,
+				    struct snap_bdev_io_done_ctx *done_ctx,
+				    int thread_id)
+{
+	uint32_t blk_size = dev->bdev.attrs.blk_size;
+	struct snap_uring_blk_io io;
+	int ret;
+
+	ret = snap_uring_blk_io_start(dev, thread_id, done_ctx, 0, &io);
+	if (ret)
+		return ret;
+
+	io_uring_prep_fallocate(io.sqe, dev->fd, mode | FALLOC_FL_KEEP_SIZE,
+				offset_blocks * blk_size, num_blocks * blk_size);
+	snap_uring_blk_io_commit(&io);
+	return 0;
+}
+
+static int snap_uring_blk_readv_blocks(void *ctx, struct iovec *iov, int iovcnt,
+				       uint64_t offset_blocks, uint64_t num_blocks,
+				       struct snap_bdev_io_done_ctx *done_ctx,
+				       int thread_id)
+{
+	return snap_uring_blk_rwv(to_uring_blk_dev(ctx), false, iov, iovcnt,
+				  offset_blocks, num_blocks, done_ctx, thread_id);
+}
+
+static int snap_uring_blk_writev_blocks(void *ctx, struct iovec *iov, int iovcnt,
+					uint64_t offset_blocks, uint64_t num_blocks,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id)
+{
+	return snap_uring_blk_rwv(to_uring_blk_dev(ctx), true, iov, iovcnt,
+				  offset_blocks, num_blocks, done_ctx, thread_id);
+}
+
+static int snap_uring_blk_read(void *ctx, void *buf, uint64_t offset,
+			       uint64_t len, struct snap_bdev_io_done_ctx *done_ctx,
+			       int thread_id)
+{
+	return snap_uring_blk_rw(to_uring_blk_dev(ctx), false, buf, offset, len,
+				 done_ctx, thread_id);
+}
+
+static int snap_uring_blk_write(void *ctx, void *buf, uint64_t offset,
+				uint64_t len, struct snap_bdev_io_done_ctx *done_ctx,
+				int thread_id)
+{
+	return snap_uring_blk_rw(to_uring_blk_dev(ctx), true, buf, offset, len,
+				 done_ctx, thread_id);
+}
+
+static int snap_uring_blk_flush(void *ctx, uint64_t offset_blocks,
+				uint64_t num_blocks,
+				struct snap_bdev_io_done_ctx *done_ctx,
+				int thread_id)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	struct snap_uring_blk_io io;
+	int ret;
+
+	ret = snap_uring_blk_io_start(dev, thread_id, done_ctx, 0, &io);
+	if (ret)
+		return ret;
+
+	io_uring_prep_fsync(io.sqe, dev->fd, IORING_FSYNC_DATASYNC);
+	snap_uring_blk_io_commit(&io);
+	return 0;
+}
+
+static int snap_uring_blk_write_zeroes(void *ctx, uint64_t offset_blocks,
+				       uint64_t num_blocks,
+				       struct snap_bdev_io_done_ctx *done_ctx,
+				       int thread_id)
+{
+	return snap_uring_blk_fallocate(to_uring_blk_dev(ctx), FALLOC_FL_ZERO_RANGE,
+					offset_blocks, num_blocks, done_ctx, thread_id);
+}
+
+static int snap_uring_blk_discard(void *ctx, uint64_t offset_blocks,
+				  uint64_t num_blocks,
+				  struct snap_bdev_io_done_ctx *done_ctx,
+				  int thread_id)
+{
+	return snap_uring_blk_fallocate(to_uring_blk_dev(ctx), FALLOC_FL_PUNCH_HOLE,
+					offset_blocks, num_blocks, done_ctx, thread_id);
+}
+
+static void *snap_uring_blk_dma_malloc(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, SNAP_URING_BLK_BUF_ALIGN, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	snap_uring_blk_fixed_add(buf, size);
+	return buf;
+}
+
+static void snap_uring_blk_dma_free(void *buf)
+{
+	snap_uring_blk_fixed_del(buf);
+	free(buf);
+}
+
+static void *snap_uring_blk_pool_get(struct snap_uring_blk_dev *dev)
+{
+	uint32_t idx;
+
+	pthread_spin_lock(&dev->pool_lock);
+	if (!dev->pool_nfree) {
+		pthread_spin_unlock(&dev->pool_lock);
+		return NULL;
+	}
+	idx = dev->pool_free[--dev->pool_nfree];
+	pthread_spin_unlock(&dev->pool_lock);
+
+	return (char *)dev->pool_buf + (size_t)idx * dev->pool_buf_size;
+}
+
+static bool snap_uring_blk_dma_pool_enabled(void *ctx)
+{
+	return to_uring_blk_dev(ctx)->pool_mr != NULL;
+}
+
+/*
+ * Requests bigger than a pool buffer get their own registered buffer. The
+ * memory region is kept in the page in front of the buffer, so the buffer
+ * stays page aligned.
+ */
+static void *snap_uring_blk_big_alloc(struct snap_uring_blk_dev *dev,
+				      size_t size, struct ibv_mr **mr)
+{
+	char *mem;
+
+	if (posix_memalign((void **)&mem, SNAP_URING_BLK_BUF_ALIGN,
+			   SNAP_URING_BLK_BUF_ALIGN + size))
+		return NULL;
+
+	*mr = ibv_reg_mr(dev->pool_pd, mem + SNAP_URING_BLK_BUF_ALIGN, size,
+			 IBV_ACCESS_LOCAL_WRITE |
+			 IBV_ACCESS_REMOTE_READ |
+			 IBV_ACCESS_REMOTE_WRITE);
+	if (!*mr) {
+		printf("uring_blk: failed to register %zu bytes buffer, errno %d\n",
+		       size, errno);
+		free(mem);
+		return NULL;
+	}
+
+	*(struct ibv_mr **)mem = *mr;
+	return mem + SNAP_URING_BLK_BUF_ALIGN;
+}
+
+static void snap_uring_blk_big_free(void *buf)
+{
+	char *mem = (char *)buf - SNAP_URING_BLK_BUF_ALIGN;
+
+	ibv_dereg_mr(*(struct ibv_mr **)mem);
+	free(mem);
+}
+
+/*
+ * When the pool is empty the request waits on its thread and is served from
+ * snap_uring_blk_progress(), so that the callback always runs on the thread
+ * that asked for the buffer.
+ */
+static int snap_uring_blk_dma_pool_malloc(size_t size,
+					  struct snap_blk_mempool_ctx *mem_ctx)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(mem_ctx->ctx);
+	struct snap_uring_blk_pool_wait *w;
+	struct snap_uring_blk_thread *t;
+	struct ibv_mr *mr;
+	void *buf;
+
+	if (size > dev->pool_buf_size) {
+		buf = snap_uring_blk_big_alloc(dev, size, &mr);
+		if (!buf)
+			return -ENOMEM;
+
+		mem_ctx->tag = NULL;
+		mem_ctx->callback(buf, mr, mem_ctx->user);
+		return 0;
+	}
+
+	buf = snap_uring_blk_pool_get(dev);
+	if (buf) {
+		mem_ctx->tag = NULL;
+		mem_ctx->callback(buf, dev->pool_mr, mem_ctx->user);
+		return 0;
+	}
+
+	t = snap_uring_blk_get_thread(dev, mem_ctx->thread_id);
+	if (!t)
+		return -ENOMEM;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	w->mem_ctx = mem_ctx;
+	mem_ctx->tag = w;
+	TAILQ_INSERT_TAIL(&t->pool_waiters, w, entry);
+	return 0;
+}
+
+static void snap_uring_blk_dma_pool_cancel(struct snap_blk_mempool_ctx *mem_ctx)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(mem_ctx->ctx);
+	struct snap_uring_blk_pool_wait *w = mem_ctx->tag;
+	struct snap_uring_blk_thread *t;
+
+	if (!w)
+		return;
+
+	t = dev->threads[mem_ctx->thread_id];
+	TAILQ_REMOVE(&t->pool_waiters, w, entry);
+	mem_ctx->tag = NULL;
+	free(w);
+}
+
+static void snap_uring_blk_dma_pool_free(struct snap_blk_mempool_ctx *mem_ctx,
+					 void *buf)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(mem_ctx->ctx);
+	uint32_t idx = ((char *)buf - (char *)dev->pool_buf) / dev->pool_buf_size;
+
+	if ((char *)buf < (char *)dev->pool_buf || idx >= dev->pool_num_bufs) {
+		snap_uring_blk_big_free(buf);
+		return;
+	}
+
+	pthread_spin_lock(&dev->pool_lock);
+	dev->pool_free[dev->pool_nfree++] = idx;
+	pthread_spin_unlock(&dev->pool_lock);
+}
+
+static int snap_uring_blk_pool_progress(struct snap_uring_blk_dev *dev,
+					struct snap_uring_blk_thread *t)
+{
+	struct snap_uring_blk_pool_wait *w;
+	struct snap_blk_mempool_ctx *mem_ctx;
+	int n = 0;
+	void *buf;
+
+	while ((w = TAILQ_FIRST(&t->pool_waiters))) {
+		buf = snap_uring_blk_pool_get(dev);
+		if (!buf)
+			break;
+
+		TAILQ_REMOVE(&t->pool_waiters, w, entry);
+		mem_ctx = w->mem_ctx;
+		mem_ctx->tag = NULL;
+		free(w);
+		mem_ctx->callback(buf, dev->pool_mr, mem_ctx->user);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Completions are reaped without waiting. io_uring_submit_and_get_events()
+ * is only entered while there are outstanding operations, it submits the
+ * queued ones and runs pending completion task work, which otherwise would
+ * be delayed until the polling thread enters the kernel.
+ */
+static int snap_uring_blk_progress(void *ctx, int thread_id)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	struct io_uring_cqe *cqes[SNAP_URING_BLK_REAP_BATCH];
+	struct snap_uring_blk_req *reqs[SNAP_URING_BLK_REAP_BATCH];
+	int res[SNAP_URING_BLK_REAP_BATCH];
+	struct snap_bdev_io_done_ctx *done_ctx;
+	struct snap_uring_blk_thread *t;
+	enum snap_bdev_op_status status;
+	unsigned int i, n;
+
+	if (thread_id < 0 || thread_id >= SNAP_URING_BLK_MAX_THREADS)
+		return 0;
+
+	t = dev->threads[thread_id];
+	if (!t)
+		return 0;
+
+	if (t->inflight)
+		io_uring_submit_and_get_events(&t->ring);
+
+	n = io_uring_peek_batch_cqe(&t->ring, cqes, SNAP_URING_BLK_REAP_BATCH);
+	for (i = 0; i < n; i++) {
+		reqs[i] = io_uring_cqe_get_data(cqes[i]);
+		res[i] = cqes[i]->res;
+	}
+	/* callbacks may queue new operations, release the cq entries first */
+	io_uring_cq_advance(&t->ring, n);
+
+	for (i = 0; i < n; i++) {
+		if (res[i] < 0 || (reqs[i]->len && (uint64_t)res[i] != reqs[i]->len)) {
+			printf("uring_blk %s: operation failed, res %d expected %lu\n",
+			       dev->bdev.name, res[i], reqs[i]->len);
+			status = SNAP_BDEV_OP_IO_ERROR;
+		} else
+			status = SNAP_BDEV_OP_SUCCESS;
+
+		if (reqs[i]->bounce)
+			snap_uring_blk_bounce_done(reqs[i], reqs[i]->read &&
+						   status == SNAP_BDEV_OP_SUCCESS);
+		done_ctx = reqs[i]->done_ctx;
+		reqs[i]->next_free = t->free_reqs;
+		t->free_reqs = reqs[i];
+		t->inflight--;
+		done_ctx->cb(status, done_ctx->user_arg);
+	}
+
+	if (!TAILQ_EMPTY(&t->pool_waiters))
+		n += snap_uring_blk_pool_progress(dev, t);
+
+	return n;
+}
+
+static uint64_t snap_uring_blk_get_num_blocks(void *ctx)
+{
+	return to_uring_blk_dev(ctx)->bdev.attrs.size_b;
+}
+
+static uint32_t snap_uring_blk_get_block_size(void *ctx)
+{
+	return to_uring_blk_dev(ctx)->bdev.attrs.blk_size;
+}
+
+static const char *snap_uring_blk_get_bdev_name(void *ctx)
+{
+	return to_uring_blk_dev(ctx)->bdev.name;
+}
+
+static int snap_uring_blk_pool_create(struct snap_uring_blk_dev *dev,
+				      const struct snap_blk_dev_attrs *attrs)
+{
+	size_t size;
+	uint32_t i;
+
+	dev->pool_pd = attrs->pd;
+	dev->pool_buf_size = attrs->pool_buf_size ? : SNAP_URING_BLK_POOL_BUF_SIZE;
+	dev->pool_num_bufs = attrs->pool_num_bufs ? : SNAP_URING_BLK_POOL_NUM_BUFS;
+	size = (size_t)dev->pool_buf_size * dev->pool_num_bufs;
+
+	if (posix_memalign(&dev->pool_buf, SNAP_URING_BLK_BUF_ALIGN, size))
+		return -ENOMEM;
+
+	dev->pool_free = calloc(dev->pool_num_bufs, sizeof(*dev->pool_free));
+	if (!dev->pool_free)
+		goto free_buf;
+
+	dev->pool_mr = ibv_reg_mr(attrs->pd, dev->pool_buf, size,
+				  IBV_ACCESS_LOCAL_WRITE |
+				  IBV_ACCESS_REMOTE_READ |
+				  IBV_ACCESS_REMOTE_WRITE);
+	if (!dev->pool_mr) {
+		printf("uring_blk: failed to register dma pool, errno %d\n", errno);
+		goto free_list;
+	}
+
+	for (i = 0; i < dev->pool_num_bufs; i++)
+		dev->pool_free[i] = dev->pool_num_bufs - i - 1;
+	dev->pool_nfree = dev->pool_num_bufs;
+	pthread_spin_init(&dev->pool_lock, 0);
+	snap_uring_blk_fixed_add(dev->pool_buf, size);
+	return 0;
+
+free_list:
+	free(dev->pool_free);
+free_buf:
+	free(dev->pool_buf);
+	return -ENOMEM;
+}
+
+static void snap_uring_blk_pool_destroy(struct snap_uring_blk_dev *dev)
+{
+	snap_uring_blk_fixed_del(dev->pool_buf);
+	pthread_spin_destroy(&dev->pool_lock);
+	ibv_dereg_mr(dev->pool_mr);
+	free(dev->pool_free);
+	free(dev->pool_buf);
+}
+
+static int snap_uring_blk_get_geometry(struct snap_uring_blk_dev *dev,
+				       const struct snap_blk_dev_attrs *attrs)
+{
+	uint64_t size_bytes;
+	uint32_t lbs = 512;
+	struct stat st;
+
+	if (fstat(dev->fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(dev->fd, BLKGETSIZE64, &size_bytes) ||
+		    ioctl(dev->fd, BLKSSZGET, &lbs))
+			return -errno;
+	} else
+		size_bytes = st.st_size;
+
+	dev->bdev.attrs.blk_size = attrs->blk_size ? : lbs;
+	dev->bdev.attrs.size_b = attrs->size_b ? : size_bytes / dev->bdev.attrs.blk_size;
+	if (!dev->bdev.attrs.size_b)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * snap_uring_blk_dev_open() - open io_uring block device
+ * @name:	bdev name
+ * @attrs:	creation attributes, @attrs->path is required
+ *
+ * Open a local file or block device and serve bdev operations with
+ * io_uring. Every thread id gets its own ring, created on first use.
+ * Operations complete only from the progress op called with the thread id
+ * they were submitted with. The file is opened with O_DIRECT unless the
+ * filesystem doesn't support it, user buffers that are not aligned to the
+ * logical block size are then bounced.
+ *
+ * Return: block device or NULL on error
+ */
+struct snap_blk_dev *snap_uring_blk_dev_open(const char *name,
+					     const struct snap_blk_dev_attrs *attrs)
+{
+	struct snap_uring_blk_dev *dev;
+	int ret;
+
+	if (!attrs->path) {
+		printf("uring_blk: path is required\n");
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->bdev.name = strdup(name);
+	if (!dev->bdev.name)
+		goto free_dev;
+
+	dev->path = strdup(attrs->path);
+	if (!dev->path)
+		goto free_name;
+
+	memcpy(&dev->bdev.attrs, attrs, sizeof(dev->bdev.attrs));
+	dev->bdev.attrs.path = dev->path;
+	dev->queue_depth = attrs->queue_depth ? : SNAP_URING_BLK_QUEUE_DEPTH;
+
+	dev->fd = open(dev->path, O_RDWR | O_DIRECT);
+	dev->direct = dev->fd >= 0;
+	if (dev->fd < 0 && errno == EINVAL)
+		dev->fd = open(dev->path, O_RDWR);
+	if (dev->fd < 0) {
+		printf("uring_blk: failed to open %s, errno %d\n", dev->path, errno);
+		goto free_path;
+	}
+
+	ret = snap_uring_blk_get_geometry(dev, attrs);
+	if (ret) {
+		printf("uring_blk: failed to get size of %s (%d)\n", dev->path, ret);
+		goto close_fd;
+	}
+
+	if (attrs->pd && snap_uring_blk_pool_create(dev, attrs))
+		goto close_fd;
+
+	dev->bdev.ops.readv_blocks = snap_uring_blk_readv_blocks;
+	dev->bdev.ops.writev_blocks = snap_uring_blk_writev_blocks;
+	dev->bdev.ops.read = snap_uring_blk_read;
+	dev->bdev.ops.write = snap_uring_blk_write;
+	dev->bdev.ops.flush = snap_uring_blk_flush;
+	dev->bdev.ops.write_zeroes = snap_uring_blk_write_zeroes;
+	dev->bdev.ops.discard = snap_uring_blk_discard;
+	dev->bdev.ops.dma_malloc = snap_uring_blk_dma_malloc;
+	dev->bdev.ops.dma_free = snap_uring_blk_dma_free;
+	dev->bdev.ops.get_num_blocks = snap_uring_blk_get_num_blocks;
+	dev->bdev.ops.get_block_size = snap_uring_blk_get_block_size;
+	dev->bdev.ops.get_bdev_name = snap_uring_blk_get_bdev_name;
+	dev->bdev.ops.dma_pool_enabled = snap_uring_blk_dma_pool_enabled;
+	dev->bdev.ops.dma_pool_malloc = snap_uring_blk_dma_pool_malloc;
+	dev->bdev.ops.dma_pool_cancel = snap_uring_blk_dma_pool_cancel;
+	dev->bdev.ops.dma_pool_free = snap_uring_blk_dma_pool_free;
+	dev->bdev.ops.progress = snap_uring_blk_progress;
+
+	return &dev->bdev;
+
+close_fd:
+	close(dev->fd);
+free_path:
+	free(dev->path);
+free_name:
+	free(dev->bdev.name);
+free_dev:
+	free(dev);
+	return NULL;
+}
+
+/**
+ * snap_uring_blk_dev_close() - close io_uring block device
+ * @bdev: block device to close
+ *
+ * All operations must be completed before the device is closed.
+ */
+void snap_uring_blk_dev_close(struct snap_blk_dev *bdev)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(bdev);
+	int i;
+
+	for (i = 0; i < SNAP_URING_BLK_MAX_THREADS; i++) {
+		if (dev->threads[i])
+			snap_uring_blk_thread_destroy(dev->threads[i]);
+	}
+
+	if (dev->pool_mr)
+		snap_uring_blk_pool_destroy(dev);
+	close(dev->fd);
+	free(dev->path);
+	free(dev->bdev.name);
+	free(dev);
+}
@@ -13,6 +13,7 @@
 #define _ISOC11_SOURCE //For aligned_alloc
 
 #include <stdlib.h>
+#include <errno.h>
 #include <stdint.h>
 #include "snap_buf.h"
 #include "snap_macros.h"
@@ -57,3 +58,241 @@ uint32_t snap_buf_get_mkey(void *ubuf)
 
 	return buf->mr->lkey;
 }
+
+/*
+ * Registered buffer pool
+ *
+ * Buffers are grouped in power of 2 size classes. Each class keeps a free
+ * list of fixed size chunks carved from big memory regions which are
+ * allocated and registered only when the class runs out of chunks. Thus
+ * alloc/free do not involve memory registration.
+ *
+ * Chunk headers are kept out of band, in a per region array. Chunks are
+ * packed back to back, so a region holds exactly region_size / class size
+ * chunks and every chunk is aligned to min(class size, page size), which is
+ * what O_DIRECT block devices need. Free looks the owning region up by
+ * address, the number of regions is bounded by max_mem / region_size.
+ *
+ * The pool is not thread safe. It is supposed to be owned by an entity
+ * that is progressed by a single thread at a time, like a virtqueue.
+ */
+struct snap_buf_pool_region;
+
+struct snap_buf_pool_chunk {
+	struct snap_buf_pool_chunk *next;
+	uint8_t *buf;
+	struct snap_buf_pool_region *region;
+};
+
+struct snap_buf_pool_region {
+	uint8_t *mem;
+	size_t size;
+	struct ibv_mr *mr;
+	unsigned int class_idx;
+	struct snap_buf_pool_chunk *chunks;
+	struct snap_buf_pool_region *next;
+};
+
+struct snap_buf_pool_class {
+	size_t size;
+	struct snap_buf_pool_chunk *free_list;
+};
+
+struct snap_buf_pool {
+	struct ibv_pd *pd;
+	struct snap_buf_pool_attr attr;
+	unsigned int min_shift;
+	unsigned int num_classes;
+	struct snap_buf_pool_class classes[SNAP_BUF_POOL_MAX_CLASSES];
+	struct snap_buf_pool_region *regions;
+	size_t mem_used;
+};
+
+static inline unsigned int snap_buf_pool_log2_up(size_t size)
+{
+	return size <= 1 ? 0 : 64 - __builtin_clzl(size - 1);
+}
+
+static void *snap_buf_pool_default_malloc(size_t size)
+{
+	return aligned_alloc(SNAP_BUF_POOL_ALIGN, size);
+}
+
+/**
+ * snap_buf_pool_create() - Create registered buffer pool
+ * @pd:		protection domain buffers are registered with
+ * @attr:	pool attributes, default values are used for zero fields
+ *
+ * Return: new pool or NULL on error
+ */
+struct snap_buf_pool *snap_buf_pool_create(struct ibv_pd *pd,
+		const struct snap_buf_pool_attr *attr)
+{
+	struct snap_buf_pool *pool;
+	unsigned int max_shift, i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->pd = pd;
+	pool->attr = *attr;
+	if (!pool->attr.min_size)
+		pool->attr.min_size = SNAP_BUF_POOL_MIN_SIZE;
+	if (!pool->attr.max_size)
+		pool->attr.max_size = SNAP_BUF_POOL_MAX_SIZE;
+	if (!pool->attr.region_size)
+		pool->attr.region_size = SNAP_BUF_POOL_REGION_SIZE;
+	if (!pool->attr.max_mem)
+		pool->attr.max_mem = SNAP_BUF_POOL_MAX_MEM;
+	if (!pool->attr.dma_malloc) {
+		pool->attr.dma_malloc = snap_buf_pool_default_malloc;
+		pool->attr.dma_free = free;
+	}
+
+	pool->min_shift = snap_buf_pool_log2_up(pool->attr.min_size);
+	max_shift = snap_buf_pool_log2_up(pool->attr.max_size);
+	if (max_shift < pool->min_shift ||
+	    max_shift - pool->min_shift >= SNAP_BUF_POOL_MAX_CLASSES) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->num_classes = max_shift - pool->min_shift + 1;
+	for (i = 0; i < pool->num_classes; i++)
+		pool->classes[i].size = 1UL << (pool->min_shift + i);
+
+	return pool;
+}
+
+/**
+ * snap_buf_pool_destroy() - Destroy registered buffer pool
+ * @pool:	pool to destroy
+ *
+ * All pool buffers must be returned to the pool before it is destroyed.
+ */
+void snap_buf_pool_destroy(struct snap_buf_pool *pool)
+{
+	struct snap_buf_pool_region *region;
+
+	while (pool->regions) {
+		region = pool->regions;
+		pool->regions = region->next;
+		ibv_dereg_mr(region->mr);
+		pool->attr.dma_free(region->mem);
+		free(region->chunks);
+		free(region);
+	}
+
+	free(pool);
+}
+
+static int snap_buf_pool_grow(struct snap_buf_pool *pool, unsigned int class_idx)
+{
+	struct snap_buf_pool_class *class = &pool->classes[class_idx];
+	struct snap_buf_pool_region *region;
+	struct snap_buf_pool_chunk *chunk;
+	size_t size, num, i;
+
+	num = snap_max(pool->attr.region_size / class->size, 1UL);
+	size = num * class->size;
+	if (pool->mem_used + size > pool->attr.max_mem)
+		return -ENOMEM;
+
+	region = calloc(1, sizeof(*region));
+	if (!region)
+		return -ENOMEM;
+
+	region->chunks = calloc(num, sizeof(*region->chunks));
+	if (!region->chunks)
+		goto free_region;
+
+	region->mem = pool->attr.dma_malloc(size);
+	if (!region->mem)
+		goto free_chunks;
+
+	region->mr = snap_reg_mr(pool->pd, region->mem, size);
+	if (!region->mr)
+		goto free_mem;
+
+	region->size = size;
+	region->class_idx = class_idx;
+	for (i = 0; i < num; i++) {
+		chunk = &region->chunks[i];
+		chunk->buf = region->mem + i * class->size;
+		chunk->region = region;
+		chunk->next = class->free_list;
+		class->free_list = chunk;
+	}
+
+	region->next = pool->regions;
+	pool->regions = region;
+	pool->mem_used += size;
+	return 0;
+
+free_mem:
+	pool->attr.dma_free(region->mem);
+free_chunks:
+	free(region->chunks);
+free_region:
+	free(region);
+	return -ENOMEM;
+}
+
+/**
+ * snap_buf_pool_alloc() - Get registered buffer from the pool
+ * @pool:	buffer pool
+ * @size:	requested buffer size
+ * @mr:		memory region the buffer belongs to
+ *
+ * Return: buffer of at least @size bytes or NULL if @size is too big or
+ * the pool reached its memory limit
+ */
+void *snap_buf_pool_alloc(struct snap_buf_pool *pool, size_t size,
+		struct ibv_mr **mr)
+{
+	struct snap_buf_pool_class *class;
+	struct snap_buf_pool_chunk *chunk;
+	unsigned int shift, class_idx;
+
+	shift = snap_buf_pool_log2_up(size);
+	class_idx = shift > pool->min_shift ? shift - pool->min_shift : 0;
+	if (snap_unlikely(class_idx >= pool->num_classes))
+		return NULL;
+
+	class = &pool->classes[class_idx];
+	if (snap_unlikely(!class->free_list) &&
+	    snap_buf_pool_grow(pool, class_idx))
+		return NULL;
+
+	chunk = class->free_list;
+	class->free_list = chunk->next;
+	*mr = chunk->region->mr;
+	return chunk->buf;
+}
+
+/**
+ * snap_buf_pool_free() - Return buffer to the pool
+ * @pool:	buffer pool
+ * @buf:	buffer allocated by snap_buf_pool_alloc()
+ */
+void snap_buf_pool_free(struct snap_buf_pool *pool, void *buf)
+{
+	struct snap_buf_pool_region *region;
+	struct snap_buf_pool_chunk *chunk;
+	struct snap_buf_pool_class *class;
+	uint8_t *addr = buf;
+
+	for (region = pool->regions; region; region = region->next) {
+		if (addr >= region->mem && addr < region->mem + region->size)
+			break;
+	}
+
+	if (snap_unlikely(!region))
+		return;
+
+	class = &pool->classes[region->class_idx];
+	chunk = &region->chunks[(addr - region->mem) / class->size];
+	chunk->next = class->free_list;
+	class->free_list = chunk;
+}
@@ -18,7 +18,44 @@
 
 #define SNAP_DCACHE_LINE 64
 
+#define SNAP_BUF_POOL_MAX_CLASSES	16
+#define SNAP_BUF_POOL_MIN_SIZE		4096
+#define SNAP_BUF_POOL_MAX_SIZE		(1024 * 1024)
+#define SNAP_BUF_POOL_REGION_SIZE	(2 * 1024 * 1024)
+#define SNAP_BUF_POOL_MAX_MEM		(64 * 1024 * 1024)
+#define SNAP_BUF_POOL_ALIGN		4096
+
 void *snap_buf_alloc(struct ibv_pd *pd, size_t size);
 void snap_buf_free(void *buf);
 uint32_t snap_buf_get_mkey(void *buf);
+
+/**
+ * struct snap_buf_pool_attr - registered buffer pool attributes
+ * @min_size:		size of the smallest class, rounded up to power of 2
+ * @max_size:		size of the largest class, bigger buffers are not
+ *			served by the pool
+ * @region_size:	size of the memory region that is allocated and
+ *			registered at once when a class runs out of buffers
+ * @max_mem:		max amount of memory the pool may allocate
+ * @dma_malloc:		region allocator (optional), page aligned_alloc by
+ *			default. Chunk alignment follows the region alignment
+ * @dma_free:		region free function, must match @dma_malloc
+ */
+struct snap_buf_pool_attr {
+	size_t min_size;
+	size_t max_size;
+	size_t region_size;
+	size_t max_mem;
+	void *(*dma_malloc)(size_t size);
+	void (*dma_free)(void *buf);
+};
+
+struct snap_buf_pool;
+
+struct snap_buf_pool *snap_buf_pool_create(struct ibv_pd *pd,
+		const struct snap_buf_pool_attr *attr);
+void snap_buf_pool_destroy(struct snap_buf_pool *pool);
+void *snap_buf_pool_alloc(struct snap_buf_pool *pool, size_t size,
+		struct ibv_mr **mr);
+void snap_buf_pool_free(struct snap_buf_pool *pool, void *buf);
 #endif
@@ -13,11 +13,14 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 #include <linux/virtio_ring.h>
+#include <infiniband/verbs.h>
 
 #include "khash.h"
 /* this ugliness is needed by meson build */
 #include "../src/snap_macros.h"
+#include "../src/snap_dma.h"
 #include "snap_virtio_adm_spec.h"
 #include "snap_dp_map.h"
 #include "snap_lib_log.h"
@@ -26,15 +29,86 @@ SNAP_LIB_LOG_REGISTER(DP_MAP)
 
 KHASH_INIT(snap_dp_hash, uint64_t, char, 0, kh_int64_hash_func, kh_int64_hash_equal);
 
+#define SNAP_DP_RANGE_INITIAL_SIZE 64
+
+/* run of dirty pages [start, end), in page numbers */
+struct snap_dp_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * Ranges in a shard are sorted, do not overlap and never touch: adjacent
+ * runs are coalesced on insertion.
+ */
+struct snap_dp_range_shard {
+	pthread_spinlock_t lock;
+	struct snap_dp_range *ranges;
+	uint32_t nranges;
+	uint32_t max_ranges;
+	uint64_t npages;
+	/* serialize merge cursor, valid only under lock */
+	uint32_t cursor;
+} __attribute__((aligned(64)));
+
+struct snap_dp_map_ops {
+	int (*add_range)(struct snap_dp_map *map, uint64_t pa, uint32_t length);
+	size_t (*get_size)(struct snap_dp_map *map);
+	int (*serialize)(struct snap_dp_map *map, uint64_t pa, uint64_t length,
+			 uint64_t *buf, uint32_t nelems, bool sort);
+	void (*destroy)(struct snap_dp_map *map);
+};
+
 struct snap_dp_map {
+	const struct snap_dp_map_ops *ops;
+	unsigned int page_size;
+	unsigned int page_shift;
+
+	/* SNAP_DP_MAP_HASH */
 	khash_t(snap_dp_hash) dp_set;
 	pthread_spinlock_t lock;
-	unsigned int page_size;
+
+	/* SNAP_DP_MAP_RANGE */
+	struct snap_dp_range_shard *shards;
+	int nshards;
 };
 
-struct snap_dp_map *snap_dp_map_create(unsigned int page_size)
+static const struct snap_dp_map_ops snap_dp_hash_ops;
+static const struct snap_dp_map_ops snap_dp_range_ops;
+
+static int snap_dp_hash_init(struct snap_dp_map *map, const struct snap_dp_map_attr *attr)
+{
+	kh_init_inplace(snap_dp_hash, &map->dp_set);
+	pthread_spin_init(&map->lock, 0);
+	map->ops = &snap_dp_hash_ops;
+	return 0;
+}
+
+static int snap_dp_range_init(struct snap_dp_map *map, const struct snap_dp_map_attr *attr)
+{
+	int i, nshards;
+
+	nshards = attr->nshards ? attr->nshards : SNAP_DP_MAP_DEFAULT_SHARDS;
+	if (nshards < 0 || nshards > SNAP_DP_MAP_MAX_SHARDS)
+		return -EINVAL;
+
+	if (posix_memalign((void **)&map->shards, 64, nshards * sizeof(*map->shards)))
+		return -ENOMEM;
+
+	memset(map->shards, 0, nshards * sizeof(*map->shards));
+	for (i = 0; i < nshards; i++)
+		pthread_spin_init(&map->shards[i].lock, 0);
+
+	map->nshards = nshards;
+	map->ops = &snap_dp_range_ops;
+	return 0;
+}
+
+struct snap_dp_map *snap_dp_map_create_attr(unsigned int page_size,
+					    const struct snap_dp_map_attr *attr)
 {
 	struct snap_dp_map *map;
+	int ret;
 
 	if (!SNAP_IS_POW2(page_size) || page_size <= 1)
 		return NULL;
@@ -43,19 +117,89 @@ struct snap_dp_map *snap_dp_map_create(unsigned int page_size)
 	if (!map)
 		return NULL;
 
-	kh_init_inplace(snap_dp_hash, &map->dp_set);
-	pthread_spin_init(&map->lock, 0);
 	map->page_size = page_size;
+	map->page_shift = __builtin_ctz(page_size);
+
+	switch (attr->type) {
+	case SNAP_DP_MAP_HASH:
+		ret = snap_dp_hash_init(map, attr);
+		break;
+	case SNAP_DP_MAP_RANGE:
+		ret = snap_dp_range_init(map, attr);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (ret) {
+		SNAP_LIB_LOG_ERR("Failed to create dirty page map type %d: %d", attr->type, ret);
+		free(map);
+		return NULL;
+	}
+
 	return map;
 }
 
+struct snap_dp_map *snap_dp_map_create(unsigned int page_size)
+{
+	struct snap_dp_map_attr attr = {
+		.type = SNAP_DP_MAP_HASH,
+	};
+
+	return snap_dp_map_create_attr(page_size, &attr);
+}
+
 void snap_dp_map_destroy(struct snap_dp_map *map)
+{
+	map->ops->destroy(map);
+	free(map);
+}
+
+int snap_dp_map_add_range(struct snap_dp_map *map, uint64_t pa, uint32_t length)
+{
+	return map->ops->add_range(map, pa, length);
+}
+
+size_t snap_dp_map_get_size(struct snap_dp_map *map)
+{
+	return map->ops->get_size(map);
+}
+
+/**
+ * snap_dp_map_serialize_sort() - serialize and remove dirty pages in a range
+ * @map:     dirty page map
+ * @pa:      range start
+ * @length:  range length
+ * @buf:     output buffer
+ * @buf_len: output buffer length in bytes
+ *
+ * Copies sorted addresses of dirty pages that fall into [pa, pa + length)
+ * to @buf and removes them from the map. If @buf is too small the
+ * remaining pages stay in the map and can be fetched by the next call.
+ *
+ * Return: number of pages written to @buf or -1 on error
+ */
+int snap_dp_map_serialize_sort(struct snap_dp_map *map, uint64_t pa, uint64_t length,
+			       uint64_t *buf, uint32_t buf_len)
+{
+	return map->ops->serialize(map, pa, length, buf, buf_len / sizeof(uint64_t), true);
+}
+
+int snap_dp_map_serialize(struct snap_dp_map *map, uint64_t *buf, uint32_t length)
+{
+	return map->ops->serialize(map, 0, UINT64_MAX, buf, length / sizeof(uint64_t), false);
+}
+
+/* hash based page set */
+
+static void snap_dp_hash_destroy(struct snap_dp_map *map)
 {
 	kh_destroy_inplace(snap_dp_hash, &map->dp_set);
 	pthread_spin_destroy(&map->lock);
 }
 
-int snap_dp_map_add_range(struct snap_dp_map *map, uint64_t pa, uint32_t length)
+static int snap_dp_hash_add_range(struct snap_dp_map *map, uint64_t pa, uint32_t length)
 {
 	uint64_t page;
 	int ret;
@@ -86,8 +230,8 @@ static int compare(const void *a, const void *b)
 		return 1;
 }
 
-int snap_dp_map_serialize_sort(struct snap_dp_map *map, uint64_t pa, uint64_t length,
-			       uint64_t *buf, uint32_t buf_len)
+static int snap_dp_hash_serialize_sort(struct snap_dp_map *map, uint64_t pa, uint64_t length,
+				       uint64_t *buf, uint32_t nelems)
 {
 	int i, k, j;
 	uint64_t page;
@@ -109,7 +253,7 @@ int snap_dp_map_serialize_sort(struct snap_dp_map *map, uint64_t pa, uint64_t le
 
 	//printf("Hash map has %d elements in range\n", i);
 
-	if (i * sizeof(uint64_t) > buf_len) {
+	if (i > nelems) {
 		//printf("Allocate a buffer of %u elements\n", i);
 		tmp_buf = calloc(i, sizeof(uint64_t));
 		if (!tmp_buf) {
@@ -134,7 +278,7 @@ int snap_dp_map_serialize_sort(struct snap_dp_map *map, uint64_t pa, uint64_t le
 
 	/* Sort the buffer and delete from the hash map */
 	qsort(tmp_buf_p, i, sizeof(uint64_t), compare);
-	for (j = 0; j < buf_len / sizeof(uint64_t) && j < i; j++) {
+	for (j = 0; j < nelems && j < i; j++) {
 		k = kh_get(snap_dp_hash, &map->dp_set, tmp_buf_p[j]);
 		//printf("going to delete k = %d j = %d, page %lu\n", k, j, tmp_buf_p[j]);
 		kh_del(snap_dp_hash, &map->dp_set, k);
@@ -156,17 +300,20 @@ err:
 	return -1;
 }
 
-size_t snap_dp_map_get_size(struct snap_dp_map *map)
+static size_t snap_dp_hash_get_size(struct snap_dp_map *map)
 {
 	return kh_size(&map->dp_set) * sizeof(uint64_t);
 }
 
-int snap_dp_map_serialize(struct snap_dp_map *map, uint64_t *buf, uint32_t length)
+static int snap_dp_hash_serialize(struct snap_dp_map *map, uint64_t pa, uint64_t length,
+				  uint64_t *buf, uint32_t nelems, bool sort)
 {
-	uint32_t nelems = length/sizeof(uint64_t);
 	int i, k;
 	uint64_t page;
 
+	if (sort)
+		return snap_dp_hash_serialize_sort(map, pa, length, buf, nelems);
+
 	pthread_spin_lock(&map->lock);
 
 	for (k = kh_begin(&map->dp_set), i = 0;
@@ -184,6 +331,266 @@ int snap_dp_map_serialize(struct snap_dp_map *map, uint64_t *buf, uint32_t lengt
 	return i;
 }
 
+static const struct snap_dp_map_ops snap_dp_hash_ops = {
+	.add_range = snap_dp_hash_add_range,
+	.get_size = snap_dp_hash_get_size,
+	.serialize = snap_dp_hash_serialize,
+	.destroy = snap_dp_hash_destroy,
+};
+
+/* range based page set */
+
+static __thread int snap_dp_range_thread_id = -1;
+static int snap_dp_range_next_thread_id;
+
+static inline struct snap_dp_range_shard *snap_dp_range_get_shard(struct snap_dp_map *map)
+{
+	if (snap_unlikely(snap_dp_range_thread_id < 0))
+		snap_dp_range_thread_id = __atomic_fetch_add(&snap_dp_range_next_thread_id, 1,
+							     __ATOMIC_RELAXED);
+
+	return &map->shards[snap_dp_range_thread_id % map->nshards];
+}
+
+static void snap_dp_range_destroy(struct snap_dp_map *map)
+{
+	int i;
+
+	for (i = 0; i < map->nshards; i++) {
+		free(map->shards[i].ranges);
+		pthread_spin_destroy(&map->shards[i].lock);
+	}
+	free(map->shards);
+}
+
+/* index of the first range with end >= page, ranges touching page included */
+static uint32_t snap_dp_range_lookup(struct snap_dp_range_shard *shard, uint64_t page)
+{
+	uint32_t lo = 0, hi = shard->nranges, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (shard->ranges[mid].end < page)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int snap_dp_range_reserve(struct snap_dp_range_shard *shard)
+{
+	struct snap_dp_range *ranges;
+	uint32_t max_ranges;
+
+	if (snap_likely(shard->nranges < shard->max_ranges))
+		return 0;
+
+	max_ranges = shard->max_ranges ? 2 * shard->max_ranges : SNAP_DP_RANGE_INITIAL_SIZE;
+	ranges = realloc(shard->ranges, max_ranges * sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	shard->ranges = ranges;
+	shard->max_ranges = max_ranges;
+	return 0;
+}
+
+static int snap_dp_range_insert(struct snap_dp_range_shard *shard, uint64_t start, uint64_t end)
+{
+	struct snap_dp_range *r = shard->ranges;
+	uint32_t i, j;
+	uint64_t merged = 0;
+
+	/* fast path: sequential writes extend the last run */
+	if (shard->nranges && r[shard->nranges - 1].end <= end &&
+	    r[shard->nranges - 1].end >= start && r[shard->nranges - 1].start <= start) {
+		shard->npages += end - r[shard->nranges - 1].end;
+		r[shard->nranges - 1].end = end;
+		return 0;
+	}
+
+	i = snap_dp_range_lookup(shard, start);
+	for (j = i; j < shard->nranges && r[j].start <= end; j++)
+		merged += r[j].end - r[j].start;
+
+	if (i == j) {
+		if (snap_dp_range_reserve(shard))
+			return -ENOMEM;
+		r = shard->ranges;
+		memmove(&r[i + 1], &r[i], (shard->nranges - i) * sizeof(*r));
+		shard->nranges++;
+	} else {
+		start = snap_min(start, r[i].start);
+		end = snap_max(end, r[j - 1].end);
+		memmove(&r[i + 1], &r[j], (shard->nranges - j) * sizeof(*r));
+		shard->nranges -= j - i - 1;
+	}
+
+	r[i].start = start;
+	r[i].end = end;
+	shard->npages += end - start - merged;
+	return 0;
+}
+
+/* remove pages [start, end) from the shard */
+static int snap_dp_range_clear(struct snap_dp_range_shard *shard, uint64_t start, uint64_t end)
+{
+	struct snap_dp_range *r = shard->ranges;
+	uint32_t i, j;
+
+	/* first range with end > start */
+	i = snap_dp_range_lookup(shard, start + 1);
+	if (i == shard->nranges || r[i].start >= end)
+		return 0;
+
+	if (r[i].start < start && r[i].end > end) {
+		/* split */
+		if (snap_dp_range_reserve(shard))
+			return -ENOMEM;
+		r = shard->ranges;
+		memmove(&r[i + 1], &r[i], (shard->nranges - i) * sizeof(*r));
+		shard->nranges++;
+		r[i].end = start;
+		r[i + 1].start = end;
+		shard->npages -= end - start;
+		return 0;
+	}
+
+	if (r[i].start < start) {
+		shard->npages -= r[i].end - start;
+		r[i].end = start;
+		i++;
+	}
+
+	for (j = i; j < shard->nranges && r[j].end <= end; j++)
+		shard->npages -= r[j].end - r[j].start;
+
+	if (j < shard->nranges && r[j].start < end) {
+		shard->npages -= end - r[j].start;
+		r[j].start = end;
+	}
+
+	memmove(&r[i], &r[j], (shard->nranges - j) * sizeof(*r));
+	shard->nranges -= j - i;
+	return 0;
+}
+
+static int snap_dp_range_add_range(struct snap_dp_map *map, uint64_t pa, uint32_t length)
+{
+	struct snap_dp_range_shard *shard;
+	uint64_t start, end;
+	int ret;
+
+	if (!length)
+		return 0;
+
+	start = pa >> map->page_shift;
+	end = ((pa + length - 1) >> map->page_shift) + 1;
+
+	shard = snap_dp_range_get_shard(map);
+	pthread_spin_lock(&shard->lock);
+	ret = snap_dp_range_insert(shard, start, end);
+	pthread_spin_unlock(&shard->lock);
+	return ret;
+}
+
+/*
+ * Pages dirtied from several threads can be present in more than one shard,
+ * so the size is an upper bound of what serialize returns.
+ */
+static size_t snap_dp_range_get_size(struct snap_dp_map *map)
+{
+	size_t npages = 0;
+	int i;
+
+	for (i = 0; i < map->nshards; i++)
+		npages += __atomic_load_n(&map->shards[i].npages, __ATOMIC_RELAXED);
+
+	return npages * sizeof(uint64_t);
+}
+
+/*
+ * Merge shards in page order starting at the first page of the range.
+ * Every dirty page below the merge position has been emitted, so the
+ * emitted span can be cleared from all shards at once. Output is always
+ * sorted, the sort flag is ignored.
+ */
+static int snap_dp_range_serialize(struct snap_dp_map *map, uint64_t pa, uint64_t length,
+				   uint64_t *buf, uint32_t nelems, bool sort)
+{
+	struct snap_dp_range_shard *shard, *best;
+	uint64_t mask = (uint64_t)map->page_size - 1;
+	uint64_t first, last, pos, lo, hi, best_lo, end;
+	uint32_t n = 0;
+	int i, ret = 0;
+
+	end = pa + length < pa ? UINT64_MAX : pa + length;
+	/* round up without overflowing at the top of the address space */
+	first = (pa >> map->page_shift) + !!(pa & mask);
+	last = (end >> map->page_shift) + !!(end & mask);
+
+	for (i = 0; i < map->nshards; i++) {
+		shard = &map->shards[i];
+		pthread_spin_lock(&shard->lock);
+		shard->cursor = snap_dp_range_lookup(shard, first + 1);
+	}
+
+	pos = first;
+	while (n < nelems) {
+		best = NULL;
+		best_lo = last;
+		for (i = 0; i < map->nshards; i++) {
+			shard = &map->shards[i];
+			while (shard->cursor < shard->nranges &&
+			       shard->ranges[shard->cursor].end <= pos)
+				shard->cursor++;
+			if (shard->cursor == shard->nranges)
+				continue;
+			lo = snap_max(shard->ranges[shard->cursor].start, pos);
+			if (lo < best_lo) {
+				best_lo = lo;
+				best = shard;
+			}
+		}
+
+		if (!best)
+			break;
+
+		hi = snap_min(best->ranges[best->cursor].end, last);
+		for (lo = best_lo; lo < hi && n < nelems; lo++)
+			buf[n++] = lo << map->page_shift;
+		pos = lo;
+	}
+
+	for (i = 0; i < map->nshards; i++) {
+		shard = &map->shards[i];
+		if (n && snap_dp_range_clear(shard, first, pos))
+			ret = -1;
+		pthread_spin_unlock(&shard->lock);
+	}
+
+	if (ret) {
+		SNAP_LIB_LOG_ERR("Failed to remove serialized pages from the map");
+		return ret;
+	}
+
+	return n;
+}
+
+static const struct snap_dp_map_ops snap_dp_range_ops = {
+	.add_range = snap_dp_range_add_range,
+	.get_size = snap_dp_range_get_size,
+	.serialize = snap_dp_range_serialize,
+	.destroy = snap_dp_range_destroy,
+};
+
+/* run of map bytes [off, off + len) that must be set to 0xFF on the host */
+struct snap_dp_bmap_wc {
+	uint64_t off;
+	uint64_t len;
+};
+
 /* host side byte/bitmap */
 struct snap_dp_bmap {
 	struct snap_vq_adm_sge *sge_list;
@@ -192,6 +599,28 @@ struct snap_dp_bmap {
 	bool is_bytemap;
 	uint64_t start_pa;
 	uint32_t host_key;
+	/* total size of the host map in bytes */
+	uint64_t map_size;
+
+	/*
+	 * Write combining cache. Offsets are in the map byte space, that is
+	 * the concatenation of all sges.
+	 */
+	pthread_spinlock_t lock;
+	struct snap_dp_bmap_wc pending[SNAP_DP_BMAP_MAX_PENDING];
+	int n_pending;
+	uint64_t pending_bytes;
+	/* time of the oldest pending write, usec */
+	uint64_t pending_ts;
+	uint32_t flush_usec;
+	bool flush_req;
+	/* one bit per map byte, set while the byte is pending in the cache */
+	uint64_t *shadow;
+	char *ff_buf;
+	struct ibv_mr *ff_mr;
+	struct ibv_pd *ff_pd;
+	uint64_t n_suppressed;
+	uint64_t n_writes;
 };
 
 void snap_dp_bmap_set_mkey(struct snap_dp_bmap *map, uint32_t mkey)
@@ -208,6 +637,7 @@ struct snap_dp_bmap *snap_dp_bmap_create(struct snap_vq_adm_sge *sge_list, int s
 		unsigned int page_size, bool is_bytemap)
 {
 	struct snap_dp_bmap *map;
+	int i;
 
 	if (!SNAP_IS_POW2(page_size) || page_size <= 1)
 		return NULL;
@@ -227,11 +657,24 @@ struct snap_dp_bmap *snap_dp_bmap_create(struct snap_vq_adm_sge *sge_list, int s
 	map->page_size = page_size;
 	map->is_bytemap = is_bytemap;
 	map->start_pa = 0;
+	for (i = 0; i < sge_count; i++)
+		map->map_size += sge_list[i].len;
+
+	pthread_spin_init(&map->lock, 0);
 	return map;
 }
 
 void snap_dp_bmap_destroy(struct snap_dp_bmap *map)
 {
+	if (map->n_pending)
+		SNAP_LIB_LOG_WARN("map %p: dropping %lu pending dirty map bytes", map, map->pending_bytes);
+
+	SNAP_LIB_LOG_DBG("map %p: %lu writes, %lu suppressed marks", map, map->n_writes, map->n_suppressed);
+	if (map->ff_mr)
+		ibv_dereg_mr(map->ff_mr);
+	free(map->ff_buf);
+	free(map->shadow);
+	pthread_spin_destroy(&map->lock);
 	free(map->sge_list);
 	free(map);
 }
@@ -296,3 +739,390 @@ found:
 
 	return ret_len;
 }
+
+/**
+ * snap_dp_bmap_cache_enable() - enable dirty map write combining
+ * @map:        byte/bitmap
+ * @pd:         protection domain of the dma queues that will be used to
+ *              update the host map. Can be NULL, in such case the map is
+ *              updated with inline writes.
+ * @flush_usec: max time a dirty map update is allowed to stay in the cache
+ *
+ * Without the cache every mark_dirty call is written to the host at once.
+ * With the cache enabled map bytes are collected in a list of pending
+ * runs. Adjacent and overlapping runs are merged and written with a
+ * single RDMA write, either when the oldest run becomes older than
+ * @flush_usec (see snap_dp_bmap_progress()) or when the list is full.
+ *
+ * The cache also keeps a local shadow of the pending runs. Map bytes that
+ * are still waiting in the cache are not queued again. Once a byte is
+ * written to the host it is queued again on the next mark, the hypervisor
+ * may have harvested and cleared it in between.
+ *
+ * Return: 0 on success or -errno
+ */
+int snap_dp_bmap_cache_enable(struct snap_dp_bmap *map, struct ibv_pd *pd, uint32_t flush_usec)
+{
+	map->shadow = calloc(SNAP_ALIGN_CEIL(map->map_size, 64) / 64, sizeof(uint64_t));
+	if (!map->shadow)
+		return -ENOMEM;
+
+	if (pd) {
+		map->ff_buf = malloc(SNAP_DP_BMAP_WC_BUF_SIZE);
+		if (!map->ff_buf)
+			goto free_shadow;
+
+		memset(map->ff_buf, 0xFF, SNAP_DP_BMAP_WC_BUF_SIZE);
+		map->ff_mr = ibv_reg_mr(pd, map->ff_buf, SNAP_DP_BMAP_WC_BUF_SIZE, IBV_ACCESS_LOCAL_WRITE);
+		if (!map->ff_mr) {
+			SNAP_LIB_LOG_ERR("map %p: failed to register write combining buffer", map);
+			goto free_buf;
+		}
+		map->ff_pd = pd;
+	}
+
+	map->flush_usec = flush_usec;
+	return 0;
+
+free_buf:
+	free(map->ff_buf);
+	map->ff_buf = NULL;
+free_shadow:
+	free(map->shadow);
+	map->shadow = NULL;
+	return -ENOMEM;
+}
+
+static inline uint64_t snap_dp_bmap_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void snap_dp_bmap_wc_add(struct snap_dp_bmap *map, uint64_t off, uint64_t len)
+{
+	struct snap_dp_bmap_wc *wc, *best = NULL;
+	uint64_t gap, best_gap = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < map->n_pending; i++) {
+		wc = &map->pending[i];
+		if (off <= wc->off + wc->len && wc->off <= off + len)
+			goto merge;
+
+		gap = off > wc->off ? off - (wc->off + wc->len) : wc->off - (off + len);
+		if (gap < best_gap) {
+			best_gap = gap;
+			best = wc;
+		}
+	}
+
+	if (!map->n_pending)
+		map->pending_ts = snap_dp_bmap_now_usec();
+
+	if (map->n_pending < SNAP_DP_BMAP_MAX_PENDING) {
+		wc = &map->pending[map->n_pending++];
+		wc->off = off;
+		wc->len = len;
+		map->pending_bytes += len;
+		return;
+	}
+
+	/*
+	 * No room and the list could not be flushed. Bridge the gap to the
+	 * nearest run: marking extra map bytes only costs extra page copies.
+	 */
+	wc = best;
+merge:
+	map->pending_bytes -= wc->len;
+	len = snap_max(wc->off + wc->len, off + len);
+	wc->off = snap_min(wc->off, off);
+	wc->len = len - wc->off;
+	map->pending_bytes += wc->len;
+
+	/* the grown run may now touch other runs, absorb them */
+	for (i = 0; i < map->n_pending; i++) {
+		struct snap_dp_bmap_wc *o = &map->pending[i];
+
+		if (o == wc || o->off > wc->off + wc->len || wc->off > o->off + o->len)
+			continue;
+
+		map->pending_bytes -= wc->len + o->len;
+		len = snap_max(wc->off + wc->len, o->off + o->len);
+		wc->off = snap_min(wc->off, o->off);
+		wc->len = len - wc->off;
+		map->pending_bytes += wc->len;
+
+		/* move the last run into the hole and rescan */
+		if (wc == &map->pending[map->n_pending - 1])
+			wc = o;
+		*o = map->pending[--map->n_pending];
+		i = -1;
+	}
+}
+
+static void snap_dp_bmap_shadow_clear(struct snap_dp_bmap *map, uint64_t off, uint64_t len)
+{
+	uint64_t end = off + len, mask;
+
+	if (!map->shadow)
+		return;
+
+	end = snap_min(end, map->map_size);
+	while (off < end) {
+		len = snap_min(64 - off % 64, end - off);
+		mask = len == 64 ? UINT64_MAX : ((1ULL << len) - 1) << (off % 64);
+		map->shadow[off / 64] &= ~mask;
+		off += len;
+	}
+}
+
+/* ff buffer can only be used by queues of the pd it was registered with */
+static inline bool snap_dp_bmap_use_ff(struct snap_dp_bmap *map, struct snap_dma_q *q)
+{
+	return map->ff_mr && snap_dma_q_get_pd(q) == map->ff_pd;
+}
+
+static int snap_dp_bmap_write(struct snap_dp_bmap *map, struct snap_dma_q *q,
+		uint64_t raddr, uint32_t len, bool use_ff)
+{
+	uint64_t ff_inline = UINT64_MAX;
+
+	if (use_ff)
+		return snap_dma_q_write(q, map->ff_buf, len, map->ff_mr->lkey, raddr,
+				map->host_key, NULL);
+
+	/* data is copied into the wqe */
+	return snap_dma_q_write_short(q, &ff_inline, len, raddr, map->host_key);
+}
+
+/* write single pending run, on failure the run is updated to what is left */
+static int snap_dp_bmap_wc_write(struct snap_dp_bmap *map, struct snap_dma_q *q,
+		struct snap_dp_bmap_wc *wc)
+{
+	bool use_ff = snap_dp_bmap_use_ff(map, q);
+	uint64_t sge_off = 0, n;
+	uint32_t max_len;
+	int i, rc;
+
+	max_len = use_ff ? SNAP_DP_BMAP_WC_BUF_SIZE : sizeof(uint64_t);
+	for (i = 0; i < map->sge_count && wc->len; i++) {
+		if (wc->off >= sge_off + map->sge_list[i].len) {
+			sge_off += map->sge_list[i].len;
+			continue;
+		}
+
+		while (wc->len && wc->off < sge_off + map->sge_list[i].len) {
+			n = snap_min(wc->len, sge_off + map->sge_list[i].len - wc->off);
+			n = snap_min(n, max_len);
+			rc = snap_dp_bmap_write(map, q, map->sge_list[i].addr + wc->off - sge_off,
+					n, use_ff);
+			if (rc)
+				return rc;
+
+			snap_dp_bmap_shadow_clear(map, wc->off, n);
+			map->n_writes++;
+			map->pending_bytes -= n;
+			wc->off += n;
+			wc->len -= n;
+		}
+		sge_off += map->sge_list[i].len;
+	}
+
+	/* whatever is left is outside of the map */
+	snap_dp_bmap_shadow_clear(map, wc->off, wc->len);
+	map->pending_bytes -= wc->len;
+	wc->len = 0;
+	return 0;
+}
+
+static int snap_dp_bmap_flush_locked(struct snap_dp_bmap *map, struct snap_dma_q *q)
+{
+	int i, j, rc = 0;
+
+	for (i = 0; i < map->n_pending; i++) {
+		rc = snap_dp_bmap_wc_write(map, q, &map->pending[i]);
+		if (rc)
+			break;
+	}
+
+	/* compact runs that were not fully written */
+	for (j = 0; i < map->n_pending; i++) {
+		if (map->pending[i].len)
+			map->pending[j++] = map->pending[i];
+	}
+	map->n_pending = j;
+	map->flush_req = false;
+
+	if (rc && rc != -EAGAIN) {
+		SNAP_LIB_LOG_ERR("map %p: failed to write dirty map: %d, dropping %lu bytes",
+				 map, rc, map->pending_bytes);
+		/* dropped bytes must be queued again on the next mark */
+		for (i = 0; i < map->n_pending; i++)
+			snap_dp_bmap_shadow_clear(map, map->pending[i].off, map->pending[i].len);
+		map->n_pending = 0;
+		map->pending_bytes = 0;
+		return rc;
+	}
+
+	/* retry on the next progress */
+	if (rc == -EAGAIN)
+		map->flush_req = true;
+	return 0;
+}
+
+static void snap_dp_bmap_wc_queue(struct snap_dp_bmap *map, struct snap_dma_q *q,
+		uint64_t off, uint64_t len)
+{
+	if (map->n_pending == SNAP_DP_BMAP_MAX_PENDING)
+		snap_dp_bmap_flush_locked(map, q);
+	snap_dp_bmap_wc_add(map, off, len);
+}
+
+/**
+ * snap_dp_bmap_mark_dirty() - mark guest memory range as dirty
+ * @map:    byte/bitmap
+ * @q:      dma queue to write the host map with
+ * @pa:     guest physical address
+ * @length: range length
+ *
+ * Set map bytes that cover the range. If the write combining cache is
+ * enabled the update may be delayed, see snap_dp_bmap_cache_enable().
+ * If @q runs out of resources the update is kept and retried by
+ * snap_dp_bmap_progress() or snap_dp_bmap_flush().
+ *
+ * Return: 0 on success or -errno
+ */
+int snap_dp_bmap_mark_dirty(struct snap_dp_bmap *map, struct snap_dma_q *q,
+		uint64_t pa, uint32_t length)
+{
+	uint64_t first_page, end_page, off, end, run;
+	int rc = 0;
+
+	if (snap_unlikely(pa < map->start_pa || !length))
+		return 0;
+
+	first_page = (pa - map->start_pa) / map->page_size;
+	end_page = SNAP_ALIGN_CEIL(pa + length - map->start_pa, map->page_size) / map->page_size;
+	if (map->is_bytemap) {
+		off = first_page;
+		end = end_page;
+	} else {
+		off = first_page / 8;
+		end = SNAP_ALIGN_CEIL(end_page, 8) / 8;
+	}
+	end = snap_min(end, map->map_size);
+	if (snap_unlikely(off >= end))
+		return 0;
+
+	pthread_spin_lock(&map->lock);
+	if (!map->shadow) {
+		snap_dp_bmap_wc_queue(map, q, off, end - off);
+		goto flush;
+	}
+
+	while (off < end) {
+		/* skip bytes that are already pending */
+		while (off < end && (map->shadow[off / 64] & (1ULL << (off % 64)))) {
+			map->n_suppressed++;
+			off++;
+		}
+
+		for (run = off; run < end && !(map->shadow[run / 64] & (1ULL << (run % 64))); run++)
+			map->shadow[run / 64] |= 1ULL << (run % 64);
+
+		if (run > off)
+			snap_dp_bmap_wc_queue(map, q, off, run - off);
+		off = run;
+	}
+
+flush:
+	if (!map->flush_usec || map->n_pending == SNAP_DP_BMAP_MAX_PENDING)
+		rc = snap_dp_bmap_flush_locked(map, q);
+	pthread_spin_unlock(&map->lock);
+	return rc;
+}
+
+/**
+ * snap_dp_bmap_flush() - write all pending map updates to the host
+ * @map: byte/bitmap
+ * @q:   dma queue to write the host map with
+ *
+ * Writes are posted but not waited for, use snap_dma_q_flush() on @q.
+ *
+ * Return: 0 on success, -EAGAIN if some updates are still pending or -errno
+ */
+int snap_dp_bmap_flush(struct snap_dp_bmap *map, struct snap_dma_q *q)
+{
+	int rc;
+
+	pthread_spin_lock(&map->lock);
+	rc = snap_dp_bmap_flush_locked(map, q);
+	if (!rc && map->n_pending)
+		rc = -EAGAIN;
+	pthread_spin_unlock(&map->lock);
+	return rc;
+}
+
+/**
+ * snap_dp_bmap_progress() - flush map updates that stayed too long in the cache
+ * @map: byte/bitmap
+ * @q:   dma queue to write the host map with
+ */
+void snap_dp_bmap_progress(struct snap_dp_bmap *map, struct snap_dma_q *q)
+{
+	if (snap_likely(!map->n_pending))
+		return;
+
+	if (!map->flush_req && snap_dp_bmap_now_usec() - map->pending_ts < map->flush_usec)
+		return;
+
+	if (pthread_spin_trylock(&map->lock))
+		return;
+
+	if (map->n_pending)
+		snap_dp_bmap_flush_locked(map, q);
+	pthread_spin_unlock(&map->lock);
+}
+
+/**
+ * snap_dp_bmap_report_sync() - start a new dirty map reporting round
+ * @map: byte/bitmap
+ * @q:   dma queue to write the host map with. If it was not created on the
+ *       pd that was passed to snap_dp_bmap_cache_enable() the updates are
+ *       written inline.
+ *
+ * Must be called when the hypervisor asks for the dirty map report, before
+ * the report is completed. All pending updates are written to the host and
+ * waited for, so that the hypervisor harvests them with this report.
+ *
+ * Return: 0 on success or -errno if some updates could not be written
+ */
+int snap_dp_bmap_report_sync(struct snap_dp_bmap *map, struct snap_dma_q *q)
+{
+	int rc;
+
+	pthread_spin_lock(&map->lock);
+	while (!(rc = snap_dp_bmap_flush_locked(map, q)) && map->n_pending) {
+		/* out of tx resources, let the queue drain */
+		pthread_spin_unlock(&map->lock);
+		snap_dma_q_flush(q);
+		pthread_spin_lock(&map->lock);
+	}
+	pthread_spin_unlock(&map->lock);
+
+	snap_dma_q_flush(q);
+	return rc;
+}
+
+uint64_t snap_dp_bmap_pending_bytes(struct snap_dp_bmap *map)
+{
+	return map->pending_bytes;
+}
+
+int snap_dp_bmap_pending_writes(struct snap_dp_bmap *map)
+{
+	return map->n_pending;
+}
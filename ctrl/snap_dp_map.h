@@ -14,12 +14,44 @@
 #define _SNAP_DP_MAP_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct snap_dp_map;
 struct snap_vq_adm_sge;
+struct snap_dma_q;
+struct ibv_pd;
 
 /* page set */
+
+/**
+ * enum snap_dp_map_type - dirty page set implementation
+ * @SNAP_DP_MAP_HASH:  one hash entry per dirty page, single lock
+ * @SNAP_DP_MAP_RANGE: sorted runs of adjacent dirty pages, sharded per
+ *                     inserting thread. Serialization merges the shards
+ *                     in order and does not need a global sort.
+ */
+enum snap_dp_map_type {
+	SNAP_DP_MAP_HASH,
+	SNAP_DP_MAP_RANGE,
+};
+
+#define SNAP_DP_MAP_DEFAULT_SHARDS 8
+#define SNAP_DP_MAP_MAX_SHARDS     64
+
+/**
+ * struct snap_dp_map_attr - dirty page set attributes
+ * @type:    map implementation
+ * @nshards: number of insertion shards for SNAP_DP_MAP_RANGE, 0 means
+ *           SNAP_DP_MAP_DEFAULT_SHARDS. Ignored by SNAP_DP_MAP_HASH.
+ */
+struct snap_dp_map_attr {
+	enum snap_dp_map_type type;
+	int nshards;
+};
+
 struct snap_dp_map *snap_dp_map_create(unsigned int page_size);
+struct snap_dp_map *snap_dp_map_create_attr(unsigned int page_size,
+					    const struct snap_dp_map_attr *attr);
 void snap_dp_map_destroy(struct snap_dp_map *map);
 
 int snap_dp_map_add_range(struct snap_dp_map *map, uint64_t pa, uint32_t length);
@@ -42,4 +74,20 @@ uint32_t snap_dp_bmap_get_start_pa(struct snap_dp_bmap *map, uint64_t pa, uint32
 
 void snap_dp_bmap_set_mkey(struct snap_dp_bmap *map, uint32_t mkey);
 uint32_t snap_dp_bmap_get_mkey(struct snap_dp_bmap *map);
+
+/* max number of separate runs of map bytes waiting to be written */
+#define SNAP_DP_BMAP_MAX_PENDING 64
+/* max size of a single host map write */
+#define SNAP_DP_BMAP_WC_BUF_SIZE 4096
+/* default max delay of a host map update */
+#define SNAP_DP_BMAP_FLUSH_USEC 100
+
+int snap_dp_bmap_cache_enable(struct snap_dp_bmap *map, struct ibv_pd *pd, uint32_t flush_usec);
+int snap_dp_bmap_mark_dirty(struct snap_dp_bmap *map, struct snap_dma_q *q,
+		uint64_t pa, uint32_t length);
+int snap_dp_bmap_flush(struct snap_dp_bmap *map, struct snap_dma_q *q);
+void snap_dp_bmap_progress(struct snap_dp_bmap *map, struct snap_dma_q *q);
+int snap_dp_bmap_report_sync(struct snap_dp_bmap *map, struct snap_dma_q *q);
+uint64_t snap_dp_bmap_pending_bytes(struct snap_dp_bmap *map);
+int snap_dp_bmap_pending_writes(struct snap_dp_bmap *map);
 #endif
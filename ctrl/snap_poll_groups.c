@@ -14,6 +14,8 @@
 #include "snap_poll_groups.h"
 
 static size_t *virtio_pg_usage;
+/* sum of the load of queues in the group, see snap_virtio_ctrl_pg_balance() */
+static uint64_t *virtio_pg_load;
 static size_t virtio_pg_ref_count;
 
 void snap_pgs_free(struct snap_pg_ctx *ctx)
@@ -32,6 +34,8 @@ void snap_pgs_free(struct snap_pg_ctx *ctx)
 	if (!virtio_pg_ref_count) {
 		free(virtio_pg_usage);
 		virtio_pg_usage = NULL;
+		free(virtio_pg_load);
+		virtio_pg_load = NULL;
 	}
 }
 
@@ -46,7 +50,12 @@ int snap_pgs_alloc(struct snap_pg_ctx *ctx, int npgs)
 
 	if (!virtio_pg_usage) {
 		virtio_pg_usage = calloc(npgs, sizeof(*virtio_pg_usage));
-		if (!virtio_pg_usage) {
+		virtio_pg_load = calloc(npgs, sizeof(*virtio_pg_load));
+		if (!virtio_pg_usage || !virtio_pg_load) {
+			free(virtio_pg_usage);
+			virtio_pg_usage = NULL;
+			free(virtio_pg_load);
+			virtio_pg_load = NULL;
 			free(ctx->pgs);
 			return -1;
 		}
@@ -78,14 +87,31 @@ void snap_pgs_resume(struct snap_pg_ctx *ctx)
 		pthread_spin_unlock(&ctx->pgs[i].lock);
 }
 
+/*
+ * Pick the least loaded group. Without load information (all groups idle
+ * or balancing disabled) this is the group with the fewest queues.
+ */
 struct snap_pg *snap_pg_get_next(struct snap_pg_ctx *ctx)
 {
-	struct snap_pg *pg;
 	size_t pg_index = 0, i;
+	uint64_t load, min_load = snap_pg_load(0);
 
-	for (i = 1; i < ctx->npgs; i++)
-		if (virtio_pg_usage[i] < virtio_pg_usage[pg_index])
+	for (i = 1; i < ctx->npgs; i++) {
+		load = snap_pg_load(i);
+		if (load < min_load ||
+		    (load == min_load && virtio_pg_usage[i] < virtio_pg_usage[pg_index])) {
 			pg_index = i;
+			min_load = load;
+		}
+	}
+
+	return snap_pg_get(ctx, pg_index);
+}
+
+struct snap_pg *snap_pg_get(struct snap_pg_ctx *ctx, size_t pg_index)
+{
+	struct snap_pg *pg;
+
 	pg = &ctx->pgs[pg_index];
 	virtio_pg_usage[pg_index]++;
 	pg->id = pg_index;
@@ -98,6 +124,16 @@ void snap_pg_usage_decrease(size_t pg_index)
 	virtio_pg_usage[pg_index]--;
 }
 
+void snap_pg_load_update(size_t pg_index, int64_t delta)
+{
+	__atomic_add_fetch(&virtio_pg_load[pg_index], delta, __ATOMIC_RELAXED);
+}
+
+uint64_t snap_pg_load(size_t pg_index)
+{
+	return __atomic_load_n(&virtio_pg_load[pg_index], __ATOMIC_RELAXED);
+}
+
 struct snap_pg *snap_pg_get_admin(struct snap_pg_ctx *ctx)
 {
 	struct snap_pg *pg;
@@ -14,6 +14,7 @@
 #define _SNAP_POLL_GROUPS_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/queue.h>
 
 struct snap_pg_q_entry {
@@ -38,7 +39,10 @@ int snap_pgs_alloc(struct snap_pg_ctx *ctx, int nthreads);
 void snap_pgs_suspend(struct snap_pg_ctx *ctx);
 void snap_pgs_resume(struct snap_pg_ctx *ctx);
 struct snap_pg *snap_pg_get_next(struct snap_pg_ctx *ctx);
+struct snap_pg *snap_pg_get(struct snap_pg_ctx *ctx, size_t pg_index);
 void snap_pg_usage_decrease(size_t pg_index);
+void snap_pg_load_update(size_t pg_index, int64_t delta);
+uint64_t snap_pg_load(size_t pg_index);
 
 struct snap_pg *snap_pg_get_admin(struct snap_pg_ctx *ctx);
 
@@ -26,6 +26,8 @@
 					 (1ULL << VIRTIO_BLK_F_SIZE_MAX) |\
 					 (1ULL << VIRTIO_BLK_F_SEG_MAX) |\
 					 (1ULL << VIRTIO_BLK_F_BLK_SIZE)|\
+					 (1ULL << VIRTIO_BLK_F_DISCARD)|\
+					 (1ULL << VIRTIO_BLK_F_WRITE_ZEROES)|\
 					 (1ULL << VIRTIO_F_ADMIN_VQ)|\
 					 (1ULL << VIRTIO_F_ADMIN_MIGRATION)|\
 					 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PUSH_BITMAP_TRACK)|\
@@ -167,6 +169,12 @@ snap_virtio_blk_ctrl_bar_get_state(struct snap_virtio_ctrl *ctrl,
 	dev_cfg->seg_max = vbbar->seg_max;
 	dev_cfg->blk_size = vbbar->blk_size;
 	dev_cfg->num_queues = vbbar->max_blk_queues;
+	dev_cfg->max_discard_sectors = vbbar->max_discard_sectors;
+	dev_cfg->max_discard_seg = vbbar->max_discard_seg;
+	dev_cfg->discard_sector_alignment = vbbar->discard_sector_alignment;
+	dev_cfg->max_write_zeroes_sectors = vbbar->max_write_zeroes_sectors;
+	dev_cfg->max_write_zeroes_seg = vbbar->max_write_zeroes_segs;
+	dev_cfg->write_zeroes_may_unmap = vbbar->write_zeroes_may_unmap;
 	return snap_virtio_blk_ctrl_bar_get_state_size(ctrl);
 }
 
@@ -200,6 +208,12 @@ snap_virtio_blk_ctrl_bar_set_state(struct snap_virtio_ctrl *ctrl,
 	vbbar->seg_max = dev_cfg->seg_max;
 	vbbar->blk_size = dev_cfg->blk_size;
 	vbbar->max_blk_queues = dev_cfg->num_queues;
+	vbbar->max_discard_sectors = dev_cfg->max_discard_sectors;
+	vbbar->max_discard_seg = dev_cfg->max_discard_seg;
+	vbbar->discard_sector_alignment = dev_cfg->discard_sector_alignment;
+	vbbar->max_write_zeroes_sectors = dev_cfg->max_write_zeroes_sectors;
+	vbbar->max_write_zeroes_segs = dev_cfg->max_write_zeroes_seg;
+	vbbar->write_zeroes_may_unmap = dev_cfg->write_zeroes_may_unmap;
 
 	ret = snap_virtio_blk_modify_device(ctrl->sdev,
 					    SNAP_VIRTIO_MOD_ALL |
@@ -417,6 +431,17 @@ int snap_virtio_blk_ctrl_bar_setup(struct snap_virtio_blk_ctrl *ctrl,
 					    ~SNAP_VIRTIO_BLK_MODIFIABLE_FTRS);
 		bar.vattr.device_feature |= (new_ftrs &
 					     SNAP_VIRTIO_BLK_MODIFIABLE_FTRS);
+		/* Don't offer commands the block device can't execute */
+		if ((bar.vattr.device_feature & (1ULL << VIRTIO_BLK_F_DISCARD)) &&
+		    !(ctrl->bdev_ops && ctrl->bdev_ops->discard)) {
+			SNAP_LIB_LOG_WARN("Block device doesn't support discard, clearing VIRTIO_BLK_F_DISCARD");
+			bar.vattr.device_feature &= ~(1ULL << VIRTIO_BLK_F_DISCARD);
+		}
+		if ((bar.vattr.device_feature & (1ULL << VIRTIO_BLK_F_WRITE_ZEROES)) &&
+		    !(ctrl->bdev_ops && ctrl->bdev_ops->write_zeroes)) {
+			SNAP_LIB_LOG_WARN("Block device doesn't support write zeroes, clearing VIRTIO_BLK_F_WRITE_ZEROES");
+			bar.vattr.device_feature &= ~(1ULL << VIRTIO_BLK_F_WRITE_ZEROES);
+		}
 		bar.vattr.max_queue_size = regs->queue_size ? :
 					   bar.vattr.max_queue_size;
 		bar.vattr.max_queues = regs->max_queues;
@@ -442,6 +467,14 @@ int snap_virtio_blk_ctrl_bar_setup(struct snap_virtio_blk_ctrl *ctrl,
 			SNAP_LIB_LOG_WARN("Seg_max cannot be larger than queue depth - 2. Changed seg_max to %d.", regs->seg_max);
 		}
 		bar.seg_max = regs->seg_max ? : bar.seg_max;
+		bar.max_discard_sectors = regs->max_discard_sectors ? : bar.max_discard_sectors;
+		bar.max_discard_seg = regs->max_discard_seg ? : bar.max_discard_seg;
+		bar.discard_sector_alignment = regs->discard_sector_alignment ? :
+					       bar.discard_sector_alignment;
+		bar.max_write_zeroes_sectors = regs->max_write_zeroes_sectors ? :
+					       bar.max_write_zeroes_sectors;
+		bar.max_write_zeroes_segs = regs->max_write_zeroes_segs ? : bar.max_write_zeroes_segs;
+		bar.write_zeroes_may_unmap = regs->write_zeroes_may_unmap ? : bar.write_zeroes_may_unmap;
 	}
 
 	ret = snap_virtio_blk_modify_device(sdev, regs_mask | extra_flags, &bar);
@@ -586,8 +619,13 @@ out:
 	return ret;
 }
 
-static struct snap_virtio_ctrl*
-snap_virtio_blk_ctrl_get_vf(struct snap_virtio_ctrl *vctrl, struct snap_vq_cmd *cmd)
+/*
+ * The controllers have no snap device while they are reopened after FLR,
+ * admin commands that need it fail with -EAGAIN until the FLR is done.
+ */
+static int snap_virtio_blk_ctrl_get_vf(struct snap_virtio_ctrl *vctrl,
+				       struct snap_vq_cmd *cmd,
+				       struct snap_virtio_ctrl **vf)
 {
 	struct snap_virtio_adm_cmd_hdr_v1_2 *hdr = &snap_vaq_cmd_layout_get(cmd)->hdr.hdr_v1_2;
 	struct snap_virtio_blk_ctrl *pf_ctrl = to_blk_ctrl(vctrl);
@@ -597,10 +635,25 @@ snap_virtio_blk_ctrl_get_vf(struct snap_virtio_ctrl *vctrl, struct snap_vq_cmd *
 	/* vdev_id as given in cmd_in starts count with 1 */
 	vdev_id = snap_vaq_cmd_layout_get(cmd)->in.vdev_id - 1;
 	if (vdev_id < 0)
-		return NULL;
+		return -EINVAL;
+
+	if (vctrl->pending_flr) {
+		SNAP_LIB_LOG_ERR("%p: PF got adm cmd %d:%d to run on VF:%d during FLR",
+			   pf_ctrl, hdr->cmd_class, hdr->command, vdev_id);
+		return -EAGAIN;
+	}
 
 	if (pf_ctrl->common.sdev->pci->num_vfs > vdev_id && pf_ctrl->vfs_ctrl) {
 		vf_ctrl =  pf_ctrl->vfs_ctrl[vdev_id];
+		if (vf_ctrl && vf_ctrl->common.pending_flr) {
+			SNAP_LIB_LOG_ERR("%p: PF:%d (%s) got adm cmd %d:%d to run on VF:%d ctrl %p during its FLR",
+				  pf_ctrl,
+				  vctrl->sdev->pci->id,
+				  vctrl->sdev->pci->pci_number,
+				  hdr->cmd_class, hdr->command,
+				  vdev_id, vf_ctrl);
+			return -EAGAIN;
+		}
 		if (vf_ctrl) {
 			SNAP_LIB_LOG_INFO("%p: PF:%d (%s) got adm cmd %d:%d to run on VF:%d (%s) ctrl %p",
 				  pf_ctrl,
@@ -610,7 +663,8 @@ snap_virtio_blk_ctrl_get_vf(struct snap_virtio_ctrl *vctrl, struct snap_vq_cmd *
 				  vdev_id,
 				  vf_ctrl->common.sdev->pci->pci_number,
 				  vf_ctrl);
-			return &vf_ctrl->common;
+			*vf = &vf_ctrl->common;
+			return 0;
 		}
 	}
 
@@ -620,7 +674,14 @@ snap_virtio_blk_ctrl_get_vf(struct snap_virtio_ctrl *vctrl, struct snap_vq_cmd *
 		   vctrl->sdev->pci->pci_number,
 		   hdr->cmd_class, hdr->command, vdev_id);
 
-	return NULL;
+	return -ENODEV;
+}
+
+/* FLR in flight is transient, the host may retry the command */
+static inline enum snap_virtio_adm_status snap_virtio_blk_ctrl_vf_err_status(int ret)
+{
+	return ret == -EAGAIN ? SNAP_VIRTIO_ADM_STATUS_ERR :
+				SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR;
 }
 
 static void snap_virtio_blk_ctrl_lm_dp_start_track_cb(struct snap_vq_cmd *vcmd,
@@ -631,6 +692,7 @@ static void snap_virtio_blk_ctrl_lm_dp_start_track_cb(struct snap_vq_cmd *vcmd,
 	struct snap_virtio_blk_ctrl *pf_blk_ctrl;
 	struct snap_vq_adm_dirty_page_track_start *dp_start_cmd;
 	size_t sge_len;
+	int ret;
 
 	pf_ctrl = snap_vaq_cmd_ctrl_get(vcmd);
 	pf_blk_ctrl = to_blk_ctrl(pf_ctrl);
@@ -640,9 +702,9 @@ static void snap_virtio_blk_ctrl_lm_dp_start_track_cb(struct snap_vq_cmd *vcmd,
 		goto done;
 	}
 
-	vf_ctrl = snap_virtio_blk_ctrl_get_vf(pf_ctrl, vcmd);
-	if (!vf_ctrl) {
-		vq_adm_status = SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR;
+	ret = snap_virtio_blk_ctrl_get_vf(pf_ctrl, vcmd, &vf_ctrl);
+	if (ret) {
+		vq_adm_status = snap_virtio_blk_ctrl_vf_err_status(ret);
 		goto done;
 	}
 
@@ -669,6 +731,8 @@ static void snap_virtio_blk_ctrl_lm_dp_start_track_cb(struct snap_vq_cmd *vcmd,
 	}
 
 	snap_dp_bmap_set_mkey(vf_ctrl->dp_map, vf_ctrl->pf_xmkey->mkey);
+	if (snap_dp_bmap_cache_enable(vf_ctrl->dp_map, vf_ctrl->lb_pd, SNAP_DP_BMAP_FLUSH_USEC))
+		SNAP_LIB_LOG_WARN("ctrl %p: dirty map write combining is disabled", vf_ctrl);
 	snap_virtio_ctrl_start_dirty_pages_track(vf_ctrl);
 
 done:
@@ -685,9 +749,9 @@ static void snap_virtio_blk_ctrl_lm_dp_start_track(struct snap_virtio_ctrl *vctr
 	size_t offset, sgl_len;
 	int ret;
 
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -732,10 +796,11 @@ static void snap_virtio_blk_ctrl_lm_dp_stop_track(struct snap_virtio_ctrl *vctrl
 						struct snap_vq_cmd *cmd)
 {
 	struct snap_virtio_ctrl *ctrl;
+	int ret;
 
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -759,11 +824,12 @@ static void snap_virtio_blk_ctrl_lm_dp_pending_bytes_get(struct snap_virtio_ctrl
 {
 	struct snap_virtio_ctrl *ctrl;
 	struct snap_vq_adm_get_pending_bytes_result *res;
+	int ret;
 
 	res = &snap_vaq_cmd_layout_get(cmd)->out.pending_bytes_res;
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -779,11 +845,12 @@ static void snap_virtio_blk_ctrl_lm_status_get(struct snap_virtio_ctrl *vctrl,
 {
 	struct snap_virtio_ctrl *ctrl;
 	struct snap_vq_adm_get_status_result *res;
+	int ret;
 
 	res = &snap_vaq_cmd_layout_get(cmd)->out.get_status_res;
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -796,13 +863,13 @@ static void snap_virtio_blk_ctrl_lm_status_modify(struct snap_virtio_ctrl *vctrl
 	struct snap_vq_adm_modify_status_data data;
 	enum snap_virtio_ctrl_lm_state cur_status, new_status;
 	struct snap_virtio_ctrl *ctrl;
-	int ret = -1;
+	int ret;
 
 	data = snap_vaq_cmd_layout_get(cmd)->in.modify_status_data;
 	new_status = data.internal_status;
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -827,7 +894,9 @@ static void snap_virtio_blk_ctrl_lm_status_modify(struct snap_virtio_ctrl *vctrl
 		break;
 	case SNAP_VIRTIO_CTRL_LM_RUNNING:
 		ret = snap_virtio_ctrl_unquiesce(ctrl);
+		break;
 	default:
+		ret = -EINVAL;
 		break;
 	}
 
@@ -842,11 +911,12 @@ static void snap_virtio_blk_ctrl_lm_pending_bytes_get(struct snap_virtio_ctrl *v
 {
 	struct snap_virtio_ctrl *ctrl;
 	struct snap_vq_adm_get_pending_bytes_result *res;
+	int ret;
 
 	res = &snap_vaq_cmd_layout_get(cmd)->out.pending_bytes_res;
-	ctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!ctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -887,9 +957,9 @@ static void snap_virtio_blk_ctrl_lm_state_restore_cb(struct snap_vq_cmd *vcmd,
 		goto free_mem;
 	}
 
-	vf_ctrl = snap_virtio_blk_ctrl_get_vf(snap_vaq_cmd_ctrl_get(vcmd), vcmd);
-	if (!vf_ctrl) {
-		snap_vaq_cmd_complete(vcmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(snap_vaq_cmd_ctrl_get(vcmd), vcmd, &vf_ctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(vcmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		goto free_mem;
 	}
 
@@ -915,9 +985,9 @@ static void snap_virtio_blk_ctrl_lm_state_save(struct snap_virtio_ctrl *vctrl,
 	struct snap_vq_adm_save_state_data data;
 	int ret;
 
-	vf_vctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!vf_vctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &vf_vctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -990,9 +1060,9 @@ static void snap_virtio_blk_ctrl_lm_dp_report_map(struct snap_virtio_ctrl *vctrl
 	struct snap_vq_adm_save_state_data *data;
 	int ret;
 
-	vf_vctrl = snap_virtio_blk_ctrl_get_vf(vctrl, cmd);
-	if (!vf_vctrl) {
-		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+	ret = snap_virtio_blk_ctrl_get_vf(vctrl, cmd, &vf_vctrl);
+	if (ret) {
+		snap_vaq_cmd_complete(cmd, snap_virtio_blk_ctrl_vf_err_status(ret));
 		return;
 	}
 
@@ -1002,7 +1072,17 @@ static void snap_virtio_blk_ctrl_lm_dp_report_map(struct snap_virtio_ctrl *vctrl
 	if (!blk_ctrl->lm_buf) {
 		SNAP_LIB_LOG_ERR("Failed allocating data buf for dirty pages");
 		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+		return;
 	}
+
+	/* delayed map updates must be in the host map before it is harvested */
+	ret = snap_virtio_ctrl_dp_map_report_sync(vf_vctrl, snap_vaq_cmd_dmaq_get(cmd));
+	if (ret) {
+		snap_buf_free(blk_ctrl->lm_buf);
+		snap_vaq_cmd_complete(cmd, SNAP_VIRTIO_ADM_STATUS_DEVICE_INTERNAL_ERR);
+		return;
+	}
+
 	ret = snap_virtio_ctrl_serialize_dirty_pages(vf_vctrl, blk_ctrl->lm_buf, data->length);
 	if (ret < 0) {
 		snap_buf_free(blk_ctrl->lm_buf);
@@ -1133,6 +1213,14 @@ static int blk_virtq_create_helper(struct snap_virtio_blk_ctrl_queue *vbq,
 		attr.seg_max = dev_attr->seg_max;
 	else
 		attr.seg_max = 1;
+	if (vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_BLK_F_DISCARD)) {
+		attr.max_discard_sectors = dev_attr->max_discard_sectors;
+		attr.max_discard_seg = dev_attr->max_discard_seg ? : 1;
+	}
+	if (vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_BLK_F_WRITE_ZEROES)) {
+		attr.max_write_zeroes_sectors = dev_attr->max_write_zeroes_sectors;
+		attr.max_write_zeroes_segs = dev_attr->max_write_zeroes_segs ? : 1;
+	}
 	attr.queue_size = vbq->attr->vattr.size;
 	attr.pd = blk_ctrl->common.lb_pd;
 	attr.desc = vbq->attr->vattr.desc;
@@ -1327,13 +1415,12 @@ static int snap_virtio_blk_ctrl_queue_resume(struct snap_virtio_ctrl_queue *vq)
 static int snap_virtio_blk_ctrl_queue_progress(struct snap_virtio_ctrl_queue *vq)
 {
 	struct snap_virtio_blk_ctrl_queue *vbq = to_blk_ctrl_q(vq);
-	struct virtq_common_ctx *q = &to_blk_ctx(vbq->q_impl)->common_ctx;
 
 	if (vbq->is_adm_vq) {
 		if (snap_likely(vbq->q_impl))
 			return snap_vq_progress(vbq->q_impl);
 	} else
-		return virtq_progress(q, vq->thread_id);
+		return blk_virtq_progress(vbq->q_impl, vq->thread_id);
 
 	return 0;
 }
@@ -1468,6 +1555,9 @@ snap_virtio_blk_ctrl_open(struct snap_context *sctx,
 
 	ctrl->bdev_ops = bdev_ops;
 	ctrl->bdev = bdev;
+	pthread_spin_init(&ctrl->flush.lock, 0);
+	/* nothing is known about the bdev cache, first flush is never skipped */
+	ctrl->flush.write_gen = 1;
 
 	if (attr->common.pf_id < 0 ||
 	    attr->common.pf_id >= sctx->virtio_blk_pfs.max_pfs) {
@@ -1557,6 +1647,7 @@ teardown_dev:
 close_ctrl:
 	snap_virtio_ctrl_close(&ctrl->common);
 free_ctrl:
+	pthread_spin_destroy(&ctrl->flush.lock);
 	free(ctrl);
 err:
 	return NULL;
@@ -1574,6 +1665,7 @@ void snap_virtio_blk_ctrl_close(struct snap_virtio_blk_ctrl *ctrl)
 	if (!ctrl->common.pending_flr)
 		snap_virtio_blk_teardown_device(ctrl->common.sdev);
 	snap_virtio_ctrl_close(&ctrl->common);
+	pthread_spin_destroy(&ctrl->flush.lock);
 	free(ctrl);
 }
 
@@ -51,6 +51,34 @@ struct snap_virtio_blk_ctrl_attr {
 	struct snap_virtio_blk_registers regs;
 };
 
+/**
+ * struct snap_virtio_blk_flush_state - flush coalescing across queues
+ * @lock:	  protects all fields except @write_gen and @sampled_gen
+ * @write_gen:	  write generation, advanced by a write that completes after
+ *		  a flush sampled the current generation
+ * @sampled_gen:  last @write_gen value sampled by a flush
+ * @flushed_gen:  @write_gen value covered by the last successful flush
+ * @inflight_gen: @write_gen value covered by the running backend flush
+ * @issued_seq:	  number of backend flushes issued
+ * @done_seq:	  number of backend flushes completed
+ * @inflight:	  backend flush is running
+ *
+ * Only one backend flush runs per controller at a time. Flush requests
+ * that arrive while it runs and are covered by it wait for its completion
+ * instead of issuing their own, and a flush request with no writes
+ * completed since the last successful flush is completed immediately.
+ */
+struct snap_virtio_blk_flush_state {
+	pthread_spinlock_t lock;
+	uint64_t write_gen;
+	uint64_t sampled_gen;
+	uint64_t flushed_gen;
+	uint64_t inflight_gen;
+	uint64_t issued_seq;
+	uint64_t done_seq;
+	bool inflight;
+};
+
 struct snap_virtio_blk_ctrl {
 	struct snap_virtio_ctrl common;
 	struct snap_bdev_ops *bdev_ops;
@@ -63,6 +91,7 @@ struct snap_virtio_blk_ctrl {
 	struct snap_virtio_blk_ctrl **vfs_ctrl;
 	uint8_t *lm_buf;
 	bool has_adm_vq;
+	struct snap_virtio_blk_flush_state flush;
 };
 
 struct snap_virtio_blk_ctrl *
@@ -19,6 +19,7 @@
 #include "snap_env.h"
 #include "snap_virtio_blk_ctrl.h"
 #include "snap_dpa_virtq.h"
+#include "snap_queue.h"
 
 #define NUM_HDR_FTR_DESCS 2
 
@@ -52,6 +53,19 @@ struct blk_virtq_cmd {
 	uint64_t offset_blocks;
 	uint64_t num_blocks;
 	bool in_bdev_detach;
+	/* bdev ops still in flight for a multi-segment discard/write zeroes */
+	int bdev_ops_pending;
+	bool bdev_op_failed;
+	/* first discard/write zeroes segment not submitted yet */
+	int dwz_pos;
+	/* flush coalescing, see struct snap_virtio_blk_flush_state */
+	uint64_t flush_gen;
+	uint64_t flush_seq;
+	bool flush_covered;
+	TAILQ_ENTRY(blk_virtq_cmd) flush_entry;
+	/* first data desc and req_buf offset not posted yet, 0 - no transfer */
+	int xfer_pos;
+	size_t xfer_offset;
 	struct virtio_blk_outftr ftr;
 	int max_iov_cnt;
 	int iov_cnt;
@@ -183,6 +197,9 @@ static void init_blk_virtq_cmd(struct blk_virtq_cmd *cmd, int idx,
 	cmd->common_cmd.dma_comp.func = sm_dma_cb;
 	cmd->bdev_op_ctx.user_arg = cmd;
 	cmd->bdev_op_ctx.cb = bdev_io_comp_cb;
+	cmd->bdev_ops_pending = 0;
+	cmd->bdev_op_failed = false;
+	cmd->dwz_pos = 0;
 	cmd->common_cmd.io_cmd_stat = NULL;
 	cmd->common_cmd.cmd_available_index = 0;
 	cmd->common_cmd.vq_priv->merge_descs = true;
@@ -214,7 +231,9 @@ static void init_blk_virtq_cmd(struct blk_virtq_cmd *cmd, int idx,
  * via RDMA queues and written/read to block device. Descriptors memory should
  * be allocated such that it can be written to by RDMA. Instead of registering
  * another memory region for completion allocate memory for completion mem at
- * end of the request buffer.
+ * end of the request buffer. Per command data is padded to the bdev block
+ * size, so that every request buffer is block aligned as O_DIRECT backends
+ * require.
  * Note: for easy implementation there is a direct mapping between descr_head_idx
  * and command.
  * Todo: Unify memory into one block for all commands
@@ -230,7 +249,8 @@ alloc_blk_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 	const size_t req_size = size_max * seg_max;
 	const size_t descs_size = VIRTIO_NUM_DESC(seg_max) * sizeof(struct vring_desc);
 	const size_t aux_size = sizeof(struct blk_virtq_cmd_aux) + descs_size;
-	size_t data_size;
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(&vq_priv->virtq_dev);
+	size_t data_size, blk_size;
 	uint8_t *cmd_data, *cmd_aux;
 
 	if (vq_priv->zcopy) {
@@ -248,9 +268,12 @@ alloc_blk_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 	}
 
 	data_size = aux_size;
-	if (!vq_priv->use_mem_pool)
-		data_size += req_size;
-	vq_priv->data = to_blk_bdev_ops(&vq_priv->virtq_dev)->dma_malloc(data_size * num);
+	if (!vq_priv->use_mem_pool) {
+		blk_size = snap_max(ops->get_block_size(vq_priv->virtq_dev.ctx),
+				    (uint32_t)BDEV_SECTOR_SIZE);
+		data_size = SNAP_ALIGN_CEIL(data_size + req_size, blk_size);
+	}
+	vq_priv->data = ops->dma_malloc(data_size * num);
 	if (!vq_priv->data) {
 		SNAP_LIB_LOG_ERR("failed to allocate %ld bytes of memory for virtq %d",
 			data_size * num, vq_priv->vq_ctx->idx);
@@ -343,12 +366,50 @@ err:
 	return -1;
 }
 
+static inline struct snap_virtio_blk_flush_state *
+to_blk_flush_state(struct virtq_priv *priv)
+{
+	return &to_blk_ctrl(priv->vbq->ctrl)->flush;
+}
+
+/**
+ * blk_virtq_flush_mark_dirty() - note that a write has completed
+ * @fs: controller flush state
+ *
+ * Only the first write completed after a flush sampled the write
+ * generation advances it, the following ones see a generation that is not
+ * covered by any flush yet and skip the atomic update.
+ */
+static inline void blk_virtq_flush_mark_dirty(struct snap_virtio_blk_flush_state *fs)
+{
+	if (__atomic_load_n(&fs->write_gen, __ATOMIC_ACQUIRE) ==
+	    __atomic_load_n(&fs->sampled_gen, __ATOMIC_ACQUIRE))
+		__atomic_fetch_add(&fs->write_gen, 1, __ATOMIC_RELEASE);
+}
+
 static void bdev_io_comp_cb(enum snap_bdev_op_status status, void *done_arg)
 {
 	struct blk_virtq_cmd *cmd = done_arg;
 	enum virtq_cmd_sm_op_status op_status = VIRTQ_CMD_SM_OP_OK;
+	uint32_t cmd_type = to_blk_cmd_aux(cmd->common_cmd.aux)->header.type;
+
+	if (snap_unlikely(status != SNAP_BDEV_OP_SUCCESS))
+		cmd->bdev_op_failed = true;
+
+	/* even a failed write may have changed the media */
+	if (cmd_type == VIRTIO_BLK_T_OUT || cmd_type == VIRTIO_BLK_T_WRITE_ZEROES ||
+	    cmd_type == VIRTIO_BLK_T_DISCARD)
+		blk_virtq_flush_mark_dirty(to_blk_flush_state(cmd->common_cmd.vq_priv));
+
+	/* Command is done only when the last of its segments completes */
+	if (snap_unlikely(cmd->bdev_ops_pending > 1)) {
+		cmd->bdev_ops_pending--;
+		return;
+	}
+	cmd->bdev_ops_pending = 0;
 
-	if (snap_unlikely(status != SNAP_BDEV_OP_SUCCESS)) {
+	if (snap_unlikely(cmd->bdev_op_failed)) {
+		cmd->bdev_op_failed = false;
 		SNAP_LIB_LOG_ERR("Failed iov completion!");
 		to_blk_cmd_ftr(cmd->common_cmd.ftr)->status = VIRTIO_BLK_S_IOERR;
 		cmd->common_cmd.state = VIRTQ_CMD_STATE_WRITE_STATUS;
@@ -397,7 +458,8 @@ static inline bool zcopy_prepare(struct blk_virtq_cmd *cmd)
 	if (cmd->common_cmd.num_desc == NUM_HDR_FTR_DESCS)
 		return false;
 
-	if (aux->header.type == VIRTIO_BLK_T_GET_ID)
+	if (aux->header.type != VIRTIO_BLK_T_IN &&
+	    aux->header.type != VIRTIO_BLK_T_OUT)
 		return false;
 
 	if (!ops->zcopy_validate_params)
@@ -540,6 +602,9 @@ static void blk_virtq_proc_desc(struct virtq_cmd *cmd)
 
 static int virtq_alloc_req_dbuf(struct blk_virtq_cmd *cmd, size_t len)
 {
+	if (!virtq_req_pool_alloc(&cmd->common_cmd, len))
+		return 0;
+
 	cmd->common_cmd.req_buf = to_blk_bdev_ops(&cmd->common_cmd.vq_priv->virtq_dev)->dma_malloc(len);
 	if (!cmd->common_cmd.req_buf) {
 		SNAP_LIB_LOG_ERR("failed to dynamically allocate %lu bytes for command %d request",
@@ -590,7 +655,11 @@ static bool blk_virtq_sm_read_header(struct virtq_cmd *cmd,
 		to_blk_cmd_aux(cmd->aux)->descs[0].addr, priv->vattr->dma_mkey,
 		&cmd->dma_comp);
 
-	if (ret) {
+	if (snap_unlikely(ret == -EAGAIN)) {
+		cmd->state = VIRTQ_CMD_STATE_READ_HEADER;
+		virtq_cmd_defer(cmd);
+		return false;
+	} else if (ret) {
 		/* print qp number */
 		ERR_ON_CMD(cmd, "failed to read header, ret %d qpn 0x%x", ret, snap_qp_get_qpnum(priv->dma_q->sw_qp.qp));
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
@@ -642,6 +711,8 @@ static bool blk_virtq_sm_parse_header(struct virtq_cmd *cmd,
 
 	switch (to_blk_cmd_aux(cmd->aux)->header.type) {
 	case VIRTIO_BLK_T_OUT:
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
 		req_len = cmd->total_seg_len;
 		cmd->state = VIRTQ_CMD_STATE_READ_DATA;
 		break;
@@ -682,11 +753,211 @@ static bool blk_virtq_sm_parse_header(struct virtq_cmd *cmd,
 	return true;
 }
 
+static inline bool blk_virtq_data_desc_skip(struct vring_desc *desc,
+					     bool to_host)
+{
+	return !to_host && (desc->flags & VRING_DESC_F_WRITE);
+}
+
+/*
+ * Queues created without iov support can only move one descriptor at a
+ * time. Every host iov entry takes at least one send wqe, so a group must
+ * also fit in the send queue.
+ */
+static inline int blk_virtq_data_xfer_max_iov(struct virtq_cmd *cmd)
+{
+	struct snap_dma_q *q = cmd->vq_priv->dma_q;
+
+	if (!q->iov_support)
+		return 1;
+	return snap_max(snap_min(SNAP_DMA_Q_MAX_IOV_CNT, q->tx_qsize), 1);
+}
+
+static int blk_virtq_data_xfer_count_from(struct virtq_cmd *cmd, bool to_host,
+					  int pos)
+{
+	struct vring_desc *descs = to_blk_cmd_aux(cmd->aux)->descs;
+	int max_iov = blk_virtq_data_xfer_max_iov(cmd);
+	int i, n = 0;
+
+	for (i = pos; i < cmd->num_desc - 1; i++) {
+		if (!blk_virtq_data_desc_skip(&descs[i], to_host))
+			n++;
+	}
+
+	return (n + max_iov - 1) / max_iov;
+}
+
+/**
+ * blk_virtq_data_xfer_count() - number of dma operations to move cmd data
+ * @cmd: Command being processed
+ * @to_host: true if data is written to the host, false if it is read
+ *
+ * Return: number of dma operations blk_virtq_data_xfer() is going to post
+ * if the dma queue has enough room. Groups that are cut short by a busy
+ * queue are accounted by blk_virtq_data_xfer() itself.
+ */
+static int blk_virtq_data_xfer_count(struct virtq_cmd *cmd, bool to_host)
+{
+	return blk_virtq_data_xfer_count_from(cmd, to_host, 1);
+}
+
+static int blk_virtq_data_xfer_post(struct virtq_cmd *cmd, bool to_host,
+				    struct iovec *host_iov, int iov_cnt,
+				    size_t offset, size_t len)
+{
+	struct snap_dma_q *q = cmd->vq_priv->dma_q;
+	uint32_t rkey = cmd->vq_priv->vattr->dma_mkey;
+	uint32_t lkey = cmd->req_mr->lkey;
+	struct iovec local_iov;
+
+	/* plain read/write is cheaper when there is nothing to gather */
+	if (iov_cnt == 1) {
+		if (to_host)
+			return snap_dma_q_write(q, cmd->req_buf + offset, len,
+						lkey, (uint64_t)host_iov[0].iov_base,
+						rkey, &cmd->dma_comp);
+		return snap_dma_q_read(q, cmd->req_buf + offset, len,
+				       lkey, (uint64_t)host_iov[0].iov_base,
+				       rkey, &cmd->dma_comp);
+	}
+
+	local_iov.iov_base = cmd->req_buf + offset;
+	local_iov.iov_len = len;
+	if (to_host)
+		return snap_dma_q_writev2v(q, &lkey, &local_iov, 1,
+					   &rkey, host_iov, iov_cnt,
+					   true, true, &cmd->dma_comp);
+	return snap_dma_q_readv2v(q, &lkey, &local_iov, 1,
+				  &rkey, host_iov, iov_cnt,
+				  true, true, &cmd->dma_comp);
+}
+
+static int blk_virtq_data_xfer_group(struct virtq_cmd *cmd, bool to_host,
+				     struct iovec *host_iov, int iov_cnt,
+				     size_t len, int next_pos, bool cut)
+{
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+	int i, ret, n_ops = 0;
+
+	/* ops left if the group had not been cut, before it is posted */
+	if (cut)
+		n_ops = blk_virtq_data_xfer_count_from(cmd, to_host, blk_cmd->xfer_pos);
+
+	ret = blk_virtq_data_xfer_post(cmd, to_host, host_iov, iov_cnt, blk_cmd->xfer_offset, len);
+	if (ret)
+		return ret;
+
+	/* the posted op is still outstanding, the count cannot drop to 0 */
+	if (cut)
+		cmd->dma_comp.count += 1 + blk_virtq_data_xfer_count_from(cmd, to_host, next_pos) - n_ops;
+
+	if (to_host) {
+		for (i = 0; i < iov_cnt; i++) {
+			virtq_mark_dirty_mem(cmd, (uint64_t)host_iov[i].iov_base,
+					     host_iov[i].iov_len, false);
+			cmd->total_in_len += host_iov[i].iov_len;
+		}
+	}
+	blk_cmd->xfer_offset += len;
+	blk_cmd->xfer_pos = next_pos;
+	return 0;
+}
+
+/**
+ * blk_virtq_data_xfer() - move cmd data between req_buf and host memory
+ * @cmd: Command being processed
+ * @to_host: true to write req_buf to the host, false to read into req_buf
+ *
+ * Data descriptors are gathered into host iov lists of up to
+ * SNAP_DMA_Q_MAX_IOV_CNT entries (one if the dma queue has no iov
+ * support), capped by the send queue size and by the send queue room
+ * left, and each list is moved to/from the contiguous req_buf by a single
+ * vectored dma operation. All operations share cmd->dma_comp, its count
+ * must be set by the caller to the value returned by
+ * blk_virtq_data_xfer_count(). A list cut short by the queue room is
+ * accounted here, once it is posted.
+ *
+ * The transfer starts at xfer_pos/xfer_offset. If the dma queue is full
+ * they are left pointing to the first operation that was not posted, so
+ * the transfer can be continued by calling the function again. The
+ * operations that were not posted are still accounted in dma_comp.count,
+ * so the command cannot complete in between.
+ *
+ * Return: 0 on success, -EAGAIN if the transfer must be continued later,
+ * dma error otherwise
+ */
+static int blk_virtq_data_xfer(struct virtq_cmd *cmd, bool to_host)
+{
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+	struct vring_desc *descs = to_blk_cmd_aux(cmd->aux)->descs;
+	struct iovec host_iov[SNAP_DMA_Q_MAX_IOV_CNT];
+	int max_iov = blk_virtq_data_xfer_max_iov(cmd);
+	int room = snap_max(cmd->vq_priv->dma_q->tx_available, 1);
+	size_t len = 0;
+	int i, n = 0, ret;
+
+	for (i = blk_cmd->xfer_pos; i < cmd->num_desc - 1; i++) {
+		if (blk_virtq_data_desc_skip(&descs[i], to_host))
+			continue;
+
+		virtq_log_data(cmd, "%s: pa 0x%llx len %u\n",
+			       to_host ? "WRITE_DATA" : "READ_DATA",
+			       descs[i].addr, descs[i].len);
+		host_iov[n].iov_base = (void *)descs[i].addr;
+		host_iov[n].iov_len = descs[i].len;
+		len += descs[i].len;
+
+		if (++n < snap_min(max_iov, room))
+			continue;
+
+		ret = blk_virtq_data_xfer_group(cmd, to_host, host_iov, n, len, i + 1,
+						n < max_iov);
+		if (ret)
+			return ret;
+		room = snap_max(cmd->vq_priv->dma_q->tx_available, 1);
+		len = 0;
+		n = 0;
+	}
+
+	if (n) {
+		ret = blk_virtq_data_xfer_group(cmd, to_host, host_iov, n, len, i, false);
+		if (ret)
+			return ret;
+	}
+
+	blk_cmd->xfer_pos = 0;
+	return 0;
+}
+
+/*
+ * Start or continue the data transfer of a command. Return true if the
+ * command has to wait for dma queue resources.
+ */
+static bool blk_virtq_data_xfer_deferred(struct virtq_cmd *cmd, bool to_host, int *ret)
+{
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+
+	if (!blk_cmd->xfer_pos) {
+		blk_cmd->xfer_pos = 1;
+		blk_cmd->xfer_offset = 0;
+	}
+
+	*ret = blk_virtq_data_xfer(cmd, to_host);
+	if (snap_likely(*ret != -EAGAIN))
+		return false;
+
+	virtq_cmd_defer(cmd);
+	return true;
+}
+
 /**
  * virtq_read_req_from_host() - Read request from host
  * @cmd: Command being processed
  *
- * RDMA READ the command request data from host memory.
+ * RDMA READ the command request data from host memory. Data descriptors
+ * are gathered into a single vectored read, or a few of them when the
+ * number of descriptors is above SNAP_DMA_Q_MAX_IOV_CNT.
  * Error after requesting the first RDMA READ is fatal because we can't
  * cancel previous RDMA READ requests done for this command, and since
  * the failing RDMA READ will not return the completion counter will not get
@@ -706,52 +977,304 @@ static bool blk_virtq_sm_read_data(struct virtq_cmd *cmd,
 	     enum virtq_cmd_sm_op_status status)
 {
 	struct virtq_priv *priv = cmd->vq_priv;
-	size_t offset, i;
 	int ret;
 
+	/* continue the transfer that was stopped by a full dma queue */
+	if (to_blk_virtq_cmd(cmd)->xfer_pos)
+		goto xfer;
+
 	cmd->state = VIRTQ_CMD_STATE_HANDLE_REQ;
 
-	// Calculate number of descriptors we want to read
-	cmd->dma_comp.count = 0;
-	for (i = 1; i < cmd->num_desc - 1; i++) {
-		if (to_blk_cmd_aux(cmd->aux)->descs[i].flags & VRING_DESC_F_WRITE)
-			continue;
-		cmd->dma_comp.count++;
-	}
+	// Calculate number of dma operations we want to post
+	cmd->dma_comp.count = blk_virtq_data_xfer_count(cmd, false);
 
 	// If we have nothing to read - move synchronously to
 	// VIRTQ_CMD_STATE_HANDLE_REQ
 	if (!cmd->dma_comp.count)
 		return true;
 
-	offset = 0;
-	for (i = 1; i < cmd->num_desc - 1; i++) {
-		if (to_blk_cmd_aux(cmd->aux)->descs[i].flags & VRING_DESC_F_WRITE)
-			continue;
+xfer:
+	cmd->state = VIRTQ_CMD_STATE_READ_DATA;
+	if (blk_virtq_data_xfer_deferred(cmd, false, &ret))
+		return false;
 
-		virtq_log_data(cmd, "READ_DATA: pa 0x%llx len %u\n",
-				to_blk_cmd_aux(cmd->aux)->descs[i].addr, to_blk_cmd_aux(cmd->aux)->descs[i].len);
-		ret = snap_dma_q_read(priv->dma_q, cmd->req_buf + offset,
-				to_blk_cmd_aux(cmd->aux)->descs[i].len, cmd->req_mr->lkey, to_blk_cmd_aux(cmd->aux)->descs[i].addr,
-				priv->vattr->dma_mkey, &cmd->dma_comp);
-		if (ret) {
-			ERR_ON_CMD(cmd, "failed to read data, ret %d", ret);
-			cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
-			return true;
-		}
-		offset += to_blk_cmd_aux(cmd->aux)->descs[i].len;
+	cmd->state = VIRTQ_CMD_STATE_HANDLE_REQ;
+	if (ret) {
+		to_blk_virtq_cmd(cmd)->xfer_pos = 0;
+		ERR_ON_CMD(cmd, "failed to read data, ret %d", ret);
+		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
+		return true;
 	}
 
 	++priv->cmd_cntrs.outstanding_to_host;
 	return false;
 }
 
+/**
+ * blk_virtq_dwz_validate() - validate discard/write zeroes segments
+ * @cmd: Command being processed
+ * @cmd_type: VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ *
+ * Segments are checked against the limits advertised in the device config
+ * and against the block device geometry before anything is submitted, so
+ * that a bad segment fails the whole request without side effects.
+ *
+ * Return: VIRTIO_BLK_S_OK if all segments are valid, otherwise the status
+ * to report to the driver.
+ */
+static uint8_t blk_virtq_dwz_validate(struct virtq_cmd *cmd, uint32_t cmd_type)
+{
+	struct blk_virtq_ctx *vq_ctx = to_blk_virtq_ctx(cmd->vq_priv->vq_ctx);
+	struct virtq_bdev *bdev = &cmd->vq_priv->virtq_dev;
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(bdev);
+	struct virtio_blk_discard_write_zeroes *seg = (void *)cmd->req_buf;
+	uint32_t nsegs = cmd->total_seg_len / sizeof(*seg);
+	uint32_t max_sectors, max_segs, num_sectors, flags, blk_size, i;
+	uint64_t sector, bdev_sectors;
+
+	if (cmd_type == VIRTIO_BLK_T_DISCARD) {
+		max_sectors = vq_ctx->max_discard_sectors;
+		max_segs = ops->discard ? vq_ctx->max_discard_seg : 0;
+	} else {
+		max_sectors = vq_ctx->max_write_zeroes_sectors;
+		max_segs = ops->write_zeroes ? vq_ctx->max_write_zeroes_segs : 0;
+	}
+
+	if (!max_segs) {
+		ERR_ON_CMD(cmd, "command type %u was not negotiated", cmd_type);
+		return VIRTIO_BLK_S_UNSUPP;
+	}
+
+	if (!nsegs || cmd->total_seg_len % sizeof(*seg) || nsegs > max_segs) {
+		ERR_ON_CMD(cmd, "bad segment table: len %u max segments %u",
+			   cmd->total_seg_len, max_segs);
+		return VIRTIO_BLK_S_IOERR;
+	}
+
+	blk_size = ops->get_block_size(bdev->ctx);
+	bdev_sectors = ops->get_num_blocks(bdev->ctx) * blk_size / BDEV_SECTOR_SIZE;
+	for (i = 0; i < nsegs; i++) {
+		sector = le64toh(seg[i].sector);
+		num_sectors = le32toh(seg[i].num_sectors);
+		flags = le32toh(seg[i].flags);
+
+		/* unmap hint is only defined for write zeroes */
+		if ((flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) ||
+		    (flags && cmd_type == VIRTIO_BLK_T_DISCARD)) {
+			ERR_ON_CMD(cmd, "segment %u: unsupported flags 0x%x", i, flags);
+			return VIRTIO_BLK_S_UNSUPP;
+		}
+
+		if (!num_sectors || (max_sectors && num_sectors > max_sectors) ||
+		    sector >= bdev_sectors || num_sectors > bdev_sectors - sector ||
+		    (sector * BDEV_SECTOR_SIZE) % blk_size ||
+		    ((uint64_t)num_sectors * BDEV_SECTOR_SIZE) % blk_size) {
+			ERR_ON_CMD(cmd, "segment %u: bad range sector %lu num_sectors %u",
+				   i, sector, num_sectors);
+			return VIRTIO_BLK_S_IOERR;
+		}
+	}
+
+	return VIRTIO_BLK_S_OK;
+}
+
+/**
+ * blk_virtq_dwz_submit() - submit discard/write zeroes segments to bdev
+ * @cmd: Command being processed
+ * @cmd_type: VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ *
+ * Each segment is a separate bdev operation sharing the command done
+ * context. The command holds an extra pending reference while submitting,
+ * so segments completing inline can't finish it before all are posted.
+ * If the backend is out of resources the submission stops at the failed
+ * segment and continues from it when the function is called again. If a
+ * submission fails after some segments were posted, those complete the
+ * command with an error.
+ *
+ * Return: 0 if the command will be completed by bdev_io_comp_cb(),
+ * -EAGAIN if the submission must be continued later, error if nothing was
+ * submitted.
+ */
+static int blk_virtq_dwz_submit(struct virtq_cmd *cmd, uint32_t cmd_type)
+{
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+	struct virtq_bdev *bdev = &cmd->vq_priv->virtq_dev;
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(bdev);
+	struct virtio_blk_discard_write_zeroes *seg = (void *)cmd->req_buf;
+	int i, ret = 0, nsegs = cmd->total_seg_len / sizeof(*seg);
+	uint32_t blk_size = ops->get_block_size(bdev->ctx);
+	uint64_t offset_blocks, num_blocks;
+
+	if (!blk_cmd->dwz_pos) {
+		blk_cmd->bdev_ops_pending = nsegs + 1;
+		blk_cmd->bdev_op_failed = false;
+	}
+
+	for (i = blk_cmd->dwz_pos; i < nsegs; i++) {
+		offset_blocks = le64toh(seg[i].sector) * BDEV_SECTOR_SIZE / blk_size;
+		num_blocks = (uint64_t)le32toh(seg[i].num_sectors) * BDEV_SECTOR_SIZE / blk_size;
+		if (cmd_type == VIRTIO_BLK_T_DISCARD)
+			ret = ops->discard(bdev->ctx, offset_blocks, num_blocks,
+					   &blk_cmd->bdev_op_ctx, cmd->vq_priv->pg_id);
+		else
+			ret = ops->write_zeroes(bdev->ctx, offset_blocks, num_blocks,
+						&blk_cmd->bdev_op_ctx, cmd->vq_priv->pg_id);
+		if (snap_unlikely(ret))
+			break;
+	}
+
+	if (snap_unlikely(ret == -EAGAIN)) {
+		/* keep the submission reference until all segments are posted */
+		blk_cmd->dwz_pos = i;
+		if (!i)
+			blk_cmd->bdev_ops_pending = 0;
+		return ret;
+	}
+
+	blk_cmd->dwz_pos = 0;
+	if (snap_unlikely(ret)) {
+		if (!i) {
+			blk_cmd->bdev_ops_pending = 0;
+			return ret;
+		}
+		ERR_ON_CMD(cmd, "failed to submit segment %d of %d", i, nsegs);
+		blk_cmd->bdev_ops_pending -= nsegs - i;
+		blk_cmd->bdev_op_failed = true;
+	}
+
+	/* drop the submission reference */
+	bdev_io_comp_cb(SNAP_BDEV_OP_SUCCESS, blk_cmd);
+	return 0;
+}
+
+static void blk_virtq_flush_complete(struct snap_virtio_blk_flush_state *fs,
+				     bool success)
+{
+	pthread_spin_lock(&fs->lock);
+	if (success && fs->inflight_gen > fs->flushed_gen)
+		fs->flushed_gen = fs->inflight_gen;
+	__atomic_store_n(&fs->done_seq, fs->issued_seq, __ATOMIC_RELEASE);
+	fs->inflight = false;
+	pthread_spin_unlock(&fs->lock);
+}
+
+static void blk_virtq_flush_done_cb(enum snap_bdev_op_status status, void *done_arg)
+{
+	struct blk_virtq_cmd *cmd = done_arg;
+
+	cmd->bdev_op_ctx.cb = bdev_io_comp_cb;
+	blk_virtq_flush_complete(to_blk_flush_state(cmd->common_cmd.vq_priv),
+				 status == SNAP_BDEV_OP_SUCCESS);
+	bdev_io_comp_cb(status, done_arg);
+}
+
+/**
+ * blk_virtq_flush_start() - flush writes completed before cmd->flush_gen
+ * @cmd: Flush command being processed
+ *
+ * Complete the command right away if a successful flush already covered
+ * its write generation, wait for the running backend flush if there is one,
+ * or issue a new backend flush of the whole device otherwise. Waiting
+ * commands are completed from blk_virtq_progress() of their own queue.
+ *
+ * Return: 0 if the command will be completed by bdev_io_comp_cb(), -EAGAIN
+ * if the backend is out of resources and the flush must be retried, error
+ * if the backend flush could not be submitted.
+ */
+static int blk_virtq_flush_start(struct blk_virtq_cmd *cmd)
+{
+	struct virtq_priv *priv = cmd->common_cmd.vq_priv;
+	struct snap_virtio_blk_flush_state *fs = to_blk_flush_state(priv);
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(&priv->virtq_dev);
+	int ret;
+
+	pthread_spin_lock(&fs->lock);
+	if (fs->flushed_gen >= cmd->flush_gen) {
+		pthread_spin_unlock(&fs->lock);
+		bdev_io_comp_cb(SNAP_BDEV_OP_SUCCESS, cmd);
+		return 0;
+	}
+
+	if (fs->inflight) {
+		cmd->flush_seq = fs->issued_seq;
+		cmd->flush_covered = fs->inflight_gen >= cmd->flush_gen;
+		pthread_spin_unlock(&fs->lock);
+		TAILQ_INSERT_TAIL(&to_blk_virtq_ctx(priv->vq_ctx)->flush_waiters, cmd, flush_entry);
+		return 0;
+	}
+
+	fs->inflight = true;
+	fs->issued_seq++;
+	fs->inflight_gen = __atomic_load_n(&fs->write_gen, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&fs->sampled_gen, fs->inflight_gen, __ATOMIC_RELEASE);
+	pthread_spin_unlock(&fs->lock);
+
+	cmd->bdev_op_ctx.cb = blk_virtq_flush_done_cb;
+	ret = ops->flush(priv->virtq_dev.ctx, 0, ops->get_num_blocks(priv->virtq_dev.ctx),
+			 &cmd->bdev_op_ctx, priv->pg_id);
+	if (ret) {
+		cmd->bdev_op_ctx.cb = bdev_io_comp_cb;
+		if (ret == -EAGAIN) {
+			/* nothing was issued, commands that joined wait for the retry */
+			pthread_spin_lock(&fs->lock);
+			fs->inflight = false;
+			pthread_spin_unlock(&fs->lock);
+		} else
+			blk_virtq_flush_complete(fs, false);
+	}
+
+	return ret;
+}
+
+/**
+ * blk_virtq_progress_flush() - complete flush commands waiting on a queue
+ * @q: block virtq context
+ *
+ * A waiting command is done once the backend flush it waited for completes.
+ * If that flush was issued before the command's writes completed, the
+ * command starts over and may issue or join another backend flush.
+ */
+static void blk_virtq_progress_flush(struct blk_virtq_ctx *q)
+{
+	struct snap_virtio_blk_flush_state *fs = to_blk_flush_state(q->common_ctx.priv);
+	uint64_t done_seq = __atomic_load_n(&fs->done_seq, __ATOMIC_ACQUIRE);
+	struct blk_virtq_cmd *cmd, *next;
+	uint64_t flushed_gen;
+	int ret;
+
+	SNAP_TAILQ_FOREACH_SAFE(cmd, &q->flush_waiters, flush_entry, next) {
+		if (cmd->flush_seq > done_seq)
+			continue;
+
+		TAILQ_REMOVE(&q->flush_waiters, cmd, flush_entry);
+		pthread_spin_lock(&fs->lock);
+		flushed_gen = fs->flushed_gen;
+		pthread_spin_unlock(&fs->lock);
+
+		if (flushed_gen >= cmd->flush_gen) {
+			bdev_io_comp_cb(SNAP_BDEV_OP_SUCCESS, cmd);
+			continue;
+		}
+
+		ret = cmd->flush_covered ? -EIO : blk_virtq_flush_start(cmd);
+		if (ret == -EAGAIN) {
+			/* flush_seq is not above done_seq, retried on the next call */
+			if (next)
+				TAILQ_INSERT_BEFORE(next, cmd, flush_entry);
+			else
+				TAILQ_INSERT_TAIL(&q->flush_waiters, cmd, flush_entry);
+		} else if (ret)
+			bdev_io_comp_cb(SNAP_BDEV_OP_IO_ERROR, cmd);
+	}
+}
+
 /**
  * virtq_handle_req() - Handle received request from host
  * @cmd: Command being processed
  * @status: Callback status
  *
- * Perform commands operation (READ/WRITE/FLUSH) on backend block device.
+ * Perform commands operation (READ/WRITE/FLUSH/DISCARD/WRITE_ZEROES) on
+ * backend block device.
  *
  * Return: True if state machine is moved synchronously to the new state
  * (error cases) or false if the state transition will be done asynchronously.
@@ -761,11 +1284,11 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 {
 	struct virtq_bdev *bdev = &cmd->vq_priv->virtq_dev;
 	int ret, len;
-	uint64_t num_blocks;
-	uint32_t blk_size;
 	const char *dev_name;
 	uint64_t offset;
 	uint32_t cmd_type = to_blk_cmd_aux(cmd->aux)->header.type;
+	uint32_t total_in_len = cmd->total_in_len;
+	uint8_t vstatus;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
 		ERR_ON_CMD(cmd, "failed to get request data, returning failure");
@@ -830,11 +1353,10 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 			ret = -1;
 		} else {
 			cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-			num_blocks = to_blk_bdev_ops(bdev)->get_num_blocks(bdev->ctx);
-			blk_size = to_blk_bdev_ops(bdev)->get_block_size(bdev->ctx);
-			ret = to_blk_bdev_ops(bdev)->flush(bdev->ctx, 0,
-					       num_blocks * blk_size,
-					       &to_blk_virtq_cmd(cmd)->bdev_op_ctx, cmd->vq_priv->pg_id);
+			to_blk_virtq_cmd(cmd)->flush_gen =
+				__atomic_load_n(&to_blk_flush_state(cmd->vq_priv)->write_gen,
+						__ATOMIC_ACQUIRE);
+			ret = blk_virtq_flush_start(to_blk_virtq_cmd(cmd));
 		}
 		break;
 	case VIRTIO_BLK_T_GET_ID:
@@ -861,6 +1383,22 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 				       &(cmd->dma_comp));
 		virtq_mark_dirty_mem(cmd, to_blk_cmd_aux(cmd->aux)->descs[1].addr, len, false);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		if (cmd_type == VIRTIO_BLK_T_DISCARD)
+			cmd->io_cmd_stat = &(to_blk_virtq_ctx(cmd->vq_priv->vq_ctx)->io_stat.discard);
+		else
+			cmd->io_cmd_stat = &(to_blk_virtq_ctx(cmd->vq_priv->vq_ctx)->io_stat.write_zeroes);
+		cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
+		vstatus = blk_virtq_dwz_validate(cmd, cmd_type);
+		if (vstatus != VIRTIO_BLK_S_OK) {
+			cmd->io_cmd_stat->total++;
+			cmd->io_cmd_stat->fail++;
+			to_blk_cmd_ftr(cmd->ftr)->status = vstatus;
+			return true;
+		}
+		ret = blk_virtq_dwz_submit(cmd, cmd_type);
+		break;
 	default:
 		ERR_ON_CMD(cmd, "invalid command - requested command type 0x%x is not implemented",
 			   to_blk_cmd_aux(cmd->aux)->header.type);
@@ -869,8 +1407,17 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 		return true;
 	}
 
+	if (snap_unlikely(ret == -EAGAIN)) {
+		/* backend or dma queue is full, handle the request again later */
+		cmd->state = VIRTQ_CMD_STATE_HANDLE_REQ;
+		cmd->total_in_len = total_in_len;
+		virtq_cmd_defer(cmd);
+		return false;
+	}
+
 	if (cmd->io_cmd_stat) {
 		cmd->io_cmd_stat->total++;
+		cmd->io_cmd_stat->bytes += cmd->total_seg_len;
 		if (ret)
 			cmd->io_cmd_stat->fail++;
 		if (cmd->vq_priv->merge_descs)
@@ -913,8 +1460,7 @@ err:
 static bool blk_virtq_sm_handle_in_iov_done(struct virtq_cmd *cmd,
 				  enum virtq_cmd_sm_op_status status)
 {
-	int i, ret;
-	size_t offset = 0;
+	int ret;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
 		ERR_ON_CMD(cmd, "failed to read from block device, send ioerr to host");
@@ -923,27 +1469,16 @@ static bool blk_virtq_sm_handle_in_iov_done(struct virtq_cmd *cmd,
 		return true;
 	}
 
-	cmd->dma_comp.count = cmd->num_desc - NUM_HDR_FTR_DESCS;
+	if (!to_blk_virtq_cmd(cmd)->xfer_pos)
+		cmd->dma_comp.count = blk_virtq_data_xfer_count(cmd, true);
+	if (blk_virtq_data_xfer_deferred(cmd, true, &ret))
+		return false;
+
 	cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-	for (i = 0; i < cmd->num_desc - NUM_HDR_FTR_DESCS; i++) {
-		virtq_log_data(cmd, "WRITE_DATA: pa 0x%llx len %u\n",
-			       to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr, to_blk_cmd_aux(cmd->aux)->descs[i + 1].len);
-		ret = snap_dma_q_write(cmd->vq_priv->dma_q,
-				       cmd->req_buf + offset,
-				       to_blk_cmd_aux(cmd->aux)->descs[i + 1].len,
-				       cmd->req_mr->lkey,
-				       to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr,
-				       cmd->vq_priv->vattr->dma_mkey,
-				       &(cmd->dma_comp));
-		if (ret) {
-			to_blk_cmd_ftr(cmd->ftr)->status = VIRTIO_BLK_S_IOERR;
-			cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-			return true;
-		}
-		virtq_mark_dirty_mem(cmd, to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr,
-				     to_blk_cmd_aux(cmd->aux)->descs[i + 1].len, false);
-		offset += to_blk_cmd_aux(cmd->aux)->descs[i + 1].len;
-		cmd->total_in_len += to_blk_cmd_aux(cmd->aux)->descs[i + 1].len;
+	if (ret) {
+		to_blk_virtq_cmd(cmd)->xfer_pos = 0;
+		to_blk_cmd_ftr(cmd->ftr)->status = VIRTIO_BLK_S_IOERR;
+		return true;
 	}
 	++cmd->vq_priv->cmd_cntrs.outstanding_to_host;
 	return false;
@@ -1007,7 +1542,7 @@ static void blk_virtq_rx_cb(struct snap_dma_q *q, const void *data,
 	struct virtq_cmd *cmd = virtq_rx_cb_common_set(priv, data);
 	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
 
-	blk_cmd->dma_pool_ctx.thread_id = priv->thread_id;
+	blk_cmd->dma_pool_ctx.thread_id = priv->pg_id;
 	virtq_rx_cb_common_proc(cmd, data, data_len, imm_data);
 }
 
@@ -1132,6 +1667,12 @@ struct blk_virtq_ctx *blk_virtq_create(struct snap_virtio_blk_ctrl_queue *vbq,
 		    &ctx_attr))
 		goto release_ctx;
 
+	vq_ctx->max_discard_sectors = attr->max_discard_sectors;
+	vq_ctx->max_discard_seg = attr->max_discard_seg;
+	vq_ctx->max_write_zeroes_sectors = attr->max_write_zeroes_sectors;
+	vq_ctx->max_write_zeroes_segs = attr->max_write_zeroes_segs;
+	TAILQ_INIT(&vq_ctx->flush_waiters);
+
 	vq_priv = vq_ctx->common_ctx.priv;
 	vq_priv->custom_sm = &blk_sm;
 	vq_priv->ops = &blk_impl_ops;
@@ -1139,6 +1680,12 @@ struct blk_virtq_ctx *blk_virtq_create(struct snap_virtio_blk_ctrl_queue *vbq,
 	vq_priv->use_mem_pool = bdev_ops->dma_pool_enabled(vq_priv->virtq_dev.ctx);
 	if (bdev_ops->is_zcopy)
 		vq_priv->zcopy = bdev_ops->is_zcopy(vq_priv->virtq_dev.ctx);
+	if (!vq_priv->use_mem_pool &&
+	    virtq_req_pool_create(vq_priv, bdev_ops->dma_malloc, bdev_ops->dma_free)) {
+		SNAP_LIB_LOG_ERR("failed creating request buffer pool for queue %d",
+			   attr->idx);
+		goto release_priv;
+	}
 	vq_priv->cmd_arr = (struct virtq_cmd *) alloc_blk_virtq_cmd_arr(attr->size_max,
 						   attr->seg_max, vq_priv);
 	if (!vq_priv->cmd_arr) {
@@ -1328,6 +1875,33 @@ int blk_virtq_get_state(struct blk_virtq_ctx *q,
 	return 0;
 }
 
+/**
+ * blk_virtq_progress() - progress block virtq
+ * @q: block virtq context
+ * @thread_id: id of the polling thread
+ *
+ * Reaps completions of a polled block device, completes flush commands
+ * whose backend flush finished on another queue and progresses the common
+ * virtq. Block device operations are submitted with the queue poll group id,
+ * so they are reaped with it as well.
+ *
+ * Return: number of progressed completions
+ */
+int blk_virtq_progress(struct blk_virtq_ctx *q, int thread_id)
+{
+	struct virtq_priv *priv = q->common_ctx.priv;
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(&priv->virtq_dev);
+	int n = 0;
+
+	if (ops->progress)
+		n += ops->progress(priv->virtq_dev.ctx, priv->pg_id);
+
+	if (snap_unlikely(!TAILQ_EMPTY(&q->flush_waiters)))
+		blk_virtq_progress_flush(q);
+
+	return n + virtq_progress(&q->common_ctx, thread_id);
+}
+
 const struct snap_virtio_ctrl_queue_stats *
 blk_virtq_get_io_stats(struct blk_virtq_ctx *q)
 {
@@ -23,6 +23,12 @@
 struct blk_virtq_ctx {
 	struct virtq_common_ctx common_ctx;
 	struct snap_virtio_ctrl_queue_stats io_stat;
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_segs;
+	/* flush commands waiting for a backend flush issued by another queue */
+	TAILQ_HEAD(, blk_virtq_cmd) flush_waiters;
 };
 
 struct snap_virtio_blk_ctrl_queue;
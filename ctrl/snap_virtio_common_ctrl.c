@@ -11,6 +11,8 @@
  */
 
 #include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "snap_virtio_common_ctrl.h"
 #include "snap_queue.h"
@@ -189,6 +191,93 @@ static inline int snap_virtio_ctrl_bar_update(struct snap_virtio_ctrl *ctrl,
 	return ctrl->bar_ops->update(ctrl, bar);
 }
 
+#define SNAP_VIRTIO_CTRL_MAX_EVENTS 8
+
+static inline uint64_t snap_virtio_ctrl_elapsed_ms(const struct timespec *from,
+						   const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+	       (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Device change events are only used as a hint to query the bar, so the
+ * event channel is drained non blocking from the progress path. This is
+ * only done for a channel that the controller created itself, see
+ * snap_virtio_ctrl_open().
+ */
+static int snap_virtio_ctrl_bar_events_init(struct snap_virtio_ctrl *ctrl)
+{
+	int fd, flags;
+
+	if (!ctrl->bar_poll_period_ms)
+		return 0;
+
+	fd = snap_device_get_fd(ctrl->sdev);
+	if (fd < 0)
+		return -EINVAL;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ctrl->bar_last_update);
+	return 0;
+}
+
+static bool snap_virtio_ctrl_bar_events_pending(struct snap_virtio_ctrl *ctrl)
+{
+	struct snap_event events[SNAP_VIRTIO_CTRL_MAX_EVENTS];
+	int n, total = 0;
+
+	do {
+		n = snap_device_get_events(ctrl->sdev, SNAP_VIRTIO_CTRL_MAX_EVENTS, events);
+		/* query the bar if events cannot be read */
+		if (n < 0)
+			return true;
+		total += n;
+	} while (n == SNAP_VIRTIO_CTRL_MAX_EVENTS);
+
+	return total > 0;
+}
+
+static bool snap_virtio_ctrl_bar_refresh_needed(struct snap_virtio_ctrl *ctrl)
+{
+	struct timespec now;
+	bool events;
+
+	if (!ctrl->bar_poll_period_ms)
+		return true;
+
+	events = snap_virtio_ctrl_bar_events_pending(ctrl);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	/* flows that are in flight are driven by polling the bar */
+	if (!events && ctrl->state != SNAP_VIRTIO_CTRL_SUSPENDING &&
+	    !ctrl->pending_reset && !ctrl->pending_resume &&
+	    !snap_virtio_ctrl_critical_bar_change_detected(ctrl)) {
+		if (snap_virtio_ctrl_elapsed_ms(&ctrl->bar_last_update, &now) <
+		    ctrl->bar_poll_period_ms)
+			return false;
+	}
+
+	ctrl->bar_last_update = now;
+	return true;
+}
+
+/*
+ * Query the bar if it may have changed. Otherwise behave like a query that
+ * returned the same values, so that changes are not detected twice.
+ */
+static int snap_virtio_ctrl_bar_refresh(struct snap_virtio_ctrl *ctrl)
+{
+	if (snap_virtio_ctrl_bar_refresh_needed(ctrl))
+		return snap_virtio_ctrl_bar_update(ctrl, ctrl->bar_curr);
+
+	snap_virtio_ctrl_bar_copy(ctrl, ctrl->bar_curr, ctrl->bar_prev);
+	return 0;
+}
+
 static inline int snap_virtio_ctrl_bar_modify(struct snap_virtio_ctrl *ctrl,
 					      uint64_t mask,
 					      struct snap_virtio_device_attr *bar)
@@ -287,8 +376,11 @@ static void snap_virtio_ctrl_desched_q(struct snap_virtio_ctrl_queue *vq)
 		return;
 
 	pthread_spin_lock(&pg->lock);
-	if (!(vq->ctrl->q_ops->is_admin && vq->ctrl->q_ops->is_admin(vq)))
+	if (!(vq->ctrl->q_ops->is_admin && vq->ctrl->q_ops->is_admin(vq))) {
 		snap_pg_usage_decrease(vq->pg->id);
+		snap_pg_load_update(vq->pg->id, -(int64_t)vq->pg_load);
+		vq->pg_load = 0;
+	}
 
 	snap_virtio_ctrl_desched_q_nolock(vq);
 	pthread_spin_unlock(&pg->lock);
@@ -317,6 +409,8 @@ static void snap_virtio_ctrl_queue_destroy(struct snap_virtio_ctrl_queue *vq)
 {
 	struct snap_virtio_ctrl *ctrl = vq->ctrl;
 
+	if (ctrl->pg_migrate_vq == vq)
+		ctrl->pg_migrate_vq = NULL;
 	snap_virtio_ctrl_desched_q(vq);
 	ctrl->q_ops->destroy(vq);
 }
@@ -396,7 +490,6 @@ static int snap_virtio_ctrl_change_status(struct snap_virtio_ctrl *ctrl)
 	if (SNAP_VIRTIO_CTRL_FLR_DETECTED(ctrl)) {
 		struct snap_context *sctx = ctrl->sdev->sctx;
 		void *dd_data = ctrl->sdev->dd_data;
-		int i;
 
 		if (!snap_virtio_ctrl_is_stopped(ctrl)) {
 			if (ctrl->state == SNAP_VIRTIO_CTRL_STARTED) {
@@ -428,49 +521,16 @@ static int snap_virtio_ctrl_change_status(struct snap_virtio_ctrl *ctrl)
 		}
 
 		snap_close_device(ctrl->sdev);
+		ctrl->sdev = NULL;
 		ctrl->pending_flr = true;
+		ctrl->flr_sctx = sctx;
+		ctrl->flr_dd_data = dd_data;
+		ctrl->flr_attempts = 0;
+		clock_gettime(CLOCK_MONOTONIC, &ctrl->flr_start);
+		ctrl->flr_last_try = ctrl->flr_start;
 
-		/*
-		 * Per PCIe r4.0, sec 6.6.2, a device must complete a FLR
-		 * within 100ms. Creating a device emulation object succeed
-		 * only after FLR completes, so polling on this command.
-		 * Be more graceful and try to recover for 1 second.
-		 */
-
-		/* TODO: do this part asynchronously */
-		for (i = 0; i < 100; i++) {
-			usleep(10000);
-			ctrl->sdev = snap_open_device(sctx, &ctrl->sdev_attr);
-			if (ctrl->sdev) {
-				if (i > 9)
-					SNAP_LIB_LOG_WARN("FLR took more than 100ms");
-				ctrl->sdev->dd_data = dd_data;
-				ctrl->pending_flr = false;
-				break;
-			}
-		}
-
-		if (ctrl->bar_cbs.post_flr)
-			ctrl->bar_cbs.post_flr(ctrl->cb_ctx);
-
-		if (ctrl->pending_flr == false) {
-
-			/* A new emu dev was created after FLR done, value stored
-			 * in ctrl->bar_curr was queried from destroyed emu dev,
-			 * must clear those stale value before do next bar_update.
-			 **/
-			ctrl->bar_curr->status = 0;
-			ctrl->bar_curr->enabled = 0;
-			ctrl->bar_curr->reset = 0;
-
-			/* return and wait for next round ctrl_progress on new emu dev */
-			return 0;
-		}
-
-		if (!ctrl->sdev) {
-			SNAP_LIB_LOG_ERR("virtio controller %p FLR failed", ctrl);
-			return -ENODEV;
-		}
+		/* device is reopened by snap_virtio_ctrl_progress_flr() */
+		return 0;
 	}
 
 	if (!ctrl->ignore_reset && SNAP_VIRTIO_CTRL_RESET_DETECTED(ctrl)) {
@@ -743,6 +803,8 @@ int snap_virtio_ctrl_suspend(struct snap_virtio_ctrl *ctrl)
 
 	SNAP_LIB_LOG_INFO("Suspending controller %p", ctrl);
 
+	/* queue being migrated is resumed together with the rest */
+	ctrl->pg_migrate_vq = NULL;
 	snap_pgs_suspend(&ctrl->pg_ctx);
 	for (i = 0; i < ctrl->max_queues; i++) {
 		if (ctrl->queues[i])
@@ -933,6 +995,247 @@ void snap_virtio_ctrl_progress_unlock(struct snap_virtio_ctrl *ctrl)
 	pthread_mutex_unlock(&ctrl->progress_lock);
 }
 
+/*
+ * Per PCIe r4.0, sec 6.6.2, a device must complete a FLR within 100ms.
+ * Creating a device emulation object succeed only after FLR completes,
+ * so try to reopen the device every 10ms. Be more graceful and try to
+ * recover for 1 second.
+ */
+#define SNAP_VIRTIO_CTRL_FLR_RETRY_MS     10
+#define SNAP_VIRTIO_CTRL_FLR_MAX_ATTEMPTS 100
+
+/*
+ * Reopen the device after FLR without blocking. Each call does at most one
+ * open attempt, so controllers that are reset at the same time progress
+ * their FLRs in parallel instead of one after another.
+ */
+static void snap_virtio_ctrl_progress_flr(struct snap_virtio_ctrl *ctrl)
+{
+	struct timespec now;
+	uint64_t flr_ms;
+
+	if (ctrl->flr_attempts >= SNAP_VIRTIO_CTRL_FLR_MAX_ATTEMPTS)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (snap_virtio_ctrl_elapsed_ms(&ctrl->flr_last_try, &now) < SNAP_VIRTIO_CTRL_FLR_RETRY_MS)
+		return;
+
+	ctrl->flr_last_try = now;
+	ctrl->sdev = snap_open_device(ctrl->flr_sctx, &ctrl->sdev_attr);
+	if (!ctrl->sdev) {
+		if (++ctrl->flr_attempts < SNAP_VIRTIO_CTRL_FLR_MAX_ATTEMPTS)
+			return;
+
+		SNAP_LIB_LOG_ERR("virtio controller %p FLR failed", ctrl);
+		if (ctrl->bar_cbs.post_flr)
+			ctrl->bar_cbs.post_flr(ctrl->cb_ctx);
+		return;
+	}
+
+	flr_ms = snap_virtio_ctrl_elapsed_ms(&ctrl->flr_start, &now);
+	if (flr_ms > 100)
+		SNAP_LIB_LOG_WARN("FLR took more than 100ms");
+	SNAP_LIB_LOG_INFO("virtio controller %p FLR done in %lu ms", ctrl, flr_ms);
+
+	ctrl->sdev->dd_data = ctrl->flr_dd_data;
+	ctrl->pending_flr = false;
+	if (snap_virtio_ctrl_bar_events_init(ctrl)) {
+		SNAP_LIB_LOG_WARN("ctrl %p: no bar events after FLR, polling bar", ctrl);
+		ctrl->bar_poll_period_ms = 0;
+	}
+
+	if (ctrl->bar_cbs.post_flr)
+		ctrl->bar_cbs.post_flr(ctrl->cb_ctx);
+
+	/* A new emu dev was created after FLR done, value stored
+	 * in ctrl->bar_curr was queried from destroyed emu dev,
+	 * must clear those stale value before do next bar_update.
+	 **/
+	ctrl->bar_curr->status = 0;
+	ctrl->bar_curr->enabled = 0;
+	ctrl->bar_curr->reset = 0;
+}
+
+/* imbalance between poll groups, in percent of the busiest group load */
+#define SNAP_VIRTIO_CTRL_PG_BALANCE_THRESHOLD 25
+/* ignore imbalance below this load, e.g. a few commands per interval */
+#define SNAP_VIRTIO_CTRL_PG_BALANCE_MIN_LOAD  64
+/* balance intervals a migrated queue stays in its new poll group */
+#define SNAP_VIRTIO_CTRL_PG_MIGRATE_HOLD      10
+/* data size that counts as much as one command */
+#define SNAP_VIRTIO_CTRL_PG_LOAD_BYTES_SHIFT  12
+
+static bool snap_virtio_ctrl_pg_balance_q(struct snap_virtio_ctrl *ctrl,
+					  struct snap_virtio_ctrl_queue *vq)
+{
+	return vq && vq->pg && !(ctrl->q_ops->is_admin && ctrl->q_ops->is_admin(vq));
+}
+
+static uint64_t snap_virtio_ctrl_queue_bytes(struct snap_virtio_ctrl_queue *vq)
+{
+	const struct snap_virtio_ctrl_queue_stats *stats;
+
+	if (!vq->ctrl->q_ops->get_io_stats)
+		return 0;
+
+	stats = vq->ctrl->q_ops->get_io_stats(vq);
+	if (!stats)
+		return 0;
+
+	return stats->read.bytes + stats->write.bytes;
+}
+
+/*
+ * Sample commands and bytes done by each queue since the last interval and
+ * fold them into a smoothed per queue load. Poll group load is the sum of
+ * its queue loads over all controllers.
+ */
+static void snap_virtio_ctrl_pg_load_sample(struct snap_virtio_ctrl *ctrl)
+{
+	struct snap_virtio_ctrl_queue *vq;
+	uint64_t cmds, bytes, sample, load;
+	int i;
+
+	for (i = 0; i < ctrl->max_queues; i++) {
+		vq = ctrl->queues[i];
+		if (!snap_virtio_ctrl_pg_balance_q(ctrl, vq))
+			continue;
+
+		cmds = __atomic_load_n(&vq->pg_cmds, __ATOMIC_RELAXED);
+		bytes = snap_virtio_ctrl_queue_bytes(vq);
+		/* io stats start from 0 when the queue is recreated */
+		sample = cmds - vq->pg_last_cmds +
+			 ((bytes >= vq->pg_last_bytes ? bytes - vq->pg_last_bytes : bytes) >>
+			  SNAP_VIRTIO_CTRL_PG_LOAD_BYTES_SHIFT);
+		vq->pg_last_cmds = cmds;
+		vq->pg_last_bytes = bytes;
+
+		load = (3 * vq->pg_load + sample) / 4;
+		snap_pg_load_update(vq->pg->id, (int64_t)load - (int64_t)vq->pg_load);
+		vq->pg_load = load;
+
+		if (vq->pg_migrate_hold)
+			vq->pg_migrate_hold--;
+	}
+}
+
+static void snap_virtio_ctrl_pg_migrate_start(struct snap_virtio_ctrl *ctrl)
+{
+	struct snap_virtio_ctrl_queue *vq, *best = NULL;
+	uint64_t load, max_load, min_load, diff, best_diff = UINT64_MAX;
+	int i, max_pg = 0, min_pg = 0;
+
+	max_load = min_load = snap_pg_load(0);
+	for (i = 1; i < ctrl->pg_ctx.npgs; i++) {
+		load = snap_pg_load(i);
+		if (load > max_load) {
+			max_load = load;
+			max_pg = i;
+		} else if (load < min_load) {
+			min_load = load;
+			min_pg = i;
+		}
+	}
+
+	diff = max_load - min_load;
+	if (diff < SNAP_VIRTIO_CTRL_PG_BALANCE_MIN_LOAD ||
+	    diff * 100 < max_load * SNAP_VIRTIO_CTRL_PG_BALANCE_THRESHOLD)
+		return;
+
+	/* pick a queue that leaves the two groups closest to each other */
+	for (i = 0; i < ctrl->max_queues; i++) {
+		vq = ctrl->queues[i];
+		if (!snap_virtio_ctrl_pg_balance_q(ctrl, vq) || vq->pg->id != max_pg ||
+		    vq->pg_migrate_hold || !vq->pg_load || vq->pg_load >= diff)
+			continue;
+
+		load = diff > 2 * vq->pg_load ? diff - 2 * vq->pg_load : 2 * vq->pg_load - diff;
+		if (load < best_diff) {
+			best_diff = load;
+			best = vq;
+		}
+	}
+
+	if (!best)
+		return;
+
+	SNAP_LIB_LOG_INFO("ctrl %p queue %d: migrating from pg %d (load %lu) to pg %d (load %lu), queue load %lu",
+			  ctrl, best->index, max_pg, max_load, min_pg, min_load, best->pg_load);
+
+	pthread_spin_lock(&best->pg->lock);
+	ctrl->q_ops->suspend(best);
+	pthread_spin_unlock(&best->pg->lock);
+	ctrl->pg_migrate_vq = best;
+	ctrl->pg_migrate_to = min_pg;
+}
+
+/*
+ * Finish migration once the queue is suspended: recreate it the same way
+ * snap_virtio_ctrl_resume() does and schedule it on the new poll group.
+ */
+static void snap_virtio_ctrl_pg_migrate_progress(struct snap_virtio_ctrl *ctrl)
+{
+	struct snap_virtio_ctrl_queue *vq = ctrl->pg_migrate_vq;
+	struct snap_pg *old_pg = vq->pg, *new_pg;
+	bool suspended;
+	int ret;
+
+	pthread_spin_lock(&old_pg->lock);
+	suspended = ctrl->q_ops->is_suspended(vq);
+	pthread_spin_unlock(&old_pg->lock);
+	if (!suspended)
+		return;
+
+	ctrl->pg_migrate_vq = NULL;
+
+	snap_pgs_suspend(&ctrl->pg_ctx);
+	ret = ctrl->q_ops->resume(vq);
+	if (ret) {
+		snap_pgs_resume(&ctrl->pg_ctx);
+		SNAP_LIB_LOG_ERR("ctrl %p queue %d: resume failed during pg migration", ctrl, vq->index);
+		snap_virtio_ctrl_device_error(ctrl);
+		return;
+	}
+
+	new_pg = snap_pg_get(&ctrl->pg_ctx, ctrl->pg_migrate_to);
+	snap_pg_usage_decrease(old_pg->id);
+	snap_pg_load_update(old_pg->id, -(int64_t)vq->pg_load);
+	snap_pg_load_update(new_pg->id, vq->pg_load);
+
+	snap_virtio_ctrl_desched_q_nolock(vq);
+	snap_virtio_ctrl_sched_q_nolock(ctrl, vq, new_pg);
+	snap_pgs_resume(&ctrl->pg_ctx);
+
+	vq->pg_migrate_hold = SNAP_VIRTIO_CTRL_PG_MIGRATE_HOLD;
+	SNAP_LIB_LOG_INFO("ctrl %p queue %d: migrated from pg %d to pg %d", ctrl, vq->index,
+			  old_pg->id, new_pg->id);
+}
+
+static void snap_virtio_ctrl_pg_balance(struct snap_virtio_ctrl *ctrl)
+{
+	struct timespec now;
+
+	if (!ctrl->pg_balance_interval_ms)
+		return;
+
+	if (ctrl->pg_migrate_vq) {
+		snap_virtio_ctrl_pg_migrate_progress(ctrl);
+		return;
+	}
+
+	if (ctrl->state != SNAP_VIRTIO_CTRL_STARTED)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (snap_virtio_ctrl_elapsed_ms(&ctrl->pg_balance_last, &now) < ctrl->pg_balance_interval_ms)
+		return;
+	ctrl->pg_balance_last = now;
+
+	snap_virtio_ctrl_pg_load_sample(ctrl);
+	snap_virtio_ctrl_pg_migrate_start(ctrl);
+}
+
 /**
  * snap_virtio_ctrl_progress() - progress virtio controller
  * @ctrl:   virtio controller
@@ -946,6 +1249,10 @@ void snap_virtio_ctrl_progress_unlock(struct snap_virtio_ctrl *ctrl)
  *
  * snap_virtio_ctrl_pg_io_progress() or snap_virtio_ctrl_io_progress() should
  * be called to progress virtio queues.
+ *
+ * Suspend and the device reopen after FLR do not block, so many controllers
+ * can be in the middle of FLR at the same time. Reset and queue teardown
+ * are still done synchronously, from the call that detects them.
  */
 void snap_virtio_ctrl_progress(struct snap_virtio_ctrl *ctrl)
 {
@@ -953,21 +1260,22 @@ void snap_virtio_ctrl_progress(struct snap_virtio_ctrl *ctrl)
 
 	snap_virtio_ctrl_progress_lock(ctrl);
 
-	/* TODO: do flr asynchronously, in order not to block progress
-	 * when we have many VFs
-	 *
+	/*
 	 * If flr was not finished we can only:
 	 * - finish flr, open snap device
 	 * - destroy the controller
-	 * Anything else is dangerous because snap device is not available
+	 * Anything else is dangerous because snap device is not available.
+	 * Wait for next round ctrl_progress on new emu dev.
 	 */
-	if (ctrl->pending_flr)
+	if (ctrl->pending_flr) {
+		snap_virtio_ctrl_progress_flr(ctrl);
 		goto out;
+	}
 
 	if (ctrl->state == SNAP_VIRTIO_CTRL_SUSPENDING)
 		snap_virtio_ctrl_progress_suspend(ctrl);
 
-	ret = snap_virtio_ctrl_bar_update(ctrl, ctrl->bar_curr);
+	ret = snap_virtio_ctrl_bar_refresh(ctrl);
 	if (ret)
 		goto out;
 
@@ -981,6 +1289,8 @@ void snap_virtio_ctrl_progress(struct snap_virtio_ctrl *ctrl)
 	if (ctrl->bar_curr->num_of_vfs != ctrl->bar_prev->num_of_vfs)
 		snap_virtio_ctrl_change_num_vfs(ctrl);
 
+	snap_virtio_ctrl_pg_balance(ctrl);
+
 out:
 	snap_virtio_ctrl_progress_unlock(ctrl);
 }
@@ -1006,13 +1316,17 @@ static int snap_virtio_ctrl_pg_thread_io_progress(
 	struct snap_pg *pg = &ctrl->pg_ctx.pgs[pg_id];
 	struct snap_virtio_ctrl_queue *vq;
 	struct snap_pg_q_entry *pg_q;
-	int n = 0;
+	int n = 0, n_q;
 
 	pthread_spin_lock(&pg->lock);
 	TAILQ_FOREACH(pg_q, &pg->q_list, entry) {
 		vq = pg_q_entry_to_virtio_ctrl_queue(pg_q);
 		vq->thread_id = thread_id;
-		n += snap_virtio_ctrl_queue_progress(vq);
+		n_q = snap_virtio_ctrl_queue_progress(vq);
+		if (n_q > 0) {
+			__atomic_store_n(&vq->pg_cmds, vq->pg_cmds + n_q, __ATOMIC_RELAXED);
+			n += n_q;
+		}
 	}
 	pthread_spin_unlock(&pg->lock);
 
@@ -1076,7 +1390,7 @@ int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 		ret = -EINVAL;
 		goto err;
 	};
-	if (attr->event)
+	if (attr->event || attr->bar_poll_period_ms)
 		ctrl->sdev_attr.flags |= SNAP_DEVICE_FLAGS_EVENT_CHANNEL;
 	if (attr->vf_dynamic_msix_supported)
 		ctrl->sdev_attr.flags |= SNAP_DEVICE_FLAGS_VF_DYN_MSIX;
@@ -1091,6 +1405,15 @@ int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 		goto err;
 	}
 
+	/* events on an application owned channel are not ours to consume */
+	ctrl->bar_poll_period_ms = attr->event ? 0 : attr->bar_poll_period_ms;
+	if (attr->event && attr->bar_poll_period_ms)
+		SNAP_LIB_LOG_INFO("ctrl %p: event channel is owned by the application, polling bar", ctrl);
+	if (snap_virtio_ctrl_bar_events_init(ctrl)) {
+		SNAP_LIB_LOG_WARN("ctrl %p: failed to init bar events, polling bar", ctrl);
+		ctrl->bar_poll_period_ms = 0;
+	}
+
 	ctrl->bar_ops = bar_ops;
 	ctrl->bar_cbs = *attr->bar_cbs;
 	ctrl->cb_ctx = attr->cb_ctx;
@@ -1129,6 +1452,9 @@ int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 
 	ctrl->type = attr->type;
 	ctrl->force_in_order = attr->force_in_order;
+	if (attr->pg_balance_interval_ms && npgs > 1 && q_ops->suspend &&
+	    q_ops->is_suspended && q_ops->resume)
+		ctrl->pg_balance_interval_ms = attr->pg_balance_interval_ms;
 	return 0;
 
 free_pgs:
@@ -2275,13 +2601,40 @@ int snap_virtio_ctrl_serialize_dirty_pages(void *data, void *buffer, size_t leng
 	return nelems;
 }
 
+/**
+ * snap_virtio_ctrl_dp_map_report_sync() - prepare push mode dirty map report
+ * @ctrl: virtio controller
+ * @q:    dma queue used to write delayed dirty map updates
+ *
+ * Writes all dirty map updates that are still held by the write combining
+ * cache to the host and waits for them. Must be called before the dirty
+ * map report command is completed.
+ *
+ * Return: 0 on success or -errno
+ */
+int snap_virtio_ctrl_dp_map_report_sync(struct snap_virtio_ctrl *ctrl, struct snap_dma_q *q)
+{
+	int ret;
+
+	if (!ctrl->dp_map)
+		return -EINVAL;
+
+	snap_virtio_ctrl_progress_lock(ctrl);
+	ret = snap_dp_bmap_report_sync(ctrl->dp_map, q);
+	snap_virtio_ctrl_progress_unlock(ctrl);
+	if (ret)
+		SNAP_LIB_LOG_ERR("ctrl %p: failed to sync dirty map: %d", ctrl, ret);
+	return ret;
+}
+
 static uint16_t snap_virtio_ctrl_get_pci_bdf(void *data)
 {
 	struct snap_virtio_ctrl *ctrl = data;
 	uint16_t bdf;
 
 	snap_virtio_ctrl_progress_lock(ctrl);
-	bdf = ctrl->sdev->pci->pci_bdf.raw;
+	/* no device while it is reopened after FLR, 0 tells to retry later */
+	bdf = ctrl->pending_flr ? 0 : ctrl->sdev->pci->pci_bdf.raw;
 	snap_virtio_ctrl_progress_unlock(ctrl);
 	SNAP_LIB_LOG_INFO("ctrl %p: get_pci_bdf: 0x0%x", ctrl, bdf);
 	return bdf;
@@ -147,6 +147,19 @@ struct snap_virtio_ctrl_attr {
 	bool force_recover;
 	bool db_cq_map_supported;
 	bool eq_in_sw_supported;
+	/*
+	 * If not 0, refresh device bar only on a device change event, or every
+	 * bar_poll_period_ms as a fallback. Implies event channel. If 0, bar
+	 * is queried on every snap_virtio_ctrl_progress() call.
+	 * Ignored if @event is set: the event channel belongs to the
+	 * application and the controller does not read it.
+	 */
+	uint32_t bar_poll_period_ms;
+	/*
+	 * If not 0, measure queue load every pg_balance_interval_ms and
+	 * migrate queues from the most to the least loaded poll group.
+	 */
+	uint32_t pg_balance_interval_ms;
 };
 
 struct snap_virtio_ctrl_queue {
@@ -158,6 +171,13 @@ struct snap_virtio_ctrl_queue {
 
 	TAILQ_ENTRY(snap_virtio_ctrl_queue) entry;
 	int thread_id;
+
+	/* poll group load accounting */
+	uint64_t pg_cmds; /* updated by the poll group thread */
+	uint64_t pg_last_cmds;
+	uint64_t pg_last_bytes;
+	uint64_t pg_load;
+	int pg_migrate_hold;
 };
 
 struct snap_virtio_ctrl_queue_counter {
@@ -168,7 +188,7 @@ struct snap_virtio_ctrl_queue_counter {
 	uint64_t merged_desc;
 	uint64_t long_desc_chain;
 	uint64_t large_in_buf;
-
+	uint64_t bytes;
 };
 
 /**
@@ -183,12 +203,17 @@ struct snap_virtio_ctrl_queue_out_counter {
 	uint32_t outstanding_in_bdev;
 	uint32_t outstanding_to_host;
 	uint32_t fatal;
+	/* commands waiting for dma queue resources and total number of such waits */
+	uint32_t deferred;
+	uint64_t deferrals;
 };
 
 struct snap_virtio_ctrl_queue_stats {
 	struct snap_virtio_ctrl_queue_counter read;
 	struct snap_virtio_ctrl_queue_counter write;
 	struct snap_virtio_ctrl_queue_counter flush;
+	struct snap_virtio_ctrl_queue_counter discard;
+	struct snap_virtio_ctrl_queue_counter write_zeroes;
 	struct snap_virtio_ctrl_queue_out_counter outstanding;
 };
 
@@ -260,6 +285,12 @@ struct snap_virtio_ctrl {
 	bool force_in_order;
 	/* true if FLR was requested */
 	bool pending_flr;
+	/* asynchronous FLR state, valid while pending_flr is set */
+	struct snap_context *flr_sctx;
+	void *flr_dd_data;
+	int flr_attempts;
+	struct timespec flr_start;
+	struct timespec flr_last_try;
 	struct snap_device_attr sdev_attr;
 	int lm_state;
 	struct snap_cross_mkey *xmkey;
@@ -270,6 +301,14 @@ struct snap_virtio_ctrl {
 	struct snap_dp_bmap *dp_map;
 	struct snap_cross_mkey *pf_xmkey;
 	uint16_t spec_version;
+	/* event driven bar refresh, 0 means query bar on every progress */
+	uint32_t bar_poll_period_ms;
+	struct timespec bar_last_update;
+	/* poll group balancing, 0 interval means disabled */
+	uint32_t pg_balance_interval_ms;
+	struct timespec pg_balance_last;
+	struct snap_virtio_ctrl_queue *pg_migrate_vq;
+	int pg_migrate_to;
 };
 
 bool snap_virtio_ctrl_is_stopped(struct snap_virtio_ctrl *ctrl);
@@ -456,6 +495,7 @@ int snap_virtio_ctrl_start_dirty_pages_track(void *data);
 int snap_virtio_ctrl_stop_dirty_pages_track(void *data);
 int snap_virtio_ctrl_get_dirty_pages_size(void *data);
 int snap_virtio_ctrl_serialize_dirty_pages(void *data, void *buffer, size_t length);
+int snap_virtio_ctrl_dp_map_report_sync(struct snap_virtio_ctrl *ctrl, struct snap_dma_q *q);
 int snap_virtio_ctrl_clear_reset(struct snap_virtio_ctrl *ctrl);
 
 #endif
@@ -43,6 +43,11 @@
 #define FS_VIRTQ_CHECK_FS_REQ_FORMAT(cmd) true
 #endif
 
+/* FUSE_READ/FUSE_WRITE payloads smaller than this are still copied through
+ * the command buffer, it is cheaper than building the zero copy request
+ */
+#define FS_VIRTQ_ZCOPY_MIN_LEN 16384
+
 /**
  * struct virtio_fs_outftr - footer of request, written to host memory
  */
@@ -63,12 +68,21 @@ struct fs_virtq_cmd_aux {
  * @fs_dev_op_ctx:	fs device operations
  * @iov:		io vectors pointing to data to be written/read by fs device
  * @pos_f_write:	zero based position of first writable descriptor
+ * @zcopy:		use ZCOPY for the request payload
+ * @zcopy_start:	first descriptor accessed by fs device in host memory
+ * @zcopy_end:		descriptor following the last one accessed by fs
+ *			device in host memory
+ * @ftr:		fuse out header, written to host memory
  */
 struct fs_virtq_cmd {
 	struct virtq_cmd common_cmd;
 	struct snap_fs_dev_io_done_ctx fs_dev_op_ctx;
 	struct iovec *iov;
 	int16_t pos_f_write;
+	bool zcopy;
+	int16_t zcopy_start;
+	int16_t zcopy_end;
+	struct virtio_fs_outftr ftr;
 };
 
 static inline struct snap_fs_dev_ops *to_fs_dev_ops(struct virtq_bdev *dev)
@@ -137,16 +151,19 @@ static void fs_sm_dma_cb(struct snap_dma_completion *self, int status)
 static void fs_dev_io_comp_cb(enum snap_fs_dev_op_status status, void *done_arg);
 
 
+static inline uint32_t fs_virtq_cmd_iovcnt(uint32_t seg_max)
+{
+	return seg_max + 2 /* + in_header & out_header*/;
+}
+
 static int init_fs_virtq_cmd(struct fs_virtq_cmd *cmd, int idx,
 			     uint32_t size_max, uint32_t seg_max,
-			     struct virtq_priv *vq_priv)
+			     struct iovec *iov, struct virtq_priv *vq_priv)
 {
 	uint32_t n_descs = seg_max;
 	const size_t req_size = size_max * seg_max;
 	const size_t descs_size = n_descs * sizeof(struct vring_desc);
 	const size_t aux_size = sizeof(struct fs_virtq_cmd_aux) + descs_size;
-	uint32_t iovcnt = seg_max + 2 /* + in_header & out_header*/;
-	int ret;
 
 	cmd->common_cmd.idx = idx;
 	cmd->common_cmd.vq_priv = vq_priv;
@@ -155,18 +172,8 @@ static int init_fs_virtq_cmd(struct fs_virtq_cmd *cmd, int idx,
 	cmd->fs_dev_op_ctx.cb = fs_dev_io_comp_cb;
 	cmd->common_cmd.cmd_available_index = 0;
 	cmd->common_cmd.vq_priv->merge_descs = 0; // TODO
-	cmd->common_cmd.ftr = calloc(1, sizeof(struct virtio_fs_outftr));
-	if (!cmd->common_cmd.ftr) {
-		SNAP_LIB_LOG_ERR("failed to allocate footer for virtq %d",
-			   idx);
-		return -ENOMEM;
-	}
-	cmd->iov = calloc(iovcnt, sizeof(struct iovec));
-	if (!cmd->iov) {
-		SNAP_LIB_LOG_ERR("failed to allocate iov for virtq %d cmd %d",
-			   vq_priv->vq_ctx->idx, idx);
-		return -ENOMEM;
-	}
+	cmd->common_cmd.ftr = &cmd->ftr;
+	cmd->iov = iov;
 
 	if (cmd->common_cmd.vq_priv->use_mem_pool) {
 		// TODO
@@ -177,8 +184,7 @@ static int init_fs_virtq_cmd(struct fs_virtq_cmd *cmd, int idx,
 		if (!cmd->common_cmd.buf) {
 			SNAP_LIB_LOG_ERR("failed to allocate memory for virtq %d cmd %d",
 				   vq_priv->vq_ctx->idx, idx);
-			ret = -ENOMEM;
-			goto free_iov;
+			return -ENOMEM;
 		}
 
 		cmd->common_cmd.mr = ibv_reg_mr(vq_priv->pd, cmd->common_cmd.buf, req_size + aux_size,
@@ -188,8 +194,8 @@ static int init_fs_virtq_cmd(struct fs_virtq_cmd *cmd, int idx,
 		if (!cmd->common_cmd.mr) {
 			SNAP_LIB_LOG_ERR("failed to register mr for virtq %d cmd %d",
 				   vq_priv->vq_ctx->idx, idx);
-			ret = -1;
-			goto free_cmd_buf;
+			to_fs_dev_ops(&vq_priv->virtq_dev)->dma_free(cmd->common_cmd.buf);
+			return -1;
 		}
 
 		cmd->common_cmd.aux = (struct fs_virtq_cmd_aux *)((uint8_t *)cmd->common_cmd.buf + req_size);
@@ -197,13 +203,6 @@ static int init_fs_virtq_cmd(struct fs_virtq_cmd *cmd, int idx,
 	}
 
 	return 0;
-
-free_cmd_buf:
-	to_fs_dev_ops(&vq_priv->virtq_dev)->dma_free(cmd->common_cmd.buf);
-free_iov:
-	free(cmd->iov);
-
-	return ret;
 }
 
 void free_fs_virtq_cmd(struct fs_virtq_cmd *cmd)
@@ -213,7 +212,6 @@ void free_fs_virtq_cmd(struct fs_virtq_cmd *cmd)
 	} else {
 		ibv_dereg_mr(cmd->common_cmd.mr);
 		to_fs_dev_ops(&cmd->common_cmd.vq_priv->virtq_dev)->dma_free(cmd->common_cmd.buf);
-		free(cmd->iov);
 	}
 }
 
@@ -231,6 +229,7 @@ void free_fs_virtq_cmd(struct fs_virtq_cmd *cmd)
  * end of the request buffer.
  * Note: for easy implementation there is a direct mapping between descr_head_idx
  * and command.
+ * io vectors of all commands are allocated as one block.
  * Todo: Unify memory into one block for all commands
  *
  * Return: Array of commands structs on success, NULL on error
@@ -240,7 +239,9 @@ alloc_fs_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 		       struct virtq_priv *vq_priv)
 {
 	int i, k, ret, num = vq_priv->vattr->size;
+	uint32_t iovcnt = fs_virtq_cmd_iovcnt(seg_max);
 	struct fs_virtq_cmd *cmd_arr;
+	struct iovec *iovs;
 
 	cmd_arr = calloc(num, sizeof(struct fs_virtq_cmd));
 	if (!cmd_arr) {
@@ -248,16 +249,25 @@ alloc_fs_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 		goto out;
 	}
 
+	iovs = calloc((size_t)num * iovcnt, sizeof(struct iovec));
+	if (!iovs) {
+		SNAP_LIB_LOG_ERR("failed to allocate iov for fs_virtq commands");
+		goto free_mem;
+	}
+
 	for (i = 0; i < num; i++) {
-		ret = init_fs_virtq_cmd(&cmd_arr[i], i, size_max, seg_max, vq_priv);
+		ret = init_fs_virtq_cmd(&cmd_arr[i], i, size_max, seg_max,
+					&iovs[i * iovcnt], vq_priv);
 		if (ret) {
 			for (k = 0; k < i; ++k)
 				free_fs_virtq_cmd(&cmd_arr[k]);
-			goto free_mem;
+			goto free_iovs;
 		}
 	}
 	return cmd_arr;
 
+free_iovs:
+	free(iovs);
 free_mem:
 	free(cmd_arr);
 	SNAP_LIB_LOG_ERR("failed allocating commands for queue %d",
@@ -275,6 +285,7 @@ static void free_fs_virtq_cmd_arr(struct virtq_priv *vq_priv)
 	for (i = 0; i < num_cmds; ++i)
 		free_fs_virtq_cmd(&cmd_arr[i]);
 
+	free(cmd_arr[0].iov);
 	free(vq_priv->cmd_arr);
 }
 
@@ -292,6 +303,82 @@ static void fs_dev_io_comp_cb(enum snap_fs_dev_op_status status, void *done_arg)
 	virtq_cmd_progress(&cmd->common_cmd, op_status);
 }
 
+static inline bool fs_virtq_desc_zcopy(const struct fs_virtq_cmd *cmd, int i)
+{
+	return cmd->zcopy && i >= cmd->zcopy_start && i < cmd->zcopy_end;
+}
+
+/**
+ * fs_virtq_zcopy_prepare() - check if request payload can be used in place
+ * @cmd: Command being processed
+ *
+ * Only the payload of large FUSE_WRITE (device-readable descriptors after
+ * fuse_write_in) and FUSE_READ (device-writable descriptors after
+ * fuse_out_header) requests is handed to the fs device as host addresses.
+ * Fuse headers and op arguments are always copied to the command buffer,
+ * the fs device has to parse them. Zcopy is only used when the headers and
+ * op arguments are in descriptors of their own, otherwise the request goes
+ * through the command buffer.
+ *
+ * Return: payload length accessed by fs device in host memory, 0 if the
+ * request is handled through the command buffer
+ */
+static uint32_t fs_virtq_zcopy_prepare(struct fs_virtq_cmd *cmd)
+{
+	struct virtq_priv *priv = cmd->common_cmd.vq_priv;
+	struct snap_fs_dev_ops *ops = to_fs_dev_ops(&priv->virtq_dev);
+	struct fs_virtq_cmd_aux *aux = to_fs_cmd_aux(cmd->common_cmd.aux);
+	uint32_t len = 0;
+	int i;
+
+	cmd->zcopy = false;
+
+	if (!priv->zcopy || !ops->zcopy_validate_params)
+		return 0;
+
+	/* hiprio queue requests have no payload */
+	if (priv->vq_ctx->idx == 0 || cmd->pos_f_write <= 0)
+		return 0;
+
+	if (aux->descs[0].len != sizeof(struct fuse_in_header))
+		return 0;
+
+	switch (aux->header.opcode) {
+	case FUSE_WRITE:
+		if (cmd->pos_f_write < 2 ||
+		    aux->descs[1].len != sizeof(struct fuse_write_in))
+			return 0;
+		cmd->zcopy_start = 2;
+		cmd->zcopy_end = cmd->pos_f_write;
+		break;
+	case FUSE_READ:
+		if (aux->descs[cmd->pos_f_write].len != sizeof(struct fuse_out_header))
+			return 0;
+		cmd->zcopy_start = cmd->pos_f_write + 1;
+		cmd->zcopy_end = cmd->common_cmd.num_desc;
+		break;
+	default:
+		return 0;
+	}
+
+	for (i = cmd->zcopy_start; i < cmd->zcopy_end; i++) {
+		cmd->iov[i].iov_base = (void *)aux->descs[i].addr;
+		cmd->iov[i].iov_len = aux->descs[i].len;
+		len += aux->descs[i].len;
+	}
+
+	if (len < FS_VIRTQ_ZCOPY_MIN_LEN)
+		return 0;
+
+	if (!ops->zcopy_validate_params(priv->virtq_dev.ctx,
+					&cmd->iov[cmd->zcopy_start],
+					cmd->zcopy_end - cmd->zcopy_start, len))
+		return 0;
+
+	cmd->zcopy = true;
+	return len;
+}
+
 /**
  * set_iovecs() - set iovec for fs device transactions
  * @cmd: command to which iov and descs belong to
@@ -300,6 +387,7 @@ static void fs_dev_io_comp_cb(enum snap_fs_dev_op_status status, void *done_arg)
  * transfer data to/from command buffers. Iovecs are created according
  * to the amount of descriptors given such that each iovec points to one
  * descriptor data. Relationship is iovec[i] points to desc[i].
+ * With ZCOPY the payload iovecs point to host memory instead.
  *
  * Note: the host should prepare request as described in
  * 5.11.6.1 - 'Device Operation: Request Queues'
@@ -323,9 +411,13 @@ static int set_iovecs(struct fs_virtq_cmd *cmd)
 
 	// Device-readable part
 	for (i = 1; i < num_desc; ++i) {
-		cmd->iov[i].iov_base = cmd->common_cmd.req_buf + offset;
+		if (fs_virtq_desc_zcopy(cmd, i)) {
+			cmd->iov[i].iov_base = (void *)cmd_aux->descs[i].addr;
+		} else {
+			cmd->iov[i].iov_base = cmd->common_cmd.req_buf + offset;
+			offset += cmd_aux->descs[i].len;
+		}
 		cmd->iov[i].iov_len = cmd_aux->descs[i].len;
-		offset += cmd_aux->descs[i].len;
 		virtq_log_data(&cmd->common_cmd, "RD: iov[%d] pa 0x%llx va %p, %ld\n",
 			       i, cmd_aux->descs[i].addr, cmd->iov[i].iov_base,
 			       cmd->iov[i].iov_len);
@@ -343,9 +435,13 @@ static int set_iovecs(struct fs_virtq_cmd *cmd)
 
 		// Device-writable part
 		for (i = cmd->pos_f_write + 1; i < cmd->common_cmd.num_desc; ++i) {
-			cmd->iov[i].iov_base = cmd->common_cmd.req_buf + offset;
+			if (fs_virtq_desc_zcopy(cmd, i)) {
+				cmd->iov[i].iov_base = (void *)cmd_aux->descs[i].addr;
+			} else {
+				cmd->iov[i].iov_base = cmd->common_cmd.req_buf + offset;
+				offset += cmd_aux->descs[i].len;
+			}
 			cmd->iov[i].iov_len = cmd_aux->descs[i].len;
-			offset += cmd_aux->descs[i].len;
 			virtq_log_data(&cmd->common_cmd, "WD: iov[%d] pa 0x%llx va %p, %ld\n", i,
 				       cmd_aux->descs[i].addr, cmd->iov[i].iov_base,
 				       cmd->iov[i].iov_len);
@@ -366,6 +462,9 @@ static int virtq_alloc_req_dbuf(struct fs_virtq_cmd *cmd, size_t len)
 {
 	int error;
 
+	if (!virtq_req_pool_alloc(&cmd->common_cmd, len))
+		return 0;
+
 	cmd->common_cmd.req_buf = to_fs_dev_ops(&cmd->common_cmd.vq_priv->virtq_dev)->dma_malloc(len);
 	if (!cmd->common_cmd.req_buf) {
 		SNAP_LIB_LOG_ERR("failed to dynamically allocate %lu bytes for command %d request",
@@ -440,6 +539,7 @@ static bool fs_virtq_sm_read_header(struct virtq_cmd *cmd,
 static bool fs_virtq_sm_parse_header(struct virtq_cmd *cmd,
 				     enum virtq_cmd_sm_op_status status)
 {
+	uint32_t buf_len;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
 		ERR_ON_CMD(cmd, "failed to get header data, returning failure");
@@ -449,11 +549,12 @@ static bool fs_virtq_sm_parse_header(struct virtq_cmd *cmd,
 	}
 
 	cmd->state = VIRTQ_CMD_STATE_READ_DATA;
+	buf_len = cmd->total_seg_len - fs_virtq_zcopy_prepare(to_fs_virtq_cmd(cmd));
 	if (snap_unlikely(cmd->vq_priv->use_mem_pool)) {
 		// TODO
 	} else {
-		if (snap_unlikely(cmd->total_seg_len > cmd->req_size)) {
-			if (virtq_alloc_req_dbuf(to_fs_virtq_cmd(cmd), cmd->total_seg_len))
+		if (snap_unlikely(buf_len > cmd->req_size)) {
+			if (virtq_alloc_req_dbuf(to_fs_virtq_cmd(cmd), buf_len))
 				return true;
 		}
 	}
@@ -525,7 +626,8 @@ static bool fs_virtq_sm_read_data(struct virtq_cmd *cmd,
 	cmd->dma_comp.count = 0;
 	num_desc = fs_cmd->pos_f_write > 0 ? fs_cmd->pos_f_write : cmd->num_desc;
 	for (i = 1; i < num_desc; ++i) {
-		if ((cmd_aux->descs[i].flags & VRING_DESC_F_WRITE) == 0)
+		if ((cmd_aux->descs[i].flags & VRING_DESC_F_WRITE) == 0 &&
+		    !fs_virtq_desc_zcopy(fs_cmd, i))
 			++cmd->dma_comp.count;
 	}
 
@@ -538,6 +640,8 @@ static bool fs_virtq_sm_read_data(struct virtq_cmd *cmd,
 		return true;
 
 	for (i = 1; i < num_desc; ++i) {
+		if (fs_virtq_desc_zcopy(fs_cmd, i))
+			continue;
 		virtq_log_data(cmd, "READ_DATA: pa 0x%llx va %p len %u\n",
 			       cmd_aux->descs[i].addr, cmd->req_buf + offset,
 			       cmd_aux->descs[i].len);
@@ -658,12 +762,26 @@ static bool sm_handle_in_iov_done(struct virtq_cmd *cmd,
 
 	cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
 	cmd->dma_comp.count = cmd->num_desc - (fs_cmd->pos_f_write + 1);
+	if (fs_cmd->zcopy) {
+		/* Payload was already written to host memory by fs device */
+		for (i = fs_cmd->pos_f_write + 1; i < cmd->num_desc; ++i) {
+			if (!fs_virtq_desc_zcopy(fs_cmd, i))
+				continue;
+			virtq_mark_dirty_mem(cmd, cmd_aux->descs[i].addr,
+					     cmd_aux->descs[i].len, false);
+			cmd->total_in_len += cmd_aux->descs[i].len;
+			--cmd->dma_comp.count;
+		}
+	}
+
 	if (snap_likely(cmd->dma_comp.count > 0)) {
 
 		/* Note: the desc at position cmd->pos_f_write is descriptor for
 		 * fuse_out_header status.
 		 */
 		for (i = fs_cmd->pos_f_write + 1; i < cmd->num_desc; ++i) {
+			if (fs_virtq_desc_zcopy(fs_cmd, i))
+				continue;
 			virtq_log_data(cmd, "WRITE_DATA: pa 0x%llx va %p len %u\n",
 				       cmd_aux->descs[i].addr, fs_cmd->iov[i].iov_base,
 				       cmd_aux->descs[i].len);
@@ -744,6 +862,7 @@ static void fs_virtq_rx_cb(struct snap_dma_q *q, const void *data,
 	struct fs_virtq_cmd *fs_cmd = to_fs_virtq_cmd(cmd);
 
 	fs_cmd->pos_f_write = 0;
+	fs_cmd->zcopy = false;
 	virtq_rx_cb_common_proc(cmd, data, data_len, imm_data);
 }
 
@@ -949,6 +1068,14 @@ struct fs_virtq_ctx *fs_virtq_create(struct snap_virtio_fs_ctrl_queue *vfsq,
 	vq_priv->virtq_dev.ctx = fs_dev;
 	vq_priv->use_mem_pool = 0;
 	vq_priv->pd = attr->pd;
+	if (fs_dev_ops->is_zcopy)
+		vq_priv->zcopy = fs_dev_ops->is_zcopy(fs_dev);
+
+	if (virtq_req_pool_create(vq_priv, fs_dev_ops->dma_malloc, fs_dev_ops->dma_free)) {
+		SNAP_LIB_LOG_ERR("failed creating request buffer pool for queue %d",
+			   attr->idx);
+		goto release_priv;
+	}
 
 	vq_priv->cmd_arr = (struct virtq_cmd *)alloc_fs_virtq_cmd_arr(attr->size_max,
 								      attr->seg_max, vq_priv);
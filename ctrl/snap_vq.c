@@ -97,14 +97,67 @@ static void snap_vq_cmd_fetch_next_desc_done(struct snap_dma_completion *self,
 		snap_vq_cmd_fatal(cmd);
 }
 
-static void snap_vq_cmd_fetch_next_desc(struct snap_vq_cmd *cmd)
+/*
+ * Append descriptors that belong to the chain from the prefetched window.
+ * The first window entry is always the descriptor that was requested. The
+ * walk stops when the chain ends or leaves the window. The number of
+ * appended descriptors is limited by the window size, so a looped chain
+ * cannot get us stuck here.
+ */
+static void snap_vq_cmd_fetch_desc_window_done(struct snap_dma_completion *self,
+						int status)
+{
+	struct snap_vq_cmd *cmd;
+	struct snap_vq_cmd_desc *desc;
+	const struct vring_desc *wdesc;
+	uint16_t i, next;
+
+	cmd = container_of(self, struct snap_vq_cmd, dma_comp);
+	if (snap_unlikely(status != IBV_WC_SUCCESS)) {
+		snap_vq_cmd_fatal(cmd);
+		return;
+	}
+
+	wdesc = &cmd->prefetch_descs[0];
+	for (i = 0; i < cmd->prefetch_cnt; i++) {
+		desc = snap_vq_cmd_desc_get(cmd);
+		desc->desc = *wdesc;
+		if (!(wdesc->flags & VRING_DESC_F_NEXT))
+			break;
+
+		next = wdesc->next - cmd->prefetch_start;
+		if (next >= cmd->prefetch_cnt)
+			break;
+		wdesc = &cmd->prefetch_descs[next];
+	}
+
+	snap_vq_cmd_process(cmd);
+}
+
+static int snap_vq_cmd_fetch_next_desc_post(struct snap_vq_cmd *cmd)
 {
 	struct snap_vq_cmd_desc *last;
 	struct snap_vq_cmd_desc *next;
 	uint64_t next_addr;
+	uint16_t window;
 	int ret;
 
 	last = TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list);
+	/* the window must not cross the end of the desc table */
+	window = last->desc.next < cmd->vq->size ?
+		 snap_min(cmd->vq->desc_prefetch, cmd->vq->size - last->desc.next) : 1;
+	if (window > 1) {
+		cmd->prefetch_start = last->desc.next;
+		cmd->prefetch_cnt = window;
+		next_addr = cmd->vq->desc_pa + last->desc.next * sizeof(struct vring_desc);
+		cmd->dma_comp.count = 1;
+		cmd->dma_comp.func = snap_vq_cmd_fetch_desc_window_done;
+		return snap_dma_q_read(cmd->vq->dma_q, cmd->prefetch_descs,
+				window * sizeof(struct vring_desc),
+				cmd->vq->desc_pool.prefetch_lkey,
+				next_addr, cmd->vq->xmkey, &cmd->dma_comp);
+	}
+
 	next = snap_vq_cmd_desc_get(cmd);
 	next_addr = cmd->vq->desc_pa + last->desc.next * sizeof(next->desc);
 	cmd->dma_comp.count = 1;
@@ -112,7 +165,33 @@ static void snap_vq_cmd_fetch_next_desc(struct snap_vq_cmd *cmd)
 	ret = snap_dma_q_read(cmd->vq->dma_q, &next->desc,
 			sizeof(struct vring_desc), cmd->vq->desc_pool.lkey,
 			next_addr, cmd->vq->xmkey, &cmd->dma_comp);
-	if (ret)
+	if (snap_unlikely(ret)) {
+		/* the read will be retried with a new desc */
+		TAILQ_REMOVE(&cmd->descs, next, entry);
+		cmd->num_descs--;
+		snap_vq_desc_pool_put(cmd->vq, next);
+	}
+	return ret;
+}
+
+static void snap_vq_cmd_defer(struct snap_vq_cmd *cmd, enum snap_vq_cmd_deferred op)
+{
+	struct snap_vq *q = cmd->vq;
+
+	cmd->deferred = op;
+	TAILQ_INSERT_TAIL(&q->deferred_cmds, cmd, deferred_entry);
+	q->n_deferred++;
+	q->n_deferrals++;
+}
+
+static void snap_vq_cmd_fetch_next_desc(struct snap_vq_cmd *cmd)
+{
+	int ret;
+
+	ret = snap_vq_cmd_fetch_next_desc_post(cmd);
+	if (snap_unlikely(ret == -EAGAIN))
+		snap_vq_cmd_defer(cmd, SNAP_VQ_CMD_DEFERRED_FETCH);
+	else if (snap_unlikely(ret))
 		snap_vq_cmd_fatal(cmd);
 }
 
@@ -183,27 +262,16 @@ static void snap_vq_cmd_start(struct snap_vq *q, const struct snap_vq_header *hd
 	snap_vq_cmd_process(cmd);
 }
 
-int snap_vq_cmd_descs_rw(struct snap_vq_cmd *cmd,
-		const struct snap_vq_cmd_desc *first_desc, size_t first_offset,
-		void *lbuf, size_t total_len, uint32_t lbuf_mkey,
-		snap_vq_cmd_done_cb_t done_cb, bool write)
+static int snap_vq_cmd_descs_rw_post(struct snap_vq_cmd *cmd)
 {
-	int ret = 0;
-	char *laddr;
-	const struct snap_vq_cmd_desc *desc;
-	size_t offset, len, desc_len;
+	struct snap_vq_cmd_rw *rw = &cmd->rw;
+	size_t len;
 	uint64_t raddr;
+	int ret;
 
-	cmd->done_cb = done_cb;
-	cmd->dma_comp.func = snap_vq_cmd_dma_rw_done;
-
-	desc = first_desc;
-	offset = first_offset;
-	laddr = lbuf;
-	while (total_len > 0 && desc) {
-		desc_len = desc->desc.len - offset;
-		len = snap_min(total_len, desc_len);
-		raddr = desc->desc.addr + offset;
+	while (rw->total_len > 0 && rw->desc) {
+		len = snap_min(rw->total_len, rw->desc->desc.len - rw->offset);
+		raddr = rw->desc->desc.addr + rw->offset;
 
 		/*
 		 * Since we always process queue in a single thread, it is
@@ -211,31 +279,61 @@ int snap_vq_cmd_descs_rw(struct snap_vq_cmd *cmd,
 		 * completion callbacks.
 		 */
 		cmd->dma_comp.count++;
-		if (write) {
+		if (rw->write)
 			ret = snap_dma_q_write(cmd->vq->dma_q,
-				(void *)laddr, len, lbuf_mkey,
+				(void *)rw->laddr, len, rw->lkey,
 				raddr, cmd->vq->xmkey, &cmd->dma_comp);
-			if (!ret)
-				cmd->len += len;
-		} else {
+		else
 			ret = snap_dma_q_read(cmd->vq->dma_q,
-				(void *)laddr, len, lbuf_mkey,
+				(void *)rw->laddr, len, rw->lkey,
 				raddr, cmd->vq->xmkey, &cmd->dma_comp);
-		}
-		if (snap_unlikely(ret))
-			/* TODO add -EBUSY handling, pending list */
+		if (snap_unlikely(ret)) {
+			cmd->dma_comp.count--;
 			return ret;
+		}
 
-		laddr += len;
-		total_len -= len;
-		desc = TAILQ_NEXT(desc, entry);
-		offset = 0;
-	};
+		if (rw->write)
+			cmd->len += len;
+		rw->laddr += len;
+		rw->total_len -= len;
+		rw->desc = TAILQ_NEXT(rw->desc, entry);
+		rw->offset = 0;
+	}
 
-	return ret;
+	return 0;
 }
 
-static void snap_vq_cmd_complete_execute(struct snap_vq_cmd *cmd)
+int snap_vq_cmd_descs_rw(struct snap_vq_cmd *cmd,
+		const struct snap_vq_cmd_desc *first_desc, size_t first_offset,
+		void *lbuf, size_t total_len, uint32_t lbuf_mkey,
+		snap_vq_cmd_done_cb_t done_cb, bool write)
+{
+	int ret;
+
+	cmd->done_cb = done_cb;
+	cmd->dma_comp.func = snap_vq_cmd_dma_rw_done;
+
+	cmd->rw.desc = first_desc;
+	cmd->rw.offset = first_offset;
+	cmd->rw.laddr = lbuf;
+	cmd->rw.total_len = total_len;
+	cmd->rw.lkey = lbuf_mkey;
+	cmd->rw.write = write;
+	ret = snap_vq_cmd_descs_rw_post(cmd);
+	if (snap_likely(ret != -EAGAIN))
+		return ret;
+
+	/*
+	 * Post the rest from the progress. Until then hold an extra
+	 * reference so that the already posted part does not complete
+	 * the command.
+	 */
+	cmd->dma_comp.count++;
+	snap_vq_cmd_defer(cmd, SNAP_VQ_CMD_DEFERRED_RW);
+	return 0;
+}
+
+static int snap_vq_cmd_complete_post(struct snap_vq_cmd *cmd)
 {
 	struct snap_vq_completion comp = {};
 	int ret;
@@ -243,11 +341,26 @@ static void snap_vq_cmd_complete_execute(struct snap_vq_cmd *cmd)
 	comp.id = cmd->id;
 	comp.len = cmd->len;
 	ret = snap_dma_q_send_completion(cmd->vq->dma_q, &comp, sizeof(comp));
+	if (snap_unlikely(ret == -EAGAIN))
+		return ret;
+
 	if (snap_unlikely(ret))
 		snap_vq_cmd_fatal(cmd);
 	else
 		snap_vq_cmd_cleanup(cmd);
 	snap_vq_cmd_put(cmd->vq, cmd);
+	return 0;
+}
+
+static void snap_vq_cmd_complete_execute(struct snap_vq_cmd *cmd)
+{
+	/*
+	 * Deferred command stays at the tail of inflight_cmds with
+	 * pending_completion cleared, so in order completions of the
+	 * following commands wait for it.
+	 */
+	if (snap_unlikely(snap_vq_cmd_complete_post(cmd)))
+		snap_vq_cmd_defer(cmd, SNAP_VQ_CMD_DEFERRED_COMPLETE);
 }
 
 static void snap_vq_flush_pending_completions(struct snap_vq *q)
@@ -277,7 +390,6 @@ void snap_vq_cmd_complete(struct snap_vq_cmd *cmd)
 
 void snap_vq_cmd_fatal(struct snap_vq_cmd *cmd)
 {
-	/* TODO add pending list handling */
 	TAILQ_REMOVE(&cmd->vq->inflight_cmds, cmd, entry);
 	TAILQ_INSERT_HEAD(&cmd->vq->fatal_cmds, cmd, entry);
 	SNAP_LIB_LOG_ERR("Request %p entered fatal state and cannot be completed",
@@ -287,6 +399,7 @@ void snap_vq_cmd_fatal(struct snap_vq_cmd *cmd)
 void snap_vq_cmd_create(struct snap_vq *q, struct snap_vq_cmd *cmd)
 {
 	cmd->vq = q;
+	cmd->deferred = SNAP_VQ_CMD_DEFERRED_NONE;
 	TAILQ_INIT(&cmd->descs);
 }
 
@@ -361,6 +474,9 @@ static int snap_vq_cmds_create(struct snap_vq *q, size_t num_cmds,
 	TAILQ_INIT(&q->free_cmds);
 	TAILQ_INIT(&q->inflight_cmds);
 	TAILQ_INIT(&q->fatal_cmds);
+	TAILQ_INIT(&q->deferred_cmds);
+	q->n_deferred = 0;
+	q->n_deferrals = 0;
 	for (i = 0; i < num_cmds; i++) {
 		cmd = ops->create(q, i);
 		if (!cmd)
@@ -375,6 +491,31 @@ destroy_cmds:
 	return -EINVAL;
 }
 
+static int snap_vq_descs_prefetch_create(struct snap_vq *q,
+			const struct snap_vq_create_attr *attr)
+{
+	struct snap_vq_desc_pool *pool = &q->desc_pool;
+	struct snap_vq_cmd *cmd;
+	int i = 0;
+
+	q->desc_prefetch = snap_virtio_desc_prefetch_window(attr->desc_prefetch ?
+							attr->desc_prefetch :
+							q->cmd_ops->desc_prefetch);
+	if (q->desc_prefetch <= 1)
+		return 0;
+
+	pool->prefetch = snap_buf_alloc(attr->pd, attr->size * q->desc_prefetch *
+					sizeof(*pool->prefetch));
+	if (!pool->prefetch)
+		return -ENOMEM;
+
+	pool->prefetch_lkey = snap_buf_get_mkey(pool->prefetch);
+	TAILQ_FOREACH(cmd, &q->free_cmds, entry)
+		cmd->prefetch_descs = &pool->prefetch[q->desc_prefetch * i++];
+
+	return 0;
+}
+
 static int snap_vq_descs_create(struct snap_vq *q,
 			const struct snap_vq_create_attr *attr)
 {
@@ -392,11 +533,18 @@ static int snap_vq_descs_create(struct snap_vq *q,
 	for (i = 0; i < attr->size; i++)
 		snap_vq_desc_pool_put(q, &pool->entries[i]);
 
+	if (snap_vq_descs_prefetch_create(q, attr)) {
+		snap_buf_free(pool->entries);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 static void snap_vq_descs_destroy(struct snap_vq_desc_pool *pool)
 {
+	if (pool->prefetch)
+		snap_buf_free(pool->prefetch);
 	snap_buf_free(pool->entries);
 }
 
@@ -575,6 +723,8 @@ err:
 
 void snap_vq_destroy(struct snap_vq *q)
 {
+	if (q->n_deferrals)
+		SNAP_LIB_LOG_DBG("queue %d: %lu dma operations were deferred", q->index, q->n_deferrals);
 	snap_vq_hwq_destroy(q);
 	snap_vq_descs_destroy(&q->desc_pool);
 	snap_vq_cmds_destroy(q);
@@ -596,6 +746,55 @@ snap_vq_cmd_get_descs(struct snap_vq_cmd *cmd)
 	return &cmd->descs;
 }
 
+/*
+ * Retry dma operations that were deferred because the dma queue was full.
+ * Stop at the first one that still does not fit to keep them in order.
+ */
+static void snap_vq_progress_deferred(struct snap_vq *q)
+{
+	struct snap_vq_cmd *cmd;
+	enum snap_vq_cmd_deferred op;
+	int ret;
+
+	while (!TAILQ_EMPTY(&q->deferred_cmds)) {
+		cmd = TAILQ_FIRST(&q->deferred_cmds);
+		TAILQ_REMOVE(&q->deferred_cmds, cmd, deferred_entry);
+		op = cmd->deferred;
+
+		switch (op) {
+		case SNAP_VQ_CMD_DEFERRED_FETCH:
+			ret = snap_vq_cmd_fetch_next_desc_post(cmd);
+			break;
+		case SNAP_VQ_CMD_DEFERRED_RW:
+			/* drop the reference taken by snap_vq_cmd_descs_rw() */
+			cmd->dma_comp.count--;
+			ret = snap_vq_cmd_descs_rw_post(cmd);
+			if (ret == -EAGAIN)
+				cmd->dma_comp.count++;
+			break;
+		case SNAP_VQ_CMD_DEFERRED_COMPLETE:
+			ret = snap_vq_cmd_complete_post(cmd);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		if (ret == -EAGAIN) {
+			TAILQ_INSERT_HEAD(&q->deferred_cmds, cmd, deferred_entry);
+			return;
+		}
+
+		q->n_deferred--;
+		cmd->deferred = SNAP_VQ_CMD_DEFERRED_NONE;
+		if (snap_unlikely(ret))
+			snap_vq_cmd_fatal(cmd);
+		else if (op == SNAP_VQ_CMD_DEFERRED_COMPLETE &&
+			 q->op_flags & SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS)
+			snap_vq_flush_pending_completions(q);
+	}
+}
+
 /**
  * snap_vq_handle_events() - Handle queue events
  * @q: queue
@@ -627,6 +826,8 @@ int snap_vq_handle_events(struct snap_vq *q)
 
 	do {
 		n = snap_dma_q_progress(q->dma_q);
+		if (snap_unlikely(q->n_deferred))
+			snap_vq_progress_deferred(q);
 	} while (n > 0);
 
 	return 0;
@@ -693,6 +894,8 @@ int snap_vq_progress(struct snap_vq *q)
 	int n;
 
 	n = q->dma_q->ops->progress_tx(q->dma_q, -1);
+	if (snap_unlikely(q->n_deferred))
+		snap_vq_progress_deferred(q);
 	if (snap_likely(q->state == SNAP_VQ_STATE_RUNNING))
 		n += q->dma_q->ops->progress_rx(q->dma_q);
 
@@ -97,6 +97,7 @@ TAILQ_HEAD(snap_vq_cmd_desc_list, snap_vq_cmd_desc);
  * @caps: Virtio HW capabilities
  * @comp_channel: Completion channel for queue events (optional)
  * @comp_vector: Completion vector for queue events (optional)
+ * @desc_prefetch: Descriptor prefetch window (optional), 0 - use default
  *
  * Describes all required/optional attribute used for virtqueue
  * creation process.
@@ -119,6 +120,7 @@ struct snap_vq_create_attr {
 	struct ibv_comp_channel *comp_channel;
 	int comp_vector;
 	bool in_recovery;
+	uint16_t desc_prefetch;
 };
 
 void snap_vq_suspend(struct snap_vq *q);
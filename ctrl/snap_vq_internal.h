@@ -28,6 +28,9 @@ struct snap_vq_desc_pool {
 	struct snap_vq_cmd_desc *entries;
 	struct snap_vq_cmd_desc_list free_descs;
 	uint32_t lkey;
+	/* per command windows for the descriptor prefetch */
+	struct vring_desc *prefetch;
+	uint32_t prefetch_lkey;
 };
 
 struct snap_vq_cmd_ops {
@@ -48,6 +51,31 @@ struct snap_vq_cmd_ops {
 	 * improve command latency performance.
 	 */
 	void (*prefetch)(struct snap_vq_cmd *cmd);
+	/*
+	 * Descriptor prefetch window (optional): number of descriptors that
+	 * are read from the host desc table at once when the chain is not
+	 * fully tunneled. Can be overridden per queue by the
+	 * snap_vq_create_attr. 0 means SNAP_VIRTQ_DESC_PREFETCH default.
+	 */
+	uint16_t desc_prefetch;
+};
+
+/* dma operation of a command that is waiting for dma queue resources */
+enum snap_vq_cmd_deferred {
+	SNAP_VQ_CMD_DEFERRED_NONE,
+	SNAP_VQ_CMD_DEFERRED_FETCH,
+	SNAP_VQ_CMD_DEFERRED_RW,
+	SNAP_VQ_CMD_DEFERRED_COMPLETE,
+};
+
+/* where snap_vq_cmd_descs_rw() stopped, valid while the rw is deferred */
+struct snap_vq_cmd_rw {
+	const struct snap_vq_cmd_desc *desc;
+	size_t offset;
+	char *laddr;
+	size_t total_len;
+	uint32_t lkey;
+	bool write;
 };
 
 struct snap_vq_cmd {
@@ -60,8 +88,14 @@ struct snap_vq_cmd {
 	struct snap_dma_completion dma_comp;
 	snap_vq_cmd_done_cb_t done_cb;
 	void *priv;
+	struct vring_desc *prefetch_descs;
+	uint16_t prefetch_start;
+	uint16_t prefetch_cnt;
+	enum snap_vq_cmd_deferred deferred;
+	struct snap_vq_cmd_rw rw;
 
 	TAILQ_ENTRY(snap_vq_cmd) entry;
+	TAILQ_ENTRY(snap_vq_cmd) deferred_entry;
 };
 
 struct snap_vq {
@@ -73,6 +107,7 @@ struct snap_vq {
 	uint64_t device_pa;
 	uint32_t op_flags;
 	uint32_t xmkey;
+	uint16_t desc_prefetch;
 	struct snap_virtio_caps *caps;
 	struct ibv_comp_channel *comp_channel;
 	struct snap_virtio_ctrl *vctrl;
@@ -80,6 +115,15 @@ struct snap_vq {
 	TAILQ_HEAD(, snap_vq_cmd) free_cmds;
 	TAILQ_HEAD(snap_vq_inflight_cmds, snap_vq_cmd) inflight_cmds;
 	TAILQ_HEAD(snap_vq_fatal_cmds, snap_vq_cmd) fatal_cmds;
+	/*
+	 * Commands whose dma operation could not be posted because the dma
+	 * queue was full. Retried in order from the progress as tx
+	 * completions return. A command has at most one deferred operation,
+	 * so the list is bounded by the queue size.
+	 */
+	TAILQ_HEAD(snap_vq_deferred_cmds, snap_vq_cmd) deferred_cmds;
+	uint32_t n_deferred;
+	uint64_t n_deferrals;
 	const struct snap_vq_cmd_ops *cmd_ops;
 
 	struct snap_dma_q *dma_q;
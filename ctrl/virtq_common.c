@@ -33,6 +33,8 @@ static struct snap_dma_q *virtq_rdma_qp_init(struct virtq_create_attr *attr,
 	rdma_qp_create_attr.mode = snap_env_getenv(SNAP_DMA_Q_OPMODE);
 	rdma_qp_create_attr.sw_use_devx = true;
 	rdma_qp_create_attr.fw_use_devx = true;
+	/* verbs mode needs iov contexts for readv2v/writev2v */
+	rdma_qp_create_attr.iov_enable = true;
 
 	return snap_dma_q_create(attr->pd, &rdma_qp_create_attr);
 }
@@ -60,6 +62,40 @@ static void virtq_vattr_from_attr(struct virtq_create_attr *attr,
 	vattr->pd = attr->pd;
 }
 
+static int virtq_desc_prefetch_init(struct virtq_priv *vq_priv,
+				    struct virtq_create_attr *attr)
+{
+	size_t size;
+
+	vq_priv->desc_prefetch = snap_virtio_desc_prefetch_window(attr->desc_prefetch);
+	if (vq_priv->desc_prefetch <= 1)
+		return 0;
+
+	size = attr->queue_size * vq_priv->desc_prefetch * sizeof(struct vring_desc);
+	vq_priv->prefetch_descs = calloc(1, size);
+	if (!vq_priv->prefetch_descs)
+		return -ENOMEM;
+
+	vq_priv->prefetch_mr = ibv_reg_mr(vq_priv->pd, vq_priv->prefetch_descs,
+					  size, IBV_ACCESS_LOCAL_WRITE);
+	if (!vq_priv->prefetch_mr) {
+		free(vq_priv->prefetch_descs);
+		vq_priv->prefetch_descs = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void virtq_desc_prefetch_destroy(struct virtq_priv *vq_priv)
+{
+	if (!vq_priv->prefetch_mr)
+		return;
+
+	ibv_dereg_mr(vq_priv->prefetch_mr);
+	free(vq_priv->prefetch_descs);
+}
+
 /**
  * virtq_ctxt_init() - Creates a new virtq object, along with RDMA QPs.
 
@@ -101,6 +137,7 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 	vq_priv->swq_state = SW_VIRTQ_RUNNING;
 	vq_priv->vbq = ctxt_attr->vq;
 	memset(&vq_priv->cmd_cntrs, 0, sizeof(vq_priv->cmd_cntrs));
+	TAILQ_INIT(&vq_priv->deferred_cmds);
 	vq_priv->force_in_order = attr->force_in_order;
 	vq_priv->dma_q = virtq_rdma_qp_init(attr, vq_priv,
 					    ctxt_attr->tx_elem_size,
@@ -111,10 +148,15 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 		goto destroy_attr;
 	}
 
+	if (virtq_desc_prefetch_init(vq_priv, attr)) {
+		SNAP_LIB_LOG_ERR("failed creating descriptor prefetch buffers");
+		goto destroy_dma_q;
+	}
+
 	if (attr->in_recovery) {
 		if (snap_virtio_get_used_index_from_host(vq_priv->dma_q,
 				attr->device, attr->xmkey, &hw_used, &flush_ret))
-			goto destroy_dma_q;
+			goto destroy_prefetch;
 
 		if (flush_ret) {
 			SNAP_LIB_LOG_ERR("flush failed for used index (ctrl %p q# %d), ret %d", vq_priv->vbq->ctrl, vq_ctx->idx, flush_ret);
@@ -143,6 +185,8 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 
 	return true;
 
+destroy_prefetch:
+	virtq_desc_prefetch_destroy(vq_priv);
 destroy_dma_q:
 	snap_dma_q_destroy(vq_priv->dma_q);
 destroy_attr:
@@ -157,10 +201,68 @@ err:
 void virtq_ctx_destroy(struct virtq_priv *vq_priv)
 {
 	snap_dma_q_destroy(vq_priv->dma_q);
+	virtq_desc_prefetch_destroy(vq_priv);
+	if (vq_priv->req_pool)
+		snap_buf_pool_destroy(vq_priv->req_pool);
 	free(to_common_queue_attr(vq_priv->vattr));
 	free(vq_priv);
 }
 
+/**
+ * virtq_req_pool_create() - Create registered buffer pool for requests
+ * @vq_priv:	virtq private context
+ * @dma_malloc:	backend memory allocator
+ * @dma_free:	backend memory free function
+ *
+ * The pool serves requests that are bigger than the preallocated
+ * command buffer, so that no memory registration is done on the
+ * I/O path.
+ *
+ * Return: 0 on success, -ENOMEM otherwise
+ */
+int virtq_req_pool_create(struct virtq_priv *vq_priv,
+			  void *(*dma_malloc)(size_t size),
+			  void (*dma_free)(void *buf))
+{
+	struct snap_buf_pool_attr attr = {
+		.dma_malloc = dma_malloc,
+		.dma_free = dma_free,
+	};
+
+	vq_priv->req_pool = snap_buf_pool_create(vq_priv->pd, &attr);
+	if (!vq_priv->req_pool)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * virtq_req_pool_alloc() - Take command request buffer from the req_pool
+ * @cmd:	command
+ * @len:	request buffer length
+ *
+ * Return: 0 on success, -ENOMEM if the buffer is too big for the pool or
+ * the pool is exhausted
+ */
+int virtq_req_pool_alloc(struct virtq_cmd *cmd, size_t len)
+{
+	struct ibv_mr *mr;
+	void *buf;
+
+	if (!cmd->vq_priv->req_pool)
+		return -ENOMEM;
+
+	buf = snap_buf_pool_alloc(cmd->vq_priv->req_pool, len, &mr);
+	if (!buf)
+		return -ENOMEM;
+
+	cmd->req_buf = buf;
+	cmd->req_mr = mr;
+	cmd->use_dmem = true;
+	cmd->use_pool_buf = true;
+	return 0;
+}
+
 /**
  * virtq_cmd_progress() - command state machine progress handle
  * @cmd:	command to be processed
@@ -187,6 +289,50 @@ int virtq_cmd_progress(struct virtq_cmd *cmd,
 	return 0;
 }
 
+/**
+ * virtq_cmd_defer() - wait for dma queue resources
+ * @cmd:	command that failed to post a dma operation with -EAGAIN
+ *
+ * The command must stay in the state that posts the operation and must not
+ * have any part of that step in flight, unless the step is able to continue
+ * where it stopped. The state handler is called again with
+ * VIRTQ_CMD_SM_OP_OK from virtq_progress() once tx completions return.
+ * Commands are retried in the order they were deferred. Every command can
+ * be deferred at most once so no memory is allocated here.
+ */
+void virtq_cmd_defer(struct virtq_cmd *cmd)
+{
+	struct virtq_priv *priv = cmd->vq_priv;
+
+	virtq_log_data(cmd, "DEFER: state %d\n", cmd->state);
+	cmd->deferred = true;
+	TAILQ_INSERT_TAIL(&priv->deferred_cmds, cmd, deferred_entry);
+	++priv->cmd_cntrs.deferred;
+	++priv->cmd_cntrs.deferrals;
+}
+
+static void virtq_progress_deferred(struct virtq_priv *priv)
+{
+	struct virtq_cmd *cmd;
+
+	while (!TAILQ_EMPTY(&priv->deferred_cmds)) {
+		cmd = TAILQ_FIRST(&priv->deferred_cmds);
+		TAILQ_REMOVE(&priv->deferred_cmds, cmd, deferred_entry);
+		cmd->deferred = false;
+		--priv->cmd_cntrs.deferred;
+
+		virtq_cmd_progress(cmd, VIRTQ_CMD_SM_OP_OK);
+		if (snap_likely(!cmd->deferred))
+			continue;
+
+		/* still no room, keep it first and try again later */
+		TAILQ_REMOVE(&priv->deferred_cmds, cmd, deferred_entry);
+		TAILQ_INSERT_HEAD(&priv->deferred_cmds, cmd, deferred_entry);
+		--priv->cmd_cntrs.deferrals;
+		break;
+	}
+}
+
 bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status)
 {
 	SNAP_LIB_LOG_ERR("command in invalid state %d",
@@ -194,13 +340,56 @@ bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status)
 	return false;
 }
 
+static inline struct vring_desc *virtq_cmd_prefetch_descs(struct virtq_cmd *cmd)
+{
+	return &cmd->vq_priv->prefetch_descs[cmd->idx * cmd->vq_priv->desc_prefetch];
+}
+
+/**
+ * virtq_desc_prefetch_consume() - Append prefetched descriptors to command
+ * @cmd: command descriptors belongs to
+ *
+ * The first window entry is always the descriptor that was requested. The
+ * chain is followed inside the window until it ends or leaves the window.
+ * At most prefetch_cnt descriptors are appended, so a looped chain cannot
+ * get us stuck here.
+ *
+ * Return: 0 on success, -1 if the command descriptors buffer can't be
+ * extended
+ */
+static int virtq_desc_prefetch_consume(struct virtq_cmd *cmd)
+{
+	struct vring_desc *wdescs = virtq_cmd_prefetch_descs(cmd);
+	struct vring_desc *descs;
+	uint16_t i, next = 0;
+
+	for (i = 0; i < cmd->prefetch_cnt; i++) {
+		if (cmd->vq_priv->ops->seg_dmem(cmd))
+			return -1;
+
+		descs = cmd->vq_priv->ops->get_descs(cmd);
+		descs[cmd->num_desc++] = wdescs[next];
+		if (!(wdescs[next].flags & VRING_DESC_F_NEXT))
+			break;
+
+		next = wdescs[next].next - cmd->prefetch_start;
+		if (next >= cmd->prefetch_cnt)
+			break;
+	}
+
+	cmd->prefetch_cnt = 0;
+	return 0;
+}
+
 /**
  * fetch_next_desc() - Fetches command descriptors from host memory
  * @cmd: command descriptors belongs to
  *
  * Function checks if there are descriptors that were not sent in the
- * tunnled command, and if so it reads them from host memory one by one.
- * Reading from host memory is done asynchronous
+ * tunnled command, and if so it reads them from host memory. When the
+ * descriptor prefetch is enabled, a window of consecutive descriptors is
+ * read at once and the chain is resolved locally, otherwise descriptors are
+ * read one by one. Reading from host memory is done asynchronous
  *
  * Return: virtq_fetch_desc_status
  */
@@ -257,6 +446,27 @@ static enum virtq_fetch_desc_status fetch_next_desc(struct virtq_cmd *cmd)
 	} else
 		return VIRTQ_FETCH_DESC_DONE;
 
+	if (!cmd->is_indirect && cmd->vq_priv->desc_prefetch > 1 &&
+	    in_ring_desc_addr < cmd->vq_priv->vattr->size) {
+		/* the window must not cross the end of the desc table */
+		cmd->prefetch_cnt = snap_min(cmd->vq_priv->desc_prefetch,
+					     cmd->vq_priv->vattr->size - in_ring_desc_addr);
+		cmd->prefetch_start = in_ring_desc_addr;
+		len = cmd->prefetch_cnt * sizeof(struct vring_desc);
+		cmd->dma_comp.count = 1;
+		virtq_log_data(cmd, "READ_DESC_WINDOW: pa 0x%lx len %lu\n", srcaddr, len);
+		ret = snap_dma_q_read(cmd->vq_priv->dma_q, virtq_cmd_prefetch_descs(cmd),
+				len, cmd->vq_priv->prefetch_mr->lkey, srcaddr,
+				cmd->vq_priv->vattr->dma_mkey,
+				&(cmd->dma_comp));
+		if (ret) {
+			cmd->prefetch_cnt = 0;
+			return ret == -EAGAIN ? VIRTQ_FETCH_DESC_AGAIN : VIRTQ_FETCH_DESC_ERR;
+		}
+		++cmd->vq_priv->cmd_cntrs.outstanding_to_host;
+		return VIRTQ_FETCH_DESC_READ;
+	}
+
 	if (cmd->vq_priv->ops->seg_dmem(cmd))
 		return VIRTQ_FETCH_DESC_ERR;
 
@@ -266,6 +476,14 @@ static enum virtq_fetch_desc_status fetch_next_desc(struct virtq_cmd *cmd)
 			len, cmd->aux_mr->lkey, srcaddr,
 			cmd->vq_priv->vattr->dma_mkey,
 			&(cmd->dma_comp));
+	if (snap_unlikely(ret == -EAGAIN)) {
+		/* undo the indirect table setup, it is redone on retry */
+		if (cmd->is_indirect) {
+			cmd->is_indirect = false;
+			cmd->num_desc++;
+		}
+		return VIRTQ_FETCH_DESC_AGAIN;
+	}
 	if (ret)
 		return VIRTQ_FETCH_DESC_ERR;
 	/* Note: the num_desc should be incremented in case the success completion only.
@@ -295,14 +513,27 @@ bool virtq_sm_fetch_cmd_descs(struct virtq_cmd *cmd,
 	enum virtq_fetch_desc_status ret;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
-		--cmd->num_desc;
+		if (cmd->prefetch_cnt)
+			cmd->prefetch_cnt = 0;
+		else
+			--cmd->num_desc;
 		ERR_ON_CMD(cmd, "failed to fetch commands descs - num_desc: %ld, dumping command without response",
 			   cmd->num_desc);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 		return true;
 	}
+
+	if (cmd->prefetch_cnt && virtq_desc_prefetch_consume(cmd)) {
+		ERR_ON_CMD(cmd, "failed to extend descs buffer for prefetched descs");
+		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
+		return true;
+	}
+
 	ret = fetch_next_desc(cmd);
-	if (ret == VIRTQ_FETCH_DESC_ERR) {
+	if (snap_unlikely(ret == VIRTQ_FETCH_DESC_AGAIN)) {
+		virtq_cmd_defer(cmd);
+		return false;
+	} else if (ret == VIRTQ_FETCH_DESC_ERR) {
 		ERR_ON_CMD(cmd, "failed to RDMA READ desc from host");
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 		return true;
@@ -356,51 +587,12 @@ inline void virtq_mark_dirty_mem(struct virtq_cmd *cmd, uint64_t pa,
 	if (vq->ctrl->lm_channel) {
 		rc = snap_channel_mark_dirty_page(vq->ctrl->lm_channel, pa, len);
 	} else if (vq->ctrl->dp_map) {
-		int64_t total_size = len;
-		/* this is what can be written inline: 8 bytes, 32k for pagemap 128k
-		 * for bitmap
-		 */
-		char pbuf[sizeof(struct virtq_split_tunnel_comp)];
-		int b_off;
-		uint32_t size;
-		uint64_t start_pa;
-
-		rc = 0;
-		memset(pbuf, 0xFF, sizeof(pbuf));
-		do {
-			rc = snap_dp_bmap_get_start_pa(vq->ctrl->dp_map, pa, len, &start_pa, &b_off, &size);
-			if (rc < 0)
-				break;
-
-			virtq_log_data(cmd, "MARK_DIRTY_MEM: start_pa 0x%lx n_bytes %d byte_len %u\n", start_pa, size, rc);
-			total_size -= rc;
-			/*
-			 * Amount of pages we can set is defined by the max inline
-			 * We need to do more writes for bigger buffers.
-			 * TODO: handle -EAGAIN, force flush in such case
-			 */
-			do {
-				size_t to_write = size <= sizeof(pbuf) ? size : sizeof(pbuf);
-
-				rc = snap_dma_q_write_short(cmd->vq_priv->dma_q, pbuf,
-						to_write,
-						start_pa,
-						snap_dp_bmap_get_mkey(vq->ctrl->dp_map));
-				if (rc < 0) {
-					ERR_ON_CMD(cmd, "rdma_write failed: %d", rc);
-					goto done;
-				}
-				size -= to_write;
-			} while (size > 0);
-
-			/* most probably region will stay in the single memory range */
-		} while (total_size > 0);
-
+		rc = snap_dp_bmap_mark_dirty(vq->ctrl->dp_map, cmd->vq_priv->dma_q, pa, len);
 	} else {
 		ERR_ON_CMD(cmd, "dirty memory logging enabled but migration channel is not present");
 		return;
 	}
-done:
+
 	if (rc)
 		ERR_ON_CMD(cmd, "mark dirty page failed: pa 0x%lx len %u", pa, len);
 }
@@ -437,8 +629,10 @@ inline bool virtq_sm_write_status(struct virtq_cmd *cmd,
 				descs[sd.desc].addr,
 				cmd->vq_priv->vattr->dma_mkey);
 
-	if (snap_unlikely(ret)) {
-		/* TODO: at some point we will have to do pending queue */
+	if (snap_unlikely(ret == -EAGAIN)) {
+		virtq_cmd_defer(cmd);
+		return false;
+	} else if (snap_unlikely(ret)) {
 		ERR_ON_CMD(cmd, "failed to send status, err=%d", ret);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 		return true;
@@ -456,6 +650,7 @@ int virtq_sw_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q)
 	struct snap_virtio_common_queue_attr *cmn_queue = to_common_queue_attr(cmd->vq_priv->vattr);
 	uint64_t used_idx_addr, used_elem_addr;
 	struct vring_used_elem elem;
+	uint16_t used_idx;
 	int ret;
 
 	elem.id = cmd->descr_head_idx;
@@ -469,10 +664,13 @@ int virtq_sw_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q)
 		return ret;
 
 	used_idx_addr = cmd->vq_priv->vattr->device + offsetof(struct vring_used, idx);
-	cmn_queue->hw_used_index = cmn_queue->hw_used_index + 1;
-	ret = snap_dma_q_write_short(q, &cmn_queue->hw_used_index, sizeof(uint16_t),
+	used_idx = cmn_queue->hw_used_index + 1;
+	ret = snap_dma_q_write_short(q, &used_idx, sizeof(uint16_t),
 						   used_idx_addr,
 					       cmd->vq_priv->vattr->dma_mkey);
+	/* on failure both writes can be safely repeated */
+	if (snap_likely(!ret))
+		cmn_queue->hw_used_index = used_idx;
 
 	return ret;
 }
@@ -550,8 +748,10 @@ inline bool virtq_sm_send_completion(struct virtq_cmd *cmd,
 	}
 
 	ret = cmd->vq_priv->ops->send_comp(cmd, cmd->vq_priv->dma_q);
-	if (snap_unlikely(ret)) {
-		/* TODO: pending queue */
+	if (snap_unlikely(ret == -EAGAIN)) {
+		virtq_cmd_defer(cmd);
+		return false;
+	} else if (snap_unlikely(ret)) {
 		ERR_ON_CMD(cmd, "failed to send completion ret %d", ret);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 	} else {
@@ -566,11 +766,16 @@ inline bool virtq_sm_send_completion(struct virtq_cmd *cmd,
 
 static void virtq_rel_req_dbuf(struct virtq_cmd *cmd)
 {
-	ibv_dereg_mr(cmd->req_mr);
-	cmd->vq_priv->ops->release_cmd(cmd);
+	if (cmd->use_pool_buf) {
+		snap_buf_pool_free(cmd->vq_priv->req_pool, cmd->req_buf);
+	} else {
+		ibv_dereg_mr(cmd->req_mr);
+		cmd->vq_priv->ops->release_cmd(cmd);
+	}
 	cmd->req_buf = cmd->buf;
 	cmd->req_mr = cmd->mr;
 	cmd->use_dmem = false;
+	cmd->use_pool_buf = false;
 }
 
 static bool virtq_common_release(struct virtq_cmd *cmd)
@@ -621,6 +826,12 @@ static void virtq_progress_suspend(struct virtq_common_ctx *q)
 	if (!virtq_check_outstanding_progress_suspend(priv))
 		return;
 
+	/* delayed dirty map updates must reach the host before the queue is suspended */
+	if (priv->vbq->log_writes_to_host && priv->vbq->ctrl->dp_map) {
+		while (snap_dp_bmap_flush(priv->vbq->ctrl->dp_map, priv->dma_q) == -EAGAIN)
+			snap_dma_q_flush(priv->dma_q);
+	}
+
 	n = snap_dma_q_flush(priv->dma_q);
 
 	qattr.vattr.state = SNAP_VIRTQ_STATE_SUSPEND;
@@ -644,7 +855,8 @@ static void virtq_progress_unordered(struct virtq_priv *vq_priv)
 			cmd_idx);
 
 	while (cmd->state == VIRTQ_CMD_STATE_SEND_IN_ORDER_COMP
-			&& cmd->cmd_available_index == cmd->vq_priv->ctrl_used_index) {
+			&& cmd->cmd_available_index == cmd->vq_priv->ctrl_used_index
+			&& !cmd->deferred) {
 		virtq_log_data(cmd, "PEND_COMP: ino_num:%d state:%d\n",
 				cmd->cmd_available_index, cmd->state);
 
@@ -656,6 +868,23 @@ static void virtq_progress_unordered(struct virtq_priv *vq_priv)
 }
 
 //#define VIRTIO_QUEUE_POLL_ENABLED
+#define VIRTQ_POLL_BATCH 64
+
+static int virtq_poll_provider(struct virtq_priv *priv)
+{
+	struct virtq_split_tunnel_req reqs[VIRTQ_POLL_BATCH];
+	int i, n;
+
+	n = priv->snap_vbq->q_ops->poll(priv->snap_vbq, reqs, VIRTQ_POLL_BATCH);
+	for (i = 0; i < n; i++)
+		priv->dma_q->rx_cb(priv->dma_q, &reqs[i], 0, 0);
+
+	if (priv->snap_vbq->q_ops->send_completions)
+		priv->snap_vbq->q_ops->send_completions(priv->snap_vbq);
+
+	return n > 0 ? n : 0;
+}
+
 /**
  * virtq_progress() - Progress RDMA QPs,  Polls on QPs CQs
  * @q:	queue to progress
@@ -674,23 +903,24 @@ int virtq_progress(struct virtq_common_ctx *q, int thread_id)
 
 	priv->thread_id = thread_id;
 	n += snap_dma_q_progress(priv->dma_q);
+	if (snap_unlikely(!TAILQ_EMPTY(&priv->deferred_cmds)))
+		virtq_progress_deferred(priv);
 
 #ifdef VIRTIO_QUEUE_POLL_ENABLED
-	if (priv->snap_vbq->q_ops->poll) {
-		int i;
-		int n;
-		struct virtq_split_tunnel_req reqs[64];
-
-		n = priv->snap_vbq->q_ops->poll(priv->snap_vbq, reqs, 64);
-		for (i = 0; i < n; i++)
-			priv->dma_q->rx_cb(priv->dma_q, &reqs[i], 0, 0);
-
-		priv->snap_vbq->q_ops->send_completions(priv->snap_vbq);
-	}
+	if (priv->snap_vbq->q_ops->poll)
+		n += virtq_poll_provider(priv);
+#else
+	/* nothing pushes avail heads for the sw provider, they must be polled */
+	if (to_common_queue_attr(priv->vattr)->q_provider == SNAP_SW_Q_PROVIDER &&
+	    priv->swq_state == SW_VIRTQ_RUNNING)
+		n += virtq_poll_provider(priv);
 #endif
 	if (snap_unlikely(priv->force_in_order))
 		virtq_progress_unordered(priv);
 
+	if (snap_unlikely(priv->vbq->log_writes_to_host) && priv->vbq->ctrl->dp_map)
+		snap_dp_bmap_progress(priv->vbq->ctrl->dp_map, priv->dma_q);
+
 	/*
 	 * need to wait until all in-flight requests
 	 * are finished before moving to the suspend state
@@ -742,10 +972,11 @@ int virtq_suspend(struct virtq_common_ctx *q)
 		return -EBUSY;
 	}
 
-	SNAP_LIB_LOG_INFO("ctrl %p queue %d: SUSPENDING command(s) - in %d bdev %d host %d fatal %d",
+	SNAP_LIB_LOG_INFO("ctrl %p queue %d: SUSPENDING command(s) - in %d bdev %d host %d fatal %d deferred %d (total %lu)",
 			priv->vbq->ctrl, q->idx,
 			priv->cmd_cntrs.outstanding_total, priv->cmd_cntrs.outstanding_in_bdev,
-			priv->cmd_cntrs.outstanding_to_host, priv->cmd_cntrs.fatal);
+			priv->cmd_cntrs.outstanding_to_host, priv->cmd_cntrs.fatal,
+			priv->cmd_cntrs.deferred, priv->cmd_cntrs.deferrals);
 
 	if (priv->vq_ctx->fatal_err)
 		SNAP_LIB_LOG_WARN("ctrl %p queue %d: fatal error. Resuming or live migration will not be possible",
@@ -798,6 +1029,7 @@ virtq_rx_cb_common_set(struct virtq_priv *vq_priv, const void *data)
 	cmd->total_in_len = 0;
 	cmd->vq_priv->ops->clear_status(cmd);
 	cmd->use_dmem = false;
+	cmd->use_pool_buf = false;
 	cmd->use_seg_dmem = false;
 	cmd->req_buf = cmd->buf;
 	cmd->req_mr = cmd->mr;
@@ -20,6 +20,7 @@
 #include "snap_virtio_common_ctrl.h"
 #include "snap_dma.h"
 #include "snap_lib_log.h"
+#include "snap_buf.h"
 
 SNAP_LIB_LOG_REGISTER(VIRTQ_COMMON_H)
 
@@ -69,6 +70,7 @@ struct virtq_common_ctx {
  * @hw_available_index:	initial value of the driver available index.
  * @hw_used_index:	initial value of the device used index
  * @force_in_order:	handle reqs in order
+ * @desc_prefetch:	descriptor prefetch window, 0 - use default
  */
 struct virtq_create_attr {
 	int idx;
@@ -87,6 +89,12 @@ struct virtq_create_attr {
 	bool force_in_order;
 	uint32_t xmkey;
 	bool in_recovery;
+	uint16_t desc_prefetch;
+	/* virtio-blk discard and write zeroes limits, 0 if not negotiated */
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_segs;
 };
 
 struct virtq_start_attr {
@@ -154,9 +162,12 @@ enum virtq_sw_state {
  * @total_seg_len:		total length of the request data to be written/read
  * @total_in_len:		total length of data written to request buffers
  * @use_dmem:			command uses dynamic mem for req_buf
+ * @use_pool_buf:		dynamic req_buf is taken from the req_pool
  * @io_cmd_stat:		command io stats
  * @cmd_available_index:sequential number of the command according to arrival
  * @use_seg_dmem:		command uses dynamic mem for descriptors
+ * @prefetch_start:		desc table index of the first prefetched descriptor
+ * @prefetch_cnt:		number of descriptors in the pending prefetch window
  */
 struct virtq_cmd {
 	int idx;
@@ -177,12 +188,18 @@ struct virtq_cmd {
 	uint32_t total_seg_len;
 	uint32_t total_in_len;
 	bool use_dmem;
+	bool use_pool_buf;
 	struct snap_virtio_ctrl_queue_counter *io_cmd_stat;
 	uint16_t cmd_available_index;
 	uint16_t indirect_pos;
 	uint16_t indirect_len;
 	bool use_seg_dmem;
 	bool is_indirect;
+	uint16_t prefetch_start;
+	uint16_t prefetch_cnt;
+	/* on virtq_priv::deferred_cmds, waiting for dma queue resources */
+	bool deferred;
+	TAILQ_ENTRY(virtq_cmd) deferred_entry;
 };
 
 /**
@@ -219,6 +236,11 @@ struct virtq_bdev {
  * @merge_descs:	merges sequntial descriptors
  * @use_mem_pool:	uses memory pool for data act
  * @thread_id:		thread id
+ * @desc_prefetch:	number of descriptors read from host at once
+ * @prefetch_descs:	per command descriptor prefetch windows
+ * @prefetch_mr:	prefetch windows mr
+ * @req_pool:		registered buffers for requests that don't fit
+ *			the preallocated request buffer
  */
 struct virtq_priv {
 	struct virtq_state_machine *custom_sm;
@@ -245,6 +267,15 @@ struct virtq_priv {
 	int merge_descs;
 	bool use_mem_pool;
 	int thread_id;
+	uint16_t desc_prefetch;
+	struct vring_desc *prefetch_descs;
+	struct ibv_mr *prefetch_mr;
+	struct snap_buf_pool *req_pool;
+	/*
+	 * commands that could not post a dma operation because the dma
+	 * queue was full, see virtq_cmd_defer()
+	 */
+	TAILQ_HEAD(, virtq_cmd) deferred_cmds;
 };
 
 struct virtq_status_data {
@@ -325,11 +356,13 @@ enum virtq_cmd_sm_state {
  * @VIRTQ_FETCH_DESC_DONE:	All descriptors were fetched
  * @VIRTQ_FETCH_DESC_ERR:	Error while trying to fetch a descriptor
  * @VIRTQ_FETCH_DESC_READ:	An Asynchronous read for desc was called
+ * @VIRTQ_FETCH_DESC_AGAIN:	DMA queue is full, fetch must be retried
  */
 enum virtq_fetch_desc_status {
 	VIRTQ_FETCH_DESC_DONE,
 	VIRTQ_FETCH_DESC_ERR,
 	VIRTQ_FETCH_DESC_READ,
+	VIRTQ_FETCH_DESC_AGAIN,
 };
 
 struct virtq_ctx_init_attr {
@@ -344,7 +377,12 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 		    struct virtq_create_attr *attr,
 		    struct virtq_ctx_init_attr *ctxt_attr);
 void virtq_ctx_destroy(struct virtq_priv *vq_priv);
+int virtq_req_pool_create(struct virtq_priv *vq_priv,
+			  void *(*dma_malloc)(size_t size),
+			  void (*dma_free)(void *buf));
+int virtq_req_pool_alloc(struct virtq_cmd *cmd, size_t len);
 int virtq_cmd_progress(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status);
+void virtq_cmd_defer(struct virtq_cmd *cmd);
 bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status);
 bool virtq_sm_fetch_cmd_descs(struct virtq_cmd *cmd,
 			       enum virtq_cmd_sm_op_status status);
@@ -198,6 +198,23 @@ static inline void dpa_msix_send(uint32_t cq_num)
 	outbox_write(ctx->outbox_base, RXT_DB, OUTBOX_V_RXT_DB(cq_num));
 }
 
+/**
+ * dpa_cycles() - read hart cycle counter
+ *
+ * Use it to measure short intervals. The thread is bound to a single hart
+ * so the values are monotonic within the thread.
+ *
+ * Return:
+ * current cycle count
+ */
+static inline uint64_t dpa_cycles(void)
+{
+	uint64_t cycles;
+
+	asm volatile("rdcycle %0" : "=r"(cycles));
+	return cycles;
+}
+
 /**
  * dpa_init() - initialize thread
  * @tcb: thread control block
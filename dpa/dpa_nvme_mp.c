@@ -122,6 +122,76 @@ dpa_nvme_mp_ns_next_rb_get(struct dpa_nvme_mp_ns *ns, uint32_t num_p2p_queues)
 	ns->credits = ns->rbs[ns->active_rb].weight;
 }
 
+/*
+ * Pick path with the lowest score. Search starts after the current path so
+ * that ties are spread between paths. Paths that have no latency samples yet
+ * score zero in the latency mode, it lets them get the samples.
+ */
+static inline void
+dpa_nvme_mp_ns_best_rb_get(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_ns *ns)
+{
+	uint64_t score, best_score = UINT64_MAX;
+	struct dpa_nvme_mp_path *path;
+	uint32_t i, qp_id;
+
+	for (i = 1; i <= cq->num_p2p_queues; i++) {
+		qp_id = (ns->active_rb + i) % cq->num_p2p_queues;
+		if (!ns->rbs[qp_id].weight)
+			continue;
+
+		path = &cq->paths[qp_id];
+		score = path->inflight + 1;
+		if (ns->policy == DPA_NVME_MP_POLICY_LATENCY)
+			score *= path->lat_ewma;
+
+		if (score < best_score) {
+			best_score = score;
+			ns->active_rb = qp_id;
+		}
+	}
+}
+
+static inline void
+dpa_nvme_mp_sqes_stamp(struct dpa_nvme_mp_sq *sq, uint32_t start_idx, uint32_t end_idx)
+{
+	/* zero marks a command without timestamp */
+	uint32_t now = (uint32_t)dpa_cycles() | 1;
+	uint32_t i;
+
+	for (i = start_idx; i != end_idx; i = (i + 1) % sq->queue_depth)
+		sq->sqe_ts[sq->sqe_buffer[i].cid % sq->queue_depth] = now;
+}
+
+static inline void
+nvme_mp_path_complete(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq,
+		uint32_t qp_id, struct snap_rx_completion *comps, int n)
+{
+	struct dpa_nvme_mp_path *path = &cq->paths[qp_id];
+	struct dpa_nvme_mp_completion *mp_comp;
+	uint32_t now, lat, *ts;
+	int i;
+
+	path->inflight -= snap_min((uint32_t)n, path->inflight);
+	if (!sq->track_latency)
+		return;
+
+	now = (uint32_t)dpa_cycles();
+	for (i = 0; i < n; i++) {
+		mp_comp = comps[i].data;
+		ts = &sq->sqe_ts[mp_comp->cid % sq->queue_depth];
+		if (!*ts)
+			continue;
+
+		lat = now - *ts;
+		*ts = 0;
+		if (snap_unlikely(!path->lat_ewma))
+			path->lat_ewma = lat;
+		else
+			path->lat_ewma = path->lat_ewma - (path->lat_ewma >> DPA_NVME_MP_LAT_EWMA_SHIFT) +
+					 (lat >> DPA_NVME_MP_LAT_EWMA_SHIFT);
+	}
+}
+
 static inline void
 dpa_nvme_mp_sqes_send(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq,
 		uint32_t nsid, uint32_t start_idx, uint32_t end_idx)
@@ -138,15 +208,23 @@ dpa_nvme_mp_sqes_send(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq,
 		return;
 	}
 
-	/* TODO_Itay: check perf against an array of only active rbs */
-	if (!ns->credits)
-		dpa_nvme_mp_ns_next_rb_get(ns, cq->num_p2p_queues);
+	if (ns->policy == DPA_NVME_MP_POLICY_WRR) {
+		/* TODO_Itay: check perf against an array of only active rbs */
+		if (!ns->credits)
+			dpa_nvme_mp_ns_next_rb_get(ns, cq->num_p2p_queues);
+		ns->credits--;
+	} else {
+		dpa_nvme_mp_ns_best_rb_get(cq, ns);
+	}
 
 	p2p_q = &cq->p2p_queues[ns->active_rb];
 	rb = &ns->rbs[ns->active_rb];
-	ns->credits--;
 
 	num_elements = (end_idx - start_idx) % sq->queue_depth;
+	cq->paths[ns->active_rb].inflight += num_elements;
+	if (ns->policy == DPA_NVME_MP_POLICY_LATENCY)
+		dpa_nvme_mp_sqes_stamp(sq, start_idx, end_idx);
+
 	snap_dpa_dma_cyclic_buffer_write(p2p_q->dma_q, sq->sqe_buffer, snap_dma_q_dpa_mkey(p2p_q->dma_q),
 			rb->arm_rb_addr, rb->arm_rb_mkey, start_idx, rb->tail,
 			num_elements, sizeof(struct nvme_cmd), sq->queue_depth, NULL);
@@ -234,6 +312,7 @@ static int dpa_nvme_mp_cq_create(struct snap_dpa_cmd *cmd)
 	memcpy(cq, &nvme_cmd->cmd_cq_create.cq, sizeof(nvme_cmd->cmd_cq_create.cq));
 
 	TAILQ_INIT(&cq->sqs);
+	memset(cq->paths, 0, sizeof(cq->paths));
 
 	if (dpa_nvme_mp_queues_init(cq))
 		return SNAP_DPA_RSP_ERR;
@@ -260,6 +339,11 @@ dpa_nvme_mp_rb_attach(struct snap_dpa_cmd *cmd)
 	struct dpa_nvme_mp_ns *ns;
 	size_t ns_size;
 
+	if (rb_cmd->policy >= DPA_NVME_MP_POLICY_MAX) {
+		dpa_error("SQ %u: nsid %u unsupported path policy %u\n", sq->sqid, rb_cmd->nsid, rb_cmd->policy);
+		return SNAP_DPA_RSP_ERR;
+	}
+
 	if (!sq->namespaces[rb_cmd->nsid]) {
 		ns_size = sizeof(struct dpa_nvme_mp_ns) + cq->num_p2p_queues * sizeof(struct dpa_nvme_mp_rb);
 		sq->namespaces[rb_cmd->nsid] = dpa_thread_alloc(ns_size);
@@ -276,6 +360,9 @@ dpa_nvme_mp_rb_attach(struct snap_dpa_cmd *cmd)
 
 	ns->active_rb = rb_cmd->qp_id;
 	ns->credits = rb_cmd->weight;
+	ns->policy = rb_cmd->policy;
+	if (ns->policy == DPA_NVME_MP_POLICY_LATENCY)
+		sq->track_latency = true;
 
 	return SNAP_DPA_RSP_OK;
 }
@@ -325,16 +412,29 @@ dpa_nvme_mp_rb_modify(struct snap_dpa_cmd *cmd)
 	struct dpa_nvme_mp_sq *sq = TAILQ_FIRST(&cq->sqs);
 	struct dpa_nvme_mp_cmd *ncmd = (struct dpa_nvme_mp_cmd *)cmd;
 	struct dpa_nvme_mp_cmd_rb_modify *rb_cmd = &ncmd->cmd_rb_modify;
-	struct dpa_nvme_mp_rb *rb = &sq->namespaces[rb_cmd->nsid]->rbs[rb_cmd->qp_id];
+	struct dpa_nvme_mp_ns *ns = sq->namespaces[rb_cmd->nsid];
+	struct dpa_nvme_mp_rb *rb;
 
-	if (!rb) {
+	if (!ns) {
 		dpa_error("SQ %u: RB of nsid %u, qp_id %u could not be found\n", sq->sqid, rb_cmd->nsid, rb_cmd->qp_id);
 		return SNAP_DPA_RSP_ERR;
 	}
 
+	rb = &ns->rbs[rb_cmd->qp_id];
 	if (rb_cmd->mask.weight)
 		rb->weight = rb_cmd->weight;
 
+	if (rb_cmd->mask.policy) {
+		if (rb_cmd->policy >= DPA_NVME_MP_POLICY_MAX) {
+			dpa_error("SQ %u: nsid %u unsupported path policy %u\n", sq->sqid, rb_cmd->nsid, rb_cmd->policy);
+			return SNAP_DPA_RSP_ERR;
+		}
+		ns->policy = rb_cmd->policy;
+		ns->credits = rb->weight;
+		if (ns->policy == DPA_NVME_MP_POLICY_LATENCY)
+			sq->track_latency = true;
+	}
+
 	return SNAP_DPA_RSP_OK;
 }
 
@@ -350,6 +450,9 @@ static int dpa_nvme_mp_sq_create(struct snap_dpa_cmd *cmd)
 
 	memset(sq->namespaces, 0, sizeof(*sq->namespaces));
 	sq->sqe_buffer = (struct nvme_cmd *) dpa_thread_alloc(sq->queue_depth * SNAP_DPA_NVME_SQE_SIZE);
+	sq->sqe_ts = dpa_thread_alloc(sq->queue_depth * sizeof(*sq->sqe_ts));
+	memset(sq->sqe_ts, 0, sq->queue_depth * sizeof(*sq->sqe_ts));
+	sq->track_latency = false;
 	sq->host2dpa_comp = (struct snap_dma_completion) {
 		.func = sq->sqid ? dpa_nvme_mp_io_host2dpa_done : dpa_nvme_mp_admin_host2dpa_done,
 		.count = 0,
@@ -544,8 +647,9 @@ static inline int process_commands(int *done)
 }
 
 static inline int
-nvme_mp_completions_poll(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq, struct snap_dma_q *q)
+nvme_mp_completions_poll(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq, uint32_t qp_id)
 {
+	struct snap_dma_q *q = cq->p2p_queues[qp_id].dma_q;
 	struct snap_rx_completion comps[NVME_MP_MAX_COMPS_POLL];
 	uint16_t cq_avail;
 	int n, i, count = 0;
@@ -559,6 +663,9 @@ nvme_mp_completions_poll(struct dpa_nvme_mp_cq *cq, struct dpa_nvme_mp_sq *sq, s
 		for (i = 0; i < n; i++)
 			nvme_mp_completion_msg_handle(cq, sq, comps[i].data);
 
+		if (n)
+			nvme_mp_path_complete(cq, sq, qp_id, comps, n);
+
 	} while (n == NVME_MP_MAX_COMPS_POLL);
 
 	return count;
@@ -577,7 +684,7 @@ nvme_mp_cqes_handle(struct dpa_rt_context *rt_ctx, struct dpa_nvme_mp_cq *cq,
 
 	/* TODO_Itay: to be replaced by shared rx cq */
 	for (int i = 0; i < cq->num_p2p_queues; i++)
-		num_comps += nvme_mp_completions_poll(cq, sq, cq->p2p_queues[i].dma_q);
+		num_comps += nvme_mp_completions_poll(cq, sq, i);
 
 	if (num_comps) {
 		cq->comp.count += snap_dpa_dma_cyclic_buffer_write(dma_q, cq->shadow_cq,
@@ -21,8 +21,12 @@
 #include "snap_dpa_virtq.h"
 
 /**
- * Single virtio/nvme queue per thread implementation. The thread can be
- * either in polling or in event mode
+ * Virtio queues per thread implementation. The thread can be either in
+ * polling or in event mode.
+ *
+ * The thread serves up to SNAP_DPA_VIRTQ_MAX_PER_THREAD queues. Queue id
+ * is given by the DPU in the queue commands and is used as the qid of the
+ * p2p messages. All queues share p2p channel and doorbell cq of the thread.
  */
 
 
@@ -48,16 +52,31 @@ do { \
 	dpa_debug("vq 0x%x#%d " _fmt, (_vq)->common.dev_emu_id, (_vq)->common.idx, ##__VA_ARGS__); \
 } while (0)
 
-static inline int dpa_virtq_msix_recv();
-static inline void dpa_virtq_msix_raise();
+struct dpa_virtq_thread {
+	/* next queue to start progress from */
+	uint32_t rr_next;
+	struct dpa_virtq vqs[SNAP_DPA_VIRTQ_MAX_PER_THREAD];
+};
+
+static inline int dpa_virtq_msix_recv(struct dpa_virtq *vq);
+static inline void dpa_virtq_msix_raise(struct dpa_virtq *vq);
 
-static inline struct dpa_virtq *get_vq()
+static inline struct dpa_virtq_thread *get_vq_thread()
 {
-	/* will redo to be mt safe */
 	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 
-	/* vq is always allocated after rt context */
-	return (struct dpa_virtq *)SNAP_ALIGN_CEIL((uint64_t)(rt_ctx + 1), DPA_CACHE_LINE_BYTES);
+	/* vq table is always allocated after rt context */
+	return (struct dpa_virtq_thread *)SNAP_ALIGN_CEIL((uint64_t)(rt_ctx + 1), DPA_CACHE_LINE_BYTES);
+}
+
+static inline struct dpa_virtq *get_vq(uint16_t qid)
+{
+	if (snap_unlikely(qid >= SNAP_DPA_VIRTQ_MAX_PER_THREAD)) {
+		dpa_error("invalid virtq id %d\n", qid);
+		return NULL;
+	}
+
+	return &get_vq_thread()->vqs[qid];
 }
 
 static void dump_stats(struct dpa_virtq *vq)
@@ -71,16 +90,16 @@ static void dump_stats(struct dpa_virtq *vq)
 		vq->stats.n_msix_sent);
 
 	/* have line len limit - split in two lines */
-	dpa_virtq_info(vq, "n_polls %u long_sends %u db_cqes %u no_db_cqes %u\n",
+	dpa_virtq_info(vq, "n_polls %u long_sends %u db_cqes %u no_db_cqes %u no_credits %u\n",
 		vq->stats.n_polls,
 		vq->stats.n_long_sends,
 		vq->stats.n_db_cqes,
-		vq->stats.n_db_empty);
+		vq->stats.n_db_empty,
+		vq->stats.n_no_credits);
 }
 
-static inline void dpa_virtq_duar_arm()
+static inline void dpa_virtq_duar_arm(struct dpa_virtq *vq)
 {
-	struct dpa_virtq *vq = get_vq();
 	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 
 	/* todo: use always armed in event mode */
@@ -90,18 +109,17 @@ static inline void dpa_virtq_duar_arm()
 	dpa_duar_arm(vq->duar_id, rt_ctx->db_cq.cq_num);
 }
 
-static inline void dpa_virtq_msix_arm()
+static inline void dpa_virtq_msix_arm(struct dpa_virtq *vq)
 {
 	/* todo: use always armed in event mode */
-	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 	struct mlx5_cqe64 *cqe;
 	int n;
 
 	/* cq shall be armed before it is polled. See man ibv_get_cq_event */
-	snap_dv_arm_cq(&rt_ctx->msix_cq);
+	snap_dv_arm_cq(&vq->msix_cq);
 
 	for (n = 0; n < SNAP_DPA_RT_THR_MSIX_CQE_CNT; n++) {
-		cqe = snap_dv_poll_cq(&rt_ctx->msix_cq, 64);
+		cqe = snap_dv_poll_cq(&vq->msix_cq, 64);
 		if (!cqe)
 			break;
 	}
@@ -121,10 +139,19 @@ static void dpa_virtq_write_rsp(struct dpa_virtq *vq)
 int dpa_virtq_create(struct snap_dpa_cmd *cmd)
 {
 	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
 	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 
+	if (!vq || vcmd->cmd_create.vq.qid != vcmd->qid)
+		return SNAP_DPA_RSP_ERR;
+
+	if (vq->state != DPA_VIRTQ_STATE_ERR) {
+		dpa_virtq_error(vq, "virtq slot %d is busy\n", vcmd->qid);
+		return SNAP_DPA_RSP_ERR;
+	}
+
 	memcpy(vq, &vcmd->cmd_create.vq, sizeof(vcmd->cmd_create.vq));
+	vq->msix_pending = 0;
 
 	/* TODO: input validation/sanity check */
 
@@ -150,7 +177,7 @@ int dpa_virtq_create(struct snap_dpa_cmd *cmd)
 	 */
 	if (vq->state == DPA_VIRTQ_STATE_RDY) {
 		vq->pending = 1;
-		dpa_virtq_duar_arm();
+		dpa_virtq_duar_arm(vq);
 	} else
 		vq->state = DPA_VIRTQ_STATE_INIT;
 
@@ -160,12 +187,13 @@ int dpa_virtq_create(struct snap_dpa_cmd *cmd)
 			vcmd->cmd_create.do_recovery, vq->hw_available_index,
 			vq->common.msix_vector);
 
-	dpa_virtq_info(vq, "DPA_RT_CONFIG: qp 0x%x rx_cq 0x%x tx_cq 0x%x db_cq 0x%x duar_id 0x%x msix_cq 0x%x\n",
+	dpa_virtq_info(vq, "DPA_RT_CONFIG: qid %d qp 0x%x rx_cq 0x%x tx_cq 0x%x db_cq 0x%x duar_id 0x%x msix_cq 0x%x\n",
+		  vq->qid,
 		  rt_ctx->dpa_cmd_chan.dma_q->sw_qp.dv_qp.hw_qp.qp_num,
 		  rt_ctx->dpa_cmd_chan.dma_q->sw_qp.dv_rx_cq.cq_num,
 		  rt_ctx->dpa_cmd_chan.dma_q->sw_qp.dv_tx_cq.cq_num,
 		  rt_ctx->db_cq.cq_num, vq->duar_id,
-		  rt_ctx->msix_cq.cq_num);
+		  vq->msix_cq.cq_num);
 
 	dpa_virtq_write_rsp(vq);
 	return SNAP_DPA_RSP_OK;
@@ -173,10 +201,14 @@ int dpa_virtq_create(struct snap_dpa_cmd *cmd)
 
 int dpa_virtq_destroy(struct snap_dpa_cmd *cmd)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
 	int n_msix;
 
-	n_msix = dpa_virtq_msix_recv();
+	if (!vq)
+		return SNAP_DPA_RSP_ERR;
+
+	n_msix = dpa_virtq_msix_recv(vq);
 	if (n_msix)
 		dpa_virtq_error(vq, "virtq_destroy: %d pending msix messages. Host driver may hang\n", n_msix);
 
@@ -188,11 +220,14 @@ int dpa_virtq_destroy(struct snap_dpa_cmd *cmd)
 
 int dpa_virtq_modify(struct snap_dpa_cmd *cmd)
 {
-	struct dpa_virtq *vq = get_vq();
-	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
+	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 	enum dpa_virtq_state next_state = vcmd->cmd_modify.state;
 
+	if (!vq)
+		return SNAP_DPA_RSP_ERR;
+
 	dpa_virtq_info(vq, "virtq modify: state %d new_state %d\n", vq->state, next_state);
 
 	if (vq->state == next_state)
@@ -209,13 +244,13 @@ int dpa_virtq_modify(struct snap_dpa_cmd *cmd)
 			 * can send doorbell before we armed it
 			 */
 			vq->pending = 1;
-			dpa_virtq_duar_arm();
+			dpa_virtq_duar_arm(vq);
 			/* It is possible that controller died
 			 * after updating used index but before sending MSIX.
 			 */
 			if (vq->common.msix_vector != 0xFFFF) {
 				if (vq->do_recovery)
-					dpa_virtq_msix_raise();
+					dpa_virtq_msix_raise(vq);
 
 				if (is_event_mode())
 					snap_dv_arm_cq(&rt_ctx->dpa_cmd_chan.dma_q->sw_qp.dv_rx_cq);
@@ -259,7 +294,11 @@ done_bad_state:
 
 int dpa_virtq_query(struct snap_dpa_cmd *cmd)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
+
+	if (!vq)
+		return SNAP_DPA_RSP_ERR;
 
 	dpa_virtq_info(vq, "virtq query\n");
 	dpa_virtq_write_rsp(vq);
@@ -268,7 +307,8 @@ int dpa_virtq_query(struct snap_dpa_cmd *cmd)
 
 int dpa_virtq_health_check(struct snap_dpa_cmd *cmd)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
 	struct snap_dpa_tcb *tcb = dpa_tcb();
 	struct dpa_virtq_rsp *rsp;
 	struct virtq_device_ring *used_ring;
@@ -276,6 +316,9 @@ int dpa_virtq_health_check(struct snap_dpa_cmd *cmd)
 	uint16_t host_available_index, host_used_index;
 	int msix_count;
 
+	if (!vq)
+		return SNAP_DPA_RSP_ERR;
+
 	dpa_virtq_debug(vq, "virtq health check\n");
 
 	dpa_window_set_active_mkey(vq->dpa_xmkey);
@@ -301,12 +344,12 @@ int dpa_virtq_health_check(struct snap_dpa_cmd *cmd)
 	rsp->vq_health.host_used_index = host_used_index;
 
 	/* check for missing msix */
-	msix_count = dpa_virtq_msix_recv();
+	msix_count = dpa_virtq_msix_recv(vq);
 	if (msix_count > 0) {
 		if (vq->common.msix_vector != 0xFFFF) {
 			dpa_virtq_error(vq, "%d pending msix detected\n", msix_count);
 			if (vq->state == DPA_VIRTQ_STATE_RDY)
-				dpa_virtq_msix_raise();
+				dpa_virtq_msix_raise(vq);
 		} else
 			dpa_virtq_error(vq, "%d pending msix, but no msix vector\n", msix_count);
 	}
@@ -317,9 +360,13 @@ int dpa_virtq_health_check(struct snap_dpa_cmd *cmd)
 
 int dpa_virtq_get_stats(struct snap_dpa_cmd *cmd)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq_cmd *vcmd = (struct dpa_virtq_cmd *)cmd;
+	struct dpa_virtq *vq = get_vq(vcmd->qid);
 	struct dpa_virtq_rsp *rsp;
 
+	if (!vq)
+		return SNAP_DPA_RSP_ERR;
+
 	dpa_virtq_debug(vq, "get_stats\n");
 
 	rsp = (struct dpa_virtq_rsp *)snap_dpa_mbox_to_rsp(dpa_mbox());
@@ -331,7 +378,6 @@ int dpa_virtq_get_stats(struct snap_dpa_cmd *cmd)
 static int do_command(int *done)
 {
 	struct snap_dpa_tcb *tcb = dpa_tcb();
-	struct dpa_virtq *vq = get_vq();
 	struct mlx5_cqe64 *cqe;
 	struct snap_dpa_cmd *cmd;
 	uint32_t rsp_status;
@@ -385,9 +431,7 @@ static int do_command(int *done)
 	dpa_debug("sn %d: done command 0x%x status %d\n", cmd->sn, cmd->cmd, rsp_status);
 	snap_dpa_rsp_send(dpa_mbox(), rsp_status);
 cmd_done:
-	if (vq->state == DPA_VIRTQ_STATE_RDY)
-		dpa_window_set_active_mkey(vq->dpa_xmkey);
-
+	/* virtq_progress() switches window to the queue mkey as needed */
 	return 0;
 }
 
@@ -403,80 +447,151 @@ static inline int process_commands(int *done)
 #define VIRTQ_DPA_NUM_P2P_MSGS 32
 #define DPA_TABLE_THRESHOLD 4
 
-static inline int dpa_virtq_msix_recv()
+static inline void dpa_virtq_msix_request(struct dpa_virtq_thread *thr, uint8_t type, uint16_t qid)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_virtq *vq;
+
+	if (type != SNAP_DPA_P2P_MSG_VQ_MSIX || qid >= SNAP_DPA_VIRTQ_MAX_PER_THREAD) {
+		dpa_error("bad p2p message type %d qid %d\n", type, qid);
+		return;
+	}
+	vq = &thr->vqs[qid];
+	vq->msix_pending++;
+	vq->stats.n_msix_rcvd++;
+}
+
+/* msix requests of several queues coalesced by DPU */
+static inline void dpa_virtq_p2p_recv_batch(struct dpa_virtq_thread *thr,
+					    struct snap_dpa_p2p_msg_batch *msg)
+{
+	int i;
+
+	if (msg->n_entries > SNAP_DPA_P2P_BATCH_MAX_ENTRIES) {
+		dpa_error("bad p2p batch size %d\n", msg->n_entries);
+		return;
+	}
+
+	for (i = 0; i < msg->n_entries; i++)
+		dpa_virtq_msix_request(thr, msg->entries[i].type, msg->entries[i].qid);
+}
+
+/*
+ * Receive messages from DPU, at the moment these are only msix requests.
+ * Every message may carry credits for the messages that queues of the
+ * thread have sent to DPU. DPU returns a credit once the message is taken
+ * from the queue inbox, so the credits also bound the DPU inbox usage.
+ */
+static inline void dpa_virtq_p2p_recv()
+{
+	struct dpa_virtq_thread *thr = get_vq_thread();
 	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 	struct snap_dpa_p2p_msg *msgs[VIRTQ_DPA_NUM_P2P_MSGS];
-	int n, msix_count;
+	int i, n;
 
 	/* cq shall be armed before it is polled. See man ibv_get_cq_event */
 	if (is_event_mode())
 		snap_dv_arm_cq(&rt_ctx->dpa_cmd_chan.dma_q->sw_qp.dv_rx_cq);
 
-	msix_count = 0;
 	do {
 		n = snap_dpa_p2p_recv_msg(&rt_ctx->dpa_cmd_chan, msgs, VIRTQ_DPA_NUM_P2P_MSGS);
 		if (n)
 			dpa_debug("recv %d new messages\n", n);
-		msix_count += n;
+		for (i = 0; i < n; i++) {
+			rt_ctx->dpa_cmd_chan.credit_count += msgs[i]->base.credit_delta;
+			if (msgs[i]->base.type == SNAP_DPA_P2P_MSG_CR_UPDATE)
+				continue;
+			if (msgs[i]->base.type == SNAP_DPA_P2P_MSG_BATCH) {
+				dpa_virtq_p2p_recv_batch(thr, (struct snap_dpa_p2p_msg_batch *)msgs[i]);
+				continue;
+			}
+			dpa_virtq_msix_request(thr, msgs[i]->base.type, msgs[i]->base.qid);
+		}
 	} while (n != 0);
+}
 
-	if (msix_count == 0)
-		return 0;
+static inline int dpa_virtq_msix_recv(struct dpa_virtq *vq)
+{
+	int msix_count;
 
-	vq->stats.n_msix_rcvd += msix_count;
+	dpa_virtq_p2p_recv();
+	msix_count = vq->msix_pending;
+	vq->msix_pending = 0;
+	return msix_count;
+}
 
-#if 0
-	/* at the moment we are only getting msix messages for the one queue. no need to parse */
-	for (msix_count = i = 0; i < n; i++) {
-		rt_ctx->dpa_cmd_chan.credit_count += msgs[i]->base.credit_delta;
-		if (msgs[i]->base.type == SNAP_DPA_P2P_MSG_CR_UPDATE) {
-			//cr_update = 1;
-			continue;
-		}
-		if (msgs[i]->base.type != SNAP_DPA_P2P_MSG_VQ_MSIX)
-			continue;
-		/* TODO: log bad messages */
-		msix_count++;
+static inline void dpa_virtq_msix_raise(struct dpa_virtq *vq)
+{
+	dpa_virtq_msix_arm(vq);
+	dpa_msix_send(vq->msix_cqnum);
+	vq->stats.n_msix_sent++;
+}
+
+/*
+ * Doorbell cq is shared by all thread queues and the cqe does not tell
+ * which queue was rung. Return number of doorbells, caller has to check
+ * all ready queues.
+ */
+static inline int dpa_virtq_db_poll()
+{
+	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
+	struct mlx5_cqe64 *cqe;
+	int n;
+
+	/* we can collapse doorbells and just pick up last avail index,
+	 * todo use 1 entry cq
+	 */
+	if (is_event_mode())
+		snap_dv_arm_cq(&rt_ctx->db_cq);
+
+	for (n = 0; n < SNAP_DPA_RT_THR_MULTI_DB_CQE_CNT; n++) {
+		cqe = snap_dv_poll_cq(&rt_ctx->db_cq, 64);
+		if (!cqe)
+			break;
 	}
-#endif
 
-	return msix_count;
+	return n;
 }
 
-static inline void dpa_virtq_msix_raise()
+/*
+ * Each vq heads or table message takes a credit of the thread channel.
+ * If there are no credits the queue is left pending and the rest of the
+ * heads are sent once DPU returns credits.
+ */
+static inline bool dpa_virtq_p2p_credit_get(struct dpa_virtq *vq)
 {
-	struct dpa_virtq *vq = get_vq();
+	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
 
-	dpa_virtq_msix_arm();
-	dpa_msix_send(vq->msix_cqnum);
-	vq->stats.n_msix_sent++;
+	if (snap_unlikely(rt_ctx->dpa_cmd_chan.credit_count <= 0)) {
+		vq->pending = 1;
+		vq->stats.n_no_credits++;
+		return false;
+	}
+
+	rt_ctx->dpa_cmd_chan.credit_count--;
+	return true;
 }
 
-static inline void virtq_progress()
+/* Return: number of p2p messages sent to DPU */
+static inline int virtq_progress_one(struct dpa_virtq *vq, int n_db)
 {
-	struct dpa_virtq *vq = get_vq();
 	struct dpa_rt_context *rt_ctx;
 	struct virtq_device_ring *avail_ring;
 	uint16_t delta, host_avail_idx;
-	struct mlx5_cqe64 *cqe;
-	int n, msix_count;
+	int n, n_msgs = 0;
 	//int cr_update;
 
 	if (vq->state != DPA_VIRTQ_STATE_RDY)
-		return;
+		return 0;
 
 	vq->stats.n_polls++;
 
 	rt_ctx = dpa_rt_ctx();
 
-	/* recv messages from DPU */
-	//cr_update = 0;
-
-	msix_count = dpa_virtq_msix_recv();
-	if (msix_count)
-		dpa_virtq_msix_raise();
+	/* msix requests are collected by dpa_virtq_p2p_recv() */
+	if (vq->msix_pending) {
+		vq->msix_pending = 0;
+		dpa_virtq_msix_raise(vq);
+	}
 #if 0
 	/* todo: fix credit logic */
 	if (cr_update) {
@@ -490,21 +605,7 @@ static inline void virtq_progress()
 		}
 	}
 #endif
-	/* we can collapse doorbells and just pick up last avail index,
-	 * todo use 1 entry cq
-	 */
-	if (is_event_mode())
-		snap_dv_arm_cq(&rt_ctx->db_cq);
-
-	for (n = 0; n < SNAP_DPA_RT_THR_SINGLE_DB_CQE_CNT; n++) {
-		cqe = snap_dv_poll_cq(&rt_ctx->db_cq, 64);
-		if (!cqe)
-			break;
-	}
-
-	if (n)
-		vq->stats.n_db_cqes += n;
-	else
+	if (!n_db)
 		vq->stats.n_db_empty++;
 
 	/**
@@ -516,11 +617,14 @@ static inline void virtq_progress()
 	 */
 	dpa_duar_arm(vq->duar_id, rt_ctx->db_cq.cq_num);
 
-	if (n == 0 && !vq->pending)
-		return;
+	if (n_db == 0 && !vq->pending)
+		return 0;
 
 	vq->pending = 0;
 
+	if (dpa_tcb()->active_lkey != vq->dpa_xmkey)
+		dpa_window_set_active_mkey(vq->dpa_xmkey);
+
 	/* note: this is going to disable db batching, optimize */
 	/* we don't need to arm tx cq at the moment because tx qp has
 	 * 2x vq size. It means that we can accomodate vq * (send_table + send_head)
@@ -556,7 +660,11 @@ static inline void virtq_progress()
 
 	/* todo: unlikely */
 	if (vq->hw_available_index == host_avail_idx)
-		return;
+		return 0;
+
+	/* doorbell cq is shared, only count doorbells of the queue that moved */
+	if (n_db)
+		vq->stats.n_db_cqes++;
 
 	delta = host_avail_idx - vq->hw_available_index;
 	/*
@@ -573,11 +681,14 @@ static inline void virtq_progress()
 		goto fatal_err;
 	}
 
+	if (!dpa_virtq_p2p_credit_get(vq))
+		return 0;
+
 	vq->stats.n_io_submited += delta;
 
 	if (snap_unlikely(delta < DPA_TABLE_THRESHOLD)) {
 		/* post send */
-		n = snap_dpa_p2p_send_vq_heads(&rt_ctx->dpa_cmd_chan, vq->common.idx,
+		n = snap_dpa_p2p_send_vq_heads(&rt_ctx->dpa_cmd_chan, vq->qid,
 				vq->common.size,
 				vq->hw_available_index, host_avail_idx, vq->common.driver,
 				vq->dpu_xmkey);
@@ -590,7 +701,7 @@ static inline void virtq_progress()
 		vq->stats.n_vq_heads++;
 	} else {
 		/* rdma_write 4k; post send */
-		n = snap_dpa_p2p_send_vq_table(&rt_ctx->dpa_cmd_chan, vq->common.idx,
+		n = snap_dpa_p2p_send_vq_table(&rt_ctx->dpa_cmd_chan, vq->qid,
 				vq->common.size,
 				vq->hw_available_index, host_avail_idx, vq->common.driver,
 				vq->dpu_xmkey,
@@ -605,19 +716,26 @@ static inline void virtq_progress()
 	}
 
 	vq->stats.n_sends++;
+	n_msgs++;
 
 	/* unroll, only 1 iteration is expected */
 	if (snap_unlikely(n != delta)) {
 again:
 		vq->hw_available_index += n;
+		if (!dpa_virtq_p2p_credit_get(vq)) {
+			/* the rest is counted when it is sent */
+			vq->stats.n_io_submited -= (uint16_t)(host_avail_idx - vq->hw_available_index);
+			return n_msgs;
+		}
+
 		if (delta < DPA_TABLE_THRESHOLD) {
-			n = snap_dpa_p2p_send_vq_heads(&rt_ctx->dpa_cmd_chan, vq->common.idx,
+			n = snap_dpa_p2p_send_vq_heads(&rt_ctx->dpa_cmd_chan, vq->qid,
 					vq->common.size,
 					vq->hw_available_index, host_avail_idx, vq->common.driver,
 					vq->dpu_xmkey);
 			vq->stats.n_vq_heads++;
 		} else {
-			n = snap_dpa_p2p_send_vq_table_cont(&rt_ctx->dpa_cmd_chan, vq->common.idx,
+			n = snap_dpa_p2p_send_vq_table_cont(&rt_ctx->dpa_cmd_chan, vq->qid,
 					vq->common.size,
 					vq->hw_available_index, host_avail_idx, vq->common.driver,
 					vq->dpu_xmkey);
@@ -634,6 +752,7 @@ again:
 
 		vq->stats.n_sends++;
 		vq->stats.n_long_sends++;
+		n_msgs++;
 
 		if ((uint16_t)(vq->hw_available_index + (uint16_t)n) != host_avail_idx) {
 			goto again;
@@ -642,31 +761,55 @@ again:
 
 	dpa_debug("===> send vq heads done %d\n", n);
 	vq->hw_available_index = host_avail_idx;
-
-	/* kick off doorbells, pickup completions */
-	rt_ctx->dpa_cmd_chan.dma_q->ops->progress_tx(rt_ctx->dpa_cmd_chan.dma_q, -1);
-	return;
+	return n_msgs;
 
 fatal_err:
 	/* todo: add logic */
 	dpa_virtq_error(vq, "FATAL processing error, disabling virtqueue\n");
 	vq->state = DPA_VIRTQ_STATE_ERR;
-	return;
+	return n_msgs;
+}
+
+static inline void virtq_progress()
+{
+	struct dpa_virtq_thread *thr = get_vq_thread();
+	struct dpa_rt_context *rt_ctx = dpa_rt_ctx();
+	int i, qid, n_db, n_msgs = 0;
+
+	dpa_virtq_p2p_recv();
+	n_db = dpa_virtq_db_poll();
+
+	/* rotate start queue so that a busy queue does not delay the rest */
+	for (i = 0; i < SNAP_DPA_VIRTQ_MAX_PER_THREAD; i++) {
+		qid = (thr->rr_next + i) % SNAP_DPA_VIRTQ_MAX_PER_THREAD;
+		n_msgs += virtq_progress_one(&thr->vqs[qid], n_db);
+	}
+	thr->rr_next = (thr->rr_next + 1) % SNAP_DPA_VIRTQ_MAX_PER_THREAD;
+
+	/* kick off doorbells, pickup completions */
+	if (n_msgs)
+		rt_ctx->dpa_cmd_chan.dma_q->ops->progress_tx(rt_ctx->dpa_cmd_chan.dma_q, -1);
 }
 
 int dpa_init()
 {
-	struct dpa_virtq *vq;
+	struct dpa_virtq_thread *thr;
+	int i;
 
 	dpa_rt_init();
 
-	vq = dpa_thread_alloc(sizeof(*vq));
-	if (vq != get_vq())
-		dpa_fatal("vq must follow rt context: vq@%p expected@%p\n", vq, get_vq());
+	thr = dpa_thread_alloc(sizeof(*thr));
+	if (thr != get_vq_thread())
+		dpa_fatal("vq table must follow rt context: vqs@%p expected@%p\n", thr, get_vq_thread());
 
-	vq->state = DPA_VIRTQ_STATE_ERR;
+	thr->rr_next = 0;
+	for (i = 0; i < SNAP_DPA_VIRTQ_MAX_PER_THREAD; i++) {
+		thr->vqs[i].qid = i;
+		thr->vqs[i].msix_pending = 0;
+		thr->vqs[i].state = DPA_VIRTQ_STATE_ERR;
+	}
 
-	dpa_debug("VirtQ init done! vq@%p\n", vq);
+	dpa_debug("VirtQ init done! vqs@%p\n", thr);
 	return 0;
 }
 
@@ -23,6 +23,7 @@ typedef void * cpu_set_t;
 typedef unsigned long size_t;
 
 typedef unsigned pthread_mutex_t;
+typedef unsigned pthread_spinlock_t;
 
 /* from sys/uio.h */
 
@@ -1,6 +1,8 @@
 #ifndef _SNAP_FS_OPS_H
 #define _SNAP_FS_OPS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/uio.h>
 
 /**
@@ -38,6 +40,12 @@ struct snap_fs_dev_io_done_ctx {
  * @handle_req:		pointer to function which handles fuse request
  * @dma_malloc: 	pointer to function which allocates host memory 
  * @dma_free: 		pointer to function which frees host memory
+ * @is_zcopy:		optional, pointer to function which returns true if fs
+ *			device supports ZCOPY
+ * @zcopy_validate_params: optional, pointer to function which returns true if
+ *			the payload of a FUSE_READ/FUSE_WRITE request can be
+ *			accessed by the fs device directly in host memory.
+ *			iov_base of each io vector holds the host address.
  *
  * operations provided by the fs backend device given to the virtio controller
  */
@@ -47,6 +55,9 @@ struct snap_fs_dev_ops {
 		          struct snap_fs_dev_io_done_ctx *done_ctx);
 	void *(*dma_malloc)(size_t size);
 	void (*dma_free)(void *buf);	
+	bool (*is_zcopy)(void *ctx);
+	bool (*zcopy_validate_params)(void *ctx, struct iovec *iov,
+				      size_t iov_cnt, uint64_t len);
 };
 
 #endif
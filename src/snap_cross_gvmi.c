@@ -3,6 +3,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "config.h"
 
 #include "mlx5_ifc.h"
@@ -222,107 +223,275 @@ static struct snap_alias_object * snap_create_alias_obj_wrap(struct snap_dpa_ctx
 	
 	int rv = -1; 
 	struct snap_alias_object *alias_obj = NULL;
-	if (snap_get_dev_vhca_id(dpa_ctx->pd->context) !=
-	    snap_get_dev_vhca_id(sf_ctx)) { 
+	uint8_t access_key[SNAP_ACCESS_KEY_LENGTH] = {0};
+	uint32_t access_key_be[ALIAS_ACCESS_KEY_NUM_DWORD] = {0};
 
-		uint8_t access_key[SNAP_ACCESS_KEY_LENGTH] = {0};
-		uint32_t access_key_be[ALIAS_ACCESS_KEY_NUM_DWORD] = {0};
-
-		if (!aliasable_obj->is_allowed) { 
-
-			generate_alias_access_key(aliasable_obj->id, aliasable_obj->access_key,
-							SNAP_ACCESS_KEY_LENGTH);
-			
-			for(int i=0; i<ALIAS_ACCESS_KEY_NUM_DWORD; i++) {
-				access_key_be[i] = htobe32(aliasable_obj->access_key[i]);
-			}
-			memcpy(access_key, access_key_be, SNAP_ACCESS_KEY_LENGTH);
-			rv = snap_allow_other_vhca_access(dpa_ctx->pd->context,
-					obj_type,
-					cross_type,
-					aliasable_obj->id,
-					access_key);
-			if (rv) { 
-				SNAP_LIB_LOG_ERR("Failed to allow cross vhca access");
-				goto out;
-			}
-			aliasable_obj->is_allowed = 1;
-		}
+	if (!aliasable_obj->is_allowed) { 
 
+		generate_alias_access_key(aliasable_obj->id, aliasable_obj->access_key,
+						SNAP_ACCESS_KEY_LENGTH);
+		
 		for(int i=0; i<ALIAS_ACCESS_KEY_NUM_DWORD; i++) {
 			access_key_be[i] = htobe32(aliasable_obj->access_key[i]);
 		}
 		memcpy(access_key, access_key_be, SNAP_ACCESS_KEY_LENGTH);
-		alias_obj = snap_create_alias_object(sf_ctx,
-								obj_type,
-								cross_type,
-								dpa_ctx->pd->context,					
-								aliasable_obj->id,
-								access_key);
-
-		if (!alias_obj) {
-			SNAP_LIB_LOG_ERR("Failed to create alias");
+		rv = snap_allow_other_vhca_access(dpa_ctx->pd->context,
+				obj_type,
+				cross_type,
+				aliasable_obj->id,
+				access_key);
+		if (rv) { 
+			SNAP_LIB_LOG_ERR("Failed to allow cross vhca access");
 			goto out;
 		}
+		aliasable_obj->is_allowed = 1;
+	}
 
+	for(int i=0; i<ALIAS_ACCESS_KEY_NUM_DWORD; i++) {
+		access_key_be[i] = htobe32(aliasable_obj->access_key[i]);
+	}
+	memcpy(access_key, access_key_be, SNAP_ACCESS_KEY_LENGTH);
+	alias_obj = snap_create_alias_object(sf_ctx,
+							obj_type,
+							cross_type,
+							dpa_ctx->pd->context,					
+							aliasable_obj->id,
+							access_key);
+
+	if (!alias_obj) {
+		SNAP_LIB_LOG_ERR("Failed to create alias");
+		goto out;
 	}
 
 out: 
 	return alias_obj;
 }
 
+static void snap_dpa_alias_ctx_free(struct snap_dpa_alias_ctx *actx)
+{
+	struct snap_dpa_thread_alias *talias;
+
+	LIST_REMOVE(actx, entry);
+	while ((talias = LIST_FIRST(&actx->threads))) {
+		LIST_REMOVE(talias, entry);
+		snap_destroy_alias_object(talias->alias);
+		free(talias);
+	}
+	if (actx->dumem)
+		snap_destroy_alias_object(actx->dumem);
+	if (actx->uar)
+		flexio_uar_destroy(actx->uar);
+	free(actx);
+}
+
+/*
+ * Find or create alias set of the @sf_ctx. Checking if aliases are needed
+ * costs two vhca queries, so the answer is cached together with the
+ * aliases. Must be called with the process res_lock held. A new set has no
+ * references and is dropped again if the caller fails to take one.
+ */
+static struct snap_dpa_alias_ctx *snap_dpa_alias_ctx_get(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx)
+{
+	struct snap_dpa_alias_ctx *actx;
+
+	LIST_FOREACH(actx, &dpa_ctx->alias_ctxs, entry) {
+		if (actx->ctx == sf_ctx)
+			return actx;
+	}
+
+	actx = calloc(1, sizeof(*actx));
+	if (!actx) {
+		SNAP_LIB_LOG_ERR("Failed to allocate dpa alias context");
+		return NULL;
+	}
+
+	actx->ctx = sf_ctx;
+	actx->cross_vhca = sf_ctx != dpa_ctx->pd->context &&
+			   snap_get_dev_vhca_id(dpa_ctx->pd->context) != snap_get_dev_vhca_id(sf_ctx);
+	LIST_INIT(&actx->threads);
+	LIST_INSERT_HEAD(&dpa_ctx->alias_ctxs, actx, entry);
+	return actx;
+}
+
 int snap_check_create_alias_dumem(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, uint32_t *umem_id) {
-	
+	struct snap_dpa_alias_ctx *actx;
 	int rv = -1; 
-	if (snap_get_dev_vhca_id(dpa_ctx->pd->context) !=
-	    snap_get_dev_vhca_id(sf_ctx)) { 
-		struct snap_alias_object *alias_obj = snap_create_alias_obj_wrap(dpa_ctx, sf_ctx, &dpa_ctx->dpa_proc->dumem, 
-									MLX5_OBJ_TYPE_DPA_DUMEM, CROSS_VHCA_OBJ_SUPPORT_UMEM);
-		if(!alias_obj) {
-			SNAP_LIB_LOG_ERR("Failed to create dumem alias\n");
-			goto out;
+
+	pthread_mutex_lock(&dpa_ctx->res_lock);
+	actx = snap_dpa_alias_ctx_get(dpa_ctx, sf_ctx);
+	if (!actx)
+		goto out;
+
+	if (actx->cross_vhca) { 
+		if (actx->dumem) {
+			dpa_ctx->stats.n_alias_hits++;
+		} else {
+			actx->dumem = snap_create_alias_obj_wrap(dpa_ctx, sf_ctx, &dpa_ctx->dpa_proc->dumem, 
+								 MLX5_OBJ_TYPE_DPA_DUMEM, CROSS_VHCA_OBJ_SUPPORT_UMEM);
+			if (!actx->dumem) {
+				SNAP_LIB_LOG_ERR("Failed to create dumem alias\n");
+				goto out;
+			}
 		}
-		*umem_id = alias_obj->obj_id;
+		*umem_id = actx->dumem->obj_id;
 	}
+	actx->refcnt++;
 	rv = 0;
 
 out: 
+	if (rv && actx && !actx->refcnt)
+		snap_dpa_alias_ctx_free(actx);
+	pthread_mutex_unlock(&dpa_ctx->res_lock);
 	return rv;
 }
 
 int snap_check_create_alias_thread(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, struct snap_dpa_thread *thread, uint32_t *thread_id) {
+	struct snap_dpa_alias_ctx *actx;
+	struct snap_dpa_thread_alias *talias;
 	int rv = -1; 
-	if (snap_get_dev_vhca_id(dpa_ctx->pd->context) !=
-	    snap_get_dev_vhca_id(sf_ctx)) { 
 
-		struct snap_alias_object *alias_obj = snap_create_alias_obj_wrap(dpa_ctx, sf_ctx, &thread->dpa_thread->thread->aliasable, 
-									MLX5_OBJ_TYPE_DPA_THREAD, CROSS_VHCA_OBJ_SUPPORT_DPA_THREAD);
-		if(!alias_obj) {
-			SNAP_LIB_LOG_ERR("Failed to create thread alias\n");
-			goto out;
+	pthread_mutex_lock(&dpa_ctx->res_lock);
+	actx = snap_dpa_alias_ctx_get(dpa_ctx, sf_ctx);
+	if (!actx)
+		goto out;
+
+	if (!actx->cross_vhca)
+		goto ref;
+
+	LIST_FOREACH(talias, &actx->threads, entry) {
+		if (talias->thread == thread) {
+			dpa_ctx->stats.n_alias_hits++;
+			*thread_id = talias->alias->obj_id;
+			goto ref;
 		}
-		*thread_id = alias_obj->obj_id;
-	
 	}
+
+	talias = calloc(1, sizeof(*talias));
+	if (!talias) {
+		SNAP_LIB_LOG_ERR("Failed to allocate thread alias\n");
+		goto out;
+	}
+
+	talias->alias = snap_create_alias_obj_wrap(dpa_ctx, sf_ctx, &thread->dpa_thread->thread->aliasable, 
+						   MLX5_OBJ_TYPE_DPA_THREAD, CROSS_VHCA_OBJ_SUPPORT_DPA_THREAD);
+	if (!talias->alias) {
+		SNAP_LIB_LOG_ERR("Failed to create thread alias\n");
+		free(talias);
+		goto out;
+	}
+	talias->thread = thread;
+	LIST_INSERT_HEAD(&actx->threads, talias, entry);
+	*thread_id = talias->alias->obj_id;
+ref:
+	actx->refcnt++;
 	rv = 0;
 
 out: 
+	if (rv && actx && !actx->refcnt)
+		snap_dpa_alias_ctx_free(actx);
+	pthread_mutex_unlock(&dpa_ctx->res_lock);
 	return rv;
 }
 
 int snap_check_create_alias_uar(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, uint32_t *uar_id) {
-
+	struct snap_dpa_alias_ctx *actx;
 	int rv = -1; 
-	if (snap_get_dev_vhca_id(dpa_ctx->pd->context) !=
-	    snap_get_dev_vhca_id(sf_ctx)) {
-		struct flexio_uar *alias_uar;
-		if (flexio_uar_extend(dpa_ctx->flexio_uar, sf_ctx, &alias_uar)) { 
+
+	pthread_mutex_lock(&dpa_ctx->res_lock);
+	actx = snap_dpa_alias_ctx_get(dpa_ctx, sf_ctx);
+	if (!actx)
+		goto out;
+
+	if (actx->cross_vhca) {
+		if (actx->uar) {
+			dpa_ctx->stats.n_alias_hits++;
+		} else if (flexio_uar_extend(dpa_ctx->flexio_uar, sf_ctx, &actx->uar)) { 
 			SNAP_LIB_LOG_ERR("Failed to extend uar \n");
+			actx->uar = NULL;
 			goto out;
 		}
-		*uar_id = flexio_uar_get_id(alias_uar);
+		*uar_id = flexio_uar_get_id(actx->uar);
 	}
+	actx->refcnt++;
 	rv = 0;
 out: 
+	if (rv && actx && !actx->refcnt)
+		snap_dpa_alias_ctx_free(actx);
+	pthread_mutex_unlock(&dpa_ctx->res_lock);
 	return rv;
-}
\ No newline at end of file
+}
+
+/**
+ * snap_dpa_alias_put() - release reference on the aliases of the context
+ * @dpa_ctx: DPA context
+ * @sf_ctx:  ibv context that was passed to snap_check_create_alias_*()
+ *
+ * Must be called once for every successful snap_check_create_alias_*() call,
+ * after the object that uses the alias is destroyed. The aliases of @sf_ctx
+ * are destroyed together with the last reference. This way a new ibv context
+ * that happens to reuse the address of the closed one never finds stale
+ * aliases.
+ */
+void snap_dpa_alias_put(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx)
+{
+	struct snap_dpa_alias_ctx *actx;
+
+	pthread_mutex_lock(&dpa_ctx->res_lock);
+	LIST_FOREACH(actx, &dpa_ctx->alias_ctxs, entry) {
+		if (actx->ctx == sf_ctx)
+			break;
+	}
+
+	if (!actx)
+		SNAP_LIB_LOG_ERR("%s: no aliases for context %p", dpa_ctx->app_name, sf_ctx);
+	else if (--actx->refcnt == 0)
+		snap_dpa_alias_ctx_free(actx);
+	pthread_mutex_unlock(&dpa_ctx->res_lock);
+}
+
+/**
+ * snap_dpa_thread_alias_destroy() - destroy cross gvmi aliases of the thread
+ * @thread: DPA thread
+ *
+ * Must be called before the thread is destroyed and after all objects that
+ * use the aliases are gone.
+ */
+void snap_dpa_thread_alias_destroy(struct snap_dpa_thread *thread)
+{
+	struct snap_dpa_ctx *dpa_ctx = thread->dctx;
+	struct snap_dpa_alias_ctx *actx;
+	struct snap_dpa_thread_alias *talias;
+
+	pthread_mutex_lock(&dpa_ctx->res_lock);
+	LIST_FOREACH(actx, &dpa_ctx->alias_ctxs, entry) {
+		/* thread has at most one alias per context */
+		LIST_FOREACH(talias, &actx->threads, entry) {
+			if (talias->thread == thread)
+				break;
+		}
+		if (!talias)
+			continue;
+		LIST_REMOVE(talias, entry);
+		snap_destroy_alias_object(talias->alias);
+		free(talias);
+	}
+	pthread_mutex_unlock(&dpa_ctx->res_lock);
+}
+
+/**
+ * snap_dpa_alias_cache_destroy() - destroy all cross gvmi aliases of the process
+ * @dpa_ctx: DPA context
+ *
+ * All references should have been dropped by now. Leftovers belong to
+ * objects that were not destroyed before the process.
+ */
+void snap_dpa_alias_cache_destroy(struct snap_dpa_ctx *dpa_ctx)
+{
+	struct snap_dpa_alias_ctx *actx;
+
+	while ((actx = LIST_FIRST(&dpa_ctx->alias_ctxs))) {
+		SNAP_LIB_LOG_ERR("%s: aliases for context %p are still in use, refcnt %d",
+				 dpa_ctx->app_name, actx->ctx, actx->refcnt);
+		snap_dpa_alias_ctx_free(actx);
+	}
+}
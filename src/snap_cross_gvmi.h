@@ -28,6 +28,30 @@ struct snap_alias_object {
 	uint8_t access_key[SNAP_ACCESS_KEY_LENGTH];
 };
 
+struct snap_dpa_thread_alias {
+	struct snap_dpa_thread *thread;
+	struct snap_alias_object *alias;
+	LIST_ENTRY(snap_dpa_thread_alias) entry;
+};
+
+/*
+ * DPA process objects as seen from another ibv context. Aliases are created
+ * on first use. Every successful snap_check_create_alias_*() call takes a
+ * reference that is dropped by snap_dpa_alias_put(). The aliases are
+ * destroyed with the last reference, so that the entry never outlives
+ * the objects created over @ctx.
+ */
+struct snap_dpa_alias_ctx {
+	struct ibv_context *ctx;
+	int refcnt;
+	/* false if ctx is on the process vhca and needs no aliases */
+	bool cross_vhca;
+	struct snap_alias_object *dumem;
+	struct flexio_uar *uar;
+	LIST_HEAD(snap_dpa_thread_alias_list, snap_dpa_thread_alias) threads;
+	LIST_ENTRY(snap_dpa_alias_ctx) entry;
+};
+
 uint16_t snap_get_dev_vhca_id(struct ibv_context *context);
 
 int snap_allow_other_vhca_access(struct ibv_context *context,
@@ -48,5 +72,8 @@ void snap_destroy_alias_object(struct snap_alias_object *obj);
 int snap_check_create_alias_uar(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, uint32_t *uar_id);
 int snap_check_create_alias_thread(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, struct snap_dpa_thread *thread, uint32_t *thread_id);
 int snap_check_create_alias_dumem(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx, uint32_t *umem_id);
+void snap_dpa_alias_put(struct snap_dpa_ctx *dpa_ctx, struct ibv_context *sf_ctx);
+void snap_dpa_thread_alias_destroy(struct snap_dpa_thread *thread);
+void snap_dpa_alias_cache_destroy(struct snap_dpa_ctx *dpa_ctx);
 
 #endif
\ No newline at end of file
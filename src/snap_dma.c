@@ -298,6 +298,10 @@ int snap_dma_q_writev2v(struct snap_dma_q *q,
  *	and is now in progress
  * \-EAGAIN
  *	queue does not have enough resources, must be retried later
+ * \-ENOTSUP
+ *	crypto is not enabled on the queue, see
+ *	&struct snap_dma_q_create_attr.crypto_enable. It is never enabled on
+ *	SNAP_DMA_Q_MODE_SW queues. Use plain read or write instead.
  * < 0
  *	some other error has occurred. Return value is -errno
  */
@@ -311,6 +315,9 @@ int snap_dma_q_writec(struct snap_dma_q *q, void *src_buf, uint32_t lkey,
 	struct iovec liov;
 	struct snap_dma_q_io_attr io_attr = {0};
 
+	if (snap_unlikely(!q->crypto_support))
+		return -ENOTSUP;
+
 	for (i = 0, len = 0; i < iov_cnt; i++) {
 		rkey[i] = rmkey;
 		len += iov[i].iov_len;
@@ -364,6 +371,10 @@ int snap_dma_q_writec(struct snap_dma_q *q, void *src_buf, uint32_t lkey,
  *	and is now in progress
  * \-EAGAIN
  *	queue does not have enough resources, must be retried later
+ * \-ENOTSUP
+ *	crypto is not enabled on the queue, see
+ *	&struct snap_dma_q_create_attr.crypto_enable. It is never enabled on
+ *	SNAP_DMA_Q_MODE_SW queues. Use plain read or write instead.
  * < 0
  *	some other error has occurred. Return value is -errno
  */
@@ -376,6 +387,9 @@ int snap_dma_q_writev2vc(struct snap_dma_q *q,
 	int i, rc, n_bb = 0;
 	uint32_t rkey[dst_iov_cnt];
 
+	if (snap_unlikely(!q->crypto_support))
+		return -ENOTSUP;
+
 	for (i = 0; i < dst_iov_cnt; i++)
 		rkey[i] = rmkey;
 
@@ -583,6 +597,10 @@ int snap_dma_q_readv2v(struct snap_dma_q *q, uint32_t *dst_mkey,
  *	and is now in progress
  * \-EAGAIN
  *	queue does not have enough resources, must be retried later
+ * \-ENOTSUP
+ *	crypto is not enabled on the queue, see
+ *	&struct snap_dma_q_create_attr.crypto_enable. It is never enabled on
+ *	SNAP_DMA_Q_MODE_SW queues. Use plain read or write instead.
  * < 0
  *	some other error has occurred. Return value is -errno
  */
@@ -596,6 +614,9 @@ int snap_dma_q_readc(struct snap_dma_q *q, void *dst_buf, uint32_t lkey,
 	struct iovec liov;
 	struct snap_dma_q_io_attr io_attr = {0};
 
+	if (snap_unlikely(!q->crypto_support))
+		return -ENOTSUP;
+
 	for (i = 0, len = 0; i < iov_cnt; i++) {
 		rkey[i] = rmkey;
 		len += iov[i].iov_len;
@@ -724,6 +745,9 @@ int snap_dma_q_send_completion(struct snap_dma_q *q, void *src_buf, size_t len)
 struct ibv_qp *snap_dma_q_get_fw_qp(struct snap_dma_q *q)
 {
 #if !defined(__DPA)
+	if (!q->fw_qp)
+		return NULL;
+
 	if (q->fw_qp->use_devx) {
 		assert_debug(q->fw_qp->fw_qp.qp->type == SNAP_OBJ_DEVX);
 		return &q->fw_qp->fake_verbs_qp;
@@ -735,6 +759,26 @@ struct ibv_qp *snap_dma_q_get_fw_qp(struct snap_dma_q *q)
 #endif
 }
 
+/**
+ * snap_dma_q_get_pd() - Get dma queue protection domain
+ * @q:   dma queue
+ *
+ * Not valid on the DPA
+ *
+ * Return: pd of the queue or NULL if the queue has no hw qp
+ */
+struct ibv_pd *snap_dma_q_get_pd(struct snap_dma_q *q)
+{
+#if !defined(__DPA)
+	if (!q || !q->sw_qp.qp)
+		return NULL;
+
+	return snap_qp_get_pd(q->sw_qp.qp);
+#else
+	return NULL;
+#endif
+}
+
 /**
  * snap_dma_q_send() - Send data segments (inline and memory pointer)
  * @q:       dma queue
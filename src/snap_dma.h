@@ -41,6 +41,7 @@
 
 struct snap_dma_q;
 struct snap_dma_completion;
+struct snap_dma_sw_qp;
 
 /**
  * typedef snap_dma_rx_cb_t - receive callback
@@ -162,34 +163,44 @@ enum snap_db_ring_flag {
 };
 
 struct snap_dv_qp {
+	/* hot: touched by every post and progress call */
 	struct snap_hw_qp hw_qp;
-	int n_outstanding;
-	uint32_t opaque_lkey;
-	uint32_t dpa_mkey;
 	struct snap_dv_dma_completion *comps;
+	struct mlx5_wqe_ctrl_seg *ctrl;
 	/* used to hold GGA data */
 	struct mlx5_dma_opaque     *opaque_buf;
-	struct ibv_mr              *opaque_mr;
+	int n_outstanding;
+	enum snap_db_ring_flag db_flag;
+	uint32_t opaque_lkey;
+	uint32_t dpa_mkey;
 	/* true if tx db is in the non cacheable memory */
 	bool tx_db_nc;
-	enum snap_db_ring_flag db_flag;
 	bool tx_need_ring_db;
-	struct mlx5_wqe_ctrl_seg *ctrl;
+
+	/* cold: stat is only updated when doorbell is rung */
+	struct ibv_mr              *opaque_mr;
 	struct snap_dv_qp_stat stat;
 };
 
+SNAP_STATIC_ASSERT(offsetof(struct snap_dv_qp, opaque_mr) <= 2 * SNAP_MLX5_L2_CACHE_SIZE,
+		"Oops snap_dv_qp hot fields do not fit into 2 cache lines");
+
 struct snap_dma_ibv_qp {
+	/* hot: rx buffer, cqs and hot part of the dv qp */
+	char           *rx_buf;
 	/* used when working in devx mode */
 	struct snap_hw_cq dv_tx_cq;
 	struct snap_hw_cq dv_rx_cq;
 	struct snap_dv_qp dv_qp;
 
+	/* cold */
 	struct snap_qp *qp;
 	struct snap_cq *tx_cq;
 	struct snap_cq *rx_cq;
 	struct ibv_mr  *rx_mr;
-	char           *rx_buf;
 	int            mode;
+	/* used when working in sw loopback mode */
+	struct snap_dma_sw_qp *sw;
 	struct {
 		struct snap_dpa_memh *rx_mr;
 		struct snap_dpa_mkeyh *mkey;
@@ -223,7 +234,8 @@ enum snap_dma_q_mode {
 	SNAP_DMA_Q_MODE_AUTOSELECT = 0,
 	SNAP_DMA_Q_MODE_VERBS = 1,
 	SNAP_DMA_Q_MODE_DV = 2,
-	SNAP_DMA_Q_MODE_GGA = 3
+	SNAP_DMA_Q_MODE_GGA = 3,
+	SNAP_DMA_Q_MODE_SW = 4
 };
 
 struct snap_dma_q_ops {
@@ -329,17 +341,21 @@ struct snap_dma_fw_qp {
  */
 struct snap_dma_q {
 	/* private: */
-	/* TODO: for dpa/ep we don't need all fields. Group all frequently used
-	 * fields so that they all fit into 2 cachelines
+	/* hot: fields used by the post and progress paths come first and
+	 * must stay within SNAP_DMA_Q_HOT_SIZE bytes. Queues are allocated
+	 * cache line aligned on both DPU and DPA, so the hot part takes
+	 * exactly SNAP_DMA_Q_HOT_SIZE / 64 cache lines.
 	 */
-	struct snap_dma_ibv_qp sw_qp;
+	const struct snap_dma_q_ops  *ops;
+	snap_dma_rx_cb_t       rx_cb;
+	struct snap_dma_worker *worker;
 	int                    tx_available;
-	int                    tx_qsize;
 	int                    tx_elem_size;
 	int                    rx_elem_size;
-	snap_dma_rx_cb_t       rx_cb;
+	struct snap_dma_ibv_qp sw_qp;
 
-	const struct snap_dma_q_ops  *ops;
+	/* cold: control path, iov, crypto and umr state */
+	int                    tx_qsize;
 
 	struct snap_dma_q_iov_ctx *iov_ctx;
 	struct snap_dma_q_crypto_ctx *crypto_ctx;
@@ -356,7 +372,6 @@ struct snap_dma_q {
 	SLIST_ENTRY(snap_dma_q) entry;
 
 	struct snap_dma_q_ops  *custom_ops;
-	struct snap_dma_worker *worker;
 
 	/* public: */
 	/** @uctx:  user supplied context */
@@ -376,6 +391,11 @@ struct snap_dma_q {
 	snap_dma_dv_err_cb_t dv_err_cb;
 };
 
+#define SNAP_DMA_Q_HOT_SIZE (4 * SNAP_MLX5_L2_CACHE_SIZE)
+
+SNAP_STATIC_ASSERT(offsetof(struct snap_dma_q, sw_qp.dv_qp.opaque_mr) <= SNAP_DMA_Q_HOT_SIZE,
+		"Oops snap_dma_q hot fields do not fit into SNAP_DMA_Q_HOT_SIZE");
+
 enum {
 	SNAP_DMA_Q_DPA_MODE_NONE = 0,
 	SNAP_DMA_Q_DPA_MODE_POLLING,
@@ -429,8 +449,13 @@ struct snap_dma_q_crypto_attr {
  *                 SNAP_DMA_Q_MODE_DV    - dv, direct hw access, faster than verbs
  *                 SNAP_DMA_Q_MODE_GGA   - dv, plus uses hw dma engine directly to
  *                                         do rdma read or write. Fastest, best bandwidth.
+ *                 SNAP_DMA_Q_MODE_SW    - sw loopback, no hw is used. Data is copied
+ *                                         with memcpy(), remote addresses are virtual
+ *                                         addresses in the process, keys are ignored.
+ *                                         Useful for testing and cpu profiling.
  *                Mode choice can be overridden at runtime by setting SNAP_DMA_Q_OPMODE
- *                environment variable: 0 - autoselect, 1 - verbs, 2 - dv, 3 - gga.
+ *                environment variable: 0 - autoselect, 1 - verbs, 2 - dv, 3 - gga,
+ *                4 - sw.
  * @rx_cb:        receive callback. See &typedef snap_dma_rx_cb_t
  * @iov_enable:   enable/disable this dma queue to use readv/writev API
  * @crypto_enable:enable/disable this dma queue to use crypto rw API
@@ -503,6 +528,13 @@ struct snap_dma_q_create_attr {
 	bool use_emu_dev_eqn;
 	uint32_t emu_dev_eqn;
 
+	/* uar pool slot of the thread that will ring the queue doorbells.
+	 * Worker queues default to the worker slot, other queues to the
+	 * slot of the creating thread.
+	 */
+	bool use_uar_slot;
+	int uar_slot;
+
 	struct snap_dma_q_crypto_attr crypto_attr;
 
 	bool 		use_aliases;
@@ -541,14 +573,20 @@ struct snap_dma_worker {
 	struct snap_cq *tx_cq;
 	enum snap_dma_worker_mode mode;
 	int max_queues;
+	/* uar pool slot of the worker queues, the worker id */
+	int uar_slot;
 
 	SLIST_HEAD(, snap_dma_q) pending_dbs;
+	/* shared cq poll hit/miss, updated only with SNAP_DMA_Q_STATS */
+	struct snap_dma_poll_counter rx_poll;
+	struct snap_dma_poll_counter tx_poll;
 	struct snap_dma_q *queues[0];
 };
 struct snap_dma_worker *snap_dma_worker_create(struct ibv_pd *pd,
 		const struct snap_dma_worker_create_attr *attr);
 void snap_dma_worker_destroy(struct snap_dma_worker *wk);
 int snap_dma_worker_flush(struct snap_dma_worker *wk);
+int snap_dma_worker_get_stat(const struct snap_dma_worker *wk, struct snap_dv_qp_stat *stat);
 
 /* progress receives, dma_q rx callbacks will be called */
 int snap_dma_worker_progress_rx(struct snap_dma_worker *wk);
@@ -599,6 +637,7 @@ int snap_dma_q_flush_nowait(struct snap_dma_q *q, struct snap_dma_completion *co
 bool snap_dma_q_empty(struct snap_dma_q *q);
 int snap_dma_q_arm(struct snap_dma_q *q);
 struct ibv_qp *snap_dma_q_get_fw_qp(struct snap_dma_q *q);
+struct ibv_pd *snap_dma_q_get_pd(struct snap_dma_q *q);
 struct snap_dma_q *snap_dma_ep_create(struct ibv_pd *pd,
 	const struct snap_dma_q_create_attr *attr);
 int snap_dma_ep_connect(struct snap_dma_q *q1, struct snap_dma_q *q2);
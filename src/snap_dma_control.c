@@ -136,12 +136,42 @@ static int check_port(struct ibv_context *ctx, int port_num, bool *roce_en,
 	return 0;
 }
 
+/**
+ * snap_dma_q_hist_create() - Allocate dma queue histograms
+ * @sq_wqe_cnt:  number of send queue wqe basic blocks
+ *
+ * Return: histograms or NULL if the library is built without
+ * SNAP_DMA_Q_STATS or on allocation failure. Missing histograms only
+ * disable stats collection for the queue.
+ */
+struct snap_dma_q_hist_stat *snap_dma_q_hist_create(int sq_wqe_cnt)
+{
+#if SNAP_DMA_Q_STATS
+	struct snap_dma_q_hist_stat *hist;
+
+	hist = calloc(1, sizeof(*hist) + sq_wqe_cnt * sizeof(hist->slots[0]));
+	if (!hist)
+		SNAP_LIB_LOG_WARN("Failed to allocate dma queue histograms, stats are disabled");
+	return hist;
+#else
+	return NULL;
+#endif
+}
+
+void snap_dma_q_hist_destroy(struct snap_dma_q_hist_stat *hist)
+{
+	free(hist);
+}
+
 static void snap_destroy_qp_helper(struct snap_dma_ibv_qp *qp, bool destroy_cqs)
 {
 	if (!snap_qp_on_dpa(qp->qp)) {
 		if (qp->dv_qp.comps)
 			free(qp->dv_qp.comps);
 
+		snap_dma_q_hist_destroy(qp->dv_qp.stat.hist);
+		qp->dv_qp.stat.hist = NULL;
+
 		if (qp->dv_qp.opaque_buf) {
 			ibv_dereg_mr(qp->dv_qp.opaque_mr);
 			free(qp->dv_qp.opaque_buf);
@@ -214,7 +244,9 @@ static int snap_create_qp_helper(struct ibv_pd *pd, const struct snap_dma_q_crea
 		.comp_channel = dma_q_attr->comp_channel,
 		.comp_vector = dma_q_attr->comp_vector,
 		.cqe_cnt = qp_init_attr->sq_size,
-		.cqe_size = SNAP_DMA_Q_TX_CQE_SIZE
+		.cqe_size = SNAP_DMA_Q_TX_CQE_SIZE,
+		.use_uar_slot = qp_init_attr->use_uar_slot,
+		.uar_slot = qp_init_attr->uar_slot
 	};
 	int rc;
 
@@ -335,6 +367,7 @@ static int snap_create_qp_helper(struct ibv_pd *pd, const struct snap_dma_q_crea
 
 		memset(qp->dv_qp.comps, 0,
 				qp->dv_qp.hw_qp.sq.wqe_cnt * sizeof(struct snap_dv_dma_completion));
+		qp->dv_qp.stat.hist = snap_dma_q_hist_create(qp->dv_qp.hw_qp.sq.wqe_cnt);
 	} else {
 		qp->dpa.mkey = snap_dpa_mkey_alloc(qp_init_attr->dpa_proc, pd);
 		if (!qp->dpa.mkey)
@@ -374,9 +407,11 @@ static int snap_create_qp_helper(struct ibv_pd *pd, const struct snap_dma_q_crea
 free_opaque:
 	free(qp->dv_qp.opaque_buf);
 free_comps:
-	if (!qp_init_attr->qp_on_dpa)
+	if (!qp_init_attr->qp_on_dpa) {
+		snap_dma_q_hist_destroy(qp->dv_qp.stat.hist);
+		qp->dv_qp.stat.hist = NULL;
 		free(qp->dv_qp.comps);
-	else
+	} else
 		snap_dpa_mkey_free(qp->dpa.mkey);
 free_qp:
 	snap_qp_destroy(qp->qp);
@@ -393,6 +428,11 @@ static void snap_destroy_sw_qp(struct snap_dma_q *q)
 {
 	bool destroy_cqs = true;
 
+	if (q->sw_qp.mode == SNAP_DMA_Q_MODE_SW) {
+		snap_dma_sw_qp_destroy(q);
+		return;
+	}
+
 	if (!snap_qp_on_dpa(q->sw_qp.qp))
 		snap_free_rx_wqes(&q->sw_qp);
 
@@ -660,6 +700,9 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 		qp_init_attr->sq_max_sge = 1;
 	qp_init_attr->rq_max_sge = 1;
 
+	qp_init_attr->use_uar_slot = attr->use_uar_slot;
+	qp_init_attr->uar_slot = attr->uar_slot;
+
 	if (attr->wk) {
 		qp_init_attr->rq_cq = attr->wk->rx_cq;
 		qp_init_attr->sq_cq = attr->wk->tx_cq;
@@ -667,6 +710,11 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 		qp_init_attr->qp_type = SNAP_OBJ_DEVX;
 		qp_init_attr->uidx = snap_dma_worker_queue_idx_get(attr->wk, q);
 		qp_init_attr->qp_on_dpa = false;
+		if (!attr->use_uar_slot) {
+			/* doorbells are rung by the worker thread */
+			qp_init_attr->use_uar_slot = true;
+			qp_init_attr->uar_slot = attr->wk->uar_slot;
+		}
 		q->no_events = true;
 	}
 
@@ -713,6 +761,9 @@ static int snap_create_sw_qp(struct snap_dma_q *q, struct ibv_pd *pd,
 	struct snap_qp_attr qp_init_attr = {0};
 	int rc;
 
+	if (attr->mode == SNAP_DMA_Q_MODE_SW)
+		return snap_dma_sw_qp_create(q, attr);
+
 	rc = snap_qp_attr_helper(q, pd, attr, &qp_init_attr);
 	if (rc)
 		return rc;
@@ -1599,6 +1650,9 @@ int snap_dma_ep_connect(struct snap_dma_q *q1, struct snap_dma_q *q2)
 	if (!q1 || !q2)
 		return -1;
 
+	if (q1->sw_qp.mode == SNAP_DMA_Q_MODE_SW)
+		return snap_dma_sw_qp_connect(q1, q2);
+
 	pd = snap_qp_get_pd(q1->sw_qp.qp);
 	if (!pd)
 		return -1;
@@ -1650,12 +1704,24 @@ int snap_dma_ep_connect_remote_qpn(struct snap_dma_q *q1, int remote_qpn)
 	return 0;
 }
 
+/* hot fields of the queue are packed into the first SNAP_DMA_Q_HOT_SIZE bytes */
+static struct snap_dma_q *snap_dma_q_alloc(void)
+{
+	struct snap_dma_q *q;
+
+	if (posix_memalign((void **)&q, SNAP_MLX5_L2_CACHE_SIZE, sizeof(*q)))
+		return NULL;
+
+	memset(q, 0, sizeof(*q));
+	return q;
+}
+
 static struct snap_dma_q *snap_dma_worker_queue_get(struct snap_dma_worker *wk)
 {
 	int idx;
 	struct snap_dma_q *q;
 
-	q = calloc(1, sizeof(*q));
+	q = snap_dma_q_alloc();
 	if (!q)
 		return NULL;
 	for (idx = 0; idx < wk->max_queues; idx++)
@@ -1689,6 +1755,8 @@ static void snap_dma_worker_queue_put(struct snap_dma_q *q)
  * If the endpoint is created on DPA, dpa_dma_ep_init() must be called by a
  * DPA thread to complete initialization.
  *
+ * In the SNAP_DMA_Q_MODE_SW mode @pd is not used and may be NULL.
+ *
  * Return: dma queue or NULL on error.
  */
 struct snap_dma_q *snap_dma_ep_create(struct ibv_pd *pd,
@@ -1697,14 +1765,14 @@ struct snap_dma_q *snap_dma_ep_create(struct ibv_pd *pd,
 	int rc;
 	struct snap_dma_q *q;
 
-	if (!pd)
+	if (!pd && attr->mode != SNAP_DMA_Q_MODE_SW)
 		return NULL;
 
 	if (!attr->rx_cb)
 		return NULL;
 
 	if (!attr->wk)
-		q = calloc(1, sizeof(*q));
+		q = snap_dma_q_alloc();
 	else
 		q = snap_dma_worker_queue_get(attr->wk);
 	if (!q)
@@ -1754,6 +1822,9 @@ free_q:
  *
  * All these steps must be done by the application.
  *
+ * In the SNAP_DMA_Q_MODE_SW mode there is no fw qp and the queue is not
+ * connected. It can only be used for the rdma read and write operations.
+ *
  * Return: dma queue or NULL on error.
  */
 struct snap_dma_q *snap_dma_q_create(struct ibv_pd *pd,
@@ -1766,6 +1837,9 @@ struct snap_dma_q *snap_dma_q_create(struct ibv_pd *pd,
 	if (!q)
 		return NULL;
 
+	if (q->sw_qp.mode == SNAP_DMA_Q_MODE_SW)
+		return q;
+
 	rc = snap_create_fw_qp(q, pd, attr);
 	if (rc)
 		goto free_sw_qp;
@@ -1913,7 +1987,9 @@ struct snap_dma_worker *snap_dma_worker_create(struct ibv_pd *pd,
 		.comp_vector = 0,
 		.cqe_cnt = attr->exp_queue_num * attr->exp_queue_rx_size,
 		.cqe_size = SNAP_DMA_Q_TX_CQE_SIZE,
-		.cq_type = SNAP_OBJ_DEVX
+		.cq_type = SNAP_OBJ_DEVX,
+		.use_uar_slot = true,
+		.uar_slot = attr->id
 	};
 
 	if (!wk)
@@ -1921,6 +1997,7 @@ struct snap_dma_worker *snap_dma_worker_create(struct ibv_pd *pd,
 
 	wk->max_queues = attr->exp_queue_num;
 	wk->mode = attr->mode;
+	wk->uar_slot = attr->id;
 	SLIST_INIT(&wk->pending_dbs);
 
 	snap_create_worker_cqs_helper(wk, pd, &cq_attr);
@@ -1954,6 +2031,59 @@ int snap_dma_worker_progress_tx(struct snap_dma_worker *wk)
 	return dv_worker_progress_tx(wk);
 }
 
+/**
+ * snap_dma_worker_get_stat() - Get aggregated worker statistics
+ * @wk:    dma worker
+ * @stat:  statistics to fill
+ *
+ * The function sums doorbell and completion counters of all queues served
+ * by the worker. If @stat->hist is not NULL, queue histograms are merged
+ * into it. Worker cqs are shared, so cq poll hit/miss counters are taken
+ * from the worker itself. Histograms are only collected if the library is
+ * built with SNAP_DMA_Q_STATS.
+ *
+ * Return: 0 on success, -EINVAL if @wk or @stat are NULL
+ */
+int snap_dma_worker_get_stat(const struct snap_dma_worker *wk, struct snap_dv_qp_stat *stat)
+{
+	struct snap_dma_q_hist_stat *hist;
+	const struct snap_dv_qp_stat *qs;
+	int i, op;
+
+	if (!wk || !stat)
+		return -EINVAL;
+
+	hist = stat->hist;
+	memset(stat, 0, sizeof(*stat));
+	stat->hist = hist;
+	if (hist) {
+		memset(hist, 0, sizeof(*hist));
+		hist->rx_poll = wk->rx_poll;
+		hist->tx_poll = wk->tx_poll;
+	}
+
+	for (i = 0; i < wk->max_queues; i++) {
+		if (!wk->queues[i])
+			continue;
+
+		qs = &wk->queues[i]->sw_qp.dv_qp.stat;
+		stat->rx.total_dbs += qs->rx.total_dbs;
+		stat->rx.total_completed += qs->rx.total_completed;
+		stat->tx.total_dbs += qs->tx.total_dbs;
+		stat->tx.total_completed += qs->tx.total_completed;
+
+		if (!hist || !qs->hist)
+			continue;
+
+		for (op = 0; op < SNAP_DMA_STAT_OP_MAX; op++)
+			snap_dma_hist_merge(&hist->latency[op], &qs->hist->latency[op]);
+		snap_dma_hist_merge(&hist->tx_occupancy, &qs->hist->tx_occupancy);
+		snap_dma_hist_merge(&hist->wqes_per_db, &qs->hist->wqes_per_db);
+	}
+
+	return 0;
+}
+
 void snap_dma_q_dv_err_cb_set(struct snap_dma_q *q, snap_dma_dv_err_cb_t cb)
 {
 	q->dv_err_cb = cb;
@@ -756,6 +756,7 @@ static inline struct snap_dma_completion *dv_dma_q_get_comp(struct snap_dma_q *q
 	sq_mask = dv_qp->hw_qp.sq.wqe_cnt - 1;
 	comp_idx = be16toh(cqe->wqe_counter) & sq_mask;
 	q->tx_available += dv_qp->comps[comp_idx].n_outstanding;
+	snap_dv_stat_comp(dv_qp, comp_idx);
 
 	if ((cqe->op_own & MLX5_INLINE_SCATTER_32) && dv_qp->comps[comp_idx].read_payload) {
 		memcpy(dv_qp->comps[comp_idx].read_payload, (void *)cqe, be32toh(cqe->byte_cnt));
@@ -820,6 +821,7 @@ static inline int dv_dma_q_progress_tx(struct snap_dma_q *q, int max_tx_comp)
 out:
 	snap_dv_tx_complete(dv_qp);
 	dv_qp->stat.tx.total_completed += n;
+	snap_dv_stat_poll_tx(dv_qp, n);
 	return n;
 }
 
@@ -883,6 +885,7 @@ static inline int dv_dma_q_progress_rx(struct snap_dma_q *q)
 	for (i = 0; i < n; i++)
 		q->rx_cb(q, rx_comp[i].data, rx_comp[i].byte_len, rx_comp[i].imm_data);
 
+	snap_dv_stat_poll_rx(&q->sw_qp.dv_qp, n);
 	if (n == 0)
 		return 0;
 
@@ -916,6 +919,7 @@ static inline int dv_dma_q_poll_rx(struct snap_dma_q *q,
 		n++;
 	} while (n < max_completions);
 
+	snap_dv_stat_poll_rx(&q->sw_qp.dv_qp, n);
 	if (n == 0)
 		return 0;
 
@@ -951,6 +955,7 @@ static inline int dv_dma_q_poll_tx(struct snap_dma_q *q, struct snap_dma_complet
 
 	} while (n < max_completions);
 
+	snap_dv_stat_poll_tx(dv_qp, n);
 	return n;
 }
 
@@ -1049,7 +1054,8 @@ __attribute__((unused)) static void dump_gga_wqe(int op, uint32_t *wqe)
 
 static inline int do_gga_dma_xfer(struct snap_dma_q *q, uint64_t saddr, size_t len,
 			      uint32_t s_lkey, uint64_t daddr, uint32_t d_lkey,
-			      struct snap_dma_completion *comp, bool use_fence)
+			      struct snap_dma_completion *comp, bool use_fence,
+			      enum snap_dma_stat_op op)
 {
 	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
 	struct mlx5_dma_wqe *gga_wqe;
@@ -1083,6 +1089,7 @@ static inline int do_gga_dma_xfer(struct snap_dma_q *q, uint64_t saddr, size_t l
 	mlx5dv_set_data_seg(&gga_wqe->scatter, len, d_lkey, daddr);
 
 	snap_dv_wqe_submit(dv_qp, ctrl);
+	snap_dv_stat_set_op(dv_qp, comp_idx, op);
 
 	snap_dv_set_comp(dv_qp, comp_idx, comp, fm_ce_se, 1);
 	return 0;
@@ -1093,7 +1100,7 @@ static int gga_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
 			  struct snap_dma_completion *comp)
 {
 	return do_gga_dma_xfer(q, (uint64_t)src_buf, len, lkey,
-			dstaddr, rmkey, comp, false);
+			dstaddr, rmkey, comp, false, SNAP_DMA_STAT_OP_WRITE);
 }
 
 static int gga_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
@@ -1101,7 +1108,7 @@ static int gga_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
 			 struct snap_dma_completion *comp)
 {
 	return do_gga_dma_xfer(q, srcaddr, len, rmkey,
-			(uint64_t)dst_buf, lkey, comp, false);
+			(uint64_t)dst_buf, lkey, comp, false, SNAP_DMA_STAT_OP_READ);
 }
 
 static int gga_dma_q_writec(struct snap_dma_q *q,
@@ -1179,6 +1186,7 @@ int dv_worker_progress_rx(struct snap_dma_worker *wk)
 		n++;
 	} while (n < SNAP_DMA_MAX_RX_COMPLETIONS);
 
+	snap_dma_poll_stat(&wk->rx_poll, n);
 	/* Return from here as it will save from unnecessary load / store fence */
 	if (n == 0)
 		return n;
@@ -1243,6 +1251,7 @@ int dv_worker_progress_tx(struct snap_dma_worker *wk)
 		n++;
 	} while (n < SNAP_DMA_MAX_TX_COMPLETIONS);
 
+	snap_dma_poll_stat(&wk->tx_poll, n);
 	for (i = 0; i < n; i++) {
 		if (comp[i] && --comp[i]->count == 0)
 			comp[i]->func(comp[i], mlx5dv_get_cqe_opcode(cqe[i]));
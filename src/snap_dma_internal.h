@@ -114,6 +114,117 @@ snap_set_ctrl_seg(struct mlx5_wqe_ctrl_seg *ctrl, uint16_t pi,
 			fm_ce_se, ds, signature, imm);
 }
 
+struct snap_dma_q_hist_stat *snap_dma_q_hist_create(int sq_wqe_cnt);
+void snap_dma_q_hist_destroy(struct snap_dma_q_hist_stat *hist);
+
+#if SNAP_DMA_Q_STATS
+static inline enum snap_dma_stat_op snap_dv_stat_op(uint8_t opcode)
+{
+	switch (opcode) {
+	case MLX5_OPCODE_RDMA_READ:
+		return SNAP_DMA_STAT_OP_READ;
+	case MLX5_OPCODE_RDMA_WRITE:
+	case MLX5_OPCODE_RDMA_WRITE_IMM:
+		return SNAP_DMA_STAT_OP_WRITE;
+	case MLX5_OPCODE_SEND:
+	case MLX5_OPCODE_SEND_IMM:
+		return SNAP_DMA_STAT_OP_SEND;
+	case MLX5_OPCODE_UMR:
+		return SNAP_DMA_STAT_OP_UMR;
+	default:
+		return SNAP_DMA_STAT_OP_OTHER;
+	}
+}
+#endif
+
+static inline void snap_dv_stat_post(struct snap_dv_qp *dv_qp, uint16_t comp_idx,
+				     enum snap_dma_stat_op op, bool signaled)
+{
+#if SNAP_DMA_Q_STATS
+	struct snap_dma_q *q = container_of(dv_qp, struct snap_dma_q, sw_qp.dv_qp);
+	struct snap_dma_q_hist_stat *h = dv_qp->stat.hist;
+
+	if (snap_unlikely(!h))
+		return;
+
+	h->wqes_pending_db++;
+	snap_dma_hist_add(&h->tx_occupancy, q->tx_qsize - q->tx_available);
+	if (!signaled)
+		return;
+
+	h->slots[comp_idx].op = op;
+	h->slots[comp_idx].post_ts = snap_dma_stat_now();
+#endif
+}
+
+static inline void snap_dv_stat_post_wqe(struct snap_dv_qp *dv_qp, struct mlx5_wqe_ctrl_seg *ctrl)
+{
+#if SNAP_DMA_Q_STATS
+	uint32_t opmod_idx_opcode = be32toh(ctrl->opmod_idx_opcode);
+
+	snap_dv_stat_post(dv_qp, (opmod_idx_opcode >> 8) & (dv_qp->hw_qp.sq.wqe_cnt - 1),
+			  snap_dv_stat_op(opmod_idx_opcode & 0xff),
+			  ctrl->fm_ce_se & MLX5_WQE_CTRL_CQ_UPDATE);
+#endif
+}
+
+/* GGA wqes use MMO opcode for both directions, caller knows the real one */
+static inline void snap_dv_stat_set_op(struct snap_dv_qp *dv_qp, uint16_t comp_idx,
+				       enum snap_dma_stat_op op)
+{
+#if SNAP_DMA_Q_STATS
+	if (dv_qp->stat.hist)
+		dv_qp->stat.hist->slots[comp_idx].op = op;
+#endif
+}
+
+static inline void snap_dv_stat_comp(struct snap_dv_qp *dv_qp, uint16_t comp_idx)
+{
+#if SNAP_DMA_Q_STATS
+	struct snap_dma_q_hist_stat *h = dv_qp->stat.hist;
+	struct snap_dma_stat_slot *slot;
+
+	if (snap_unlikely(!h))
+		return;
+
+	slot = &h->slots[comp_idx];
+	if (!slot->post_ts)
+		return;
+
+	snap_dma_hist_add(&h->latency[slot->op], snap_dma_stat_now() - slot->post_ts);
+	slot->post_ts = 0;
+#endif
+}
+
+static inline void snap_dv_stat_db(struct snap_dv_qp *dv_qp)
+{
+#if SNAP_DMA_Q_STATS
+	struct snap_dma_q_hist_stat *h = dv_qp->stat.hist;
+
+	if (snap_unlikely(!h))
+		return;
+
+	snap_dma_hist_add(&h->wqes_per_db, h->wqes_pending_db);
+	h->wqes_pending_db = 0;
+#endif
+}
+
+static inline void snap_dv_stat_poll_tx(struct snap_dv_qp *dv_qp, int n)
+{
+#if SNAP_DMA_Q_STATS
+	if (dv_qp->stat.hist)
+		snap_dma_poll_stat(&dv_qp->stat.hist->tx_poll, n);
+#endif
+}
+
+static inline void snap_dv_stat_poll_rx(struct snap_dv_qp *dv_qp, int n)
+{
+#if SNAP_DMA_Q_STATS
+	if (dv_qp->stat.hist)
+		snap_dma_poll_stat(&dv_qp->stat.hist->rx_poll, n);
+#endif
+}
+
 static inline void snap_dv_update_tx_db(struct snap_dv_qp *dv_qp)
 {
 	/*
@@ -128,6 +239,7 @@ static inline void snap_dv_flush_tx_db(struct snap_dv_qp *dv_qp, struct mlx5_wqe
 {
 	*(uint64_t *)(dv_qp->hw_qp.sq.bf_addr) = *(uint64_t *)ctrl;
 	++dv_qp->stat.tx.total_dbs;
+	snap_dv_stat_db(dv_qp);
 }
 
 static inline void snap_dv_ring_tx_db(struct snap_dv_qp *dv_qp, struct mlx5_wqe_ctrl_seg *ctrl)
@@ -211,6 +323,7 @@ static inline void snap_dv_set_comp(struct snap_dv_qp *dv_qp, uint16_t pi,
 
 static inline void snap_dv_wqe_submit(struct snap_dv_qp *dv_qp, struct mlx5_wqe_ctrl_seg *ctrl)
 {
+	snap_dv_stat_post_wqe(dv_qp, ctrl);
 	dv_qp->hw_qp.sq.pi++;
 	if (dv_qp->db_flag == SNAP_DB_RING_BATCH) {
 		struct snap_dma_q *q = container_of(dv_qp, struct snap_dma_q, sw_qp.dv_qp);
@@ -276,6 +389,11 @@ int dv_worker_flush(struct snap_dma_worker *wk);
 extern const struct snap_dma_q_ops verb_ops;
 extern const struct snap_dma_q_ops dv_ops;
 extern const struct snap_dma_q_ops gga_ops;
+extern const struct snap_dma_q_ops sw_ops;
+
+int snap_dma_sw_qp_create(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr);
+void snap_dma_sw_qp_destroy(struct snap_dma_q *q);
+int snap_dma_sw_qp_connect(struct snap_dma_q *q1, struct snap_dma_q *q2);
 
 static inline struct mlx5_cqe64 *snap_dv_get_cqe(struct snap_hw_cq *dv_cq, int cqe_size)
 {
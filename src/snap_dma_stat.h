@@ -15,6 +15,68 @@
 
 #include <stdint.h>
 
+/*
+ * Latency/occupancy histograms are collected only when the library is
+ * built with SNAP_DMA_Q_STATS=1 (--enable-dma-stats). Collection adds a
+ * clock read on every signaled post and on every tx completion. Histograms
+ * live outside of the queue so that the queue layout shared with DPA does
+ * not depend on the build option. Not supported on DPA.
+ */
+#if !defined(SNAP_DMA_Q_STATS) || __DPA
+#undef SNAP_DMA_Q_STATS
+#define SNAP_DMA_Q_STATS 0
+#endif
+
+#if SNAP_DMA_Q_STATS
+#include <time.h>
+#endif
+
+#define SNAP_DMA_HIST_NBUCKETS 32
+
+enum snap_dma_stat_op {
+	SNAP_DMA_STAT_OP_READ,
+	SNAP_DMA_STAT_OP_WRITE,
+	SNAP_DMA_STAT_OP_SEND,
+	SNAP_DMA_STAT_OP_UMR,
+	SNAP_DMA_STAT_OP_OTHER,
+	SNAP_DMA_STAT_OP_MAX
+};
+
+/*
+ * log2 histogram: bucket 0 counts zero values, bucket i counts values
+ * in [2^(i-1), 2^i). The last bucket also counts everything above.
+ */
+struct snap_dma_hist {
+	uint64_t buckets[SNAP_DMA_HIST_NBUCKETS];
+};
+
+struct snap_dma_poll_counter {
+	// polls that returned at least one completion
+	uint64_t hit;
+	// polls that returned nothing
+	uint64_t miss;
+};
+
+struct snap_dma_stat_slot {
+	uint64_t post_ts;
+	enum snap_dma_stat_op op;
+};
+
+struct snap_dma_q_hist_stat {
+	// post to completion latency in ns, signaled wqes only
+	struct snap_dma_hist latency[SNAP_DMA_STAT_OP_MAX];
+	// tx ring occupancy in wqe basic blocks, sampled on each post
+	struct snap_dma_hist tx_occupancy;
+	// number of wqes covered by a single tx doorbell
+	struct snap_dma_hist wqes_per_db;
+	struct snap_dma_poll_counter rx_poll;
+	struct snap_dma_poll_counter tx_poll;
+
+	/* private: per send queue slot post bookkeeping */
+	int wqes_pending_db;
+	struct snap_dma_stat_slot slots[0];
+};
+
 struct snap_dv_qp_db_counter {
 	// total doorbels
 	uint64_t total_dbs;
@@ -25,7 +87,44 @@ struct snap_dv_qp_db_counter {
 struct snap_dv_qp_stat {
 	struct snap_dv_qp_db_counter rx;
 	struct snap_dv_qp_db_counter tx;
+	// NULL unless built with SNAP_DMA_Q_STATS
+	struct snap_dma_q_hist_stat *hist;
 };
 
+static inline void snap_dma_hist_merge(struct snap_dma_hist *dst, const struct snap_dma_hist *src)
+{
+	int i;
+
+	for (i = 0; i < SNAP_DMA_HIST_NBUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+#if SNAP_DMA_Q_STATS
+static inline uint64_t snap_dma_stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void snap_dma_hist_add(struct snap_dma_hist *h, uint64_t val)
+{
+	int b = val ? 64 - __builtin_clzll(val) : 0;
+
+	h->buckets[b < SNAP_DMA_HIST_NBUCKETS ? b : SNAP_DMA_HIST_NBUCKETS - 1]++;
+}
+#endif
+
+static inline void snap_dma_poll_stat(struct snap_dma_poll_counter *c, int n)
+{
+#if SNAP_DMA_Q_STATS
+	if (n)
+		c->hit++;
+	else
+		c->miss++;
+#endif
+}
+
 #endif
 
@@ -0,0 +1,684 @@
+/*
+ * Copyright © 2021 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "snap_dma_internal.h"
+#include "snap_env.h"
+
+#include "config.h"
+
+/*
+ * SW loopback implementation
+ *
+ * The queue never touches the hardware. Data is moved by memcpy() when
+ * the operation is posted. Remote addresses are treated as virtual addresses
+ * in the process address space and memory keys are ignored.
+ *
+ * Completions are reported from the progress and poll functions the same
+ * way the DV queue does it:
+ *  - tx credits (tx_available) are consumed per building block
+ *  - only signaled operations generate a 'cqe', unsignaled operations are
+ *    moderated by the SNAP_DMA_Q_TX_MOD_COUNT
+ *  - in the batch doorbell mode 'cqes' become visible only after the
+ *    doorbell is rung
+ * Thus upper layers see the same flow control as with the real hardware and
+ * the CPU cost of the emulation layer can be measured on any machine.
+ *
+ * Send operations are delivered to the rx ring of the connected sw queue.
+ * See snap_dma_ep_connect(). If the queue is not connected, sent data is
+ * discarded.
+ *
+ * Rdma read or write of a remote address in the first page is treated as
+ * a NULL pointer access. It is not executed and completes with the remote
+ * access error, so that error handling of the upper layers can be tested.
+ * The local buffer of the failed read is filled with 0xff because its content
+ * is undefined with the hardware. Unlike the hardware, the queue is not moved
+ * to the error state and can be used afterwards.
+ */
+
+struct snap_dma_sw_rx_desc {
+	uint32_t byte_len;
+	uint32_t imm_data;
+};
+
+struct snap_dma_sw_cqe {
+	uint16_t comp_idx;
+	uint8_t status;
+};
+
+struct snap_dma_sw_qp {
+	/* each 'cqe' holds index of the signaled wqe and its status */
+	struct snap_dma_sw_cqe *tx_cq;
+	uint32_t tx_cq_pi;
+	uint32_t tx_cq_ci;
+	/* 'cqes' up to this index were 'seen' by the doorbell */
+	uint32_t tx_cq_db;
+
+	/* rx ring, filled by the peer */
+	struct snap_dma_sw_rx_desc *rx_descs;
+	uint32_t rx_pi;
+	uint32_t rx_ci;
+
+	struct snap_dma_q *peer;
+};
+
+static inline void sw_ring_tx_db(struct snap_dma_q *q)
+{
+	q->sw_qp.sw->tx_cq_db = q->sw_qp.sw->tx_cq_pi;
+	++q->sw_qp.dv_qp.stat.tx.total_dbs;
+	snap_dv_stat_db(&q->sw_qp.dv_qp);
+}
+
+static inline void sw_tx_complete(struct snap_dma_q *q)
+{
+	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
+
+	if (dv_qp->tx_need_ring_db) {
+		dv_qp->tx_need_ring_db = false;
+		sw_ring_tx_db(q);
+	}
+}
+
+static inline void __sw_dma_q_submit(struct snap_dma_q *q, int n_bb,
+				     uint8_t fm_ce_se,
+				     struct snap_dma_completion *comp,
+				     uint8_t status)
+{
+	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	uint32_t sq_mask = dv_qp->hw_qp.sq.wqe_cnt - 1;
+	struct snap_dma_sw_cqe *cqe;
+	uint16_t comp_idx;
+
+	/* errors are always reported, as with the hardware */
+	if (snap_unlikely(status))
+		fm_ce_se |= MLX5_WQE_CTRL_CQ_UPDATE;
+
+	comp_idx = dv_qp->hw_qp.sq.pi & sq_mask;
+	snap_dv_set_comp(dv_qp, comp_idx, comp, fm_ce_se, n_bb);
+	/* sw wqes carry no opcode, account them all as other */
+	snap_dv_stat_post(dv_qp, comp_idx, SNAP_DMA_STAT_OP_OTHER,
+			  fm_ce_se & MLX5_WQE_CTRL_CQ_UPDATE);
+	if (fm_ce_se & MLX5_WQE_CTRL_CQ_UPDATE) {
+		cqe = &sw->tx_cq[sw->tx_cq_pi++ & sq_mask];
+		cqe->comp_idx = comp_idx;
+		cqe->status = status;
+	}
+
+	dv_qp->hw_qp.sq.pi += n_bb;
+	if (dv_qp->db_flag == SNAP_DB_RING_BATCH) {
+		dv_qp->tx_need_ring_db = true;
+		return;
+	}
+	sw_ring_tx_db(q);
+}
+
+static inline void sw_dma_q_submit(struct snap_dma_q *q, int n_bb,
+				   uint8_t fm_ce_se,
+				   struct snap_dma_completion *comp)
+{
+	__sw_dma_q_submit(q, n_bb, fm_ce_se, comp, 0);
+}
+
+#define SW_DMA_Q_NULL_PAGE_SIZE 4096
+
+static inline uint8_t sw_dma_q_rdma_write(void *dst, const void *src, size_t len)
+{
+	if (snap_unlikely((uintptr_t)dst < SW_DMA_Q_NULL_PAGE_SIZE))
+		return MLX5_CQE_SYNDROME_REMOTE_ACCESS_ERR;
+
+	memcpy(dst, src, len);
+	return 0;
+}
+
+static inline uint8_t sw_dma_q_rdma_read(void *dst, const void *src, size_t len)
+{
+	if (snap_unlikely((uintptr_t)src < SW_DMA_Q_NULL_PAGE_SIZE)) {
+		memset(dst, 0xff, len);
+		return MLX5_CQE_SYNDROME_REMOTE_ACCESS_ERR;
+	}
+
+	memcpy(dst, src, len);
+	return 0;
+}
+
+static inline int sw_dma_q_deliver(struct snap_dma_q *q, const void *in_buf,
+				   size_t in_len, const void *buf, size_t len,
+				   uint32_t imm)
+{
+	struct snap_dma_q *peer = q->sw_qp.sw->peer;
+	struct snap_dma_sw_qp *psw;
+	uint32_t rx_idx;
+	void *rx_elem;
+
+	if (!peer)
+		return 0;
+
+	psw = peer->sw_qp.sw;
+	if (snap_unlikely(in_len + len > peer->rx_elem_size))
+		return -EINVAL;
+
+	/* no posted receives on the peer side */
+	if (snap_unlikely(psw->rx_pi - psw->rx_ci >= peer->sw_qp.dv_qp.hw_qp.rq.wqe_cnt))
+		return -EAGAIN;
+
+	rx_idx = psw->rx_pi & (peer->sw_qp.dv_qp.hw_qp.rq.wqe_cnt - 1);
+	rx_elem = peer->sw_qp.rx_buf + rx_idx * peer->rx_elem_size;
+	if (in_len)
+		memcpy(rx_elem, in_buf, in_len);
+	if (len)
+		memcpy(rx_elem + in_len, buf, len);
+
+	psw->rx_descs[rx_idx].byte_len = in_len + len;
+	psw->rx_descs[rx_idx].imm_data = imm;
+	psw->rx_pi++;
+	return 0;
+}
+
+static int sw_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
+			  uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
+			  struct snap_dma_completion *comp)
+{
+	uint8_t status;
+
+	status = sw_dma_q_rdma_write((void *)dstaddr, src_buf, len);
+	__sw_dma_q_submit(q, 1, snap_dv_get_cq_update(&q->sw_qp.dv_qp, comp),
+			  comp, status);
+	return 0;
+}
+
+static int sw_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
+			 uint32_t lkey, uint64_t srcaddr, uint32_t rmkey,
+			 struct snap_dma_completion *comp)
+{
+	uint8_t fm_ce_se, status;
+
+	status = sw_dma_q_rdma_read(dst_buf, (void *)srcaddr, len);
+
+	/* keep dv behavior: short reads are always scattered to the cqe */
+	fm_ce_se = (len <= 32) ? MLX5_WQE_CTRL_CQ_UPDATE :
+		   snap_dv_get_cq_update(&q->sw_qp.dv_qp, comp);
+	__sw_dma_q_submit(q, 1, fm_ce_se, comp, status);
+	return 0;
+}
+
+static int sw_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
+			       size_t len, uint64_t srcaddr, uint32_t rmkey,
+			       struct snap_dma_completion *comp)
+{
+	uint8_t status;
+
+	status = sw_dma_q_rdma_read(dst_buf, (void *)srcaddr, len);
+	__sw_dma_q_submit(q, 1, MLX5_WQE_CTRL_CQ_UPDATE, comp, status);
+	return 0;
+}
+
+static int sw_dma_q_xfer_v2v(struct snap_dma_q *q,
+			     struct snap_dma_q_io_attr *io_attr,
+			     struct snap_dma_completion *comp, int *n_bb)
+{
+	int wr_cnt;
+	int num_sge[SNAP_DMA_Q_MAX_WR_CNT];
+	struct ibv_sge r_sgl[SNAP_DMA_Q_MAX_WR_CNT];
+	struct ibv_sge l_sgl[SNAP_DMA_Q_MAX_WR_CNT][SNAP_DMA_Q_MAX_SGE_NUM];
+	struct snap_dma_completion *c_comp;
+	int i, j, wqe_bb;
+	void *raddr;
+
+	if (snap_dma_build_sgl(io_attr, &wr_cnt, n_bb, num_sge, l_sgl, r_sgl))
+		return -EINVAL;
+
+	if (snap_unlikely(!qp_can_tx(q, *n_bb))) {
+		SNAP_LIB_LOG_DBG("%s: qp out of tx_available resource", __func__);
+		return -EAGAIN;
+	}
+
+	/*
+	 * readv2v is posted as an rdma write with swapped source and
+	 * destination (see snap_dma_q_readv2v()), so in both cases data goes
+	 * from the local sgl to the remote sgl
+	 */
+	for (i = 0; i < wr_cnt; i++) {
+		raddr = (void *)r_sgl[i].addr;
+		for (j = 0; j < num_sge[i]; j++) {
+			memcpy(raddr, (void *)l_sgl[i][j].addr, l_sgl[i][j].length);
+			raddr += l_sgl[i][j].length;
+		}
+
+		c_comp = (i < wr_cnt - 1) ? NULL : comp;
+		wqe_bb = (num_sge[i] <= 2) ? 1 : 1 + round_up((num_sge[i] - 2), 4);
+		sw_dma_q_submit(q, wqe_bb,
+				snap_dv_get_cq_update(&q->sw_qp.dv_qp, c_comp), c_comp);
+	}
+
+	return 0;
+}
+
+/*
+ * Inline encryption needs the DEK objects in the hardware, it can not be
+ * emulated. Crypto can only be enabled on DV queues, so snap_dma_q_readc()
+ * and snap_dma_q_writec() return -ENOTSUP before getting here.
+ */
+static int sw_dma_q_readc(struct snap_dma_q *q,
+			  struct snap_dma_q_io_attr *io_attr,
+			  struct snap_dma_completion *comp, int *n_bb)
+{
+	return -ENOTSUP;
+}
+
+static int sw_dma_q_writec(struct snap_dma_q *q,
+			   struct snap_dma_q_io_attr *io_attr,
+			   struct snap_dma_completion *comp, int *n_bb)
+{
+	return -ENOTSUP;
+}
+
+static int sw_dma_q_write_short(struct snap_dma_q *q, void *src_buf, size_t len,
+				uint64_t dstaddr, uint32_t rmkey, int *n_bb)
+{
+	size_t wqe_size;
+	uint8_t status;
+
+	/* same wqe layout as the dv inline rdma write */
+	wqe_size = sizeof(struct mlx5_wqe_ctrl_seg) + sizeof(struct mlx5_wqe_raddr_seg) +
+		   sizeof(struct mlx5_wqe_inl_data_seg) + len;
+	*n_bb = round_up(wqe_size, MLX5_SEND_WQE_BB);
+	if (snap_unlikely(!qp_can_tx(q, *n_bb)))
+		return -EAGAIN;
+
+	status = sw_dma_q_rdma_write((void *)dstaddr, src_buf, len);
+	__sw_dma_q_submit(q, *n_bb, snap_dv_get_cq_update(&q->sw_qp.dv_qp, NULL),
+			  NULL, status);
+	return 0;
+}
+
+static int sw_dma_q_send_completion(struct snap_dma_q *q, void *src_buf,
+				    size_t len, int *n_bb)
+{
+	size_t wqe_size;
+	int rc;
+
+	wqe_size = sizeof(struct mlx5_wqe_ctrl_seg) +
+		   sizeof(struct mlx5_wqe_inl_data_seg) + len;
+	*n_bb = round_up(wqe_size, MLX5_SEND_WQE_BB);
+	if (snap_unlikely(!qp_can_tx(q, *n_bb)))
+		return -EAGAIN;
+
+	rc = sw_dma_q_deliver(q, src_buf, len, NULL, 0, 0);
+	if (snap_unlikely(rc))
+		return rc;
+
+	sw_dma_q_submit(q, *n_bb, snap_dv_get_cq_update(&q->sw_qp.dv_qp, NULL), NULL);
+	return 0;
+}
+
+static int sw_dma_q_send(struct snap_dma_q *q, void *in_buf, size_t in_len,
+			 uint64_t addr, int len, uint32_t key,
+			 int *n_bb, uint32_t *imm)
+{
+	size_t wqe_size;
+	int rc;
+
+	/* same wqe layout as the dv send: inline segment plus a pointer */
+	wqe_size = sizeof(struct mlx5_wqe_ctrl_seg) + sizeof(struct mlx5_wqe_data_seg) +
+		   SNAP_ALIGN_CEIL(sizeof(struct mlx5_wqe_inl_data_seg) + in_len, 16);
+	*n_bb = round_up(wqe_size, MLX5_SEND_WQE_BB);
+	if (snap_unlikely(!qp_can_tx(q, *n_bb)))
+		return -EAGAIN;
+
+	rc = sw_dma_q_deliver(q, in_buf, in_len, (void *)addr, len, imm ? *imm : 0);
+	if (snap_unlikely(rc))
+		return rc;
+
+	sw_dma_q_submit(q, *n_bb, snap_dv_get_cq_update(&q->sw_qp.dv_qp, NULL), NULL);
+	return 0;
+}
+
+static inline struct snap_dma_completion *sw_dma_q_get_comp(struct snap_dma_q *q,
+							    uint8_t *status)
+{
+	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	uint32_t sq_mask = dv_qp->hw_qp.sq.wqe_cnt - 1;
+	struct snap_dma_sw_cqe *cqe;
+	uint16_t comp_idx;
+
+	cqe = &sw->tx_cq[sw->tx_cq_ci++ & sq_mask];
+	comp_idx = cqe->comp_idx;
+	*status = cqe->status;
+	q->tx_available += dv_qp->comps[comp_idx].n_outstanding;
+	snap_dv_stat_comp(dv_qp, comp_idx);
+	return dv_qp->comps[comp_idx].comp;
+}
+
+static int sw_dma_q_progress_tx(struct snap_dma_q *q, int max_tx_comp)
+{
+	uint16_t max_tx_comp_value = max_tx_comp == -1 ? SNAP_DMA_MAX_TX_COMPLETIONS : max_tx_comp;
+	struct snap_dma_completion *comp[max_tx_comp_value];
+	uint8_t status[max_tx_comp_value];
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	int n, i;
+
+	n = 0;
+	while (n < max_tx_comp_value && sw->tx_cq_ci != sw->tx_cq_db) {
+		comp[n] = sw_dma_q_get_comp(q, &status[n]);
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (comp[i] && --comp[i]->count == 0)
+			comp[i]->func(comp[i], status[i]);
+	}
+
+	sw_tx_complete(q);
+	q->sw_qp.dv_qp.stat.tx.total_completed += n;
+	snap_dv_stat_poll_tx(&q->sw_qp.dv_qp, n);
+	return n;
+}
+
+static void sw_dma_q_complete_tx(struct snap_dma_q *q)
+{
+	sw_tx_complete(q);
+}
+
+static inline void sw_dma_q_get_rx_comp(struct snap_dma_q *q, uint32_t rx_ci,
+					struct snap_rx_completion *rx_comp)
+{
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	uint32_t rx_idx;
+
+	rx_idx = rx_ci & (q->sw_qp.dv_qp.hw_qp.rq.wqe_cnt - 1);
+	rx_comp->data = q->sw_qp.rx_buf + rx_idx * q->rx_elem_size;
+	rx_comp->byte_len = sw->rx_descs[rx_idx].byte_len;
+	rx_comp->imm_data = sw->rx_descs[rx_idx].imm_data;
+	rx_comp->q = q;
+}
+
+static int sw_dma_q_progress_rx(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	struct snap_rx_completion rx_comp;
+	int n, i;
+
+	n = snap_min(sw->rx_pi - sw->rx_ci, SNAP_DMA_MAX_RX_COMPLETIONS);
+	snap_dv_stat_poll_rx(&q->sw_qp.dv_qp, n);
+	if (n == 0)
+		return 0;
+
+	/* rx elements are released only after all callbacks are done. It
+	 * allows callbacks to send to the peer that may send back to us.
+	 */
+	for (i = 0; i < n; i++) {
+		sw_dma_q_get_rx_comp(q, sw->rx_ci + i, &rx_comp);
+		q->rx_cb(q, rx_comp.data, rx_comp.byte_len, rx_comp.imm_data);
+	}
+
+	sw->rx_ci += n;
+	++q->sw_qp.dv_qp.stat.rx.total_dbs;
+	q->sw_qp.dv_qp.stat.rx.total_completed += n;
+	return n;
+}
+
+static int sw_dma_q_poll_rx(struct snap_dma_q *q,
+			    struct snap_rx_completion *rx_completions,
+			    int max_completions)
+{
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	int n, i;
+
+	n = snap_min(sw->rx_pi - sw->rx_ci, max_completions);
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		sw_dma_q_get_rx_comp(q, sw->rx_ci + i, &rx_completions[i]);
+
+	sw->rx_ci += n;
+	++q->sw_qp.dv_qp.stat.rx.total_dbs;
+	q->sw_qp.dv_qp.stat.rx.total_completed += n;
+	return n;
+}
+
+static int sw_dma_q_poll_tx(struct snap_dma_q *q, struct snap_dma_completion **comp,
+			    int max_completions)
+{
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+	struct snap_dma_completion *dma_comp;
+	uint8_t status;
+	int n;
+
+	sw_tx_complete(q);
+
+	n = 0;
+	while (n < max_completions && sw->tx_cq_ci != sw->tx_cq_db) {
+		dma_comp = sw_dma_q_get_comp(q, &status);
+		if (snap_unlikely(status))
+			SNAP_LIB_LOG_ERR("sw dma queue %p completion error syndrome 0x%x",
+					 q, status);
+		if (dma_comp && --dma_comp->count == 0)
+			comp[n++] = dma_comp;
+	}
+
+	return n;
+}
+
+static int sw_dma_q_arm(struct snap_dma_q *q)
+{
+	/* there is no completion channel, nothing to arm */
+	return 0;
+}
+
+static int sw_dma_q_flush(struct snap_dma_q *q)
+{
+	int n, n_out;
+	int tx_available;
+
+	n = 0;
+	/* in case we have tx moderation we need at least one
+	 * available to be able to send a flush command
+	 */
+	while (!qp_can_tx(q, 1))
+		n += sw_dma_q_progress_tx(q, -1);
+
+	/* flush all outstanding ops by issuing a signaled nop */
+	n_out = q->sw_qp.dv_qp.n_outstanding;
+	if (n_out) {
+		sw_dma_q_submit(q, 1, MLX5_WQE_CTRL_CQ_UPDATE, NULL);
+		q->tx_available--;
+		n--;
+	}
+
+	tx_available = snap_dma_q_dv_get_tx_avail_max(q);
+	while (q->tx_available < tx_available)
+		n += sw_dma_q_progress_tx(q, -1);
+
+	return n_out + n;
+}
+
+static int sw_dma_q_flush_nowait(struct snap_dma_q *q, struct snap_dma_completion *comp,
+				 int *n_bb)
+{
+	*n_bb = 1;
+	if (snap_unlikely(!qp_can_tx(q, *n_bb)))
+		return -EAGAIN;
+
+	sw_dma_q_submit(q, *n_bb, MLX5_WQE_CTRL_CQ_UPDATE, comp);
+	return 0;
+}
+
+static bool sw_dma_q_empty(struct snap_dma_q *q)
+{
+	return q->tx_available == snap_dma_q_dv_get_tx_avail_max(q);
+}
+
+static const struct snap_dv_qp_stat *sw_dma_q_stat(const struct snap_dma_q *q)
+{
+	return &q->sw_qp.dv_qp.stat;
+}
+
+const struct snap_dma_q_ops sw_ops = {
+	.mode            = SNAP_DMA_Q_MODE_SW,
+	.write           = sw_dma_q_write,
+	.writev2v        = sw_dma_q_xfer_v2v,
+	.writec          = sw_dma_q_writec,
+	.write_short     = sw_dma_q_write_short,
+	.read            = sw_dma_q_read,
+	.readv2v         = sw_dma_q_xfer_v2v,
+	.readc           = sw_dma_q_readc,
+	.read_short      = sw_dma_q_read_short,
+	.send_completion = sw_dma_q_send_completion,
+	.send            = sw_dma_q_send,
+	.progress_tx     = sw_dma_q_progress_tx,
+	.complete_tx     = sw_dma_q_complete_tx,
+	.progress_rx     = sw_dma_q_progress_rx,
+	.poll_rx         = sw_dma_q_poll_rx,
+	.poll_tx         = sw_dma_q_poll_tx,
+	.arm             = sw_dma_q_arm,
+	.flush           = sw_dma_q_flush,
+	.flush_nowait    = sw_dma_q_flush_nowait,
+	.empty           = sw_dma_q_empty,
+	.stat            = sw_dma_q_stat,
+};
+
+/**
+ * snap_dma_sw_qp_create() - Create sw loopback 'qp'
+ * @q:     dma queue
+ * @attr:  dma queue creation attributes
+ *
+ * The function allocates tx and rx rings of the sw loopback queue. Sizes
+ * are rounded up the same way it is done for the hw queues.
+ *
+ * Return: 0 on success, -errno on failure.
+ */
+int snap_dma_sw_qp_create(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr)
+{
+	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
+	struct snap_dma_sw_qp *sw;
+	uint32_t tx_size, rx_size;
+
+	if (attr->wk || attr->dpa_mode != SNAP_DMA_Q_DPA_MODE_NONE) {
+		SNAP_LIB_LOG_ERR("sw dma queue can not be used with worker or dpa");
+		return -ENOTSUP;
+	}
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return -ENOMEM;
+
+	q->ops = &sw_ops;
+	q->sw_qp.mode = SNAP_DMA_Q_MODE_SW;
+	q->sw_qp.sw = sw;
+	q->no_events = true;
+
+	/* make sure that the completion is requested at least once */
+	if (attr->tx_qsize <= SNAP_DMA_Q_TX_MOD_COUNT && attr->tx_qsize > 0)
+		q->tx_qsize = SNAP_DMA_Q_TX_MOD_COUNT + 8;
+	else
+		q->tx_qsize = attr->tx_qsize;
+	q->tx_elem_size = attr->tx_elem_size;
+	q->rx_elem_size = attr->rx_elem_size;
+	q->rx_qsize = attr->rx_qsize;
+
+	tx_size = SNAP_ROUNDUP_POW2_OR0(q->tx_qsize);
+	rx_size = SNAP_ROUNDUP_POW2_OR0(2 * attr->rx_qsize);
+
+	if (tx_size) {
+		dv_qp->comps = calloc(tx_size, sizeof(*dv_qp->comps));
+		sw->tx_cq = calloc(tx_size, sizeof(*sw->tx_cq));
+		if (!dv_qp->comps || !sw->tx_cq)
+			goto free_rings;
+		dv_qp->stat.hist = snap_dma_q_hist_create(tx_size);
+	}
+
+	if (rx_size) {
+		q->sw_qp.rx_buf = calloc(rx_size, attr->rx_elem_size);
+		sw->rx_descs = calloc(rx_size, sizeof(*sw->rx_descs));
+		if (!q->sw_qp.rx_buf || !sw->rx_descs)
+			goto free_rings;
+	}
+
+	dv_qp->hw_qp.sq.wqe_cnt = tx_size;
+	dv_qp->hw_qp.rq.wqe_cnt = rx_size;
+	q->sw_qp.dv_tx_cq.cqe_cnt = tx_size;
+	q->sw_qp.dv_rx_cq.cqe_cnt = rx_size;
+
+	dv_qp->db_flag = (enum snap_db_ring_flag)snap_env_getenv(SNAP_DMA_Q_DBMODE);
+	q->tx_available = snap_dma_q_dv_get_tx_avail_max(q);
+	return 0;
+
+free_rings:
+	free(sw->rx_descs);
+	free(q->sw_qp.rx_buf);
+	free(sw->tx_cq);
+	free(dv_qp->comps);
+	snap_dma_q_hist_destroy(dv_qp->stat.hist);
+	free(sw);
+	q->sw_qp.rx_buf = NULL;
+	dv_qp->comps = NULL;
+	dv_qp->stat.hist = NULL;
+	q->sw_qp.sw = NULL;
+	return -ENOMEM;
+}
+
+/**
+ * snap_dma_sw_qp_destroy() - Destroy sw loopback 'qp'
+ * @q:  dma queue
+ *
+ * The function also disconnects the queue from its peer.
+ */
+void snap_dma_sw_qp_destroy(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_qp *sw = q->sw_qp.sw;
+
+	if (!sw)
+		return;
+
+	if (sw->peer)
+		sw->peer->sw_qp.sw->peer = NULL;
+
+	free(sw->rx_descs);
+	free(q->sw_qp.rx_buf);
+	free(sw->tx_cq);
+	free(q->sw_qp.dv_qp.comps);
+	snap_dma_q_hist_destroy(q->sw_qp.dv_qp.stat.hist);
+	free(sw);
+	q->sw_qp.rx_buf = NULL;
+	q->sw_qp.dv_qp.comps = NULL;
+	q->sw_qp.dv_qp.stat.hist = NULL;
+	q->sw_qp.sw = NULL;
+}
+
+/**
+ * snap_dma_sw_qp_connect() - Connect two sw loopback queues
+ * @q1:  first queue to connect
+ * @q2:  second queue to connect
+ *
+ * After the queues are connected, data sent by one queue is received
+ * by another one.
+ *
+ * Return: 0 on success, -errno on failure.
+ */
+int snap_dma_sw_qp_connect(struct snap_dma_q *q1, struct snap_dma_q *q2)
+{
+	if (q1->ops->mode != SNAP_DMA_Q_MODE_SW || q2->ops->mode != SNAP_DMA_Q_MODE_SW)
+		return -EINVAL;
+
+	if (q1->sw_qp.sw->peer || q2->sw_qp.sw->peer)
+		return -EBUSY;
+
+	q1->sw_qp.sw->peer = q2;
+	q2->sw_qp.sw->peer = q1;
+	return 0;
+}
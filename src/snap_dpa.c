@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "config.h"
 #include "snap_macros.h"
@@ -37,6 +38,7 @@
 #include "mlx5_ifc.h"
 #include "snap_dma.h"
 #include "snap_lib_log.h"
+#include "snap_cross_gvmi.h"
 
 SNAP_LIB_LOG_REGISTER(DPA)
 
@@ -237,7 +239,10 @@ free_tmp_buf:
  * by objects belonging to @pd.
  *
  * For example, a QP can use memory key to perform DMA or post_send operations
- * TODO: consider caching protection domains and sharing the key
+ *
+ * The key always covers the whole process memory, so it is created once per
+ * @pd and shared by reference. Every DPA queue of every thread would otherwise
+ * spend a firmware command and an mkey on an identical key.
  *
  * Return:
  * mkey handle or NULL
@@ -248,10 +253,24 @@ struct snap_dpa_mkeyh *snap_dpa_mkey_alloc(struct snap_dpa_ctx *dctx, struct ibv
 	struct flexio_mkey_attr fattr;
 	flexio_status st;
 
+	pthread_mutex_lock(&dctx->res_lock);
+	LIST_FOREACH(h, &dctx->mkeys, entry) {
+		if (h->pd != pd)
+			continue;
+
+		if (snap_ref_safe(&h->refcnt)) {
+			SNAP_LIB_LOG_ERR("%s: dpa mkey refcnt overflow", dctx->app_name);
+			h = NULL;
+		} else
+			dctx->stats.n_mkey_hits++;
+		pthread_mutex_unlock(&dctx->res_lock);
+		return h;
+	}
+
 	h = calloc(1, sizeof(*h));
 	if (!h) {
 		SNAP_LIB_LOG_ERR("Failed to allocate dpa memory key handle");
-		return 0;
+		goto unlock;
 	}
 
 	fattr.pd = pd;
@@ -262,9 +281,16 @@ struct snap_dpa_mkeyh *snap_dpa_mkey_alloc(struct snap_dpa_ctx *dctx, struct ibv
 	st = flexio_device_mkey_create(dctx->dpa_proc, &fattr, &h->mkey);
 	if (st != FLEXIO_STATUS_SUCCESS) {
 		free(h);
-		return NULL;
+		h = NULL;
+		goto unlock;
 	}
 
+	h->dctx = dctx;
+	h->pd = pd;
+	h->refcnt = 1;
+	LIST_INSERT_HEAD(&dctx->mkeys, h, entry);
+unlock:
+	pthread_mutex_unlock(&dctx->res_lock);
 	return h;
 }
 
@@ -286,10 +312,21 @@ uint32_t snap_dpa_mkey_id(struct snap_dpa_mkeyh *h)
  * snap_dpa_mkey_free() - free memory key handle
  * @h: memory key handle
  *
- * The function frees memory key handle and memory key object
+ * The function releases memory key handle. Memory key object is destroyed
+ * when its last user is gone.
  */
 void snap_dpa_mkey_free(struct snap_dpa_mkeyh *h)
 {
+	struct snap_dpa_ctx *dctx = h->dctx;
+
+	pthread_mutex_lock(&dctx->res_lock);
+	if (--h->refcnt > 0) {
+		pthread_mutex_unlock(&dctx->res_lock);
+		return;
+	}
+	LIST_REMOVE(h, entry);
+	pthread_mutex_unlock(&dctx->res_lock);
+
 	flexio_device_mkey_destroy(h->mkey);
 	free(h);
 }
@@ -640,6 +677,10 @@ struct snap_dpa_ctx *snap_dpa_process_create(struct ibv_context *ctx, const char
 	if (ret)
 		goto free_dpa_ctx;
 
+	pthread_mutex_init(&dpa_ctx->res_lock, NULL);
+	LIST_INIT(&dpa_ctx->mkeys);
+	LIST_INIT(&dpa_ctx->alias_ctxs);
+
 	dpa_ctx->pd = ibv_alloc_pd(ctx);
 	if (!dpa_ctx->pd) {
 		errno = -ENOMEM;
@@ -695,6 +736,7 @@ free_dpa_proc:
 free_dpa_pd:
 	ibv_dealloc_pd(dpa_ctx->pd);
 free_dpa_app:
+	pthread_mutex_destroy(&dpa_ctx->res_lock);
 	snap_dpa_unload_app(dpa_ctx);
 free_dpa_ctx:
 	free(dpa_ctx);
@@ -709,12 +751,18 @@ free_dpa_ctx:
  */
 void snap_dpa_process_destroy(struct snap_dpa_ctx *ctx)
 {
+	SNAP_LIB_LOG_DBG("%s: shared mkey hits %u alias hits %u", ctx->app_name,
+			 ctx->stats.n_mkey_hits, ctx->stats.n_alias_hits);
 	dma_q_destroy(ctx);
+	if (!LIST_EMPTY(&ctx->mkeys))
+		SNAP_LIB_LOG_ERR("%s: DPA memory keys are still in use", ctx->app_name);
+	snap_dpa_alias_cache_destroy(ctx);
 	snap_dpa_eq_destroy(ctx->dpa_eq);
 	flexio_window_destroy(ctx->dpa_window);
 	flexio_outbox_destroy(ctx->dpa_uar);
 	flexio_process_destroy(ctx->dpa_proc);
 	ibv_dealloc_pd(ctx->pd);
+	pthread_mutex_destroy(&ctx->res_lock);
 	snap_dpa_unload_app(ctx);
 	free(ctx);
 }
@@ -1013,6 +1061,7 @@ static void snap_dpa_thread_destroy_force(struct snap_dpa_thread *thr)
 	sleep(1); /* WA over simx bug */
 #endif
 	trigger_q_destroy(thr);
+	snap_dpa_thread_alias_destroy(thr);
 	flexio_event_handler_destroy(thr->dpa_thread);
 	snap_dpa_mem_free(thr->mem);
 	ibv_dereg_mr(thr->cmd_mr);
@@ -1450,37 +1499,86 @@ void snap_dpa_log_print(struct snap_dpa_log *log)
 	fflush(stdout);
 }
 
-struct snap_dpa_rsp *snap_dpa_rsp_wait(void *mbox)
+/**
+ * snap_dpa_rsp_poll() - check if the thread has responded to the command
+ * @mbox: thread mailbox
+ *
+ * Non blocking version of snap_dpa_rsp_wait(). Use it to keep commands
+ * outstanding on several DPA threads and collect the responses later.
+ * The mailbox has a single command slot, so there can be only one
+ * outstanding command per thread.
+ *
+ * Return: response or NULL if the command is still in progress
+ */
+struct snap_dpa_rsp *snap_dpa_rsp_poll(void *mbox)
 {
-	int n = 0;
-	const int count = 100000;
-	int i;
 	struct snap_dpa_rsp *rsp;
 	struct snap_dpa_cmd *cmd;
 
 	cmd = snap_dpa_mbox_to_cmd(mbox);
+	rsp = snap_dpa_mbox_to_rsp(mbox);
+	snap_memory_cpu_load_fence();
+	return rsp->sn == cmd->sn ? rsp : NULL;
+}
+
+static inline long snap_dpa_elapsed_usec(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * snap_dpa_rsp_wait() - wait for the thread response
+ * @mbox: thread mailbox
+ *
+ * The function spins on the mailbox first, most of the commands are
+ * answered within the spin. After that it polls with an exponentially
+ * growing sleep interval, from SNAP_DPA_THREAD_MBOX_POLL_MIN_USEC up to
+ * SNAP_DPA_THREAD_MBOX_POLL_MAX_USEC, so that slow commands (queue
+ * creation) are not rounded up to the max interval.
+ *
+ * The DPA thread does not signal the response, it is only visible in the
+ * mailbox memory. Callers that can not afford to block should use
+ * snap_dpa_rsp_poll() from their own progress loop.
+ *
+ * Return: response, status is SNAP_DPA_RSP_TO if the thread did not respond
+ * within SNAP_DPA_THREAD_MBOX_TIMEOUT_MSEC
+ */
+struct snap_dpa_rsp *snap_dpa_rsp_wait(void *mbox)
+{
+	long sleep_usec = SNAP_DPA_THREAD_MBOX_POLL_MIN_USEC;
+	struct snap_dpa_rsp *rsp;
+	struct snap_dpa_cmd *cmd;
+	struct timespec start;
+	long elapsed_usec;
+	int i;
+
 	/* wait for report back from the thread */
+	for (i = 0; i < SNAP_DPA_THREAD_MBOX_SPIN_COUNT; i++) {
+		rsp = snap_dpa_rsp_poll(mbox);
+		if (rsp)
+			return rsp;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	do {
-		i = 0;
-		do {
-			rsp = snap_dpa_mbox_to_rsp(mbox);
-			snap_memory_cpu_load_fence();
-			if (rsp->sn == cmd->sn)
-				goto done;
-			i++;
-		} while (i < count);
-
-		usleep(1000 * SNAP_DPA_THREAD_MBOX_POLL_INTERVAL_MSEC);
-		n += SNAP_DPA_THREAD_MBOX_POLL_INTERVAL_MSEC;
-		if (n == SNAP_DPA_THREAD_MBOX_TIMEOUT_MSEC) {
-			rsp->status = SNAP_DPA_RSP_TO;
-			rsp->sn = cmd->sn;
-			break;
+		usleep(sleep_usec);
+		rsp = snap_dpa_rsp_poll(mbox);
+		elapsed_usec = snap_dpa_elapsed_usec(&start);
+		if (rsp) {
+			if (SNAP_DEBUG)
+				SNAP_LIB_LOG_DBG("slow wait... %ld us total", elapsed_usec);
+			return rsp;
 		}
-	} while (1);
-done:
-	if (SNAP_DEBUG && n)
-		SNAP_LIB_LOG_DBG("slow wait... %d ms total", n);
+		sleep_usec = snap_min(2 * sleep_usec, SNAP_DPA_THREAD_MBOX_POLL_MAX_USEC);
+	} while (elapsed_usec < SNAP_DPA_THREAD_MBOX_TIMEOUT_MSEC * 1000L);
+
+	cmd = snap_dpa_mbox_to_cmd(mbox);
+	rsp = snap_dpa_mbox_to_rsp(mbox);
+	rsp->status = SNAP_DPA_RSP_TO;
+	rsp->sn = cmd->sn;
 	return rsp;
 }
 
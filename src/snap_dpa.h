@@ -17,6 +17,8 @@
 #include <stdbool.h>
 /* for cpu_set_t */
 #include <sched.h>
+#include <pthread.h>
+#include <sys/queue.h>
 #if HAVE_FLEXIO
 #include <libflexio/flexio.h>
 #endif
@@ -44,8 +46,16 @@ struct snap_dpa_ctx {
 	uint64_t                dpa_mem_size;
 	cpu_set_t               dpa_cpu_set;
 	char                    app_name[32];
+	/* protects objects that are shared by the process users */
+	pthread_mutex_t         res_lock;
+	/* memory keys, one per protection domain */
+	LIST_HEAD(snap_dpa_mkey_list, snap_dpa_mkeyh) mkeys;
+	/* cross gvmi aliases, one set per ibv context */
+	LIST_HEAD(snap_dpa_alias_ctx_list, snap_dpa_alias_ctx) alias_ctxs;
 	struct {
 		uint64_t heap_memory;
+		uint32_t n_mkey_hits;
+		uint32_t n_alias_hits;
 	} stats;
 };
 
@@ -62,6 +72,10 @@ struct snap_dpa_memh *snap_dpa_zalloc(struct snap_dpa_ctx *dpa_proc, size_t size
 
 struct snap_dpa_mkeyh {
 	struct flexio_mkey *mkey;
+	struct snap_dpa_ctx *dctx;
+	struct ibv_pd *pd;
+	int refcnt;
+	LIST_ENTRY(snap_dpa_mkeyh) entry;
 };
 
 struct snap_dpa_mkeyh *snap_dpa_mkey_alloc(struct snap_dpa_ctx *ctx, struct ibv_pd *pd);
@@ -133,6 +147,7 @@ void snap_dpa_thread_mbox_release(struct snap_dpa_thread *thr);
 
 void snap_dpa_cmd_send(struct snap_dpa_thread *thr, struct snap_dpa_cmd *cmd, uint32_t type);
 struct snap_dpa_rsp *snap_dpa_rsp_wait(void *mbox);
+struct snap_dpa_rsp *snap_dpa_rsp_poll(void *mbox);
 
 int snap_dpa_thread_wakeup(struct snap_dpa_thread *thr);
 
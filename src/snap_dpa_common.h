@@ -41,7 +41,9 @@
 #define SNAP_DPA_THREAD_MBOX_RSP_OFFSET 2048
 #define SNAP_DMA_THREAD_MBOX_CMD_SIZE (SNAP_DPA_THREAD_MBOX_RSP_OFFSET - sizeof(struct snap_dpa_cmd))
 #define SNAP_DPA_THREAD_MBOX_TIMEOUT_MSEC (10*1000)
-#define SNAP_DPA_THREAD_MBOX_POLL_INTERVAL_MSEC 1
+#define SNAP_DPA_THREAD_MBOX_SPIN_COUNT 100000
+#define SNAP_DPA_THREAD_MBOX_POLL_MIN_USEC 10
+#define SNAP_DPA_THREAD_MBOX_POLL_MAX_USEC 1000
 
 #define SNAP_DPA_THREAD_ENTRY_POINT "__snap_dpa_thread_start"
 
@@ -52,6 +52,30 @@ enum dpa_nvme_mp_state {
 	DPA_NVME_MP_STATE_SUSPEND,
 };
 
+/**
+ * enum dpa_nvme_mp_path_policy - how namespace picks ring buffer (path)
+ * @DPA_NVME_MP_POLICY_WRR:         static weighted round robin by rb weight
+ * @DPA_NVME_MP_POLICY_QUEUE_DEPTH: path with the least inflight commands
+ * @DPA_NVME_MP_POLICY_LATENCY:     path with the least expected latency,
+ *                                  ewma latency * (inflight + 1)
+ *
+ * Paths with zero weight are never used.
+ */
+enum dpa_nvme_mp_path_policy {
+	DPA_NVME_MP_POLICY_WRR = 0,
+	DPA_NVME_MP_POLICY_QUEUE_DEPTH,
+	DPA_NVME_MP_POLICY_LATENCY,
+	DPA_NVME_MP_POLICY_MAX
+};
+
+/* ewma weight of the new latency sample is 1/2^SHIFT */
+#define DPA_NVME_MP_LAT_EWMA_SHIFT 3
+
+struct dpa_nvme_mp_path {
+	uint32_t inflight;
+	uint32_t lat_ewma;
+};
+
 TAILQ_HEAD(dpa_nvme_mp_sq_list, dpa_nvme_mp_sq);
 
 struct NVME_MP_PACKED dpa_nvme_mp_completion {
@@ -65,6 +89,8 @@ struct dpa_nvme_mp_cq {
 	enum dpa_nvme_mp_state state;
 	struct snap_hw_cq cq_head_db_hw_cq;
 	struct snap_dpa_p2p_q p2p_queues[SNAP_DPA_NVME_MP_MAX_NUM_QPS];
+	/* per p2p queue load, shared by all namespaces */
+	struct dpa_nvme_mp_path paths[SNAP_DPA_NVME_MP_MAX_NUM_QPS];
 	uint32_t num_p2p_queues;
 	uint32_t cq_head_duar_id;
 	uint32_t msix_cqnum;
@@ -90,6 +116,7 @@ struct dpa_nvme_mp_rb {
 struct dpa_nvme_mp_ns {
 	uint8_t active_rb;
 	uint8_t credits;
+	uint8_t policy;
 	struct dpa_nvme_mp_rb rbs[0];
 };
 
@@ -106,6 +133,9 @@ struct dpa_nvme_mp_sq {
 	uint32_t arm_sq_tail;
 	uint32_t last_read_sq_tail;
 	struct nvme_cmd *sqe_buffer;
+	/* submit time by cid, only if some namespace uses latency policy */
+	uint32_t *sqe_ts;
+	bool track_latency;
 	struct snap_dma_completion host2dpa_comp;
 
 	TAILQ_ENTRY(dpa_nvme_mp_sq) entry;
@@ -151,6 +181,7 @@ struct dpa_nvme_mp_cmd_rb_attach {
 	uint32_t nsid;
 	uint8_t qp_id;
 	uint8_t weight;
+	uint8_t policy;
 };
 
 struct dpa_nvme_mp_cmd_rb_detach {
@@ -162,8 +193,10 @@ struct dpa_nvme_mp_cmd_rb_modify {
 	uint32_t nsid;
 	uint8_t qp_id;
 	uint8_t weight;
+	uint8_t policy;
 	struct {
 		uint8_t weight:1;
+		uint8_t policy:1;
 	} mask;
 };
 
@@ -10,6 +10,7 @@
  * provided with the software product.
  */
 #include <stdint.h>
+#include <string.h>
 
 #include "snap_dma.h"
 #include "snap_dpa_p2p.h"
@@ -300,17 +301,32 @@ int snap_dpa_p2p_send_cq_head(struct snap_dpa_p2p_q *q, uint16_t cq_head)
 	return snap_dpa_p2p_send_msg(q, (struct snap_dpa_p2p_msg *) &msg);
 }
 
-int snap_dpa_p2p_send_msix(struct snap_dpa_p2p_q *q, int credit)
+/**
+ * snap_dpa_p2p_send_vq_msix() - ask DPA to raise msix of the queue
+ * @q:      p2p queue
+ * @qid:    id of the queue on the DPA thread
+ * @credit: amount of credits to send
+ *
+ * Use it when several queues share p2p channel of the DPA thread.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_p2p_send_vq_msix(struct snap_dpa_p2p_q *q, uint16_t qid, int credit)
 {
 	struct snap_dpa_p2p_msg msg;
 
 	msg.base.credit_delta = credit;
 	msg.base.type = SNAP_DPA_P2P_MSG_VQ_MSIX;
-	msg.base.qid = q->qid;
+	msg.base.qid = qid;
 
 	return snap_dpa_p2p_send_msg(q, (struct snap_dpa_p2p_msg *) &msg);
 }
 
+int snap_dpa_p2p_send_msix(struct snap_dpa_p2p_q *q, int credit)
+{
+	return snap_dpa_p2p_send_vq_msix(q, q->qid, credit);
+}
+
 int snap_dpa_p2p_send_flush(struct snap_dpa_p2p_q *q)
 {
 	struct snap_dpa_p2p_msg msg = {
@@ -319,3 +335,132 @@ int snap_dpa_p2p_send_flush(struct snap_dpa_p2p_q *q)
 
 	return snap_dpa_p2p_send_msg(q, (struct snap_dpa_p2p_msg *) &msg);
 }
+
+/**
+ * snap_dpa_p2p_batch_init() - init control messages batch
+ * @b:             batch to init
+ * @max_entries:   max entries in the batch, capped by SNAP_DPA_P2P_BATCH_MAX_ENTRIES
+ * @credit_thresh: return credits once that many are accumulated
+ * @max_delay:     latency bound, 0 - send every entry immediately
+ */
+void snap_dpa_p2p_batch_init(struct snap_dpa_p2p_batch *b, int max_entries,
+		int credit_thresh, uint64_t max_delay)
+{
+	memset(b, 0, sizeof(*b));
+	b->msg.base.type = SNAP_DPA_P2P_MSG_BATCH;
+	if (max_entries <= 0 || max_entries > SNAP_DPA_P2P_BATCH_MAX_ENTRIES)
+		max_entries = SNAP_DPA_P2P_BATCH_MAX_ENTRIES;
+	b->max_entries = max_entries;
+	b->credit_thresh = credit_thresh > 0 ? credit_thresh : 1;
+	b->max_delay = max_delay;
+}
+
+static inline void batch_arm(struct snap_dpa_p2p_batch *b, uint64_t now)
+{
+	if (!b->msg.n_entries)
+		b->deadline = now + b->max_delay;
+}
+
+/**
+ * snap_dpa_p2p_batch_flush() - send staged entries and credits
+ * @q: p2p queue
+ * @b: batch
+ *
+ * If there are no staged entries a credit update message is sent. On error
+ * the batch is kept and the send can be retried.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_p2p_batch_flush(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b)
+{
+	int rc;
+
+	if (!snap_dpa_p2p_batch_pending(b))
+		return 0;
+
+	if (!b->msg.n_entries) {
+		rc = snap_dpa_p2p_send_cr_update(q, b->credits);
+	} else {
+		b->msg.base.credit_delta = b->credits;
+		b->msg.base.qid = q->qid;
+		rc = snap_dpa_p2p_send_msg(q, (struct snap_dpa_p2p_msg *)&b->msg);
+	}
+	if (snap_unlikely(rc))
+		return rc;
+
+	b->n_sends++;
+	b->n_entries += b->msg.n_entries;
+	b->msg.n_entries = 0;
+	b->credits = 0;
+	return 0;
+}
+
+/**
+ * snap_dpa_p2p_batch_add() - stage control message
+ * @q:     p2p queue
+ * @b:     batch
+ * @type:  message type, for example SNAP_DPA_P2P_MSG_VQ_MSIX
+ * @qid:   queue id
+ * @value: message specific value, for example cq head
+ * @now:   current time
+ *
+ * If the message with the same type and qid is already staged only its value
+ * is updated. The batch is sent once it is full or if the latency bound is 0.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_p2p_batch_add(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b,
+		uint8_t type, uint16_t qid, uint32_t value, uint64_t now)
+{
+	struct snap_dpa_p2p_batch_entry *e;
+	int i, rc;
+
+	for (i = 0; i < b->msg.n_entries; i++) {
+		e = &b->msg.entries[i];
+		if (e->type == type && e->qid == qid) {
+			e->value = value;
+			return 0;
+		}
+	}
+
+	if (snap_unlikely(b->msg.n_entries == b->max_entries)) {
+		rc = snap_dpa_p2p_batch_flush(q, b);
+		if (rc)
+			return rc;
+	}
+
+	batch_arm(b, now);
+	e = &b->msg.entries[b->msg.n_entries++];
+	e->type = type;
+	e->rsvd = 0;
+	e->qid = qid;
+	e->value = value;
+
+	if (b->msg.n_entries == b->max_entries || !b->max_delay)
+		return snap_dpa_p2p_batch_flush(q, b);
+
+	return 0;
+}
+
+/**
+ * snap_dpa_p2p_batch_add_credit() - return credits lazily
+ * @q:      p2p queue
+ * @b:      batch
+ * @credit: number of consumed messages
+ *
+ * Credits are piggy backed on the next batch or sent once the credit
+ * threshold is reached. Credits alone do not arm the latency bound, the
+ * peer has enough credits left to keep sending until the threshold is
+ * reached.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_p2p_batch_add_credit(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b,
+		int credit)
+{
+	b->credits += credit;
+	if (b->credits >= b->credit_thresh)
+		return snap_dpa_p2p_batch_flush(q, b);
+
+	return 0;
+}
@@ -56,10 +56,32 @@
  * 3. Both sides recv more messages, can't send more credit updates or messages
  * 4. Both sides recv credit update (+8 credits) - no dead lock
  * 5. ....
+ *
+ * Coalescing:
+ * Small control messages (msix requests, cq heads, credit updates) can be
+ * staged in a struct snap_dpa_p2p_batch and sent as one BATCH message. Each
+ * entry of the batch message is a (type, qid, value) record, entries with
+ * the same type and qid are collapsed because the receiver only needs the
+ * latest value. Credits are returned lazily: they are piggy backed on the
+ * next batch or sent once the credit threshold is reached. The threshold is
+ * a fraction of the credit count, so the peer never waits for them. The
+ * batch is flushed when it is full or when the latency bound expires,
+ * whatever comes first.
+ *
+ * Only DPU->DPA messages are batched. DPA->DPU messages are vq heads and
+ * tables: the send gathers the heads directly from the host avail ring, and
+ * a single message already carries all new heads of the queue. Packing heads
+ * of several queues into one message would need an extra host read into DPA
+ * memory per queue, which costs more than the message it saves. Instead the
+ * DPA thread rings the tx doorbell once per pass over its queues. Used ring
+ * updates do not go over the channel at all, DPU writes them to the host and
+ * coalesces them on its own.
  */
 enum {
 	SNAP_DPA_P2P_MSG_CR_UPDATE = 1,
 	SNAP_DPA_P2P_MSG_P2P_Q_FLUSH = 2,
+	/* several control messages packed together */
+	SNAP_DPA_P2P_MSG_BATCH = 3,
 	/* VirtIO specific messages */
 	/* DPA->DPU */
 	SNAP_DPA_P2P_MSG_VQ_HEADS = 20,
@@ -145,6 +167,24 @@ struct snap_dpa_p2p_msg_vq_msix {
 	struct snap_dpa_p2p_msg_base base;
 };
 
+struct snap_dpa_p2p_batch_entry {
+	uint8_t type;
+	uint8_t rsvd;
+	uint16_t qid;
+	uint32_t value;
+};
+
+/* 64 - 6 (base) - 2 (entry count) = 56 / 8 = 7 */
+#define SNAP_DPA_P2P_BATCH_MAX_ENTRIES \
+	((SNAP_DPA_P2P_MSG_LEN - sizeof(struct snap_dpa_p2p_msg_base) - sizeof(uint16_t)) \
+		/sizeof(struct snap_dpa_p2p_batch_entry))
+
+struct snap_dpa_p2p_msg_batch {
+	struct snap_dpa_p2p_msg_base base;
+	uint16_t n_entries;
+	struct snap_dpa_p2p_batch_entry entries[SNAP_DPA_P2P_BATCH_MAX_ENTRIES];
+};
+
 /**
  * struct snap_dpa_p2p_q - p2p protocol queue
  * @dma_q:        DMA queue (connected to DPA)
@@ -188,6 +228,66 @@ int snap_dpa_p2p_send_sq_tail(struct snap_dpa_p2p_q *q, uint16_t sqid, uint16_t
 		uint32_t shadow_sqes_mkey, uint32_t old_sq_tail, uint32_t depth);
 int snap_dpa_p2p_send_cq_head(struct snap_dpa_p2p_q *q, uint16_t cq_head);
 int snap_dpa_p2p_send_msix(struct snap_dpa_p2p_q *q, int credit);
+int snap_dpa_p2p_send_vq_msix(struct snap_dpa_p2p_q *q, uint16_t qid, int credit);
 int snap_dpa_p2p_send_flush(struct snap_dpa_p2p_q *q);
 
+/**
+ * struct snap_dpa_p2p_batch - coalesced control messages
+ * @msg:           staged batch message
+ * @max_entries:   flush once that many entries are staged
+ * @credit_thresh: flush once that many credits are waiting to be returned
+ * @credits:       credits waiting to be returned
+ * @max_delay:     latency bound, 0 - flush on every add
+ * @deadline:      time when staged entries must be sent, credits alone
+ *                 are sent only when @credit_thresh is reached
+ * @n_sends:       number of sent batch messages
+ * @n_entries:     number of entries sent in batch messages
+ *
+ * Time is in the units of the caller, it is passed to the batch functions
+ * and only compared against @max_delay. DPU uses usecs, DPA uses cycles.
+ */
+struct snap_dpa_p2p_batch {
+	struct snap_dpa_p2p_msg_batch msg;
+	int max_entries;
+	int credit_thresh;
+	int credits;
+	uint64_t max_delay;
+	uint64_t deadline;
+	uint64_t n_sends;
+	uint64_t n_entries;
+};
+
+void snap_dpa_p2p_batch_init(struct snap_dpa_p2p_batch *b, int max_entries,
+		int credit_thresh, uint64_t max_delay);
+int snap_dpa_p2p_batch_add(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b,
+		uint8_t type, uint16_t qid, uint32_t value, uint64_t now);
+int snap_dpa_p2p_batch_add_credit(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b,
+		int credit);
+int snap_dpa_p2p_batch_flush(struct snap_dpa_p2p_q *q, struct snap_dpa_p2p_batch *b);
+
+static inline bool snap_dpa_p2p_batch_pending(struct snap_dpa_p2p_batch *b)
+{
+	return b->msg.n_entries || b->credits;
+}
+
+/**
+ * snap_dpa_p2p_batch_progress() - enforce batch latency bound
+ * @q:   p2p queue
+ * @b:   batch
+ * @now: current time
+ *
+ * Return: 1 if batch was sent, 0 if there was nothing to send or < 0 on error
+ */
+static inline int snap_dpa_p2p_batch_progress(struct snap_dpa_p2p_q *q,
+		struct snap_dpa_p2p_batch *b, uint64_t now)
+{
+	int rc;
+
+	if (!b->msg.n_entries || now < b->deadline)
+		return 0;
+
+	rc = snap_dpa_p2p_batch_flush(q, b);
+	return rc ? rc : 1;
+}
+
 #endif
@@ -13,6 +13,7 @@
 #define _GNU_SOURCE
 #endif
 #include <sched.h>
+#include <time.h>
 
 #include "config.h"
 
@@ -45,8 +46,8 @@ static struct snap_dpa_rt *snap_dpa_rt_create(struct ibv_context *ctx, const cha
 	strncpy(rt->name, name, sizeof(rt->name) - 1);
 	CPU_ZERO(&rt->polling_cores);
 	CPU_ZERO(&rt->polling_core_set);
+	LIST_INIT(&rt->threads);
 
-	/* TODO: allocate rt, worker list, mutex etc */
 	return rt;
 free_rt:
 	free(rt);
@@ -306,7 +307,7 @@ static int rt_thread_init(struct snap_dpa_rt_thread *rt_thr, struct ibv_pd *pd_i
 		struct snap_dpa_rt_thread_init_attr *rtt_attr)
 {
 	struct snap_dpa_thread_attr attr = {
-		.heap_size = rtt_attr->heap_size,
+		.heap_size = rtt_attr ? rtt_attr->heap_size : 0,
 	};
 
 	struct snap_cq_attr db_cq_attr = {
@@ -318,7 +319,7 @@ static int rt_thread_init(struct snap_dpa_rt_thread *rt_thr, struct ibv_pd *pd_i
 	struct snap_dpa_rt *rt = rt_thr->rt;
 	struct ibv_pd *pd = pd_in ? pd_in : rt->dpa_proc->pd;
 	struct ibv_pd *dpa_pd = rt->dpa_proc->pd;
-	struct snap_dma_q_init_attr *q_init_attr = rtt_attr->q_init_attr;
+	struct snap_dma_q_init_attr *q_init_attr = rtt_attr ? rtt_attr->q_init_attr : NULL;
 	struct snap_hw_cq hw_cq;
 	int ret;
 	cpu_set_t cpu_mask;
@@ -353,6 +354,10 @@ static int rt_thread_init(struct snap_dpa_rt_thread *rt_thr, struct ibv_pd *pd_i
 	} else
 		goto free_dpa_thread;
 
+	/* doorbells of all thread queues are reported on the same cq */
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI)
+		db_cq_attr.cqe_cnt = SNAP_DPA_RT_THR_MULTI_DB_CQE_CNT;
+
 	rt_thr->db_cq = snap_cq_create(dpa_pd->context, &db_cq_attr);
 	if (!rt_thr->db_cq)
 		goto free_dpa_thread;
@@ -394,8 +399,12 @@ free_dpa_thread:
 
 static void rt_thread_reset(struct snap_dpa_rt_thread *rt_thr)
 {
-	if (rt_thr->msix_cq)
-		snap_cq_destroy(rt_thr->msix_cq);
+	int i;
+
+	for (i = 0; i < rt_thr->max_queues; i++) {
+		if (rt_thr->queues[i].msix_cq)
+			snap_cq_destroy(rt_thr->queues[i].msix_cq);
+	}
 	snap_cq_destroy(rt_thr->db_cq);
 	snap_dma_ep_destroy(rt_thr->dpa_cmd_chan.dma_q);
 	snap_dma_ep_destroy(rt_thr->dpu_cmd_chan.dma_q);
@@ -407,6 +416,34 @@ static void rt_thread_reset(struct snap_dpa_rt_thread *rt_thr)
 		snap_dpa_rt_event_core_put(rt_thr->rt, rt_thr->hart);
 }
 
+static void rt_thread_free(struct snap_dpa_rt_thread *rt_thr)
+{
+	int i;
+
+	for (i = 0; i < rt_thr->max_queues; i++)
+		free(rt_thr->queues[i].inbox);
+	free(rt_thr->queues);
+	pthread_spin_destroy(&rt_thr->chan_lock);
+	free(rt_thr);
+}
+
+/* pick the least loaded multi queue thread that still has free queue slots */
+static struct snap_dpa_rt_thread *rt_thread_lookup(struct snap_dpa_rt *rt,
+		struct snap_dpa_rt_filter *filter)
+{
+	struct snap_dpa_rt_thread *rt_thr, *best = NULL;
+
+	LIST_FOREACH(rt_thr, &rt->threads, entry) {
+		if (rt_thr->mode != filter->mode || rt_thr->pd != filter->pd)
+			continue;
+		if (rt_thr->refcount >= rt_thr->max_queues)
+			continue;
+		if (!best || rt_thr->refcount < best->refcount)
+			best = rt_thr;
+	}
+	return best;
+}
+
 /**
  * snap_dpa_rt_thread_get() - get dpa thread according to the set of constrains
  * @rt:			dpa runtime
@@ -416,8 +453,11 @@ static void rt_thread_reset(struct snap_dpa_rt_thread *rt_thr)
  * The function returns a thread that matches constrains given in the @filter
  * argument. If necessary, the thread will be created.
  *
- * At the moment we only support single/polling thread. In the future a single
- * rt thread can be shared among several queues.
+ * A single queue thread is never shared. A multi queue thread serves up to
+ * @filter->max_queues queues. Queues are placed on the least loaded existing
+ * thread with free capacity, new thread is created only when all threads
+ * are full. Each reference taken by this function accounts for one queue,
+ * the caller should get the queue id with snap_dpa_rt_thread_queue_add().
  */
 struct snap_dpa_rt_thread *snap_dpa_rt_thread_get(struct snap_dpa_rt *rt,
 			struct snap_dpa_rt_filter *filter,
@@ -429,27 +469,59 @@ struct snap_dpa_rt_thread *snap_dpa_rt_thread_get(struct snap_dpa_rt *rt,
 	if (filter->mode != SNAP_DPA_RT_THR_POLLING && filter->mode != SNAP_DPA_RT_THR_EVENT)
 		return NULL;
 
-	if (filter->queue_mux_mode != SNAP_DPA_RT_THR_SINGLE)
+	if (filter->queue_mux_mode != SNAP_DPA_RT_THR_SINGLE &&
+	    filter->queue_mux_mode != SNAP_DPA_RT_THR_MULTI)
 		return NULL;
 
+	if (filter->queue_mux_mode == SNAP_DPA_RT_THR_MULTI) {
+		pthread_mutex_lock(&rt->lock);
+		rt_thr = rt_thread_lookup(rt, filter);
+		if (rt_thr) {
+			rt_thr->refcount++;
+			pthread_mutex_unlock(&rt->lock);
+			SNAP_LIB_LOG_DBG("%s: DPA thread on hart %d serves %d queues",
+					 rt->name, rt_thr->hart, rt_thr->refcount);
+			return rt_thr;
+		}
+		pthread_mutex_unlock(&rt->lock);
+	}
+
 	rt_thr = calloc(1, sizeof(*rt_thr));
 	if (!rt_thr)
 		return NULL;
 
 	rt_thr->rt = rt;
+	rt_thr->pd = filter->pd;
 	rt_thr->mode = filter->mode;
 	rt_thr->queue_mux_mode = filter->queue_mux_mode;
 	rt_thr->refcount = 1;
+	rt_thr->max_queues = 1;
+	if (filter->queue_mux_mode == SNAP_DPA_RT_THR_MULTI)
+		rt_thr->max_queues = filter->max_queues > 0 ? filter->max_queues :
+				     SNAP_DPA_RT_THR_MULTI_MAX_QUEUES;
+	pthread_spin_init(&rt_thr->chan_lock, PTHREAD_PROCESS_PRIVATE);
+	snap_dpa_p2p_batch_init(&rt_thr->dpu_batch, 0, SNAP_DPA_RT_P2P_CREDIT_BATCH,
+				rtt_attr ? rtt_attr->p2p_batch_usec : 0);
+
+	rt_thr->queues = calloc(rt_thr->max_queues, sizeof(*rt_thr->queues));
+	if (!rt_thr->queues)
+		goto free_mem;
 
 	/* TODO: modify attribute to accept external snap_dma_q */
 	ret = rt_thread_init(rt_thr, filter->pd, rtt_attr);
 	if (ret)
 		goto free_mem;
 
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI) {
+		pthread_mutex_lock(&rt->lock);
+		LIST_INSERT_HEAD(&rt->threads, rt_thr, entry);
+		pthread_mutex_unlock(&rt->lock);
+	}
+
 	return rt_thr;
 
 free_mem:
-	free(rt_thr);
+	rt_thread_free(rt_thr);
 	return NULL;
 }
 
@@ -462,24 +534,273 @@ free_mem:
  */
 void snap_dpa_rt_thread_put(struct snap_dpa_rt_thread *rt_thr)
 {
+	struct snap_dpa_rt *rt = rt_thr->rt;
+
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI) {
+		pthread_mutex_lock(&rt->lock);
+		if (--rt_thr->refcount > 0) {
+			pthread_mutex_unlock(&rt->lock);
+			return;
+		}
+		LIST_REMOVE(rt_thr, entry);
+		pthread_mutex_unlock(&rt->lock);
+	}
+
 	rt_thread_reset(rt_thr);
-	free(rt_thr);
+	rt_thread_free(rt_thr);
+}
+
+/**
+ * snap_dpa_rt_thread_queue_add() - allocate queue id on the rt thread
+ * @rt_thr: thread that will serve the queue
+ * @depth:  max number of p2p messages that can be pending for the queue
+ *
+ * The queue id must be passed to the DPA thread with the queue create
+ * command and is used as the qid of the p2p messages of the queue.
+ *
+ * Return: queue id or -errno on error
+ */
+int snap_dpa_rt_thread_queue_add(struct snap_dpa_rt_thread *rt_thr, int depth)
+{
+	struct snap_dpa_rt_thread_queue *q = NULL;
+	struct snap_dpa_p2p_msg *inbox = NULL;
+	uint32_t inbox_size = 0;
+	int i;
+
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI) {
+		inbox_size = SNAP_ROUNDUP_POW2(depth);
+		inbox = calloc(inbox_size, sizeof(*inbox));
+		if (!inbox)
+			return -ENOMEM;
+	}
+
+	snap_dpa_rt_thread_chan_lock(rt_thr);
+	for (i = 0; i < rt_thr->max_queues; i++) {
+		if (!rt_thr->queues[i].in_use) {
+			q = &rt_thr->queues[i];
+			break;
+		}
+	}
+	if (q) {
+		free(q->inbox);
+		q->inbox = inbox;
+		q->inbox_size = inbox_size;
+		q->inbox_pi = q->inbox_ci = 0;
+		q->in_use = true;
+	}
+	snap_dpa_rt_thread_chan_unlock(rt_thr);
+
+	if (!q) {
+		SNAP_LIB_LOG_ERR("%s: no free queue slots on DPA thread %d",
+				 rt_thr->rt->name, rt_thr->hart);
+		free(inbox);
+		return -ENOSPC;
+	}
+
+	return i;
+}
+
+/*
+ * Return credits of the consumed DPA messages. Credits are piggy backed on
+ * the next batch or sent as a credit update once SNAP_DPA_RT_P2P_CREDIT_BATCH
+ * of them are accumulated. Caller must hold the thread channel lock.
+ */
+static void rt_thread_p2p_credit_return(struct snap_dpa_rt_thread *rt_thr, int credit)
+{
+	struct snap_dpa_p2p_batch *b = &rt_thr->dpu_batch;
+	uint64_t n_sends = b->n_sends;
+	int ret;
+
+	ret = snap_dpa_p2p_batch_add_credit(&rt_thr->dpu_cmd_chan, b, credit);
+	if (snap_unlikely(ret))
+		SNAP_LIB_LOG_ERR("%s: failed to return %d credits to DPA thread %d: %d",
+				 rt_thr->rt->name, b->credits, rt_thr->hart, ret);
+	else if (b->n_sends != n_sends)
+		rt_thr->dpu_cmd_chan.dma_q->ops->progress_tx(rt_thr->dpu_cmd_chan.dma_q, -1);
+}
+
+/**
+ * snap_dpa_rt_thread_queue_del() - release queue id
+ * @rt_thr: thread that serves the queue
+ * @qid:    queue id returned by snap_dpa_rt_thread_queue_add()
+ *
+ * Messages that are still pending for the queue are dropped.
+ */
+void snap_dpa_rt_thread_queue_del(struct snap_dpa_rt_thread *rt_thr, int qid)
+{
+	struct snap_dpa_rt_thread_queue *q = &rt_thr->queues[qid];
+
+	snap_dpa_rt_thread_chan_lock(rt_thr);
+	q->in_use = false;
+	/* dropped messages still hold DPA credits */
+	if (q->inbox_pi != q->inbox_ci)
+		rt_thread_p2p_credit_return(rt_thr, q->inbox_pi - q->inbox_ci);
+	q->inbox_pi = q->inbox_ci = 0;
+	snap_dpa_rt_thread_chan_unlock(rt_thr);
+}
+
+#define SNAP_DPA_RT_P2P_RECV_BATCH 16
+
+static inline uint64_t rt_now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * snap_dpa_rt_thread_p2p_batch_add() - send coalesced control message to DPA
+ * @rt_thr: thread that serves the queue
+ * @type:   message type, for example SNAP_DPA_P2P_MSG_VQ_MSIX
+ * @qid:    queue id
+ * @value:  message specific value
+ *
+ * The message is staged in the thread batch and is sent together with other
+ * staged messages and lazy credit updates once the batch is full or its
+ * latency bound expires. See snap_dpa_rt_thread_p2p_batch_progress().
+ *
+ * Caller must hold the thread channel lock.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_rt_thread_p2p_batch_add(struct snap_dpa_rt_thread *rt_thr,
+		uint8_t type, uint16_t qid, uint32_t value)
+{
+	return snap_dpa_p2p_batch_add(&rt_thr->dpu_cmd_chan, &rt_thr->dpu_batch,
+				      type, qid, value, rt_now_usec());
+}
+
+/**
+ * snap_dpa_rt_thread_p2p_send_msix() - ask DPA to raise msix of the queue
+ * @rt_thr: thread that serves the queue
+ * @qid:    queue id
+ *
+ * If batching is enabled the request is staged with
+ * snap_dpa_rt_thread_p2p_batch_add(). Otherwise it is sent at once and
+ * carries the credits that are waiting to be returned to DPA, so that no
+ * separate credit update is needed.
+ *
+ * Caller must hold the thread channel lock.
+ *
+ * Return: 0 on success or < 0 on error
+ */
+int snap_dpa_rt_thread_p2p_send_msix(struct snap_dpa_rt_thread *rt_thr, uint16_t qid)
+{
+	struct snap_dpa_p2p_batch *b = &rt_thr->dpu_batch;
+	int ret;
+
+	if (snap_dpa_rt_thread_p2p_batch_enabled(rt_thr))
+		return snap_dpa_rt_thread_p2p_batch_add(rt_thr, SNAP_DPA_P2P_MSG_VQ_MSIX, qid, 0);
+
+	ret = snap_dpa_p2p_send_vq_msix(&rt_thr->dpu_cmd_chan, qid, b->credits);
+	if (!ret)
+		b->credits = 0;
+	return ret;
+}
+
+/**
+ * snap_dpa_rt_thread_p2p_batch_progress() - enforce batch latency bound
+ * @rt_thr: rt thread
+ *
+ * Must be called periodically by every queue of the thread, for example
+ * from the queue poll function. The clock is only read if there are staged
+ * messages.
+ *
+ * Return: 1 if batch was sent, 0 if there was nothing to send or < 0 on error
+ */
+int snap_dpa_rt_thread_p2p_batch_progress(struct snap_dpa_rt_thread *rt_thr)
+{
+	int ret;
+
+	if (!rt_thr->dpu_batch.msg.n_entries)
+		return 0;
+
+	snap_dpa_rt_thread_chan_lock(rt_thr);
+	ret = snap_dpa_p2p_batch_progress(&rt_thr->dpu_cmd_chan, &rt_thr->dpu_batch,
+					  rt_now_usec());
+	if (ret > 0)
+		rt_thr->dpu_cmd_chan.dma_q->ops->progress_tx(rt_thr->dpu_cmd_chan.dma_q, -1);
+	snap_dpa_rt_thread_chan_unlock(rt_thr);
+	return ret;
+}
+
+/**
+ * snap_dpa_rt_thread_p2p_recv() - receive p2p message of the queue
+ * @rt_thr: thread that serves the queue
+ * @qid:    queue id
+ * @msg:    received message
+ *
+ * Queues of the multi queue thread share p2p channel. Messages that
+ * belong to other queues of the thread are moved to their inbox. The
+ * message stays valid until the next call for the same queue.
+ *
+ * Return: number of received messages (0 or 1) or -errno on error
+ */
+int snap_dpa_rt_thread_p2p_recv(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_p2p_msg **msg)
+{
+	struct snap_dpa_p2p_msg *msgs[SNAP_DPA_RT_P2P_RECV_BATCH];
+	struct snap_dpa_rt_thread_queue *q, *dst;
+	int i, n;
+
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_SINGLE) {
+		n = snap_dpa_p2p_recv_msg(&rt_thr->dpu_cmd_chan, msg, 1);
+		if (n > 0)
+			rt_thread_p2p_credit_return(rt_thr, n);
+		return n;
+	}
+
+	snap_dpa_rt_thread_chan_lock(rt_thr);
+	q = &rt_thr->queues[qid];
+	if (q->inbox_pi == q->inbox_ci) {
+		n = snap_dpa_p2p_recv_msg(&rt_thr->dpu_cmd_chan, msgs, SNAP_DPA_RT_P2P_RECV_BATCH);
+		for (i = 0; i < n; i++) {
+			if (snap_unlikely(msgs[i]->base.qid >= rt_thr->max_queues ||
+					  !rt_thr->queues[msgs[i]->base.qid].in_use)) {
+				SNAP_LIB_LOG_ERR("%s: drop p2p message type %d for unknown queue %d",
+						 rt_thr->rt->name, msgs[i]->base.type, msgs[i]->base.qid);
+				rt_thread_p2p_credit_return(rt_thr, 1);
+				continue;
+			}
+			dst = &rt_thr->queues[msgs[i]->base.qid];
+			if (snap_unlikely(dst->inbox_pi - dst->inbox_ci == dst->inbox_size)) {
+				SNAP_LIB_LOG_ERR("%s: queue %d inbox overflow, drop p2p message type %d",
+						 rt_thr->rt->name, msgs[i]->base.qid, msgs[i]->base.type);
+				rt_thread_p2p_credit_return(rt_thr, 1);
+				continue;
+			}
+			memcpy(&dst->inbox[dst->inbox_pi++ & (dst->inbox_size - 1)], msgs[i],
+			       sizeof(*msgs[i]));
+		}
+	}
+
+	n = 0;
+	if (q->inbox_pi != q->inbox_ci) {
+		*msg = &q->inbox[q->inbox_ci++ & (q->inbox_size - 1)];
+		/* the message is consumed, DPA may reuse its inbox slot */
+		rt_thread_p2p_credit_return(rt_thr, 1);
+		n = 1;
+	}
+	snap_dpa_rt_thread_chan_unlock(rt_thr);
+	return n;
 }
 
 /**
  * snap_dpa_rt_thread_msix_add() - add msix_vector to the rt_thread
  * @rt_thr:     thread to add msix vector
+ * @qid:        queue that raises the msix
  * @msix_eq:    event queue that is already mapped to the msix_vector
- * @msix_cqnum: cq number that should be used to raise msix
+ * @msix_hw_cq: cq that should be used to raise msix
  *
- * The function adds (msix_eq, msix_cq) mapping to the rt thread. If the mapping
- * already exists the old one will be reused
+ * The function adds (msix_eq, msix_cq) mapping for the queue of the rt
+ * thread. Each queue gets its own msix_cq, even if several queues of the
+ * thread share msix vector, so that DPA can arm it without synchronization.
  */
-int snap_dpa_rt_thread_msix_add(struct snap_dpa_rt_thread *rt_thr, struct snap_dpa_msix_eq *msix_eq, uint32_t *msix_cqnum)
+int snap_dpa_rt_thread_msix_add(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_msix_eq *msix_eq, struct snap_hw_cq *msix_hw_cq)
 {
-	/* TODO: if thread serves several queues the mapping should be ref
-	 * counted.
-	 * Note: unlike db_cq, msix_cq cannot be created at rt_thread init because
+	/* Note: unlike db_cq, msix_cq cannot be created at rt_thread init because
 	 * msix_vector(eq) is only known at the queue creation time. cq
 	 * cannot be created without eq_id.
 	 */
@@ -493,45 +814,51 @@ int snap_dpa_rt_thread_msix_add(struct snap_dpa_rt_thread *rt_thr, struct snap_d
 		.use_eqn = true,
 		.dpa_proc = rt_thr->rt->dpa_proc
 	};
-	struct snap_hw_cq hw_cq;
+	struct snap_dpa_rt_thread_queue *q = &rt_thr->queues[qid];
 	int ret;
 
-	rt_thr->msix_cq = snap_cq_create(rt_thr->rt->dpa_proc->pd->context, &msix_cq_attr);
-	if (!rt_thr->msix_cq)
+	q->msix_cq = snap_cq_create(rt_thr->rt->dpa_proc->pd->context, &msix_cq_attr);
+	if (!q->msix_cq)
 		return -EINVAL;
 
-	ret = snap_cq_to_hw_cq(rt_thr->msix_cq, &hw_cq);
+	ret = snap_cq_to_hw_cq(q->msix_cq, msix_hw_cq);
 	if (ret)
 		goto destroy_cq;
 
-	/* note that rt context is at the beginning of the thread heap */
-	ret = snap_dpa_memcpy(rt_thr->rt->dpa_proc,
-			snap_dpa_thread_heap_base(rt_thr->thread) + offsetof(struct dpa_rt_context, msix_cq),
-			&hw_cq, sizeof(hw_cq));
-	if (ret)
-		goto destroy_cq;
+	/* single queue thread also exposes msix_cq in the rt context */
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_SINGLE) {
+		/* note that rt context is at the beginning of the thread heap */
+		ret = snap_dpa_memcpy(rt_thr->rt->dpa_proc,
+				snap_dpa_thread_heap_base(rt_thr->thread) + offsetof(struct dpa_rt_context, msix_cq),
+				msix_hw_cq, sizeof(*msix_hw_cq));
+		if (ret)
+			goto destroy_cq;
+	}
 
-	*msix_cqnum = hw_cq.cq_num;
 	return 0;
 
 destroy_cq:
-	snap_cq_destroy(rt_thr->msix_cq);
+	snap_cq_destroy(q->msix_cq);
+	q->msix_cq = NULL;
 	return -EINVAL;
 }
 
 /**
  * snap_dpa_rt_thread_msix_remove() - remove msix_vector to the rt_thread
  * @rt_thr:     thread to remove msix vector
+ * @qid:        queue that raises the msix
  * @msix_eq:    event queue that is already mapped to the msix_vector
  *
- * The function removes (msix_eq, msix_cq) mapping.
+ * The function removes (msix_eq, msix_cq) mapping of the queue.
  */
-void snap_dpa_rt_thread_msix_remove(struct snap_dpa_rt_thread *rt_thr, struct snap_dpa_msix_eq *msix_eq)
+void snap_dpa_rt_thread_msix_remove(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_msix_eq *msix_eq)
 {
-	/* TODO: deref... */
-	if (!rt_thr->msix_cq)
+	struct snap_dpa_rt_thread_queue *q = &rt_thr->queues[qid];
+
+	if (!q->msix_cq)
 		return;
 
-	snap_cq_destroy(rt_thr->msix_cq);
-	rt_thr->msix_cq = NULL;
+	snap_cq_destroy(q->msix_cq);
+	q->msix_cq = NULL;
 }
@@ -59,18 +59,21 @@ struct snap_dma_q_init_attr {
 struct snap_dpa_rt_thread_init_attr {
 	struct snap_dma_q_init_attr *q_init_attr;
 	size_t heap_size;
+	/* latency bound of DPU->DPA control messages coalescing, 0 - disabled */
+	uint32_t p2p_batch_usec;
 };
 
+struct snap_dpa_rt_thread;
+
 struct snap_dpa_rt {
 	struct snap_dpa_ctx *dpa_proc;
-	/* TODO: keep list of current threads. At first we are going to
-	 * support on polling/sing combo so it can wait
-	 */
 	int refcount;
 	pthread_mutex_t lock;
 	char name[SNAP_DPA_RT_NAME_LEN];
 
 	LIST_ENTRY(snap_dpa_rt) entry;
+	/* multi queue threads that can take more queues, protected by lock */
+	LIST_HEAD(, snap_dpa_rt_thread) threads;
 
 	cpu_set_t polling_core_set;
 	cpu_set_t polling_cores;
@@ -111,13 +114,40 @@ struct snap_dpa_rt_filter {
 	struct ibv_pd *pd; // create p2p qps on this pd
 	enum snap_dpa_rt_thr_mode mode;
 	enum snap_dpa_rt_thr_nqs queue_mux_mode;
+	/* max queues served by a multi queue thread, 0 - use default */
+	int max_queues;
 	struct snap_dpa_rt_worker *w;
 	size_t heap_size;
 };
 
+#define SNAP_DPA_RT_THR_MULTI_MAX_QUEUES 8
+
+/**
+ * struct snap_dpa_rt_thread_queue - queue served by the rt thread
+ * @in_use:     slot is taken by a queue
+ * @msix_cq:    cq used to raise msix of the queue
+ * @inbox:      p2p messages received for the queue by other queues of
+ *              the thread (multi queue threads only)
+ * @inbox_size: inbox size in messages, power of 2
+ * @inbox_pi:   inbox producer index
+ * @inbox_ci:   inbox consumer index
+ *
+ * Queue id is the slot index. It is used as the qid of the p2p messages
+ * and as the queue id in the DPA commands.
+ */
+struct snap_dpa_rt_thread_queue {
+	bool in_use;
+	struct snap_cq *msix_cq;
+	struct snap_dpa_p2p_msg *inbox;
+	uint32_t inbox_size;
+	uint32_t inbox_pi;
+	uint32_t inbox_ci;
+};
+
 struct snap_dpa_rt_thread {
 	struct snap_dpa_rt *rt;
 	struct snap_dpa_worker *wk;
+	struct ibv_pd *pd;
 	enum snap_dpa_rt_thr_mode mode;
 	enum snap_dpa_rt_thr_nqs queue_mux_mode;
 	int refcount;
@@ -127,12 +157,18 @@ struct snap_dpa_rt_thread {
 	struct snap_dpa_p2p_q dpa_cmd_chan;
 	struct snap_dpa_p2p_q dpu_cmd_chan;
 	struct snap_cq *db_cq;
-	/* in manyq per thread, we should have array of msix_cqs, for now use
-	 * one msix vector per thread
-	 */
-	struct snap_cq *msix_cq;
-	int n_msix;
 	int hart;
+
+	/* queue slots, one for the single queue thread */
+	int max_queues;
+	struct snap_dpa_rt_thread_queue *queues;
+	/* queues of the multi queue thread may be polled from different
+	 * DPU threads, serializes dpu_cmd_chan and queue slots access
+	 */
+	pthread_spinlock_t chan_lock;
+	/* coalesced DPU->DPA control messages, protected by chan_lock */
+	struct snap_dpa_p2p_batch dpu_batch;
+	LIST_ENTRY(snap_dpa_rt_thread) entry;
 };
 
 struct dpa_rt_context {
@@ -148,6 +184,7 @@ struct dpa_rt_context {
 
 #define SNAP_DPA_RT_THR_SINGLE_DB_CQE_SIZE 64
 #define SNAP_DPA_RT_THR_SINGLE_DB_CQE_CNT 2
+#define SNAP_DPA_RT_THR_MULTI_DB_CQE_CNT 64
 
 #define SNAP_DPA_RT_THR_MSIX_CQE_SIZE 64
 #define SNAP_DPA_RT_THR_MSIX_CQE_CNT 2
@@ -160,8 +197,41 @@ void snap_dpa_rt_thread_put(struct snap_dpa_rt_thread *rt);
 int snap_dpa_rt_p2p_queue_create(struct snap_dpa_rt_thread *rt_thr,
 		struct ibv_pd *pd, struct snap_dma_q_init_attr *q_init_attr,
 		struct snap_dpa_p2p_q *dpu_cmd_chan, struct snap_dpa_p2p_q *dpa_cmd_chan);
-int snap_dpa_rt_thread_msix_add(struct snap_dpa_rt_thread *rt_thr, struct snap_dpa_msix_eq *msix_eq, uint32_t *msix_cqnum);
-void snap_dpa_rt_thread_msix_remove(struct snap_dpa_rt_thread *rt_thr, struct snap_dpa_msix_eq *msix_eq);
+int snap_dpa_rt_thread_msix_add(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_msix_eq *msix_eq, struct snap_hw_cq *msix_hw_cq);
+void snap_dpa_rt_thread_msix_remove(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_msix_eq *msix_eq);
+
+int snap_dpa_rt_thread_queue_add(struct snap_dpa_rt_thread *rt_thr, int depth);
+void snap_dpa_rt_thread_queue_del(struct snap_dpa_rt_thread *rt_thr, int qid);
+int snap_dpa_rt_thread_p2p_recv(struct snap_dpa_rt_thread *rt_thr, int qid,
+		struct snap_dpa_p2p_msg **msg);
+
+#define SNAP_DPA_RT_P2P_CREDIT_BATCH (SNAP_DPA_P2P_CREDIT_COUNT / 4)
+
+int snap_dpa_rt_thread_p2p_batch_add(struct snap_dpa_rt_thread *rt_thr,
+		uint8_t type, uint16_t qid, uint32_t value);
+int snap_dpa_rt_thread_p2p_batch_progress(struct snap_dpa_rt_thread *rt_thr);
+int snap_dpa_rt_thread_p2p_send_msix(struct snap_dpa_rt_thread *rt_thr, uint16_t qid);
+
+static inline bool snap_dpa_rt_thread_p2p_batch_enabled(struct snap_dpa_rt_thread *rt_thr)
+{
+	return rt_thr->dpu_batch.max_delay != 0;
+}
+
+#if !__DPA
+static inline void snap_dpa_rt_thread_chan_lock(struct snap_dpa_rt_thread *rt_thr)
+{
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI)
+		pthread_spin_lock(&rt_thr->chan_lock);
+}
+
+static inline void snap_dpa_rt_thread_chan_unlock(struct snap_dpa_rt_thread *rt_thr)
+{
+	if (rt_thr->queue_mux_mode == SNAP_DPA_RT_THR_MULTI)
+		pthread_spin_unlock(&rt_thr->chan_lock);
+}
+#endif
 
 /* TODO: add a worker to support 1w:Ndpa threads model */
 #endif
@@ -10,6 +10,7 @@
  * provided with the software product.
  */
 #include <stdlib.h>
+#include <time.h>
 #include <linux/virtio_pci.h>
 
 #include "snap_macros.h"
@@ -19,8 +20,12 @@
 #include "snap_dpa_virtq.h"
 #include "snap_dpa_rt.h"
 #include "snap_lib_log.h"
+#include "snap_env.h"
 
 SNAP_LIB_LOG_REGISTER(DPA_VIRTQ);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_DPA_VIRTQ_PER_THREAD, 1);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_DPA_VIRTQ_P2P_BATCH_USEC, 0);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_DPA_VIRTQ_COMP_BATCH_USEC, 0);
 
 #if HAVE_FLEXIO
 #include "snap_dpa.h"
@@ -44,6 +49,12 @@ static uint32_t snap_get_dev_emu_id(struct snap_device *sdev)
 	return sdev->mdev.device_emulation->obj_id;
 }
 
+static void snap_dpa_virtq_cmd_send(struct snap_dpa_virtq *vq, struct dpa_virtq_cmd *cmd, uint32_t type)
+{
+	cmd->qid = vq->rt_qid;
+	snap_dpa_cmd_send(vq->rt_thr->thread, &cmd->base, type);
+}
+
 static struct snap_dpa_virtq *snap_dpa_virtq_create(struct snap_device *sdev,
 		struct snap_dpa_virtq_attr *dpa_vq_attr, struct snap_virtio_common_queue_attr *vq_attr)
 {
@@ -54,6 +65,8 @@ static struct snap_dpa_virtq *snap_dpa_virtq_create(struct snap_device *sdev,
 		.queue_mux_mode = SNAP_DPA_RT_THR_SINGLE
 	};
 	struct snap_dpa_rt_attr attr = {};
+	struct snap_dpa_rt_thread_init_attr rtt_attr = {};
+	int vqs_per_thread;
 
 	struct snap_dpa_virtq *vq;
 	void *mbox;
@@ -74,10 +87,31 @@ static struct snap_dpa_virtq *snap_dpa_virtq_create(struct snap_device *sdev,
 	if (!vq->rt)
 		goto free_vq;
 
-	vq->rt_thr = snap_dpa_rt_thread_get(vq->rt, &f, NULL);
+	vqs_per_thread = snap_env_getenv(SNAP_DPA_VIRTQ_PER_THREAD);
+	if (vqs_per_thread > 1) {
+		f.queue_mux_mode = SNAP_DPA_RT_THR_MULTI;
+		f.max_queues = snap_min(vqs_per_thread, SNAP_DPA_VIRTQ_MAX_PER_THREAD);
+	}
+	/* dpa thread keeps all its virtqs on the heap */
+	rtt_attr.heap_size = SNAP_DPA_THREAD_MIN_HEAP_SIZE +
+			     SNAP_DPA_VIRTQ_MAX_PER_THREAD * sizeof(struct dpa_virtq);
+	/* coalesce msix requests of the thread queues */
+	rtt_attr.p2p_batch_usec = snap_env_getenv(SNAP_DPA_VIRTQ_P2P_BATCH_USEC);
+
+	vq->rt_thr = snap_dpa_rt_thread_get(vq->rt, &f, &rtt_attr);
 	if (!vq->rt_thr)
 		goto put_rt;
 
+	vq->rt_qid = snap_dpa_rt_thread_queue_add(vq->rt_thr, vq_attr->vattr.size);
+	if (vq->rt_qid < 0)
+		goto put_rt_thr;
+
+	/* max latency that completion batching may add */
+	vq->comp_max_delay = snap_env_getenv(SNAP_DPA_VIRTQ_COMP_BATCH_USEC);
+	vq->comp_batch_max = snap_min(SNAP_DPA_VIRTQ_COMP_BATCH_MAX, vq_attr->vattr.size / 2);
+	vq->comp_batch_max = snap_max(vq->comp_batch_max, 1);
+	vq->stats.comp_batch = 1;
+
 	/* pass queue data to the worker */
 	mbox = snap_dpa_thread_mbox_acquire(vq->rt_thr->thread);
 
@@ -154,10 +188,13 @@ static struct snap_dpa_virtq *snap_dpa_virtq_create(struct snap_device *sdev,
 			goto free_dpa_duar;
 		}
 
-		ret = snap_dpa_rt_thread_msix_add(vq->rt_thr, vq->msix_eq, &cmd->cmd_create.vq.msix_cqnum);
+		ret = snap_dpa_rt_thread_msix_add(vq->rt_thr, vq->rt_qid, vq->msix_eq,
+				&cmd->cmd_create.vq.msix_cq);
 		if (ret)
 			goto free_msix_eq;
 
+		cmd->cmd_create.vq.msix_cqnum = cmd->cmd_create.vq.msix_cq.cq_num;
+
 		SNAP_LIB_LOG_INFO("MSIX eqn 0x%x cqn 0x%x msix_vector %d",
 				snap_dpa_msix_eq_id(vq->msix_eq),
 				cmd->cmd_create.vq.msix_cqnum,
@@ -177,7 +214,8 @@ static struct snap_dpa_virtq *snap_dpa_virtq_create(struct snap_device *sdev,
 	cmd->cmd_create.vq.dpu_xmkey = vq->cross_mkey->mkey;
 	cmd->cmd_create.vq.dpa_xmkey = vq->cross_mkey->mkey;
 	cmd->cmd_create.vq.duar_id = snap_dpa_duar_id(vq->duar);
-	snap_dpa_cmd_send(vq->rt_thr->thread, &cmd->base, DPA_VIRTQ_CMD_CREATE);
+	cmd->cmd_create.vq.qid = vq->rt_qid;
+	snap_dpa_virtq_cmd_send(vq, cmd, DPA_VIRTQ_CMD_CREATE);
 
 	rsp = snap_dpa_rsp_wait(mbox);
 	if (rsp->status != SNAP_DPA_RSP_OK) {
@@ -194,7 +232,7 @@ free_cross_mkey:
 	snap_destroy_cross_mkey(vq->cross_mkey);
 remove_msix_vector:
 	if (vq->msix_eq)
-		snap_dpa_rt_thread_msix_remove(vq->rt_thr, vq->msix_eq);
+		snap_dpa_rt_thread_msix_remove(vq->rt_thr, vq->rt_qid, vq->msix_eq);
 free_msix_eq:
 	if (vq->msix_eq)
 		snap_dpa_msix_eq_destroy(vq->msix_eq);
@@ -206,6 +244,8 @@ free_dpa_window:
 	free(vq->desc_shadow);
 release_mbox:
 	snap_dpa_thread_mbox_release(vq->rt_thr->thread);
+	snap_dpa_rt_thread_queue_del(vq->rt_thr, vq->rt_qid);
+put_rt_thr:
 	snap_dpa_rt_thread_put(vq->rt_thr);
 put_rt:
 	snap_dpa_rt_put(vq->rt);
@@ -220,15 +260,16 @@ static void snap_dpa_virtq_destroy(struct snap_dpa_virtq *vq)
 	struct dpa_virtq_cmd *cmd;
 	struct snap_dpa_rsp *rsp;
 
-	SNAP_LIB_LOG_INFO("destroy dpa virtq: 0x%x:%d io_completed: %d comp_updates: %d used_updates: %d",
+	SNAP_LIB_LOG_INFO("destroy dpa virtq: 0x%x:%d io_completed: %d comp_updates: %d used_updates: %d comp_batch: %d idle_updates: %d timeout_updates: %d",
 			vq->common.dev_emu_id, vq->common.idx,
-			vq->stats.n_io_completed, vq->stats.n_compl_updates, vq->stats.n_used_updates);
+			vq->stats.n_io_completed, vq->stats.n_compl_updates, vq->stats.n_used_updates,
+			vq->stats.comp_batch, vq->stats.n_idle_updates, vq->stats.n_timeout_updates);
 	snap_dpa_log_print(vq->rt_thr->thread->dpa_log);
 	mbox = snap_dpa_thread_mbox_acquire(vq->rt_thr->thread);
 
 	cmd = (struct dpa_virtq_cmd *)snap_dpa_mbox_to_cmd(mbox);
 	//printf("wait... b4 destroy command\n");getchar();
-	snap_dpa_cmd_send(vq->rt_thr->thread, &cmd->base, DPA_VIRTQ_CMD_DESTROY);
+	snap_dpa_virtq_cmd_send(vq, cmd, DPA_VIRTQ_CMD_DESTROY);
 
 	rsp = snap_dpa_rsp_wait(mbox);
 	if (rsp->status != SNAP_DPA_RSP_OK)
@@ -238,10 +279,11 @@ static void snap_dpa_virtq_destroy(struct snap_dpa_virtq *vq)
 	snap_dpa_log_print(vq->rt_thr->thread->dpa_log);
 	//printf("wait... a4 destroy command\n");getchar();
 	if (vq->msix_eq) {
-		snap_dpa_rt_thread_msix_remove(vq->rt_thr, vq->msix_eq);
+		snap_dpa_rt_thread_msix_remove(vq->rt_thr, vq->rt_qid, vq->msix_eq);
 		snap_dpa_msix_eq_destroy(vq->msix_eq);
 	}
 	snap_dpa_duar_destroy(vq->duar);
+	snap_dpa_rt_thread_queue_del(vq->rt_thr, vq->rt_qid);
 	snap_dpa_rt_thread_put(vq->rt_thr);
 	snap_dpa_rt_put(vq->rt);
 	snap_destroy_cross_mkey(vq->cross_mkey);
@@ -292,7 +334,7 @@ static int snap_dpa_virtq_query(struct snap_dpa_virtq *vq,
 	mbox = snap_dpa_thread_mbox_acquire(vq->rt_thr->thread);
 
 	cmd = (struct dpa_virtq_cmd *)snap_dpa_mbox_to_cmd(mbox);
-	snap_dpa_cmd_send(vq->rt_thr->thread, &cmd->base, DPA_VIRTQ_CMD_QUERY);
+	snap_dpa_virtq_cmd_send(vq, cmd, DPA_VIRTQ_CMD_QUERY);
 
 	rsp = (struct dpa_virtq_rsp *)snap_dpa_rsp_wait(mbox);
 	if (rsp->base.status != SNAP_DPA_RSP_OK) {
@@ -323,7 +365,7 @@ static int snap_dpa_virtq_modify(struct snap_dpa_virtq *vq,
 
 	cmd = (struct dpa_virtq_cmd *)snap_dpa_mbox_to_cmd(mbox);
 	cmd->cmd_modify.state = to_dpa_virtq_state(attr->vattr.state);
-	snap_dpa_cmd_send(vq->rt_thr->thread, &cmd->base, DPA_VIRTQ_CMD_MODIFY);
+	snap_dpa_virtq_cmd_send(vq, cmd, DPA_VIRTQ_CMD_MODIFY);
 
 	rsp = snap_dpa_rsp_wait(mbox);
 	if (rsp->status != SNAP_DPA_RSP_OK) {
@@ -418,7 +460,10 @@ static int virtq_blk_dpa_poll(struct snap_virtio_queue *vq, struct virtq_split_t
 	/* TODO: use virtio specific recv msg, save one loop on translation,
 	 * since max virtq heads is known we can pick several messages
 	 */
-	n = snap_dpa_p2p_recv_msg(&dpa_q->rt_thr->dpu_cmd_chan, (struct snap_dpa_p2p_msg **)&msg, 1);
+	/* send coalesced msix requests whose latency bound expired */
+	snap_dpa_rt_thread_p2p_batch_progress(dpa_q->rt_thr);
+
+	n = snap_dpa_rt_thread_p2p_recv(dpa_q->rt_thr, dpa_q->rt_qid, (struct snap_dpa_p2p_msg **)&msg);
 	if (n <= 0)
 		return n;
 
@@ -452,6 +497,7 @@ static int virtq_blk_dpa_poll(struct snap_virtio_queue *vq, struct virtq_split_t
 		return -ENOTSUP;
 	}
 
+	dpa_q->stats.n_reqs_received += msg->descr_head_count;
 	return msg->descr_head_count;
 }
 
@@ -464,9 +510,11 @@ static inline int flush_completions(struct snap_dpa_virtq *dpa_q)
 	used_elem_addr = dpa_q->common.device +
 			offsetof(struct vring_used, ring[dpa_q->host_used_index & (dpa_q->common.size - 1)]);
 
+	snap_dpa_rt_thread_chan_lock(dpa_q->rt_thr);
 	ret = snap_dma_q_write_short(dpa_q->rt_thr->dpu_cmd_chan.dma_q, dpa_q->pending_comps,
 			sizeof(struct vring_used_elem) * dpa_q->num_pending_comps, used_elem_addr,
 			dpa_q->cross_mkey->mkey);
+	snap_dpa_rt_thread_chan_unlock(dpa_q->rt_thr);
 	if (snap_unlikely(ret)) {
 		SNAP_LIB_LOG_INFO("failed to send completion - %d", ret);
 		return ret;
@@ -490,8 +538,8 @@ int virtq_blk_dpa_complete(struct snap_virtio_queue *vq, struct vring_used_elem
 	dpa_q->hw_used_index++;
 	dpa_q->stats.n_io_completed++;
 
-	/* after 8 gains are marginal. TODO: virtq param */
-	if (dpa_q->num_pending_comps >= 8)
+	/* used elements go out in the largest single write the channel allows */
+	if (dpa_q->num_pending_comps >= SNAP_DPA_VIRTQ_COMP_WRITE_MAX)
 		goto flush_comps;
 
 	if ((dpa_q->hw_used_index & (dpa_q->common.size - 1)) == 0)
@@ -505,12 +553,72 @@ flush_comps:
 	return ret;
 }
 
+static uint64_t dpa_virtq_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Decide if completions must be made visible to the driver now. Used index
+ * update and msix are sent at once if the queue went idle. Otherwise they are
+ * held until the batch is full or the oldest completion has waited for
+ * comp_max_delay usec. The batch doubles while more than a batch of requests
+ * is in flight and halves every time the latency bound, rather than the
+ * completion rate, closes it.
+ */
+static bool dpa_virtq_comp_batch_ready(struct snap_dpa_virtq *dpa_q)
+{
+	uint16_t n_comps = dpa_q->hw_used_index - dpa_q->last_hw_used_index;
+	uint32_t inflight, batch;
+	uint64_t now;
+
+	if (!n_comps)
+		return false;
+
+	if (!dpa_q->comp_max_delay)
+		return true;
+
+	inflight = dpa_q->stats.n_reqs_received - dpa_q->stats.n_io_completed;
+	if (!inflight) {
+		dpa_q->stats.n_idle_updates++;
+		goto ready;
+	}
+
+	batch = dpa_q->stats.comp_batch;
+	if (n_comps >= batch) {
+		if (inflight >= batch)
+			dpa_q->stats.comp_batch = snap_min(2 * batch, dpa_q->comp_batch_max);
+		goto ready;
+	}
+
+	now = dpa_virtq_now_usec();
+	if (!dpa_q->comp_ts) {
+		dpa_q->comp_ts = now;
+		return false;
+	}
+
+	if (now - dpa_q->comp_ts < dpa_q->comp_max_delay)
+		return false;
+
+	dpa_q->stats.comp_batch = snap_max(batch / 2, 1);
+	dpa_q->stats.n_timeout_updates++;
+ready:
+	dpa_q->comp_ts = 0;
+	return true;
+}
+
 int virtq_blk_dpa_send_completions(struct snap_virtio_queue *vq)
 {
 	struct snap_dpa_virtq *dpa_q = to_dpa_queue(vq);
 	uint64_t used_idx_addr;
 	int ret;
 
+	if (!dpa_virtq_comp_batch_ready(dpa_q))
+		return 0;
+
 	if (dpa_q->num_pending_comps) {
 		ret = flush_completions(dpa_q);
 		if (ret)
@@ -524,9 +632,11 @@ int virtq_blk_dpa_send_completions(struct snap_virtio_queue *vq)
 		return 0;
 
 	used_idx_addr = dpa_q->common.device + offsetof(struct vring_used, idx);
+	snap_dpa_rt_thread_chan_lock(dpa_q->rt_thr);
 	ret = snap_dma_q_write_short(dpa_q->rt_thr->dpu_cmd_chan.dma_q, &dpa_q->hw_used_index, sizeof(uint16_t),
 			used_idx_addr, dpa_q->cross_mkey->mkey);
 	if (ret) {
+		snap_dpa_rt_thread_chan_unlock(dpa_q->rt_thr);
 		SNAP_LIB_LOG_INFO("failed to send hw_used - %d", ret);
 		return ret;
 	}
@@ -535,13 +645,14 @@ int virtq_blk_dpa_send_completions(struct snap_virtio_queue *vq)
 	dpa_q->stats.n_used_updates++;
 
 	if (dpa_q->msix_eq) {
-		ret = snap_dpa_p2p_send_msix(&dpa_q->rt_thr->dpu_cmd_chan, 0);
+		ret = snap_dpa_rt_thread_p2p_send_msix(dpa_q->rt_thr, dpa_q->rt_qid);
 		if (ret)
 			SNAP_LIB_LOG_INFO("failed to send msix msg at used %d ret %d", dpa_q->last_hw_used_index, ret);
 	}
 
 	/* kick off completions */
 	dpa_q->rt_thr->dpu_cmd_chan.dma_q->ops->progress_tx(dpa_q->rt_thr->dpu_cmd_chan.dma_q, -1);
+	snap_dpa_rt_thread_chan_unlock(dpa_q->rt_thr);
 	return ret;
 }
 
@@ -550,8 +661,10 @@ int virtq_blk_dpa_send_status(struct snap_virtio_queue *vq, void *data, int size
 	struct snap_dpa_virtq *dpa_q = to_dpa_queue(vq);
 	int ret;
 
+	snap_dpa_rt_thread_chan_lock(dpa_q->rt_thr);
 	ret = snap_dma_q_write_short(dpa_q->rt_thr->dpu_cmd_chan.dma_q, data, size,
 			raddr, dpa_q->cross_mkey->mkey);
+	snap_dpa_rt_thread_chan_unlock(dpa_q->rt_thr);
 	return ret;
 }
 
@@ -15,6 +15,20 @@
 
 #include "snap_dpa_common.h"
 #include "snap_dpa_virtq_common.h"
+#if !__DPA
+#include "snap_dpa_p2p.h"
+#include "snap_dpa_rt.h"
+#endif
+
+#define SNAP_DPA_VIRTQ_PER_THREAD "SNAP_DPA_VIRTQ_PER_THREAD"
+#define SNAP_DPA_VIRTQ_P2P_BATCH_USEC "SNAP_DPA_VIRTQ_P2P_BATCH_USEC"
+#define SNAP_DPA_VIRTQ_COMP_BATCH_USEC "SNAP_DPA_VIRTQ_COMP_BATCH_USEC"
+
+/* used elements that fit into a single write on the dpu command channel */
+#define SNAP_DPA_VIRTQ_COMP_WRITE_MAX \
+	(SNAP_DPA_RT_QP_TX_ELEM_SIZE / sizeof(struct vring_used_elem))
+/* completion batch never grows beyond the heads that one p2p message brings */
+#define SNAP_DPA_VIRTQ_COMP_BATCH_MAX SNAP_DPA_P2P_VQ_MAX_HEADS
 
 #if !__DPA
 struct snap_dpa_virtq {
@@ -28,6 +42,8 @@ struct snap_dpa_virtq {
 
 	struct snap_dpa_rt *rt;
 	struct snap_dpa_rt_thread *rt_thr;
+	/* queue id on the rt thread */
+	int rt_qid;
 
 	struct ibv_mr *desc_shadow_mr;
 	struct vring_desc *desc_shadow;
@@ -44,15 +60,25 @@ struct snap_dpa_virtq {
 	uint16_t hw_used_index;
 	uint16_t last_hw_used_index;
 	uint16_t host_used_index;
-	/* todo: make max pending comps configurable */
-	struct vring_used_elem pending_comps[16];
+	struct vring_used_elem pending_comps[SNAP_DPA_VIRTQ_COMP_WRITE_MAX];
 	int num_pending_comps;
 	int debug_count;
 
+	/* adaptive completion batching, disabled if comp_max_delay is 0 */
+	uint16_t comp_batch_max;
+	uint32_t comp_max_delay;
+	/* when the oldest unpublished completion was seen */
+	uint64_t comp_ts;
+
 	struct {
+		uint32_t n_reqs_received;
 		uint32_t n_io_completed;
 		uint32_t n_compl_updates;
 		uint32_t n_used_updates;
+		/* completions per used index update chosen by the policy */
+		uint32_t comp_batch;
+		uint32_t n_idle_updates;
+		uint32_t n_timeout_updates;
 	} stats;
 };
 
@@ -71,6 +71,7 @@ struct dpa_virtq_stats {
 
 	uint32_t n_sends;
 	uint32_t n_long_sends;
+	uint32_t n_no_credits;
 };
 
 /* TODO: optimize field alignment */
@@ -92,9 +93,17 @@ struct dpa_virtq {
 	uint32_t pending;
 	uint32_t do_recovery;
 
+	/* slot on the DPA thread, used as p2p message qid */
+	uint16_t qid;
+	uint32_t msix_pending;
+	struct snap_hw_cq msix_cq;
+
 	struct dpa_virtq_stats stats;
 };
 
+/* max number of virtqs that can be served by one DPA thread */
+#define SNAP_DPA_VIRTQ_MAX_PER_THREAD 8
+
 struct dpa_virtq_cmd_create {
 	struct dpa_virtq vq;
 	int do_recovery;
@@ -123,6 +132,7 @@ struct dpa_virtq_rsp_health_check {
 
 struct dpa_virtq_cmd {
 	struct snap_dpa_cmd base;
+	uint16_t qid;
 	union {
 		struct dpa_virtq_cmd_create cmd_create;
 		struct dpa_virtq_cmd_modify cmd_modify;
@@ -330,6 +330,110 @@ void snap_umem_reset(struct snap_umem *umem)
 	memset(umem, 0, sizeof(*umem));
 }
 
+/* records of a page are tracked by a single free mask */
+#define SNAP_DBRECS_PER_PAGE (SNAP_DBREC_PAGE_SIZE / SNAP_DBREC_SIZE)
+SNAP_STATIC_ASSERT(SNAP_DBRECS_PER_PAGE == 64, "dbrec page must hold 64 records");
+
+struct snap_dbrec_page {
+	struct snap_umem umem;
+	struct ibv_context *context;
+	uint64_t free_mask;
+	LIST_ENTRY(snap_dbrec_page) entry;
+};
+
+static LIST_HEAD(snap_dbrec_page_list_head, snap_dbrec_page) snap_dbrec_pages = LIST_HEAD_INITIALIZER(snap_dbrec_pages);
+static pthread_mutex_t snap_dbrec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct snap_dbrec_page *snap_dbrec_page_create(struct ibv_context *ctx)
+{
+	struct snap_dbrec_page *page;
+
+	page = calloc(1, sizeof(*page));
+	if (!page)
+		return NULL;
+
+	page->umem.size = SNAP_DBREC_PAGE_SIZE;
+	if (snap_umem_init(ctx, &page->umem)) {
+		free(page);
+		return NULL;
+	}
+
+	page->context = ctx;
+	page->free_mask = UINT64_MAX;
+	LIST_INSERT_HEAD(&snap_dbrec_pages, page, entry);
+	return page;
+}
+
+/**
+ * snap_dbrec_alloc() - allocate doorbell record
+ * @ctx:   ibv context
+ * @dbrec: doorbell record
+ *
+ * Doorbell records of all queues of the @ctx are packed into shared pages.
+ * Compared to appending a record to every queue buffer this saves a umem
+ * registration for queues that keep their buffer elsewhere (on DPA) and
+ * a page for queues whose buffer is page sized.
+ *
+ * The record is zeroed.
+ *
+ * Return:
+ * 0 or -errno on error
+ */
+int snap_dbrec_alloc(struct ibv_context *ctx, struct snap_dbrec *dbrec)
+{
+	struct snap_dbrec_page *page;
+	int idx;
+
+	pthread_mutex_lock(&snap_dbrec_lock);
+	LIST_FOREACH(page, &snap_dbrec_pages, entry) {
+		if (page->context == ctx && page->free_mask)
+			break;
+	}
+
+	if (!page) {
+		page = snap_dbrec_page_create(ctx);
+		if (!page) {
+			pthread_mutex_unlock(&snap_dbrec_lock);
+			SNAP_LIB_LOG_ERR("%s: failed to allocate dbrec page", ibv_get_device_name(ctx->device));
+			return -ENOMEM;
+		}
+	}
+
+	idx = __builtin_ctzll(page->free_mask);
+	page->free_mask &= ~(1ULL << idx);
+	pthread_mutex_unlock(&snap_dbrec_lock);
+
+	dbrec->page = page;
+	dbrec->offset = idx * SNAP_DBREC_SIZE;
+	dbrec->buf = page->umem.buf + dbrec->offset;
+	dbrec->umem_id = page->umem.devx_umem->umem_id;
+	memset(dbrec->buf, 0, SNAP_DBREC_SIZE);
+	return 0;
+}
+
+/**
+ * snap_dbrec_free() - free doorbell record
+ * @dbrec: doorbell record
+ *
+ * The record page is released once all its records are free.
+ */
+void snap_dbrec_free(struct snap_dbrec *dbrec)
+{
+	struct snap_dbrec_page *page = dbrec->page;
+
+	pthread_mutex_lock(&snap_dbrec_lock);
+	page->free_mask |= 1ULL << (dbrec->offset / SNAP_DBREC_SIZE);
+	if (page->free_mask != UINT64_MAX) {
+		pthread_mutex_unlock(&snap_dbrec_lock);
+		return;
+	}
+	LIST_REMOVE(page, entry);
+	pthread_mutex_unlock(&snap_dbrec_lock);
+
+	snap_umem_reset(&page->umem);
+	free(page);
+}
+
 static LIST_HEAD(snap_uar_list_head, snap_uar) snap_uar_list = LIST_HEAD_INITIALIZER(snap_uar_list);
 static pthread_mutex_t snap_uar_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -338,28 +442,54 @@ static const char *snap_uar_name(struct snap_uar *uar)
 	return ibv_get_device_name(uar->context->device);
 }
 
-static struct snap_uar *snap_uar_lookup(struct ibv_context *ctx)
+static struct snap_uar *snap_uar_lookup(struct ibv_context *ctx, int slot)
 {
 	struct snap_uar *uar;
 
 	LIST_FOREACH(uar, &snap_uar_list, entry) {
-		if (uar->context == ctx)
+		if (uar->context == ctx && uar->slot == slot)
 			return uar;
 	}
 	return NULL;
 }
 
-/* TODO: allow multiple ibv contexts, keep a list of (context, uar) */
+/**
+ * snap_uar_get() - get the default uar of the ibv context
+ * @ctx: ibv context
+ *
+ * Same as snap_uar_get_slot(ctx, 0)
+ *
+ * Return:
+ * uar or NULL on error
+ */
 struct snap_uar *snap_uar_get(struct ibv_context *ctx)
+{
+	return snap_uar_get_slot(ctx, 0);
+}
+
+/**
+ * snap_uar_get_slot() - get uar page from the ibv context pool
+ * @ctx:  ibv context
+ * @slot: uar page index in the pool
+ *
+ * Every ibv context has a pool of uar pages, allocated on first use and
+ * reference counted. Queues that are used by different threads can be
+ * given different slots so that their doorbells do not go through the
+ * same page.
+ *
+ * Return:
+ * uar or NULL on error
+ */
+struct snap_uar *snap_uar_get_slot(struct ibv_context *ctx, int slot)
 {
 	struct snap_uar *uar;
 
-	/* since DPU 64bit writes are atomic it is safe to use single
-	 * UAR per ibv context. (EliavB)
+	/* since DPU 64bit writes are atomic it is safe to share a
+	 * UAR between threads. (EliavB)
 	 */
 	pthread_mutex_lock(&snap_uar_list_lock);
 
-	uar = snap_uar_lookup(ctx);
+	uar = snap_uar_lookup(ctx, slot);
 	if (!uar) {
 		uar = calloc(1, sizeof(*uar));
 		if (!uar)
@@ -391,9 +521,10 @@ struct snap_uar *snap_uar_get(struct ibv_context *ctx)
 
 	uar->refcnt = 1;
 	uar->context = ctx;
+	uar->slot = slot;
 	LIST_INSERT_HEAD(&snap_uar_list, uar, entry);
-	SNAP_LIB_LOG_DBG("%s: NEW UAR: ctx %p uar %p nc %d", snap_uar_name(uar), ctx,
-		   uar->uar, uar->nc);
+	SNAP_LIB_LOG_DBG("%s: NEW UAR: ctx %p slot %d uar %p nc %d", snap_uar_name(uar), ctx,
+		   slot, uar->uar, uar->nc);
 	pthread_mutex_unlock(&snap_uar_list_lock);
 	return uar;
 
@@ -14,6 +14,7 @@
 #define SNAP_MR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/queue.h>
 #if !defined(__DPA)
 #include <infiniband/verbs.h>
@@ -90,9 +91,28 @@ snap_destroy_indirect_mkey(struct snap_indirect_mkey *mkey);
 int snap_umem_init(struct ibv_context *context, struct snap_umem *umem);
 void snap_umem_reset(struct snap_umem *umem);
 
+/* doorbell records are cache line sized so that queues never share a line */
+#define SNAP_DBREC_SIZE 64
+#define SNAP_DBREC_PAGE_SIZE 4096
+
+struct snap_dbrec_page;
+
+struct snap_dbrec {
+	void *buf;
+	uint32_t umem_id;
+	/* record offset within umem */
+	uint64_t offset;
+	struct snap_dbrec_page *page;
+};
+
+int snap_dbrec_alloc(struct ibv_context *ctx, struct snap_dbrec *dbrec);
+void snap_dbrec_free(struct snap_dbrec *dbrec);
+
 struct snap_uar {
 	struct mlx5dv_devx_uar *uar;
 	struct ibv_context *context;
+	/* index of the uar page in the context pool */
+	int slot;
 	int refcnt;
 	bool nc; /* non cacheable */
 
@@ -100,6 +120,7 @@ struct snap_uar {
 };
 
 struct snap_uar *snap_uar_get(struct ibv_context *ctx);
+struct snap_uar *snap_uar_get_slot(struct ibv_context *ctx, int slot);
 void snap_uar_put(struct snap_uar *uar);
 
 struct snap_relaxed_ordering_caps {
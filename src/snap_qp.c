@@ -34,6 +34,30 @@ SNAP_LIB_LOG_REGISTER(QP)
 #endif
 
 SNAP_ENV_REG_ENV_VARIABLE(SNAP_QP_ISOLATE_VL_TC_ENABLE, SNAP_QP_ISOLATE_VL_TC_ENABLE_DEFAULT);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_QP_UAR_POOL_SIZE, 4);
+
+/* uar pool slot of the calling thread, assigned on the first queue creation */
+static __thread int snap_qp_uar_slot = -1;
+static int snap_qp_uar_next_slot;
+
+/*
+ * Queues should use the uar of the thread that rings their doorbells. If the
+ * caller does not give a slot, every thread that creates queues gets its own
+ * slot round robin. Slots are wrapped by SNAP_QP_UAR_POOL_SIZE.
+ */
+static struct snap_uar *snap_qp_uar_get(struct ibv_context *ctx, bool use_slot, int slot)
+{
+	int pool_size = snap_max(snap_env_getenv(SNAP_QP_UAR_POOL_SIZE), 1);
+
+	if (!use_slot) {
+		if (snap_qp_uar_slot < 0)
+			snap_qp_uar_slot = __atomic_fetch_add(&snap_qp_uar_next_slot, 1,
+							      __ATOMIC_RELAXED);
+		slot = snap_qp_uar_slot;
+	}
+
+	return snap_uar_get_slot(ctx, (unsigned int)slot % pool_size);
+}
 
 static bool cq_validate_attr(const struct snap_cq_attr *attr)
 {
@@ -57,6 +81,18 @@ static void cq_init_buf(struct snap_devx_cq *devx_cq, void *cq_buf)
 	}
 }
 
+static void devx_alias_get(struct snap_devx_common *base, struct snap_dpa_ctx *dpa_ctx)
+{
+	base->alias_dctx = dpa_ctx;
+	base->alias_refs++;
+}
+
+static void devx_alias_put(struct snap_devx_common *base, struct ibv_context *ctx)
+{
+	for (; base->alias_refs; base->alias_refs--)
+		snap_dpa_alias_put(base->alias_dctx, ctx);
+}
+
 static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struct snap_cq_attr *attr)
 {
 	uint32_t in[DEVX_ST_SZ_DW(create_cq_in)] = {0};
@@ -74,7 +110,7 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 	uint64_t dbr_addr;
 	uint32_t page_id;
 
-	cq_uar = snap_uar_get(ctx);
+	cq_uar = snap_qp_uar_get(ctx, attr->use_uar_slot, attr->uar_slot);
 	if (!cq_uar)
 		return -EINVAL;
 
@@ -99,16 +135,20 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 				goto deref_uar;
 		}
 
-		cq_mem_size = attr->cqe_size * devx_cq->cqe_cnt + SNAP_MLX5_DBR_SIZE;
+		cq_mem_size = attr->cqe_size * devx_cq->cqe_cnt;
 		devx_cq->devx.umem.size = cq_mem_size;
 		ret = snap_umem_init(ctx, &devx_cq->devx.umem);
 		if (ret)
 			goto deref_uar;
 
+		ret = snap_dbrec_alloc(ctx, &devx_cq->devx.dbrec);
+		if (ret)
+			goto reset_cq_umem;
+
 		umem_id = devx_cq->devx.umem.devx_umem->umem_id;
 		umem_offset = 0;
-		dbr_umem_id = umem_id;
-		dbr_addr = (uint64_t)attr->cqe_size * devx_cq->cqe_cnt;
+		dbr_umem_id = devx_cq->devx.dbrec.umem_id;
+		dbr_addr = devx_cq->devx.dbrec.offset;
 		page_id = cq_uar->uar->page_id;
 	} else {
 		if (attr->dpa_element_type == MLX5_APU_ELEMENT_TYPE_THREAD) {
@@ -125,6 +165,7 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 				ret = -EINVAL;
 				goto deref_uar;
 			}
+			devx_alias_get(&devx_cq->devx, dpa_proc);
 			DEVX_SET(cqc, cqctx, always_armed_cq, 1);
 		} else if (attr->dpa_element_type == MLX5_APU_ELEMENT_TYPE_EQ ||
 			   attr->dpa_element_type == MLX5_APU_ELEMENT_TYPE_EMULATED_DEV_EQ) {
@@ -163,8 +204,9 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 		ret = snap_check_create_alias_dumem(dpa_proc, ctx, &umem_id); 
 		if (ret) {
 			ret = -EINVAL;
-			goto deref_uar;
+			goto free_dpa_mem;
 		}		
+		devx_alias_get(&devx_cq->devx, dpa_proc);
 		umem_offset = snap_dpa_process_umem_offset(dpa_proc, snap_dpa_mem_addr(devx_cq->devx.dpa_mem));
 		/*
 		 * TODO: switch back to the host uar, our cqs on dpa should be either
@@ -177,21 +219,21 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 		ret = snap_check_create_alias_uar(dpa_proc, ctx, &page_id); 
 		if (ret) {
 			ret = -EINVAL;
-			goto deref_uar;
+			goto free_dpa_mem;
 		}
+		devx_alias_get(&devx_cq->devx, dpa_proc);
 		/* always put dbr record on dpu side. This way cq can be armed
 		 * both from dpu and dpa. Consider adding a special option for
 		 * this
 		 *
 		 * Note that with dpa uar it can not be reliably armoed from host
 		 */
-		devx_cq->devx.umem.size = SNAP_MLX5_DBR_SIZE;
-		ret = snap_umem_init(ctx, &devx_cq->devx.umem);
+		ret = snap_dbrec_alloc(ctx, &devx_cq->devx.dbrec);
 		if (ret)
 			goto free_dpa_mem;
 
-		dbr_umem_id = devx_cq->devx.umem.devx_umem->umem_id;
-		dbr_addr = 0;
+		dbr_umem_id = devx_cq->devx.dbrec.umem_id;
+		dbr_addr = devx_cq->devx.dbrec.offset;
 		SNAP_LIB_LOG_DBG("memsize %lu umem_id %d umem_offset %lu type %d eqn/thr_id %d dpa_va: 0x%0lx page_id host/dpa 0x%0x/0x%0x",
 				cq_mem_size + SNAP_MLX5_DBR_SIZE, umem_id, umem_offset, attr->dpa_element_type,
 				devx_cq->eqn_or_dpa_element, snap_dpa_mem_addr(devx_cq->devx.dpa_mem), cq_uar->uar->page_id, page_id);
@@ -266,11 +308,14 @@ static int devx_cq_init(struct snap_cq *cq, struct ibv_context *ctx, const struc
 	return 0;
 
 reset_cq_umem:
+	if (devx_cq->devx.dbrec.page)
+		snap_dbrec_free(&devx_cq->devx.dbrec);
 	snap_umem_reset(&devx_cq->devx.umem);
 free_dpa_mem:
 	if (attr->cq_on_dpa)
 		snap_dpa_mem_free(devx_cq->devx.dpa_mem);
 deref_uar:
+	devx_alias_put(&devx_cq->devx, ctx);
 	snap_uar_put(cq_uar);
 	return ret;
 }
@@ -278,6 +323,8 @@ deref_uar:
 static void devx_common_reset(struct snap_devx_common *base)
 {
 	mlx5dv_devx_obj_destroy(base->devx_obj);
+	if (base->dbrec.page)
+		snap_dbrec_free(&base->dbrec);
 	snap_umem_reset(&base->umem);
 	if (base->on_dpa)
 		snap_dpa_mem_free(base->dpa_mem);
@@ -289,6 +336,7 @@ static void devx_cq_reset(struct snap_cq *cq)
 	struct snap_devx_cq *devx_cq = &cq->devx_cq;
 
 	devx_common_reset(&devx_cq->devx);
+	devx_alias_put(&devx_cq->devx, devx_cq->devx.ctx);
 }
 
 int devx_cq_to_hw_cq(struct snap_cq *cq, struct snap_hw_cq *hw_cq)
@@ -298,11 +346,10 @@ int devx_cq_to_hw_cq(struct snap_cq *cq, struct snap_hw_cq *hw_cq)
 	memset(hw_cq, 0, sizeof(*hw_cq));
 	if (!devx_cq->devx.on_dpa) {
 		hw_cq->cq_addr = (uintptr_t)devx_cq->devx.umem.buf;
-		hw_cq->dbr_addr = hw_cq->cq_addr + devx_cq->cqe_cnt * devx_cq->cqe_size;
 	} else {
 		hw_cq->cq_addr = snap_dpa_mem_addr(devx_cq->devx.dpa_mem);
-		hw_cq->dbr_addr = (uintptr_t)devx_cq->devx.umem.buf;
 	}
+	hw_cq->dbr_addr = (uintptr_t)devx_cq->devx.dbrec.buf;
 	hw_cq->ci = 0;
 	hw_cq->cqe_cnt = devx_cq->cqe_cnt;
 	hw_cq->cqe_size = devx_cq->cqe_size;
@@ -516,8 +563,9 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	int ret;
 	size_t qp_buf_len;
 	uint32_t pd_id;
-	uint32_t umem_id;
+	uint32_t umem_id, dbr_umem_id;
 	uint64_t umem_offset;
+	uint64_t dbr_addr;
 	uint32_t page_id;
 
 	/* TODO: check actual caps */
@@ -528,7 +576,7 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	if (ret)
 		return ret;
 
-	qp_uar = snap_uar_get(ctx);
+	qp_uar = snap_qp_uar_get(ctx, attr->use_uar_slot, attr->uar_slot);
 	if (!qp_uar)
 		return -EINVAL;
 
@@ -539,8 +587,6 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	devx_qp->devx.on_dpa = attr->qp_on_dpa;
 
 	/*
-	 * TODO: consider keeping separate cache for the dbrecs like UCX or like
-	 * we had in our first devx_verbs code
 	 * TODO: guard buffer between sq and rq
 	 * TODO: adjust sq and rq sizes according to num_sge and perhaps umrs
 	 */
@@ -549,13 +595,20 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 				     SNAP_MLX5_L2_CACHE_SIZE);
 
 	if (!attr->qp_on_dpa) {
-		devx_qp->devx.umem.size = qp_buf_len + SNAP_MLX5_DBR_SIZE;
+		devx_qp->devx.umem.size = qp_buf_len;
 		ret = snap_umem_init(ctx, &devx_qp->devx.umem);
 		if (ret)
 			goto deref_uar;
 
+		/* dbrecs are kept in shared pages, see snap_dbrec_alloc() */
+		ret = snap_dbrec_alloc(ctx, &devx_qp->devx.dbrec);
+		if (ret)
+			goto reset_qp_umem;
+
 		umem_id = devx_qp->devx.umem.devx_umem->umem_id;
 		umem_offset = 0;
+		dbr_umem_id = devx_qp->devx.dbrec.umem_id;
+		dbr_addr = devx_qp->devx.dbrec.offset;
 		page_id = qp_uar->uar->page_id;
 	} else {
 		if (!attr->dpa_proc) {
@@ -577,6 +630,7 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 			ret = -EINVAL;
 			goto reset_qp_umem;
 		}
+		devx_alias_get(&devx_qp->devx, attr->dpa_proc);
 		umem_offset = snap_dpa_process_umem_offset(attr->dpa_proc, snap_dpa_mem_addr(devx_qp->devx.dpa_mem));
 		page_id = snap_dpa_process_uar_id(attr->dpa_proc);
 
@@ -586,6 +640,11 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 			ret = -EINVAL;
 			goto reset_qp_umem;
 		}
+		devx_alias_get(&devx_qp->devx, attr->dpa_proc);
+
+		/* dbr must stay on DPA next to the queue */
+		dbr_umem_id = umem_id;
+		dbr_addr = umem_offset + qp_buf_len;
 	}
 
 	devx_qp->dbr_offset = qp_buf_len;
@@ -637,9 +696,9 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	}
 
 	DEVX_SET(qpc, qpc, dbr_umem_valid, 1);
-	DEVX_SET(qpc, qpc, dbr_umem_id, umem_id);
+	DEVX_SET(qpc, qpc, dbr_umem_id, dbr_umem_id);
 	/* offset within umem */
-	DEVX_SET64(qpc, qpc, dbr_addr, umem_offset + qp_buf_len);
+	DEVX_SET64(qpc, qpc, dbr_addr, dbr_addr);
 
 	DEVX_SET(create_qp_in, in, wq_umem_id, umem_id);
 	DEVX_SET(create_qp_in, in, wq_umem_valid, 1);
@@ -660,11 +719,14 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	return 0;
 
 reset_qp_umem:
-	if (!attr->qp_on_dpa)
+	if (!attr->qp_on_dpa) {
+		if (devx_qp->devx.dbrec.page)
+			snap_dbrec_free(&devx_qp->devx.dbrec);
 		snap_umem_reset(&devx_qp->devx.umem);
-	else
+	} else
 		snap_dpa_mem_free(devx_qp->devx.dpa_mem);
 deref_uar:
+	devx_alias_put(&devx_qp->devx, ctx);
 	snap_uar_put(qp_uar);
 	return ret;
 }
@@ -674,6 +736,7 @@ static void devx_qp_reset(struct snap_qp *qp)
 	struct snap_devx_qp *devx_qp = &qp->devx_qp;
 
 	devx_common_reset(&devx_qp->devx);
+	devx_alias_put(&devx_qp->devx, devx_qp->devx.pd->context);
 }
 
 static int devx_qp_to_hw_qp(struct snap_qp *qp, struct snap_hw_qp *hw_qp)
@@ -683,7 +746,7 @@ static int devx_qp_to_hw_qp(struct snap_qp *qp, struct snap_hw_qp *hw_qp)
 	if (!devx_qp->devx.on_dpa) {
 		hw_qp->sq.addr = (uintptr_t)devx_qp->devx.umem.buf + SNAP_MLX5_RECV_WQE_BB * devx_qp->rq_size;
 		hw_qp->rq.addr = (uintptr_t)devx_qp->devx.umem.buf;
-		hw_qp->dbr_addr = (uintptr_t)devx_qp->devx.umem.buf + devx_qp->dbr_offset;
+		hw_qp->dbr_addr = (uintptr_t)devx_qp->devx.dbrec.buf;
 	} else {
 		hw_qp->sq.addr = snap_dpa_mem_addr(devx_qp->devx.dpa_mem) + SNAP_MLX5_RECV_WQE_BB * devx_qp->rq_size;
 		hw_qp->rq.addr = snap_dpa_mem_addr(devx_qp->devx.dpa_mem);
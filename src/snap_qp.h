@@ -47,6 +47,7 @@
 #define SNAP_MLX5_CQ_ARM_DB 1
 
 #define SNAP_QP_ISOLATE_VL_TC_ENABLE "SNAP_QP_ISOLATE_VL_TC_ENABLE"
+#define SNAP_QP_UAR_POOL_SIZE "SNAP_QP_UAR_POOL_SIZE"
 
 enum {
 	SNAP_OBJ_VERBS = 0x1,
@@ -73,12 +74,17 @@ struct snap_devx_common {
 	struct snap_uar *uar;
 	struct snap_umem umem;
 	struct snap_dpa_memh *dpa_mem;
+	/* doorbell record on the DPU side, unused by qps on DPA */
+	struct snap_dbrec dbrec;
 
 	union {
 		struct ibv_pd *pd;
 		struct ibv_context *ctx;
 	};
 	bool on_dpa;
+	/* references taken by snap_check_create_alias_*() */
+	struct snap_dpa_ctx *alias_dctx;
+	int alias_refs;
 };
 
 struct snap_devx_cq {
@@ -107,6 +113,10 @@ struct snap_cq_attr {
 
 	uint32_t eqn;
 	bool use_eqn;
+
+	/* uar pool slot, by default the slot of the creating thread is used */
+	bool use_uar_slot;
+	int uar_slot;
 };
 
 struct snap_cq;
@@ -151,6 +161,10 @@ struct snap_qp_attr {
 
 	bool qp_on_dpa;
 	struct snap_dpa_ctx *dpa_proc;
+
+	/* uar pool slot, by default the slot of the creating thread is used */
+	bool use_uar_slot;
+	int uar_slot;
 };
 #endif /* !__DPA */
 
@@ -11,16 +11,16 @@
  */
 
 #include <unistd.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <time.h>
 
 #include "snap_channel.h"
 #include "snap_rdma_channel.h"
+#include "snap_macros.h"
 
 #define SNAP_CHANNEL_POLL_BATCH 16
 #define SNAP_CHANNEL_MAX_COMPLETIONS 64
-/* aligns x to y, y must be a power of 2 */
-#define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 
 static inline bool is_power_of_two(uint x)
@@ -65,12 +65,35 @@ static int snap_channel_rdma_rw(struct snap_rdma_channel *schannel,
 	return ret;
 }
 
+/*
+ * Detach the bitmap and free it once no marker can see it anymore. Markers
+ * are lock free and may still be writing to the leaves, so wait for the
+ * ones that loaded the bitmap before it was detached.
+ */
+static void snap_channel_free_bitmap(struct snap_dirty_pages *dirty_pages)
+{
+	uint64_t **bmap;
+	int i;
+
+	bmap = __atomic_exchange_n(&dirty_pages->bmap, NULL, __ATOMIC_SEQ_CST);
+	if (!bmap)
+		return;
+
+	while (__atomic_load_n(&dirty_pages->n_markers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	for (i = 0; i < SNAP_CHANNEL_BITMAP_MAX_LEAVES; i++)
+		free(bmap[i]);
+	free(bmap);
+}
+
 static int snap_channel_start_dirty_track(struct snap_rdma_channel *schannel,
 		struct mlx5_snap_common_command *cmd,
 		struct mlx5_snap_completion *cqe)
 {
 	struct mlx5_snap_start_dirty_log_command *dirty_cmd;
 	struct snap_dirty_pages *dirty_pages;
+	uint64_t **bmap;
 	int ret = 0;
 
 	dirty_cmd = (struct mlx5_snap_start_dirty_log_command *)cmd;
@@ -91,24 +114,25 @@ static int snap_channel_start_dirty_track(struct snap_rdma_channel *schannel,
 		cqe->status = MLX5_SNAP_SC_ALREADY_STARTED_LOG;
 		goto out_unlock;
 	}
-	dirty_pages->bmap = calloc(1, SNAP_CHANNEL_INITIAL_BITMAP_SIZE);
-	if (!dirty_pages->bmap) {
+	bmap = calloc(SNAP_CHANNEL_BITMAP_MAX_LEAVES, sizeof(*bmap));
+	if (!bmap) {
 		ret = -ENOMEM;
 		snap_channel_error("failed to allocate dirty pages bitmap\n");
 		cqe->status = MLX5_SNAP_SC_INTERNAL;
 		goto out_unlock;
 	}
 
-	dirty_pages->bmap_num_elements = SNAP_CHANNEL_INITIAL_BITMAP_ARRAY_SZ;
 	dirty_pages->highest_dirty_element = 0;
 	dirty_pages->page_size = dirty_cmd->page_size;
+	dirty_pages->page_shift = __builtin_ctz(dirty_cmd->page_size);
+	/* publish the bitmap after page size is set */
+	__atomic_store_n(&dirty_pages->bmap, bmap, __ATOMIC_RELEASE);
 
 	ret = schannel->base.ops->start_dirty_pages_track(schannel->base.data);
 	if (ret) {
 		snap_channel_info("schannel 0x%p failed to start track\n",
 				  schannel);
-		free(dirty_pages->bmap);
-		dirty_pages->bmap = NULL;
+		snap_channel_free_bitmap(dirty_pages);
 		cqe->status = MLX5_SNAP_SC_INTERNAL;
 	} else {
 		snap_channel_info("schannel 0x%p started dirty track\n",
@@ -158,11 +182,87 @@ out:
 	return ret;
 }
 
+static uint64_t *snap_channel_bitmap_leaf(uint64_t **bmap, uint64_t leaf_idx,
+					  bool alloc)
+{
+	uint64_t *leaf, *new_leaf;
+
+	leaf = __atomic_load_n(&bmap[leaf_idx], __ATOMIC_ACQUIRE);
+	if (snap_likely(leaf) || !alloc)
+		return leaf;
+
+	new_leaf = calloc(SNAP_CHANNEL_BITMAP_LEAF_WORDS, sizeof(*new_leaf));
+	if (!new_leaf)
+		return NULL;
+
+	/* somebody else could install the leaf in the meantime */
+	if (!__atomic_compare_exchange_n(&bmap[leaf_idx], &leaf, new_leaf, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(new_leaf);
+		return leaf;
+	}
+
+	return new_leaf;
+}
+
+static void snap_channel_update_highest(struct snap_dirty_pages *dirty_pages,
+					uint64_t end_element)
+{
+	uint64_t highest;
+
+	highest = __atomic_load_n(&dirty_pages->highest_dirty_element,
+				  __ATOMIC_RELAXED);
+	while (highest < end_element &&
+	       !__atomic_compare_exchange_n(&dirty_pages->highest_dirty_element,
+					    &highest, end_element, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Move the first num_elements bytes of the bitmap to the copy buffer and
+ * clear them. Words are cleared atomically, so pages that are marked
+ * concurrently are either copied now or reported by the next snapshot.
+ */
+static void snap_channel_snapshot_dirty_pages(struct snap_dirty_pages *dirty_pages,
+					      uint8_t *copy_bmap,
+					      uint64_t num_elements)
+{
+	const int word_sz = SNAP_CHANNEL_BITMAP_WORD_BIT_SZ / SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ;
+	uint64_t **bmap = dirty_pages->bmap;
+	uint64_t num_words, w, mask, val;
+	uint64_t *leaf;
+	int i, nbytes;
+
+	num_words = (num_elements + word_sz - 1) / word_sz;
+	for (w = 0; w < num_words; w++) {
+		leaf = snap_channel_bitmap_leaf(bmap, w / SNAP_CHANNEL_BITMAP_LEAF_WORDS,
+						false);
+		if (!leaf) {
+			/* skip the whole leaf, copy_bmap is already zeroed */
+			w |= SNAP_CHANNEL_BITMAP_LEAF_WORDS - 1;
+			continue;
+		}
+
+		nbytes = snap_channel_min(word_sz, num_elements - w * word_sz);
+		mask = nbytes == word_sz ? ~0ULL : (1ULL << (nbytes * 8)) - 1;
+		if (!(__atomic_load_n(&leaf[w % SNAP_CHANNEL_BITMAP_LEAF_WORDS],
+				      __ATOMIC_RELAXED) & mask))
+			continue;
+
+		val = __atomic_fetch_and(&leaf[w % SNAP_CHANNEL_BITMAP_LEAF_WORDS],
+					 ~mask, __ATOMIC_ACQ_REL) & mask;
+		for (i = 0; i < nbytes; i++)
+			copy_bmap[w * word_sz + i] = val >> (i * 8);
+	}
+}
+
 static int snap_channel_get_dirty_size(struct snap_rdma_channel *schannel,
 		struct mlx5_snap_common_command *cmd,
 		struct mlx5_snap_completion *cqe)
 {
 	struct snap_dirty_pages *dirty_pages;
+	uint64_t highest;
 	int ret = 0;
 
 	dirty_pages = &schannel->dirty_pages;
@@ -177,31 +277,26 @@ static int snap_channel_get_dirty_size(struct snap_rdma_channel *schannel,
 	 * copy current dirty "valid" bitmap to a bounce buffer and return the
 	 * size of the buffer. Also reset the "valid" bitmap.
 	 */
-	pthread_mutex_lock(&dirty_pages->lock);
-	if (dirty_pages->highest_dirty_element) {
-		dirty_pages->copy_bmap_num_elements = dirty_pages->highest_dirty_element;
-		dirty_pages->copy_bmap = calloc(dirty_pages->highest_dirty_element,
-						SNAP_CHANNEL_BITMAP_ELEM_SZ);
+	highest = __atomic_exchange_n(&dirty_pages->highest_dirty_element, 0,
+				      __ATOMIC_ACQ_REL);
+	if (highest) {
+		dirty_pages->copy_bmap = calloc(highest, SNAP_CHANNEL_BITMAP_ELEM_SZ);
 		if (!dirty_pages->copy_bmap) {
+			snap_channel_update_highest(dirty_pages, highest);
 			ret = -ENOMEM;
 			snap_channel_error("failed to allocate copy bitmap\n");
 			cqe->status = MLX5_SNAP_SC_INTERNAL;
-			goto out_unlock;
+			goto out_unlock_copy;
 		}
-		memcpy(dirty_pages->copy_bmap, dirty_pages->bmap,
-		       dirty_pages->highest_dirty_element * SNAP_CHANNEL_BITMAP_ELEM_SZ);
-		/* reset the bitmap */
-		memset(dirty_pages->bmap, 0,
-		       dirty_pages->highest_dirty_element * SNAP_CHANNEL_BITMAP_ELEM_SZ);
-		dirty_pages->highest_dirty_element = 0;
+		dirty_pages->copy_bmap_num_elements = highest;
+		snap_channel_snapshot_dirty_pages(dirty_pages, dirty_pages->copy_bmap,
+						  highest);
 		cqe->result = dirty_pages->copy_bmap_num_elements * SNAP_CHANNEL_BITMAP_ELEM_SZ;
 		cqe->status = MLX5_SNAP_SC_SUCCESS;
 	} else {
 		cqe->result = 0;
 		cqe->status = MLX5_SNAP_SC_SUCCESS;
 	}
-out_unlock:
-	pthread_mutex_unlock(&dirty_pages->lock);
 out_unlock_copy:
 	pthread_mutex_unlock(&dirty_pages->copy_lock);
 
@@ -998,11 +1093,6 @@ static void snap_channel_clean_qp(struct snap_rdma_channel *schannel)
 	ibv_dealloc_pd(schannel->pd);
 }
 
-static inline void write_bit(uint8_t *int_block, int nbit)
-{
-	*int_block = *int_block | (1 << nbit);
-}
-
 static int snap_channel_cm_event_handler(struct rdma_cm_id *cm_id,
 					 struct rdma_cm_event *event)
 {
@@ -1091,21 +1181,47 @@ static int snap_channel_bind_id(struct rdma_cm_id *cm_id, struct addrinfo *res)
 	return 0;
 }
 
-static int snap_channel_get_num_elements(uint64_t start_address, int length, int element_size)
+static int snap_channel_bitmap_mark(struct snap_dirty_pages *dirty_pages,
+				    uint64_t **bmap, uint64_t guest_pa, int length)
 {
-	uint64_t aligned_pa;
-	int len_to_next_element;
-
-	/* align to element size (ceiling) */
-	aligned_pa = ALIGN(start_address, element_size);
-	if (aligned_pa == start_address)
-		return (length - 1) / element_size + 1;
-	/* the length to next element */
-	len_to_next_element = aligned_pa - start_address;
-	if (length <= len_to_next_element)
-		return 1;
-	/* length > len_to_next_element, thus, we dirty at least 2 pages (+2) */
-	return ((length - 1) - len_to_next_element) / element_size + 2;
+	uint64_t page, last_page, word_idx, mask, *word;
+	int bit_num, nbits;
+
+	page = guest_pa >> dirty_pages->page_shift;
+	last_page = (guest_pa + snap_channel_max(length, 1) - 1) >> dirty_pages->page_shift;
+	if (snap_unlikely(last_page >= (uint64_t)SNAP_CHANNEL_BITMAP_MAX_LEAVES *
+					SNAP_CHANNEL_BITMAP_LEAF_BIT_SZ)) {
+		snap_channel_error("guest pa 0x%lx len %d is out of the dirty pages bitmap\n",
+				   guest_pa, length);
+		return -EINVAL;
+	}
+
+	/* set the dirty bits a whole word at a time */
+	while (page <= last_page) {
+		word_idx = page / SNAP_CHANNEL_BITMAP_WORD_BIT_SZ;
+		bit_num = page % SNAP_CHANNEL_BITMAP_WORD_BIT_SZ;
+		nbits = snap_channel_min(SNAP_CHANNEL_BITMAP_WORD_BIT_SZ - bit_num,
+					 last_page - page + 1);
+		mask = nbits == SNAP_CHANNEL_BITMAP_WORD_BIT_SZ ?
+			~0ULL : ((1ULL << nbits) - 1) << bit_num;
+
+		word = snap_channel_bitmap_leaf(bmap,
+				word_idx / SNAP_CHANNEL_BITMAP_LEAF_WORDS, true);
+		if (snap_unlikely(!word)) {
+			snap_channel_error("unable to allocate dirty pages bitmap\n");
+			return -ENOMEM;
+		}
+		word += word_idx % SNAP_CHANNEL_BITMAP_LEAF_WORDS;
+
+		/* don't dirty the cache line if the pages are already marked */
+		if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) != mask)
+			__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+		page += nbits;
+	}
+
+	snap_channel_update_highest(dirty_pages,
+				    last_page / SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ + 1);
+	return 0;
 }
 
 /**
@@ -1121,54 +1237,22 @@ int snap_rdma_channel_mark_dirty_page(struct snap_channel *channel, uint64_t gue
 				 int length)
 {
 	struct snap_rdma_channel *schannel = (struct snap_rdma_channel *)channel;
-	int i, bit_num, ret = 0;
-	int page_size, num_dirty_pages, bytes_per_element, num_elements;
-	uint64_t start_page, cur_page, start_element, cur_element, end_element;
+	struct snap_dirty_pages *dirty_pages = &schannel->dirty_pages;
+	uint64_t **bmap;
+	int ret;
 
-	pthread_mutex_lock(&schannel->dirty_pages.lock);
-	if (!schannel->dirty_pages.bmap) {
+	/* pairs with snap_channel_free_bitmap() */
+	__atomic_fetch_add(&dirty_pages->n_markers, 1, __ATOMIC_SEQ_CST);
+	bmap = __atomic_load_n(&dirty_pages->bmap, __ATOMIC_SEQ_CST);
+	if (snap_unlikely(!bmap)) {
+		__atomic_fetch_sub(&dirty_pages->n_markers, 1, __ATOMIC_RELEASE);
 		errno = EPERM;
 		snap_channel_error("dirty pages logging have not been started\n");
-		goto out_unlock;
-	}
-	page_size = schannel->dirty_pages.page_size;
-	start_page = guest_pa / page_size;
-	num_dirty_pages = snap_channel_get_num_elements(guest_pa, length, page_size);
-
-	bytes_per_element = page_size * SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ;
-	start_element = guest_pa / bytes_per_element;
-	num_elements = snap_channel_get_num_elements(guest_pa, length, bytes_per_element);
-
-	end_element = start_element + num_elements;
-	snap_channel_info("total dirty bits: %d, end_element: %ld\n", num_dirty_pages, end_element);
-
-	/* realloc case */
-	if (end_element > schannel->dirty_pages.bmap_num_elements) {
-		while (end_element >= schannel->dirty_pages.bmap_num_elements)
-			schannel->dirty_pages.bmap_num_elements <<= 1;
-		schannel->dirty_pages.bmap = realloc(schannel->dirty_pages.bmap,
-			schannel->dirty_pages.bmap_num_elements * SNAP_CHANNEL_BITMAP_ELEM_SZ);
-		if (!schannel->dirty_pages.bmap) {
-			ret = -ENOMEM;
-			snap_channel_error("unable to realloc dirty pages bitmap\n");
-			schannel->dirty_pages.bmap_num_elements = 0;
-			goto out_unlock;
-		}
-		snap_channel_info("reallocated memory, now the size is %ld\n",
-				  schannel->dirty_pages.bmap_num_elements);
+		return 0;
 	}
-	/* write to the dirty_pages.bmap */
-	for (i = 0; i < num_dirty_pages; i++) {
-		cur_page = start_page + i;
-		cur_element = cur_page / SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ;
-		bit_num = cur_page % SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ;
-		write_bit(&schannel->dirty_pages.bmap[cur_element], bit_num);
-		snap_channel_info("\tcur_element %ld bit_num %d UP\n", cur_element, bit_num);
-	}
-	schannel->dirty_pages.highest_dirty_element = snap_channel_max(end_element,
-					schannel->dirty_pages.highest_dirty_element);
-out_unlock:
-	pthread_mutex_unlock(&schannel->dirty_pages.lock);
+
+	ret = snap_channel_bitmap_mark(dirty_pages, bmap, guest_pa, length);
+	__atomic_fetch_sub(&dirty_pages->n_markers, 1, __ATOMIC_RELEASE);
 	return ret;
 }
 
@@ -1190,17 +1274,10 @@ static void snap_channel_reset_dirty_pages(struct snap_rdma_channel *schannel)
 
 	pthread_mutex_destroy(&dirty_pages->copy_lock);
 
-	pthread_mutex_lock(&dirty_pages->lock);
-	if (dirty_pages->bmap) {
-		free(dirty_pages->bmap);
-		dirty_pages->bmap = NULL;
-	}
+	snap_channel_free_bitmap(dirty_pages);
 	dirty_pages->highest_dirty_element = 0;
-	dirty_pages->bmap_num_elements = 0;
 	dirty_pages->page_size = 0;
-	pthread_mutex_unlock(&dirty_pages->lock);
-
-	pthread_mutex_destroy(&dirty_pages->lock);
+	dirty_pages->page_shift = 0;
 }
 
 static int snap_channel_init_dirty_pages(struct snap_rdma_channel *schannel)
@@ -1209,30 +1286,18 @@ static int snap_channel_init_dirty_pages(struct snap_rdma_channel *schannel)
 	int ret;
 
 	dirty_pages->page_size = 0;
-	dirty_pages->bmap_num_elements = 0;
+	dirty_pages->page_shift = 0;
 	dirty_pages->highest_dirty_element = 0;
 	dirty_pages->bmap = NULL;
+	dirty_pages->n_markers = 0;
 	dirty_pages->copy_bmap_num_elements = 0;
 	dirty_pages->copy_bmap = NULL;
 	dirty_pages->copy_mr = NULL;
 
-	ret = pthread_mutex_init(&dirty_pages->lock, NULL);
-	if (ret) {
-		snap_channel_error("dirty pages mutex init failed\n");
-		goto out;
-	}
-
 	ret = pthread_mutex_init(&dirty_pages->copy_lock, NULL);
-	if (ret) {
+	if (ret)
 		snap_channel_error("dirty pages copy_mutex init failed\n");
-		goto out_free_mutex;
-	}
-
-	return 0;
 
-out_free_mutex:
-	pthread_mutex_destroy(&dirty_pages->lock);
-out:
 	return ret;
 }
 
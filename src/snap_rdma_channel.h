@@ -131,37 +131,47 @@ struct mlx5_snap_common_command {
 
 #define SNAP_CHANNEL_BITMAP_ELEM_SZ sizeof(uint8_t)
 #define SNAP_CHANNEL_BITMAP_ELEM_BIT_SZ (8 * SNAP_CHANNEL_BITMAP_ELEM_SZ)
-#define SNAP_CHANNEL_INITIAL_BITMAP_ARRAY_SZ 1048576
 
 #define snap_channel_max(a, b) (((a) > (b)) ? (a):(b))
+#define snap_channel_min(a, b) (((a) < (b)) ? (a):(b))
 
 /*
- * Initial bitmap size is 1MB (will cover 32GB guest memory in case the page
- * size is 4KB since each bit represents a page
+ * The dirty pages bitmap is kept in two levels: a directory of leaf pointers
+ * which is allocated when the logging is started, and leaves of 64 bit words
+ * which are allocated on the first write to the range they cover. A leaf
+ * covers 256K pages (1GB of guest memory with 4KB pages), the directory
+ * covers 16G pages (64TB of guest memory with 4KB pages).
  */
-#define SNAP_CHANNEL_INITIAL_BITMAP_SIZE \
-	(SNAP_CHANNEL_INITIAL_BITMAP_ARRAY_SZ * SNAP_CHANNEL_BITMAP_ELEM_SZ)
+#define SNAP_CHANNEL_BITMAP_WORD_BIT_SZ 64
+#define SNAP_CHANNEL_BITMAP_LEAF_WORDS 4096
+#define SNAP_CHANNEL_BITMAP_LEAF_BIT_SZ \
+	(SNAP_CHANNEL_BITMAP_LEAF_WORDS * SNAP_CHANNEL_BITMAP_WORD_BIT_SZ)
+#define SNAP_CHANNEL_BITMAP_MAX_LEAVES 65536
 
 /**
  * struct snap_dirty pages - internal struct holds the information of the
  *                           dirty pages in a bit per page manner.
  *
  * @page_size: the page size that is represented by a bit, given by the host.
- * @bmap_num_elements: size of the bmap array, initial equals to
- *                     SNAP_CHANNEL_INITIAL_BITMAP_ARRAY_SZ. increase by x2
- *                     factor when required. one-based.
+ * @page_shift: log2 of the page_size.
+ * @highest_dirty_element: the highest dirty bitmap byte, so we don't have to
+ *                         copy the whole bitmap. one-based.
+ * @bmap: dirty pages bitmap directory with SNAP_CHANNEL_BITMAP_MAX_LEAVES
+ *        leaves.
  *
- * @highest_dirty_element: the highest dirty element, so we don't have to copy
- *                         the whole bitmap. one-based.
- * @lock: bitmap lock.
- * @bmap: dirty pages bitmap array with bmap_num_elements elements.
+ * @n_markers: number of threads that are marking dirty pages right now.
+ *
+ * bmap leaves and highest_dirty_element are updated with atomic operations
+ * only, so marking dirty pages does not take any lock. The bitmap is freed
+ * only after it is detached and n_markers drops to zero. The copy_* fields
+ * are protected by the copy_lock.
  */
 struct snap_dirty_pages {
 	int		page_size;
-	uint64_t	bmap_num_elements;
+	int		page_shift;
 	uint64_t	highest_dirty_element;
-	pthread_mutex_t	lock;
-	uint8_t		*bmap;
+	uint64_t	**bmap;
+	int		n_markers;
 	uint64_t	copy_bmap_num_elements;
 	pthread_mutex_t	copy_lock;
 	uint8_t		*copy_bmap;
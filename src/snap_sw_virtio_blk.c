@@ -20,7 +20,28 @@ SNAP_LIB_LOG_REGISTER(SW_VIRTIO_BLK)
 enum sw_queue_prog_state {
 	READ_AVAILABLE_IDX,
 	READ_HEADER_IDX,
-	NEW_CMD_PROC,
+};
+
+/*
+ * Avail ring is consumed in batches: read avail idx, then read the whole
+ * span of new heads (one or two reads if the span wraps) into the shadow
+ * ring and hand all of them to the caller. Heads are dispatched from the
+ * shadow ring while it is not empty, so the host is polled only once per
+ * batch rather than once per command.
+ *
+ * prev_avail <= heads_idx <= avail_idx (modulo 2^16):
+ *   prev_avail - heads handed to the caller
+ *   heads_idx  - heads available in the shadow ring
+ *   avail_idx  - last avail idx read from the host
+ */
+/*
+ * A wrapped span of heads is read with two DMA reads. Each read has its
+ * own completion so that a failure of either of them is seen, the common
+ * completion counter only reports the status of the last read.
+ */
+struct sw_queue_read {
+	struct snap_dma_completion comp;
+	struct snap_virtio_blk_sw_queue *sw_q;
 };
 
 struct snap_virtio_blk_sw_queue {
@@ -29,13 +50,18 @@ struct snap_virtio_blk_sw_queue {
 	uint64_t			driver_addr;
 	uint64_t			q_size;
 	uint16_t			prev_avail;
+	uint16_t			heads_idx;
+	uint16_t			heads_target;
 	uint16_t			avail_idx;
 	struct ibv_mr		*avail_mr;
-	uint16_t			desc_head_idx;
-	struct ibv_mr		*desc_head_mr;
+	uint16_t			*avail_ring;
+	struct ibv_mr		*avail_ring_mr;
+	bool				read_inflight;
 	bool				read_done;
+	bool				read_failed;
+	int				reads_pending;
 	enum sw_queue_prog_state prog_state;
-	struct snap_dma_completion avail_read;
+	struct sw_queue_read		avail_read[2];
 	uint32_t dma_mkey;
 };
 
@@ -50,8 +76,29 @@ to_sw_queue(struct snap_virtio_blk_queue *vbq)
 static void sw_queue_prog_read_cb(struct snap_dma_completion *comp, int status)
 {
 	struct snap_virtio_blk_sw_queue *sw_q = container_of(comp,
-			struct snap_virtio_blk_sw_queue, avail_read);
+			struct sw_queue_read, comp)->sw_q;
 
+	if (snap_unlikely(status)) {
+		SNAP_LIB_LOG_ERR("avail ring read failed for drv: 0x%lx status %d",
+				 sw_q->driver_addr, status);
+		sw_q->read_failed = true;
+	}
+
+	/* wait for all spans, the shadow ring is still being written */
+	if (--sw_q->reads_pending)
+		return;
+
+	if (snap_unlikely(sw_q->read_failed)) {
+		/*
+		 * buffer content is undefined, drop the read. Shadow ring
+		 * indexes are not advanced and the read is retried by the
+		 * next poll.
+		 */
+		if (sw_q->prog_state == READ_AVAILABLE_IDX)
+			sw_q->avail_idx = sw_q->heads_idx;
+		sw_q->read_inflight = false;
+		return;
+	}
 	sw_q->read_done = true;
 }
 
@@ -60,25 +107,35 @@ snap_virtio_blk_create_sw_queue(struct snap_device *sdev,
 				struct snap_virtio_common_queue_attr *attr)
 {
 	struct snap_virtio_blk_sw_queue *swq = calloc(1, sizeof(struct snap_virtio_blk_sw_queue));
+	int i;
 
 	if (!swq)
 		goto out;
-	swq->avail_idx = 0;
 	swq->avail_mr = snap_reg_mr(attr->qp->pd,
 			&swq->avail_idx, sizeof(uint16_t));
 	if (!swq->avail_mr) {
 		SNAP_LIB_LOG_ERR("failed to register avail_mr");
 		goto rel_q;
 	}
-	swq->desc_head_mr = snap_reg_mr(attr->qp->pd,
-			&swq->desc_head_idx, sizeof(uint16_t));
-	if (!swq->desc_head_mr) {
-		SNAP_LIB_LOG_ERR("failed to register avail_mr");
+	swq->avail_ring = calloc(attr->vattr.size, sizeof(uint16_t));
+	if (!swq->avail_ring) {
+		SNAP_LIB_LOG_ERR("failed to allocate avail ring shadow");
 		goto dereg_avail;
 	}
-	swq->prev_avail = 0;
-	swq->prog_state = 0;
-	swq->avail_read.func = sw_queue_prog_read_cb;
+	swq->avail_ring_mr = snap_reg_mr(attr->qp->pd, swq->avail_ring,
+			attr->vattr.size * sizeof(uint16_t));
+	if (!swq->avail_ring_mr) {
+		SNAP_LIB_LOG_ERR("failed to register avail_ring_mr");
+		goto free_ring;
+	}
+	swq->prev_avail = attr->hw_available_index;
+	swq->heads_idx = attr->hw_available_index;
+	swq->avail_idx = attr->hw_available_index;
+	swq->prog_state = READ_AVAILABLE_IDX;
+	for (i = 0; i < 2; i++) {
+		swq->avail_read[i].comp.func = sw_queue_prog_read_cb;
+		swq->avail_read[i].sw_q = swq;
+	}
 	swq->driver_addr = attr->vattr.driver;
 	swq->q_size = attr->vattr.size;
 	attr->q_provider = SNAP_SW_Q_PROVIDER;
@@ -87,6 +144,8 @@ snap_virtio_blk_create_sw_queue(struct snap_device *sdev,
 
 	return &swq->vbq.virtq;
 
+free_ring:
+	free(swq->avail_ring);
 dereg_avail:
 	ibv_dereg_mr(swq->avail_mr);
 rel_q:
@@ -99,16 +158,23 @@ static int snap_virtio_blk_destroy_sw_queue(struct snap_virtio_queue *vq)
 {
 	struct snap_virtio_blk_sw_queue *swq = to_sw_queue(to_blk_queue(vq));
 
+	if (swq->reads_pending)
+		SNAP_LIB_LOG_WARN("destroying sw queue with avail ring read in flight");
+
+	ibv_dereg_mr(swq->avail_ring_mr);
+	free(swq->avail_ring);
 	ibv_dereg_mr(swq->avail_mr);
-	ibv_dereg_mr(swq->desc_head_mr);
 	free(swq);
 
 	return 0;
 }
 
-static int snap_virtio_blk_query_sw_queue(struct snap_virtio_queue *vbq,
+static int snap_virtio_blk_query_sw_queue(struct snap_virtio_queue *vq,
 		struct snap_virtio_common_queue_attr *attr)
 {
+	struct snap_virtio_blk_sw_queue *swq = to_sw_queue(to_blk_queue(vq));
+
+	attr->hw_available_index = swq->prev_avail;
 	return 0;
 }
 
@@ -118,60 +184,111 @@ static int snap_virtio_blk_modify_sw_queue(struct snap_virtio_queue *vq,
 	return 0;
 }
 
-/* TODO: convert to the poll/complete/send_completion model */
-static int __attribute__((unused)) snap_virtio_blk_progress_sw_queue(struct snap_virtio_queue *vq)
+static int sw_queue_read_avail_idx(struct snap_virtio_blk_sw_queue *sw_q)
 {
-	struct snap_virtio_blk_sw_queue *sw_q = to_sw_queue(to_blk_queue(vq));
-	uint64_t avail_idx_addr  = sw_q->driver_addr + offsetof(struct vring_avail, idx);
-	uint64_t desc_hdr_idx_addr;
+	uint64_t avail_idx_addr = sw_q->driver_addr + offsetof(struct vring_avail, idx);
 	int ret;
 
-	switch (sw_q->prog_state) {
-	case READ_AVAILABLE_IDX:
-		sw_q->avail_read.count = 1;
-		sw_q->read_done = false;
-		ret = snap_dma_q_read(sw_q->dma_q, &sw_q->avail_idx, sizeof(uint16_t),
-				sw_q->avail_mr->lkey, avail_idx_addr, sw_q->dma_mkey, &sw_q->avail_read);
-		if (snap_unlikely(ret)) {
-			SNAP_LIB_LOG_ERR("failed DMA read vring_available for drv: 0x%lx",
-					sw_q->driver_addr);
-			return ret;
-		}
-		sw_q->prog_state = READ_HEADER_IDX;
-		break;
-	case READ_HEADER_IDX:
-		if (sw_q->read_done) {
-			sw_q->read_done = false;
-			if ((sw_q->avail_idx % sw_q->q_size) != sw_q->prev_avail) {
-				desc_hdr_idx_addr = sw_q->driver_addr +
-					offsetof(struct vring_avail, ring[sw_q->prev_avail]);
-				sw_q->prev_avail = (sw_q->prev_avail + 1) % sw_q->q_size;
-				sw_q->avail_read.count = 1;
-				ret = snap_dma_q_read(sw_q->dma_q, &sw_q->desc_head_idx, sizeof(uint16_t),
-						sw_q->desc_head_mr->lkey, desc_hdr_idx_addr, sw_q->dma_mkey, &sw_q->avail_read);
-				if (snap_unlikely(ret)) {
-					SNAP_LIB_LOG_ERR("failed DMA read descriptor head idx for drv: 0x%lx",
-							sw_q->driver_addr);
-					return ret;
-				}
-				sw_q->prog_state = NEW_CMD_PROC;
-			} else
-				sw_q->prog_state = READ_AVAILABLE_IDX;
-		}
-		break;
-	case NEW_CMD_PROC:
-		if (sw_q->read_done) {
-			struct virtq_split_tunnel_req_hdr hdr;
-
-			sw_q->read_done = false;
-			hdr.descr_head_idx = sw_q->desc_head_idx;
-			hdr.num_desc = 0;
-			sw_q->dma_q->rx_cb(sw_q->dma_q, &hdr, 0, 0);
-			sw_q->prog_state = READ_AVAILABLE_IDX;
+	sw_q->avail_read[0].comp.count = 1;
+	sw_q->read_done = false;
+	sw_q->read_failed = false;
+	ret = snap_dma_q_read(sw_q->dma_q, &sw_q->avail_idx, sizeof(uint16_t),
+			sw_q->avail_mr->lkey, avail_idx_addr, sw_q->dma_mkey, &sw_q->avail_read[0].comp);
+	if (snap_unlikely(ret))
+		return ret;
+
+	sw_q->reads_pending = 1;
+
+	sw_q->read_inflight = true;
+	sw_q->prog_state = READ_AVAILABLE_IDX;
+	return 0;
+}
+
+static int sw_queue_read_span(struct snap_virtio_blk_sw_queue *sw_q, uint16_t start, uint16_t n)
+{
+	uint64_t ring_addr = sw_q->driver_addr + offsetof(struct vring_avail, ring[start]);
+	struct snap_dma_completion *comp = &sw_q->avail_read[sw_q->reads_pending].comp;
+	int ret;
+
+	comp->count = 1;
+	ret = snap_dma_q_read(sw_q->dma_q, &sw_q->avail_ring[start], n * sizeof(uint16_t),
+			sw_q->avail_ring_mr->lkey, ring_addr, sw_q->dma_mkey, comp);
+	if (snap_unlikely(ret))
+		return ret;
+
+	sw_q->reads_pending++;
+	return 0;
+}
+
+static int sw_queue_read_heads(struct snap_virtio_blk_sw_queue *sw_q)
+{
+	uint16_t n = sw_q->avail_idx - sw_q->heads_idx;
+	uint16_t start = sw_q->heads_idx % sw_q->q_size;
+	uint16_t first = snap_min(n, sw_q->q_size - start);
+	int ret;
+
+	sw_q->read_done = false;
+	sw_q->read_failed = false;
+	ret = sw_queue_read_span(sw_q, start, first);
+	if (snap_unlikely(ret))
+		return ret;
+
+	/* ring is only partially read if it fails, take the first span */
+	if (first < n && sw_queue_read_span(sw_q, 0, n - first))
+		n = first;
+
+	sw_q->heads_target = sw_q->heads_idx + n;
+	sw_q->read_inflight = true;
+	sw_q->prog_state = READ_HEADER_IDX;
+	return 0;
+}
+
+static int snap_virtio_blk_poll_sw_queue(struct snap_virtio_queue *vq,
+		struct virtq_split_tunnel_req *reqs, int num_reqs)
+{
+	struct snap_virtio_blk_sw_queue *sw_q = to_sw_queue(to_blk_queue(vq));
+	uint16_t pending;
+	int i, n, ret;
+
+	if (sw_q->read_inflight) {
+		if (!sw_q->read_done)
+			return 0;
+
+		sw_q->read_inflight = false;
+		if (sw_q->prog_state == READ_HEADER_IDX)
+			sw_q->heads_idx = sw_q->heads_target;
+		else if ((uint16_t)(sw_q->avail_idx - sw_q->heads_idx) > sw_q->q_size) {
+			SNAP_LIB_LOG_ERR("drv: 0x%lx bad avail idx %u, heads %u q_size %lu",
+					 sw_q->driver_addr, sw_q->avail_idx, sw_q->heads_idx, sw_q->q_size);
+			sw_q->avail_idx = sw_q->heads_idx;
+			return -EINVAL;
 		}
-		break;
 	}
-	return 0;
+
+	pending = sw_q->heads_idx - sw_q->prev_avail;
+	n = snap_min(pending, num_reqs);
+	for (i = 0; i < n; i++) {
+		reqs[i].hdr.descr_head_idx = sw_q->avail_ring[(uint16_t)(sw_q->prev_avail + i) % sw_q->q_size];
+		reqs[i].hdr.num_desc = 0;
+		reqs[i].hdr.dpa_vq_table_flag = 0;
+		reqs[i].tunnel_descs = NULL;
+	}
+	sw_q->prev_avail += n;
+
+	/* start fetching the next batch while the current one is processed */
+	if (sw_q->heads_idx != sw_q->avail_idx)
+		ret = sw_queue_read_heads(sw_q);
+	else if (sw_q->prev_avail == sw_q->heads_idx)
+		ret = sw_queue_read_avail_idx(sw_q);
+	else
+		ret = 0;
+
+	/* out of dma resources, retry on the next poll */
+	if (snap_unlikely(ret && ret != -EAGAIN))
+		SNAP_LIB_LOG_ERR("failed DMA read of avail ring for drv: 0x%lx ret %d",
+				 sw_q->driver_addr, ret);
+
+	return n;
 }
 
 static struct virtq_q_ops snap_virtq_blk_sw_ops = {
@@ -179,7 +296,7 @@ static struct virtq_q_ops snap_virtq_blk_sw_ops = {
 	.destroy = snap_virtio_blk_destroy_sw_queue,
 	.query = snap_virtio_blk_query_sw_queue,
 	.modify = snap_virtio_blk_modify_sw_queue,
-	//.progress = snap_virtio_blk_progress_sw_queue,
+	.poll = snap_virtio_blk_poll_sw_queue,
 };
 
 struct virtq_q_ops *get_sw_queue_ops(void)
@@ -92,6 +92,24 @@ int snap_virtio_blk_query_device(struct snap_device *sdev,
 	attr->max_blk_queues = DEVX_GET(virtio_blk_device_emulation,
 					device_emulation_out,
 					virtio_blk_config.num_queues);
+	attr->max_discard_sectors = DEVX_GET(virtio_blk_device_emulation,
+					     device_emulation_out,
+					     virtio_blk_config.max_discard_sectors);
+	attr->max_discard_seg = DEVX_GET(virtio_blk_device_emulation,
+					 device_emulation_out,
+					 virtio_blk_config.max_discard_seg);
+	attr->discard_sector_alignment = DEVX_GET(virtio_blk_device_emulation,
+						  device_emulation_out,
+						  virtio_blk_config.discard_sector_alignment);
+	attr->max_write_zeroes_sectors = DEVX_GET(virtio_blk_device_emulation,
+						  device_emulation_out,
+						  virtio_blk_config.max_write_zeroes_sectors);
+	attr->max_write_zeroes_segs = DEVX_GET(virtio_blk_device_emulation,
+					       device_emulation_out,
+					       virtio_blk_config.max_write_zeroes_segs);
+	attr->write_zeroes_may_unmap = DEVX_GET(virtio_blk_device_emulation,
+						device_emulation_out,
+						virtio_blk_config.write_zeroes_may_unmap);
 	attr->crossed_vhca_mkey = DEVX_GET(virtio_blk_device_emulation,
 					   device_emulation_out,
 					   emulated_device_crossed_vhca_mkey);
@@ -38,6 +38,12 @@ struct snap_virtio_blk_device_attr {
 	uint32_t				seg_max;
 	uint32_t				blk_size;
 	uint16_t				max_blk_queues;
+	uint32_t				max_discard_sectors;
+	uint32_t				max_discard_seg;
+	uint32_t				discard_sector_alignment;
+	uint32_t				max_write_zeroes_sectors;
+	uint32_t				max_write_zeroes_segs;
+	uint8_t					write_zeroes_may_unmap;
 	uint32_t				crossed_vhca_mkey;
 };
 
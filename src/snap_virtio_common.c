@@ -29,6 +29,7 @@
 SNAP_LIB_LOG_REGISTER(VIRTIO_COMMON)
 
 SNAP_ENV_REG_ENV_VARIABLE(SNAP_QUEUE_PROVIDER, 0);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_VIRTQ_DESC_PREFETCH, SNAP_VIRTQ_DESC_PREFETCH_DEFAULT);
 
 static int snap_virtio_init_virtq_umem(struct ibv_context *context,
 					struct snap_virtio_caps *virtio,
@@ -95,6 +96,25 @@ void snap_virtio_get_device_attr(struct snap_device *sdev,
 					    admin_queue_index);
 }
 
+/**
+ * snap_virtio_desc_prefetch_window() - Get descriptor prefetch window size
+ * @window: requested window size, 0 - use SNAP_VIRTQ_DESC_PREFETCH
+ *
+ * Return: number of descriptors to read from the desc table at once. Value
+ * of 1 means that the prefetch is disabled.
+ */
+uint16_t snap_virtio_desc_prefetch_window(uint16_t window)
+{
+	long long env_window;
+
+	if (!window) {
+		env_window = snap_env_getenv(SNAP_VIRTQ_DESC_PREFETCH);
+		window = env_window > 0 ? snap_min(env_window, SNAP_VIRTQ_DESC_PREFETCH_MAX) : 1;
+	}
+
+	return snap_min(window, SNAP_VIRTQ_DESC_PREFETCH_MAX);
+}
+
 int snap_virtio_query_device(struct snap_device *sdev,
 	enum snap_emulation_type type, uint8_t *out, int outlen)
 {
@@ -550,6 +570,18 @@ int snap_virtio_modify_device(struct snap_device *sdev,
 				 virtio_blk_config.blk_size, battr->blk_size);
 			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
 				 virtio_blk_config.num_queues, battr->max_blk_queues);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_discard_sectors, battr->max_discard_sectors);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_discard_seg, battr->max_discard_seg);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.discard_sector_alignment, battr->discard_sector_alignment);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_write_zeroes_sectors, battr->max_write_zeroes_sectors);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_write_zeroes_segs, battr->max_write_zeroes_segs);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.write_zeroes_may_unmap, battr->write_zeroes_may_unmap);
 		}
 
 		if (mask & SNAP_VIRTIO_MOD_ALL) {
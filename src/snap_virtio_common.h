@@ -251,6 +251,15 @@ enum {
 
 #define SNAP_QUEUE_PROVIDER   "SNAP_QUEUE_PROVIDER"
 
+/*
+ * Number of descriptors that are read from the host desc table by a single
+ * dma read when a descriptor chain is not fully tunneled. 0 or 1 disables
+ * the prefetch.
+ */
+#define SNAP_VIRTQ_DESC_PREFETCH   "SNAP_VIRTQ_DESC_PREFETCH"
+#define SNAP_VIRTQ_DESC_PREFETCH_DEFAULT 8
+#define SNAP_VIRTQ_DESC_PREFETCH_MAX     64
+
 static inline struct snap_virtio_common_queue_attr*
 to_common_queue_attr(struct snap_virtio_queue_attr *vattr)
 {
@@ -260,6 +269,7 @@ to_common_queue_attr(struct snap_virtio_queue_attr *vattr)
 
 void snap_virtio_get_queue_attr(struct snap_virtio_queue_attr *vattr,
 	void *q_configuration);
+uint16_t snap_virtio_desc_prefetch_window(uint16_t window);
 void snap_virtio_get_queue_attr_v2(struct snap_virtio_queue_attr *vattr,
 				   void *q_configuration_v2);
 void snap_virtio_get_device_attr(struct snap_device *sdev,
@@ -0,0 +1,177 @@
+/*
+ * Measure time-to-ready of virtio-blk VF controllers that go through FLR
+ * at the same time.
+ *
+ * Open controllers for N VFs of a PF and progress all of them from a
+ * single thread. Trigger FLR on the VFs from the host, for example:
+ *
+ *   for f in /sys/bus/pci/devices/<vf bdf>/reset; do echo 1 > $f & done
+ *
+ * Each controller reports how long it stayed in FLR. Once all controllers
+ * that went through FLR are ready again the burst time-to-ready is printed.
+ */
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#include "snap.h"
+#include "snap_virtio_blk_ctrl.h"
+#include "snap_blk_dev.h"
+
+#include "snap_test.h"
+
+#define FLR_BENCH_MAX_VFS 1024
+
+struct flr_bench_ctrl {
+	struct snap_virtio_blk_ctrl *ctrl;
+	bool in_flr;
+	struct timespec flr_start;
+};
+
+static bool keep_running = true;
+
+static void signal_handler(int dummy)
+{
+	keep_running = false;
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	static struct flr_bench_ctrl ctrls[FLR_BENCH_MAX_VFS];
+	struct snap_virtio_blk_ctrl_attr blk_attr = {};
+	struct snap_virtio_ctrl_bar_cbs bar_cbs = {};
+	struct snap_blk_dev_attrs bdev_attrs = {0};
+	struct snap_blk_dev *bdev;
+	struct snap_context *sctx;
+	struct ibv_pd *pd;
+	struct timespec burst_start = {}, now;
+	double max_ms = 0, sum_ms = 0, ms;
+	int pf_id = 0, num_vfs = 1, bar_poll_ms = 0;
+	int i, opt, n_opened = 0, n_in_flr = 0, n_done = 0;
+	struct sigaction act = {};
+	int ret = 0;
+
+	act.sa_handler = signal_handler;
+	sigaction(SIGINT, &act, 0);
+	sigaction(SIGTERM, &act, 0);
+
+	while ((opt = getopt(argc, argv, "f:n:p:")) != -1) {
+		switch (opt) {
+		case 'f':
+			pf_id = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_vfs = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			bar_poll_ms = strtol(optarg, NULL, 0);
+			break;
+		default:
+			printf("Usage: snap_virtio_ctrl_flr_bench -f <pf_id> -n <num_vfs> "
+			       "[-p <bar poll period ms, 0 - query on every progress>]\n");
+			exit(1);
+		}
+	}
+
+	if (num_vfs <= 0 || num_vfs > FLR_BENCH_MAX_VFS) {
+		printf("num_vfs must be in [1, %d]\n", FLR_BENCH_MAX_VFS);
+		exit(1);
+	}
+
+	sctx = snap_ctx_open(SNAP_VIRTIO_BLK, NULL);
+	if (!sctx) {
+		printf("Failed to open snap ctx\n");
+		return -ENODEV;
+	}
+
+	bdev_attrs.type = SNAP_BLOCK_DEVICE_NULL;
+	bdev_attrs.size_b = 20;
+	bdev_attrs.blk_size = 9;
+	bdev = snap_blk_dev_open("null_blk", &bdev_attrs);
+	if (!bdev) {
+		printf("Failed to open null block device\n");
+		ret = -ENODEV;
+		goto close_sctx;
+	}
+
+	pd = ibv_alloc_pd(sctx->context);
+	if (!pd) {
+		printf("Failed to alloc pd\n");
+		ret = -ENOMEM;
+		goto close_bdev;
+	}
+
+	blk_attr.common.bar_cbs = &bar_cbs;
+	blk_attr.common.pd = pd;
+	blk_attr.common.pf_id = pf_id;
+	blk_attr.common.npgs = 1;
+	blk_attr.common.pci_type = SNAP_VIRTIO_BLK_VF;
+	blk_attr.common.bar_poll_period_ms = bar_poll_ms;
+	for (i = 0; i < num_vfs; i++) {
+		blk_attr.common.vf_id = i;
+		ctrls[i].ctrl = snap_virtio_blk_ctrl_open(sctx, &blk_attr, &bdev->ops, bdev);
+		if (!ctrls[i].ctrl) {
+			printf("Failed to create virtio-blk controller for pf %d vf %d\n", pf_id, i);
+			ret = -ENODEV;
+			goto close_ctrls;
+		}
+		n_opened++;
+	}
+
+	printf("%d VF controllers are ready, trigger FLR from the host\n", n_opened);
+
+	while (keep_running) {
+		for (i = 0; i < n_opened; i++) {
+			struct flr_bench_ctrl *c = &ctrls[i];
+
+			snap_virtio_blk_ctrl_progress(c->ctrl);
+			snap_virtio_blk_ctrl_io_progress(c->ctrl);
+
+			if (c->in_flr == c->ctrl->common.pending_flr)
+				continue;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (!c->in_flr) {
+				if (!n_in_flr)
+					burst_start = now;
+				c->in_flr = true;
+				c->flr_start = now;
+				n_in_flr++;
+				continue;
+			}
+
+			c->in_flr = false;
+			ms = elapsed_ms(&c->flr_start, &now);
+			sum_ms += ms;
+			max_ms = ms > max_ms ? ms : max_ms;
+			n_done++;
+			printf("vf %d ready after %.2f ms\n", i, ms);
+
+			if (n_done == n_in_flr) {
+				printf("%d FLRs: time-to-ready %.2f ms, per ctrl avg %.2f ms max %.2f ms\n",
+				       n_done, elapsed_ms(&burst_start, &now),
+				       sum_ms / n_done, max_ms);
+				n_in_flr = n_done = 0;
+				sum_ms = max_ms = 0;
+			}
+		}
+	}
+
+close_ctrls:
+	for (i = 0; i < n_opened; i++)
+		snap_virtio_blk_ctrl_close(ctrls[i].ctrl);
+	ibv_dealloc_pd(pd);
+close_bdev:
+	snap_blk_dev_close(bdev);
+close_sctx:
+	snap_ctx_close(sctx);
+	return ret;
+}
@@ -437,6 +437,48 @@ TEST_F(SnapDmaTest, dma_write_short) {
 	snap_dma_q_destroy(q);
 }
 
+/*
+ * Post short writes round robin on many queues from one core, so that queue
+ * state does not stay in L1. Reports ops/sec per core, compare the numbers
+ * to see the effect of the struct snap_dma_q layout.
+ */
+TEST_F(SnapDmaTest, hot_path_bench) {
+	const int NQ = 64;
+	const int N = SNAP_DEBUG ? 1000 : 2000000;
+	struct snap_dma_q *q[NQ];
+	char cqe[m_dma_q_attr.tx_elem_size];
+	struct timeval t_s, t_e, t_r;
+	int i, rc;
+	double t;
+
+	m_dma_q_attr.mode = SNAP_DMA_Q_MODE_DV;
+	for (i = 0; i < NQ; i++) {
+		q[i] = snap_dma_q_create(m_pd, &m_dma_q_attr);
+		ASSERT_TRUE(q[i]);
+		ASSERT_EQ(0U, (uintptr_t)q[i] % SNAP_MLX5_L2_CACHE_SIZE);
+	}
+
+	memset(cqe, 0xDA, sizeof(cqe));
+	gettimeofday(&t_s, 0);
+	for (i = 0; i < N; i++) {
+		while ((rc = snap_dma_q_write_short(q[i % NQ], cqe, sizeof(cqe),
+						    (uintptr_t)m_rbuf, m_rmr->lkey)) == -EAGAIN)
+			snap_dma_q_progress(q[i % NQ]);
+		ASSERT_EQ(0, rc);
+		/* progress another queue, as a polling thread would do */
+		snap_dma_q_progress(q[(i + NQ / 2) % NQ]);
+	}
+	for (i = 0; i < NQ; i++)
+		snap_dma_q_flush(q[i]);
+	gettimeofday(&t_e, 0);
+	timersub(&t_e, &t_s, &t_r);
+	t = t_r.tv_sec + t_r.tv_usec/1000000.0;
+	printf("%d queues: %.0f ops/sec per core, %d ops\n", NQ, N / t, N);
+
+	for (i = 0; i < NQ; i++)
+		snap_dma_q_destroy(q[i]);
+}
+
 TEST_F(SnapDmaTest, flush_qp) {
 	struct snap_dma_q *q;
 	int rc;
@@ -2877,3 +2919,230 @@ TEST_F(SnapQpRecoveryTest, err_cb_handled_comp_migrate_fix_rkey) {
 	EXPECT_EQ(0, g_last_comp_status);
 }
 
+
+/* SW loopback queue does not need a device, tests are not using fixture */
+static void sw_dma_q_init_attr(struct snap_dma_q_create_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->tx_qsize = 64;
+	attr->tx_elem_size = 64;
+	attr->rx_qsize = 64;
+	attr->rx_elem_size = 64;
+	attr->rx_cb = dma_rx_cb;
+	attr->mode = SNAP_DMA_Q_MODE_SW;
+	attr->iov_enable = true;
+}
+
+TEST(SnapDmaSwTest, read_write) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_completion comp;
+	struct snap_dma_q *q;
+	char lbuf[128], rbuf[128];
+
+	sw_dma_q_init_attr(&attr);
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q);
+	ASSERT_TRUE(snap_dma_q_get_fw_qp(q) == NULL);
+
+	comp.func = dma_completion;
+	comp.count = 1;
+	g_comp_count = 0;
+	memset(lbuf, 0xED, sizeof(lbuf));
+	memset(rbuf, 0, sizeof(rbuf));
+	ASSERT_EQ(0, snap_dma_q_write(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, &comp));
+	ASSERT_EQ(0, memcmp(lbuf, rbuf, sizeof(lbuf)));
+	/* completion is only reported by progress */
+	ASSERT_EQ(0, g_comp_count);
+	snap_dma_q_flush(q);
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(0, comp.count);
+
+	comp.count = 1;
+	memset(rbuf, 0xAB, sizeof(rbuf));
+	ASSERT_EQ(0, snap_dma_q_read(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, &comp));
+	ASSERT_EQ(0, memcmp(lbuf, rbuf, sizeof(lbuf)));
+	snap_dma_q_flush(q);
+	ASSERT_EQ(2, g_comp_count);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST(SnapDmaSwTest, access_error) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_completion comp;
+	struct snap_dma_q *q;
+	char lbuf[128], rbuf[128];
+	int n;
+
+	sw_dma_q_init_attr(&attr);
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q);
+
+	comp.func = dma_completion;
+	comp.count = 1;
+	g_comp_count = 0;
+	g_last_comp_status = 0;
+	/* first page is treated as NULL, local buffer content is undefined */
+	memset(lbuf, 0, sizeof(lbuf));
+	ASSERT_EQ(0, snap_dma_q_read(q, lbuf, sizeof(lbuf), 0, 16, 0, &comp));
+	snap_dma_q_flush(q);
+	ASSERT_EQ(1, g_comp_count);
+	EXPECT_EQ(MLX5_CQE_SYNDROME_REMOTE_ACCESS_ERR, g_last_comp_status);
+	EXPECT_EQ((char)0xff, lbuf[0]);
+
+	/* unsignaled operation must report the error too */
+	ASSERT_EQ(0, snap_dma_q_write(q, lbuf, sizeof(lbuf), 0, 0, 0, NULL));
+	n = 0;
+	while (!snap_dma_q_empty(q))
+		n += snap_dma_q_progress(q);
+	ASSERT_EQ(1, n);
+
+	/* queue is not moved to the error state */
+	comp.count = 1;
+	memset(rbuf, 0xAB, sizeof(rbuf));
+	ASSERT_EQ(0, snap_dma_q_read(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, &comp));
+	snap_dma_q_flush(q);
+	ASSERT_EQ(2, g_comp_count);
+	EXPECT_EQ(0, g_last_comp_status);
+	EXPECT_EQ(0, memcmp(lbuf, rbuf, sizeof(lbuf)));
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST(SnapDmaSwTest, readv2v_writev2v) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_completion comp[2];
+	struct iovec liov[2], riov[1];
+	char lbuf[2][64], rbuf[128];
+	struct snap_dma_q *q;
+	uint32_t keys[2] = {};
+
+	sw_dma_q_init_attr(&attr);
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q);
+
+	liov[0].iov_base = lbuf[0];
+	liov[0].iov_len = sizeof(lbuf[0]);
+	liov[1].iov_base = lbuf[1];
+	liov[1].iov_len = sizeof(lbuf[1]);
+	riov[0].iov_base = rbuf;
+	riov[0].iov_len = sizeof(rbuf);
+
+	comp[0].func = dma_completion;
+	comp[0].count = 1;
+	comp[1].func = dma_completion;
+	comp[1].count = 1;
+	g_comp_count = 0;
+	memset(lbuf[0], 0x11, sizeof(lbuf[0]));
+	memset(lbuf[1], 0x22, sizeof(lbuf[1]));
+	ASSERT_EQ(0, snap_dma_q_writev2v(q, keys, liov, 2, keys, riov, 1,
+			false, false, &comp[0]));
+	ASSERT_EQ(0, memcmp(rbuf, lbuf[0], sizeof(lbuf[0])));
+	ASSERT_EQ(0, memcmp(rbuf + 64, lbuf[1], sizeof(lbuf[1])));
+
+	memset(rbuf, 0x33, sizeof(rbuf));
+	ASSERT_EQ(0, snap_dma_q_readv2v(q, keys, liov, 2, keys, riov, 1,
+			false, false, &comp[1]));
+	ASSERT_EQ(0, memcmp(rbuf, lbuf[0], sizeof(lbuf[0])));
+	ASSERT_EQ(0, memcmp(rbuf + 64, lbuf[1], sizeof(lbuf[1])));
+
+	snap_dma_q_flush(q);
+	ASSERT_EQ(2, g_comp_count);
+	snap_dma_q_destroy(q);
+}
+
+TEST(SnapDmaSwTest, crypto_not_supported) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_completion comp;
+	struct snap_dma_q *q;
+	char lbuf[64], rbuf[64];
+	struct iovec riov;
+
+	sw_dma_q_init_attr(&attr);
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q);
+
+	riov.iov_base = rbuf;
+	riov.iov_len = sizeof(rbuf);
+	comp.func = dma_completion;
+	comp.count = 1;
+	g_comp_count = 0;
+	EXPECT_EQ(-ENOTSUP, snap_dma_q_writec(q, lbuf, 0, &riov, 1, 0, 0, 0, &comp));
+	EXPECT_EQ(-ENOTSUP, snap_dma_q_readc(q, lbuf, 0, &riov, 1, 0, 0, 0, &comp));
+	/* nothing was posted */
+	EXPECT_TRUE(snap_dma_q_empty(q));
+	EXPECT_EQ(0, g_comp_count);
+
+	/* crypto can not be enabled at all */
+	snap_dma_q_destroy(q);
+	attr.crypto_enable = true;
+	q = snap_dma_q_create(NULL, &attr);
+	EXPECT_TRUE(q == NULL);
+	if (q)
+		snap_dma_q_destroy(q);
+}
+
+TEST(SnapDmaSwTest, tx_moderation) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_q *q;
+	char lbuf[16], rbuf[16];
+	int i, n, tx_max;
+
+	sw_dma_q_init_attr(&attr);
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q);
+
+	tx_max = q->tx_available;
+	/* unsignaled writes are completed in batches, not one by one */
+	for (i = 0; i < tx_max; i++)
+		ASSERT_EQ(0, snap_dma_q_write(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, NULL));
+	ASSERT_EQ(0, q->tx_available);
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, NULL));
+
+	n = 0;
+	while (!snap_dma_q_empty(q))
+		n += snap_dma_q_progress(q);
+	ASSERT_GT(n, 0);
+	ASSERT_LT(n, tx_max);
+
+	/* flush must generate a completion for the outstanding writes */
+	ASSERT_EQ(0, snap_dma_q_write(q, lbuf, sizeof(lbuf), 0, (uintptr_t)rbuf, 0, NULL));
+	ASSERT_EQ(1, snap_dma_q_flush(q));
+	ASSERT_EQ(tx_max, q->tx_available);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST(SnapDmaSwTest, ep_send) {
+	struct snap_dma_q_create_attr attr;
+	struct snap_rx_completion rx_comp;
+	struct snap_dma_q *q1, *q2;
+	char data[32];
+
+	sw_dma_q_init_attr(&attr);
+	q1 = snap_dma_ep_create(NULL, &attr);
+	ASSERT_TRUE(q1);
+	q2 = snap_dma_ep_create(NULL, &attr);
+	ASSERT_TRUE(q2);
+	ASSERT_EQ(0, snap_dma_ep_connect(q1, q2));
+
+	g_rx_count = 0;
+	memset(data, 0xCD, sizeof(data));
+	ASSERT_EQ(0, snap_dma_q_send_completion(q1, data, sizeof(data)));
+	snap_dma_q_progress(q2);
+	ASSERT_EQ(1, g_rx_count);
+	ASSERT_EQ(0, memcmp(g_last_rx, data, sizeof(data)));
+
+	ASSERT_EQ(0, snap_dma_q_send_completion(q2, data, 16));
+	ASSERT_EQ(1, snap_dma_q_poll_rx(q1, &rx_comp, 1));
+	ASSERT_EQ(16U, rx_comp.byte_len);
+	ASSERT_TRUE(rx_comp.q == q1);
+	ASSERT_EQ(0, memcmp(rx_comp.data, data, 16));
+
+	snap_dma_q_flush(q1);
+	snap_dma_q_flush(q2);
+	snap_dma_ep_destroy(q1);
+	snap_dma_ep_destroy(q2);
+}
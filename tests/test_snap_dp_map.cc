@@ -4,10 +4,12 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 #include <linux/virtio_ring.h>
 
 extern "C" {
 #include "snap_dp_map.h"
+#include "snap_dma.h"
 #include "snap_virtio_adm_spec.h"
 };
 
@@ -73,6 +75,227 @@ TEST(snap_dp_map, serialize) {
 	snap_dp_map_destroy(m);
 }
 
+static struct snap_dp_map *dp_range_map_create(unsigned int page_size, int nshards)
+{
+	struct snap_dp_map_attr attr = {};
+
+	attr.type = SNAP_DP_MAP_RANGE;
+	attr.nshards = nshards;
+	return snap_dp_map_create_attr(page_size, &attr);
+}
+
+TEST(snap_dp_map, range_create) {
+	struct snap_dp_map *m;
+
+	m = dp_range_map_create(7, 0);
+	EXPECT_TRUE(m == NULL);
+	m = dp_range_map_create(4096, SNAP_DP_MAP_MAX_SHARDS + 1);
+	EXPECT_TRUE(m == NULL);
+	m = dp_range_map_create(4096, 0);
+	ASSERT_TRUE(m != NULL);
+	snap_dp_map_destroy(m);
+}
+
+TEST(snap_dp_map, range_add_range) {
+	struct snap_dp_map *m;
+	int ret;
+
+	m = dp_range_map_create(4096, 1);
+	ASSERT_TRUE(m != NULL);
+
+	ret = snap_dp_map_add_range(m, 4096, 1);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), sizeof(uint64_t));
+
+	ret = snap_dp_map_add_range(m, 4096, 4096);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), sizeof(uint64_t));
+
+	ret = snap_dp_map_add_range(m, 4096, 8*4096);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), 8*sizeof(uint64_t));
+
+	/* disjoint, then bridge the gap */
+	ret = snap_dp_map_add_range(m, 20*4096, 4096);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), 9*sizeof(uint64_t));
+	ret = snap_dp_map_add_range(m, 8*4096, 12*4096);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), 20*sizeof(uint64_t));
+
+	snap_dp_map_destroy(m);
+}
+
+TEST(snap_dp_map, range_serialize) {
+	struct snap_dp_map *m;
+	uint64_t pbuf[4];
+	int ret, i;
+
+	m = dp_range_map_create(4096, 1);
+	ASSERT_TRUE(m != NULL);
+
+	ret = snap_dp_map_add_range(m, 4097, 8*4096);
+	EXPECT_EQ(ret, 0);
+	EXPECT_EQ(snap_dp_map_get_size(m), 9*sizeof(uint64_t));
+
+	/* incremental: buffer is smaller than the map */
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 4);
+	for (i = 0; i < 4; i++)
+		EXPECT_EQ(pbuf[i], (i + 1) * 4096UL);
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 4);
+	EXPECT_EQ(pbuf[0], 5 * 4096UL);
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 1);
+	EXPECT_EQ(pbuf[0], 9 * 4096UL);
+	EXPECT_EQ(snap_dp_map_get_size(m), 0UL);
+
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 0);
+
+	snap_dp_map_destroy(m);
+}
+
+TEST(snap_dp_map, range_serialize_sort) {
+	struct snap_dp_map *m;
+	uint64_t pbuf[16];
+	int ret;
+
+	m = dp_range_map_create(4096, 4);
+	ASSERT_TRUE(m != NULL);
+
+	ret = snap_dp_map_add_range(m, 0, 16*4096);
+	EXPECT_EQ(ret, 0);
+
+	/* take a hole out of the middle of the run */
+	ret = snap_dp_map_serialize_sort(m, 4*4096, 4*4096, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 4);
+	EXPECT_EQ(pbuf[0], 4 * 4096UL);
+	EXPECT_EQ(pbuf[3], 7 * 4096UL);
+	EXPECT_EQ(snap_dp_map_get_size(m), 12*sizeof(uint64_t));
+
+	ret = snap_dp_map_serialize_sort(m, 0, 16*4096, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 12);
+	EXPECT_EQ(pbuf[3], 3 * 4096UL);
+	EXPECT_EQ(pbuf[4], 8 * 4096UL);
+	EXPECT_EQ(snap_dp_map_get_size(m), 0UL);
+
+	snap_dp_map_destroy(m);
+}
+
+struct dp_map_bench_arg {
+	struct snap_dp_map *m;
+	uint64_t base;
+	int n_ios;
+};
+
+static const uint32_t dp_bench_io_size = 1024 * 1024;
+
+static void *dp_map_bench_worker(void *arg)
+{
+	struct dp_map_bench_arg *a = (struct dp_map_bench_arg *)arg;
+	int i;
+
+	for (i = 0; i < a->n_ios; i++)
+		snap_dp_map_add_range(a->m, a->base + (uint64_t)i * dp_bench_io_size,
+				      dp_bench_io_size);
+	return NULL;
+}
+
+static double dp_map_bench(struct snap_dp_map *m, int n_threads, int n_ios)
+{
+	pthread_t threads[8];
+	struct dp_map_bench_arg args[8];
+	struct timespec t0, t1;
+	uint64_t *pbuf;
+	const uint32_t pbuf_len = 16384 * sizeof(uint64_t);
+	uint64_t total = 0;
+	int i, ret;
+
+	pbuf = (uint64_t *)malloc(pbuf_len);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n_threads; i++) {
+		args[i].m = m;
+		args[i].base = (uint64_t)i * n_ios * dp_bench_io_size;
+		args[i].n_ios = n_ios;
+		pthread_create(&threads[i], NULL, dp_map_bench_worker, &args[i]);
+	}
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	do {
+		ret = snap_dp_map_serialize_sort(m, 0, UINT64_MAX, pbuf, pbuf_len);
+		if (ret > 0)
+			total += ret;
+	} while (ret > 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(pbuf);
+
+	EXPECT_EQ(total, (uint64_t)n_threads * n_ios * (dp_bench_io_size / 4096));
+	return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+}
+
+TEST(snap_dp_map, range_threads_overlap) {
+	struct snap_dp_map *m;
+	struct dp_map_bench_arg a = {};
+	pthread_t threads[2];
+	uint64_t pbuf[64];
+	int i, ret;
+
+	m = dp_range_map_create(4096, 2);
+	ASSERT_TRUE(m != NULL);
+
+	/*
+	 * same pages from two threads. Shards are picked per thread, the
+	 * threads may or may not share one. Either way every page must be
+	 * reported once and in order.
+	 */
+	a.m = m;
+	a.n_ios = 1;
+	for (i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, dp_map_bench_worker, &a);
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 64);
+	for (i = 0; i < 64; i++)
+		EXPECT_EQ(pbuf[i], i * 4096UL);
+	ret = snap_dp_map_serialize(m, pbuf, sizeof(pbuf));
+	EXPECT_EQ(ret, 64);
+	EXPECT_EQ(pbuf[0], 64 * 4096UL);
+	snap_dp_map_destroy(m);
+}
+
+TEST(snap_dp_map, range_threads) {
+	struct snap_dp_map *m;
+
+	m = dp_range_map_create(4096, 4);
+	ASSERT_TRUE(m != NULL);
+	dp_map_bench(m, 4, 4);
+	snap_dp_map_destroy(m);
+}
+
+/* timing only, run with --gtest_also_run_disabled_tests */
+TEST(snap_dp_map, DISABLED_add_range_bench) {
+	struct snap_dp_map *m;
+	const int n_threads = 4, n_ios = 64;
+	double ms;
+
+	m = snap_dp_map_create(4096);
+	ASSERT_TRUE(m != NULL);
+	ms = dp_map_bench(m, n_threads, n_ios);
+	printf("hash:  %d x %d x 1MB writes + serialize %.2f ms\n", n_threads, n_ios, ms);
+	snap_dp_map_destroy(m);
+
+	m = dp_range_map_create(4096, n_threads);
+	ASSERT_TRUE(m != NULL);
+	ms = dp_map_bench(m, n_threads, n_ios);
+	printf("range: %d x %d x 1MB writes + serialize %.2f ms\n", n_threads, n_ios, ms);
+	snap_dp_map_destroy(m);
+}
+
 static struct snap_vq_adm_sge sges[] = {
 	{ 4096, 8192 }, { 8 * 4096, 4096 }, { 10 * 4096, 4096 }
 	/* scale to page_size * (8):  [0, 8192}, {8192, 12288}, { 12288, 16384 }
@@ -167,3 +390,162 @@ TEST(snap_dp_bmap, get_start_pa_bit) {
 
 	snap_dp_bmap_destroy(m);
 }
+
+TEST(snap_dp_bmap, cache_coalesce) {
+	struct snap_dp_bmap *m;
+	int i;
+
+	m = snap_dp_bmap_create(sges, 3, 4096, true);
+	ASSERT_TRUE(m != NULL);
+	/* no pd, big delay: nothing is written until the list is full */
+	ASSERT_EQ(snap_dp_bmap_cache_enable(m, NULL, 1000000), 0);
+
+	for (i = 0; i < 16; i++)
+		EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, i * 4096, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 1);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 16U);
+
+	/* already dirty, suppressed */
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, 4096, 2 * 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 16U);
+
+	/* far away run */
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, 9000 * 4096ULL, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 2);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 17U);
+
+	/* fill the gap, runs are merged */
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, 16 * 4096, (9000 - 16) * 4096ULL), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 1);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 9001U);
+
+	/* out of the map */
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, 1ULL << 40, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 9001U);
+
+	snap_dp_bmap_destroy(m);
+}
+
+static void dp_bmap_rx_cb(struct snap_dma_q *q, const void *data,
+		uint32_t data_len, uint32_t imm_data)
+{
+}
+
+TEST(snap_dp_bmap, cache_report) {
+	struct snap_dma_q_create_attr attr = {};
+	struct snap_vq_adm_sge host_sges[2];
+	uint8_t host_map[2][256];
+	struct snap_dp_bmap *m;
+	struct snap_dma_q *q;
+	int i;
+
+	/* sw dma queue writes straight into host_map */
+	attr.tx_qsize = 64;
+	attr.tx_elem_size = 64;
+	attr.rx_qsize = 64;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = dp_bmap_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q != NULL);
+
+	memset(host_map, 0, sizeof(host_map));
+	for (i = 0; i < 2; i++) {
+		host_sges[i].addr = (uintptr_t)host_map[i];
+		host_sges[i].len = sizeof(host_map[i]);
+	}
+
+	m = snap_dp_bmap_create(host_sges, 2, 4096, true);
+	ASSERT_TRUE(m != NULL);
+	ASSERT_EQ(snap_dp_bmap_cache_enable(m, NULL, 1000000), 0);
+
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 0, 4 * 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 300 * 4096, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 2);
+	EXPECT_EQ(host_map[0][0], 0);
+
+	/* report must not complete while updates are held by the cache */
+	EXPECT_EQ(snap_dp_bmap_report_sync(m, q), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 0U);
+	for (i = 0; i < 4; i++)
+		EXPECT_EQ(host_map[0][i], 0xFF);
+	EXPECT_EQ(host_map[0][4], 0);
+	EXPECT_EQ(host_map[1][300 - 256], 0xFF);
+
+	/* hypervisor clears the map, pages dirtied again are reported again */
+	memset(host_map, 0, sizeof(host_map));
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 0, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 0, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 1);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 1U);
+	EXPECT_EQ(snap_dp_bmap_report_sync(m, q), 0);
+	EXPECT_EQ(host_map[0][0], 0xFF);
+	EXPECT_EQ(host_map[0][1], 0);
+
+	snap_dp_bmap_destroy(m);
+	snap_dma_q_destroy(q);
+}
+
+TEST(snap_dp_bmap, cache_written_not_suppressed) {
+	struct snap_dma_q_create_attr attr = {};
+	struct snap_vq_adm_sge host_sge;
+	uint8_t host_map[256];
+	struct snap_dp_bmap *m;
+	struct snap_dma_q *q;
+
+	attr.tx_qsize = 64;
+	attr.tx_elem_size = 64;
+	attr.rx_qsize = 64;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = dp_bmap_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(q != NULL);
+
+	memset(host_map, 0, sizeof(host_map));
+	host_sge.addr = (uintptr_t)host_map;
+	host_sge.len = sizeof(host_map);
+	m = snap_dp_bmap_create(&host_sge, 1, 4096, true);
+	ASSERT_TRUE(m != NULL);
+	ASSERT_EQ(snap_dp_bmap_cache_enable(m, NULL, 1000000), 0);
+
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 0, 2 * 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_flush(m, q), 0);
+	snap_dma_q_flush(q);
+	EXPECT_EQ(host_map[0], 0xFF);
+
+	/*
+	 * pre-copy: the hypervisor harvests and clears the map in the middle
+	 * of the round, the page is written again and must not be lost
+	 */
+	memset(host_map, 0, sizeof(host_map));
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, q, 0, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 1U);
+	EXPECT_EQ(snap_dp_bmap_report_sync(m, q), 0);
+	EXPECT_EQ(host_map[0], 0xFF);
+	EXPECT_EQ(host_map[1], 0);
+
+	snap_dp_bmap_destroy(m);
+	snap_dma_q_destroy(q);
+}
+
+TEST(snap_dp_bmap, cache_coalesce_bit) {
+	struct snap_dp_bmap *m;
+	int i;
+
+	m = snap_dp_bmap_create(sges, 3, 4096, false);
+	ASSERT_TRUE(m != NULL);
+	ASSERT_EQ(snap_dp_bmap_cache_enable(m, NULL, 1000000), 0);
+
+	/* 8 pages per map byte */
+	for (i = 0; i < 64; i++)
+		EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, i * 4096, 4096), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_writes(m), 1);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 8U);
+
+	EXPECT_EQ(snap_dp_bmap_mark_dirty(m, NULL, 4095, 2), 0);
+	EXPECT_EQ(snap_dp_bmap_pending_bytes(m), 8U);
+
+	snap_dp_bmap_destroy(m);
+}
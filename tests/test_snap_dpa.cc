@@ -1,5 +1,8 @@
 #include <limits.h>
 #include <sys/time.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -19,6 +22,8 @@ class SnapDpaTest : public ::testing::Test {
 	protected:
 	struct ibv_pd *m_pd;
 	void run_cmd_lat_bench(int how);
+	void run_cmd_lat_bench_pipelined(int n_threads);
+	void run_p2p_batch_bench(uint64_t max_delay_ns);
 	public:
 	struct ibv_context *get_ib_ctx() { return m_pd->context; }
 };
@@ -354,6 +359,34 @@ TEST_F(SnapDpaTest, create_rt_thread_single_n_event)
 	printf("total heap memory used %ld bytes\n", total_memory);
 }
 
+static uint64_t cmd_lat_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cmd_lat_report(const char *name, std::vector<uint64_t> &lat_ns)
+{
+	double sum = 0;
+
+	if (lat_ns.empty())
+		return;
+
+	std::sort(lat_ns.begin(), lat_ns.end());
+	for (uint64_t l : lat_ns)
+		sum += l;
+
+	printf("%s latency usec: avg %.3f min %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f, %zu iters\n",
+	       name, sum / lat_ns.size() / 1000.0,
+	       lat_ns.front() / 1000.0,
+	       lat_ns[lat_ns.size() / 2] / 1000.0,
+	       lat_ns[lat_ns.size() * 99 / 100] / 1000.0,
+	       lat_ns[lat_ns.size() * 999 / 1000] / 1000.0,
+	       lat_ns.back() / 1000.0, lat_ns.size());
+}
+
 void SnapDpaTest::run_cmd_lat_bench(int how)
 {
 	struct snap_dpa_ctx *dpa_ctx;
@@ -363,8 +396,8 @@ void SnapDpaTest::run_cmd_lat_bench(int how)
 	struct snap_dpa_cmd *cmd;
 	struct snap_dpa_rsp *rsp;
 	int i;
-	struct timeval t_s, t_e, t_r;
-	double t;
+	std::vector<uint64_t> lat_ns;
+	uint64_t t_s;
 	int N;
 
 	N = SNAP_DEBUG ? 10 : 1000000;
@@ -379,19 +412,18 @@ void SnapDpaTest::run_cmd_lat_bench(int how)
 	mbox = snap_dpa_thread_mbox_acquire(dpa_thr);
 	cmd = snap_dpa_mbox_to_cmd(mbox);
 
-	gettimeofday(&t_s, 0);
+	lat_ns.reserve(N);
 	for (i = 0; i < N; i++) {
+		t_s = cmd_lat_now_ns();
 		snap_dpa_cmd_send(dpa_thr, cmd, SNAP_DPA_CMD_APP_FIRST);
 		rsp = snap_dpa_rsp_wait(mbox);
+		lat_ns.push_back(cmd_lat_now_ns() - t_s);
 		if (rsp->status != SNAP_DPA_RSP_OK) {
 			printf("%d: Failed to copy DMA queue: %d\n", i, rsp->status);
 			break;
 		}
 	}
-	gettimeofday(&t_e, 0);
-	timersub(&t_e, &t_s, &t_r);
-	t = t_r.tv_sec + t_r.tv_usec/1000000.0;
-	printf("CMD latency %1.9lf seconds, %d iters\n", t/N, N);
+	cmd_lat_report("CMD", lat_ns);
 
 	snap_dpa_thread_mbox_release(dpa_thr);
 	snap_dpa_log_print(dpa_thr->dpa_log);
@@ -399,6 +431,69 @@ void SnapDpaTest::run_cmd_lat_bench(int how)
 	snap_dpa_process_destroy(dpa_ctx);
 }
 
+/* keep one command outstanding on each thread, collect with rsp_poll */
+void SnapDpaTest::run_cmd_lat_bench_pipelined(int n_threads)
+{
+	struct snap_dpa_ctx *dpa_ctx;
+	std::vector<struct snap_dpa_thread *> dpa_thr(n_threads);
+	std::vector<void *> mbox(n_threads);
+	std::vector<uint64_t> t_s(n_threads);
+	std::vector<uint64_t> lat_ns;
+	struct snap_dpa_thread_attr attr = {0};
+	struct snap_dpa_rsp *rsp;
+	uint64_t b_s, b_t;
+	int i, n_sent, n_done, N;
+
+	N = SNAP_DEBUG ? 10 : 100000;
+	dpa_ctx = snap_dpa_process_create(get_ib_ctx(), "dpa_cmd_lat_bench");
+	ASSERT_TRUE(dpa_ctx);
+
+	/* event on cq */
+	attr.user_arg = 0;
+	for (i = 0; i < n_threads; i++) {
+		dpa_thr[i] = snap_dpa_thread_create(dpa_ctx, &attr);
+		ASSERT_TRUE(dpa_thr[i]);
+		mbox[i] = snap_dpa_thread_mbox_acquire(dpa_thr[i]);
+	}
+	printf("pipelined benchmark on %d threads is running now...\n", n_threads);
+
+	lat_ns.reserve(N);
+	b_s = cmd_lat_now_ns();
+	for (i = 0, n_sent = 0; i < n_threads && n_sent < N; i++, n_sent++) {
+		t_s[i] = cmd_lat_now_ns();
+		snap_dpa_cmd_send(dpa_thr[i], snap_dpa_mbox_to_cmd(mbox[i]), SNAP_DPA_CMD_APP_FIRST);
+	}
+
+	for (n_done = 0; n_done < n_sent; ) {
+		for (i = 0; i < n_threads; i++) {
+			if (!t_s[i])
+				continue;
+			rsp = snap_dpa_rsp_poll(mbox[i]);
+			if (!rsp)
+				continue;
+			lat_ns.push_back(cmd_lat_now_ns() - t_s[i]);
+			n_done++;
+			EXPECT_EQ(SNAP_DPA_RSP_OK, (int)rsp->status);
+			if (n_sent == N) {
+				t_s[i] = 0;
+				continue;
+			}
+			t_s[i] = cmd_lat_now_ns();
+			snap_dpa_cmd_send(dpa_thr[i], snap_dpa_mbox_to_cmd(mbox[i]), SNAP_DPA_CMD_APP_FIRST);
+			n_sent++;
+		}
+	}
+	b_t = cmd_lat_now_ns() - b_s;
+	cmd_lat_report("pipelined CMD", lat_ns);
+	printf("%d threads: %.0f commands/sec\n", n_threads, n_done * 1e9 / b_t);
+
+	for (i = 0; i < n_threads; i++) {
+		snap_dpa_thread_mbox_release(dpa_thr[i]);
+		snap_dpa_thread_destroy(dpa_thr[i]);
+	}
+	snap_dpa_process_destroy(dpa_ctx);
+}
+
 TEST_F(SnapDpaTest, cmd_lat_bench_event_on_cq) {
 	run_cmd_lat_bench(0);
 }
@@ -415,6 +510,131 @@ TEST_F(SnapDpaTest, cmd_lat_bench_poll_on_window) {
 	run_cmd_lat_bench(3);
 }
 
+TEST_F(SnapDpaTest, cmd_lat_bench_pipelined) {
+	run_cmd_lat_bench_pipelined(8);
+}
+
+static void p2p_bench_rx_cb(struct snap_dma_q *q, const void *data, uint32_t data_len, uint32_t imm_data)
+{
+}
+
+#define P2P_BENCH_NUM_QUEUES 8
+
+static int p2p_bench_recv(struct snap_dpa_p2p_q *q, std::vector<uint64_t> &t_s,
+		std::vector<uint64_t> &lat_ns)
+{
+	struct snap_dpa_p2p_msg *msgs[64];
+	struct snap_dpa_p2p_msg_batch *b;
+	uint64_t now;
+	int i, j, n, n_entries = 0;
+
+	n = snap_dpa_p2p_recv_msg(q, msgs, 64);
+	if (!n)
+		return 0;
+
+	now = cmd_lat_now_ns();
+	for (i = 0; i < n; i++) {
+		if (msgs[i]->base.type != SNAP_DPA_P2P_MSG_BATCH)
+			continue;
+		b = (struct snap_dpa_p2p_msg_batch *)msgs[i];
+		for (j = 0; j < b->n_entries; j++) {
+			/* request staged while the previous one was in flight */
+			if (!t_s[b->entries[j].qid])
+				continue;
+			lat_ns.push_back(now - t_s[b->entries[j].qid]);
+			t_s[b->entries[j].qid] = 0;
+		}
+		n_entries += b->n_entries;
+	}
+	return n_entries;
+}
+
+/*
+ * DPU side loopback: one end stages msix requests of several queues and
+ * lazy credit updates, another end unpacks them. Latency is measured from
+ * the first staged request of the queue until it is received.
+ */
+void SnapDpaTest::run_p2p_batch_bench(uint64_t max_delay_ns)
+{
+	struct snap_dma_q_create_attr q_attr = {};
+	struct snap_dpa_p2p_q tx_q = {}, rx_q = {};
+	struct snap_dpa_p2p_batch batch;
+	std::vector<uint64_t> t_s(P2P_BENCH_NUM_QUEUES);
+	std::vector<uint64_t> lat_ns;
+	uint64_t b_s, b_t, now;
+	int i, qid, ret, N;
+
+	N = SNAP_DEBUG ? 100 : 1000000;
+
+	q_attr.tx_qsize = SNAP_DPA_RT_QP_TX_SIZE;
+	q_attr.tx_elem_size = SNAP_DPA_RT_QP_TX_ELEM_SIZE;
+	q_attr.rx_qsize = SNAP_DPA_RT_QP_RX_SIZE;
+	q_attr.rx_elem_size = SNAP_DPA_RT_QP_RX_ELEM_SIZE;
+	q_attr.mode = SNAP_DMA_Q_MODE_DV;
+	q_attr.sw_use_devx = true;
+	q_attr.rx_cb = p2p_bench_rx_cb;
+
+	tx_q.dma_q = snap_dma_ep_create(m_pd, &q_attr);
+	ASSERT_TRUE(tx_q.dma_q);
+	rx_q.dma_q = snap_dma_ep_create(m_pd, &q_attr);
+	ASSERT_TRUE(rx_q.dma_q);
+	ASSERT_EQ(0, snap_dma_ep_connect(tx_q.dma_q, rx_q.dma_q));
+	tx_q.credit_count = rx_q.credit_count = SNAP_DPA_RT_QP_RX_SIZE;
+
+	snap_dpa_p2p_batch_init(&batch, 0, SNAP_DPA_RT_P2P_CREDIT_BATCH, max_delay_ns);
+
+	lat_ns.reserve(N);
+	b_s = cmd_lat_now_ns();
+	for (i = 0; i < N; i++) {
+		qid = i % P2P_BENCH_NUM_QUEUES;
+		now = cmd_lat_now_ns();
+		if (!t_s[qid])
+			t_s[qid] = now;
+
+		/* entry stays staged if the send failed, retry collapses it */
+		while ((ret = snap_dpa_p2p_batch_add(&tx_q, &batch, SNAP_DPA_P2P_MSG_VQ_MSIX,
+						     qid, 0, now)) == -EAGAIN) {
+			snap_dma_q_progress(tx_q.dma_q);
+			p2p_bench_recv(&rx_q, t_s, lat_ns);
+		}
+		ASSERT_EQ(0, ret);
+		/* pretend that each request was answered by the peer */
+		ASSERT_EQ(0, snap_dpa_p2p_batch_add_credit(&tx_q, &batch, 1));
+
+		ASSERT_LE(0, snap_dpa_p2p_batch_progress(&tx_q, &batch, cmd_lat_now_ns()));
+		snap_dma_q_progress(tx_q.dma_q);
+		p2p_bench_recv(&rx_q, t_s, lat_ns);
+	}
+
+	while (batch.msg.n_entries ||
+	       std::any_of(t_s.begin(), t_s.end(), [](uint64_t t) { return t != 0; })) {
+		snap_dpa_p2p_batch_progress(&tx_q, &batch, cmd_lat_now_ns());
+		snap_dma_q_progress(tx_q.dma_q);
+		p2p_bench_recv(&rx_q, t_s, lat_ns);
+	}
+	b_t = cmd_lat_now_ns() - b_s;
+
+	printf("p2p batch max delay %lu ns: %.0f requests/sec, %lu messages, %.2f requests/message\n",
+	       max_delay_ns, N * 1e9 / b_t, batch.n_sends,
+	       batch.n_sends ? (double)batch.n_entries / batch.n_sends : 0.0);
+	cmd_lat_report("p2p batch", lat_ns);
+
+	snap_dma_ep_destroy(tx_q.dma_q);
+	snap_dma_ep_destroy(rx_q.dma_q);
+}
+
+TEST_F(SnapDpaTest, p2p_batch_bench_no_delay) {
+	run_p2p_batch_bench(0);
+}
+
+TEST_F(SnapDpaTest, p2p_batch_bench_2usec) {
+	run_p2p_batch_bench(2000);
+}
+
+TEST_F(SnapDpaTest, p2p_batch_bench_10usec) {
+	run_p2p_batch_bench(10000);
+}
+
 #if 0
 extern "C" {
 #include "snap_virtio_common.h"
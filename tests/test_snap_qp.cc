@@ -120,6 +120,60 @@ TEST_F(SnapQpTest, create_cq_collapsed) {
 	snap_cq_destroy(cq);
 }
 
+TEST_F(SnapQpTest, create_cq_shared_dbrec) {
+
+	struct snap_cq_attr cq_attr = {
+		.cq_type = SNAP_OBJ_DEVX,
+		.cqe_cnt = 64,
+		.cqe_size = 64
+	};
+	struct snap_cq *cq[2];
+	struct snap_hw_cq hw_cq[2];
+	int i, ret;
+
+	for (i = 0; i < 2; i++) {
+		cq[i] = snap_cq_create(m_pd->context, &cq_attr);
+		ASSERT_TRUE(cq[i]);
+		ret = snap_cq_to_hw_cq(cq[i], &hw_cq[i]);
+		ASSERT_EQ(0, ret);
+		EXPECT_EQ(0U, hw_cq[i].dbr_addr % SNAP_DBREC_SIZE);
+	}
+
+	/* records are packed into one page, each on its own cache line */
+	EXPECT_NE(hw_cq[0].dbr_addr, hw_cq[1].dbr_addr);
+	EXPECT_EQ(hw_cq[0].dbr_addr / SNAP_DBREC_PAGE_SIZE, hw_cq[1].dbr_addr / SNAP_DBREC_PAGE_SIZE);
+
+	for (i = 0; i < 2; i++)
+		snap_cq_destroy(cq[i]);
+}
+
+TEST_F(SnapQpTest, create_cq_uar_slot) {
+
+	struct snap_cq_attr cq_attr = {
+		.cq_type = SNAP_OBJ_DEVX,
+		.cqe_cnt = 64,
+		.cqe_size = 64
+	};
+	struct snap_cq *cq[3];
+	uint32_t page_id[3];
+	int i;
+
+	cq_attr.use_uar_slot = true;
+	for (i = 0; i < 3; i++) {
+		/* slots 0, 1, 0 */
+		cq_attr.uar_slot = i % 2;
+		cq[i] = snap_cq_create(m_pd->context, &cq_attr);
+		ASSERT_TRUE(cq[i]);
+		page_id[i] = cq[i]->devx_cq.devx.uar->uar->page_id;
+	}
+
+	EXPECT_NE(page_id[0], page_id[1]);
+	EXPECT_EQ(page_id[0], page_id[2]);
+
+	for (i = 0; i < 3; i++)
+		snap_cq_destroy(cq[i]);
+}
+
 TEST_P(SnapQpTest, create_qp) {
 	struct snap_cq_attr cq_attr = {0};
 	struct snap_qp_attr qp_attr = {0};
@@ -0,0 +1,186 @@
+#include <limits.h>
+#include "gtest/gtest.h"
+
+#include <stdint.h>
+#include <linux/virtio_ring.h>
+
+extern "C" {
+#include "snap.h"
+#include "snap_dma.h"
+#include "snap_virtio_common.h"
+#include "snap_virtio_blk.h"
+#include "snap_sw_virtio_blk.h"
+};
+
+#include "tests_common.h"
+
+#define SW_VBLK_TEST_QSIZE 8
+
+/*
+ * SW virtio blk queue over the SW loopback dma queue. The avail ring is
+ * in the process memory. The device is only needed to register the
+ * shadow ring memory, tests are skipped if it is not present.
+ */
+class SnapSwVirtioBlkTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+	protected:
+	struct ibv_pd *m_pd;
+	struct ibv_qp m_qp;
+	struct snap_dma_q *m_dma_q;
+	struct virtq_q_ops *m_ops;
+	struct snap_virtio_queue *m_vq;
+	struct vring_avail *m_avail;
+
+	void create_queue(uint64_t driver_addr, uint16_t avail_idx);
+	int poll(struct virtq_split_tunnel_req *reqs, int num_reqs);
+};
+
+static void sw_vblk_rx_cb(struct snap_dma_q *q, const void *data,
+			  uint32_t data_len, uint32_t imm_data)
+{
+}
+
+void SnapSwVirtioBlkTest::SetUp()
+{
+	struct snap_dma_q_create_attr attr = {};
+	bool init_ok = false;
+	int i, n_dev;
+	struct ibv_device **dev_list;
+	struct ibv_context *ib_ctx;
+
+	m_pd = NULL;
+	m_dma_q = NULL;
+	m_vq = NULL;
+	m_avail = (struct vring_avail *)calloc(1, sizeof(*m_avail) +
+					       SW_VBLK_TEST_QSIZE * sizeof(uint16_t));
+	ASSERT_TRUE(m_avail);
+	dev_list = ibv_get_device_list(&n_dev);
+	if (!dev_list)
+		return;
+
+	for (i = 0; i < n_dev; i++) {
+		if (strcmp(ibv_get_device_name(dev_list[i]),
+					get_dev_name()) == 0) {
+			ib_ctx = ibv_open_device(dev_list[i]);
+			if (!ib_ctx)
+				FAIL() << "Failed to open " << dev_list[i];
+			m_pd = ibv_alloc_pd(ib_ctx);
+			if (!m_pd)
+				FAIL() << "Failed to create PD";
+			init_ok = true;
+			goto out;
+		}
+	}
+out:
+	ibv_free_device_list(dev_list);
+	if (!init_ok) {
+		printf("device %s is not found\n", get_dev_name());
+		return;
+	}
+
+	/* sw queue only takes the pd from the qp */
+	memset(&m_qp, 0, sizeof(m_qp));
+	m_qp.pd = m_pd;
+
+	attr.tx_qsize = 64;
+	attr.tx_elem_size = 64;
+	attr.rx_qsize = 64;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = sw_vblk_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	m_dma_q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(m_dma_q);
+
+	m_ops = get_sw_queue_ops();
+}
+
+void SnapSwVirtioBlkTest::TearDown()
+{
+	struct ibv_context *ib_ctx;
+
+	if (m_vq)
+		m_ops->destroy(m_vq);
+	if (m_dma_q)
+		snap_dma_q_destroy(m_dma_q);
+	free(m_avail);
+	if (!m_pd)
+		return;
+	ib_ctx = m_pd->context;
+	ibv_dealloc_pd(m_pd);
+	ibv_close_device(ib_ctx);
+}
+
+void SnapSwVirtioBlkTest::create_queue(uint64_t driver_addr, uint16_t avail_idx)
+{
+	struct snap_virtio_common_queue_attr attr = {};
+
+	attr.qp = &m_qp;
+	attr.hw_available_index = avail_idx;
+	attr.dma_q = m_dma_q;
+	attr.vattr.size = SW_VBLK_TEST_QSIZE;
+	attr.vattr.driver = driver_addr;
+	m_vq = m_ops->create(NULL, &attr);
+	ASSERT_TRUE(m_vq);
+	EXPECT_EQ(SNAP_SW_Q_PROVIDER, attr.q_provider);
+}
+
+/* avail ring reads are completed only by the dma queue progress */
+int SnapSwVirtioBlkTest::poll(struct virtq_split_tunnel_req *reqs, int num_reqs)
+{
+	int n;
+
+	n = m_ops->poll(m_vq, reqs, num_reqs);
+	while (!snap_dma_q_empty(m_dma_q))
+		snap_dma_q_progress(m_dma_q);
+	return n;
+}
+
+TEST_F(SnapSwVirtioBlkTest, poll_heads) {
+	struct virtq_split_tunnel_req reqs[SW_VBLK_TEST_QSIZE];
+	struct snap_virtio_common_queue_attr qattr = {};
+	int i, n;
+
+	if (!m_dma_q)
+		SKIP_TEST_R("IB device is not available");
+
+	create_queue((uintptr_t)m_avail, 5);
+
+	/* new heads wrap around the end of the ring */
+	for (i = 0; i < 6; i++)
+		m_avail->ring[(5 + i) % SW_VBLK_TEST_QSIZE] = 10 + i;
+	m_avail->idx = 11;
+
+	/* avail idx read, then heads read */
+	EXPECT_EQ(0, poll(reqs, SW_VBLK_TEST_QSIZE));
+	EXPECT_EQ(0, poll(reqs, SW_VBLK_TEST_QSIZE));
+	n = poll(reqs, 4);
+	ASSERT_EQ(4, n);
+	/* rest of the batch is taken from the shadow ring */
+	n += poll(reqs + 4, SW_VBLK_TEST_QSIZE);
+	ASSERT_EQ(6, n);
+	for (i = 0; i < n; i++)
+		EXPECT_EQ(10 + i, reqs[i].hdr.descr_head_idx);
+
+	ASSERT_EQ(0, m_ops->query(m_vq, &qattr));
+	EXPECT_EQ(11, qattr.hw_available_index);
+}
+
+TEST_F(SnapSwVirtioBlkTest, avail_read_error) {
+	struct virtq_split_tunnel_req reqs[SW_VBLK_TEST_QSIZE];
+	struct snap_virtio_common_queue_attr qattr = {};
+	int i;
+
+	if (!m_dma_q)
+		SKIP_TEST_R("IB device is not available");
+
+	/* reads of the NULL page fail and return garbage */
+	create_queue(0, 0);
+	for (i = 0; i < 16; i++)
+		ASSERT_EQ(0, poll(reqs, SW_VBLK_TEST_QSIZE));
+
+	/* shadow ring must not be advanced over the failed reads */
+	ASSERT_EQ(0, m_ops->query(m_vq, &qattr));
+	EXPECT_EQ(0, qattr.hw_available_index);
+}
@@ -0,0 +1,312 @@
+#include <limits.h>
+#include "gtest/gtest.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+extern "C" {
+#include "snap_uring_blk_dev.h"
+};
+
+#define URING_TEST_BLK_SIZE	512U
+#define URING_TEST_NUM_BLOCKS	2048UL
+
+/* io_uring bdev over a temporary file, does not need a device */
+class SnapUringBlkTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+	protected:
+	char m_path[PATH_MAX];
+	struct snap_blk_dev *m_bdev;
+	struct snap_bdev_ops *m_ops;
+	int m_n_done;
+	int m_n_failed;
+	struct snap_bdev_io_done_ctx m_done_ctx;
+
+	void open_bdev(uint32_t queue_depth);
+	void wait(int n_done, int thread_id);
+
+	public:
+	static void io_done(enum snap_bdev_op_status status, void *done_arg);
+};
+
+void SnapUringBlkTest::io_done(enum snap_bdev_op_status status, void *done_arg)
+{
+	SnapUringBlkTest *t = (SnapUringBlkTest *)done_arg;
+
+	t->m_n_done++;
+	if (status != SNAP_BDEV_OP_SUCCESS)
+		t->m_n_failed++;
+}
+
+void SnapUringBlkTest::SetUp()
+{
+	int fd;
+
+	/* tmpfs may not support O_DIRECT or fallocate modes, use cwd */
+	snprintf(m_path, sizeof(m_path), "./snap_uring_blk_XXXXXX");
+	fd = mkstemp(m_path);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(0, ftruncate(fd, URING_TEST_BLK_SIZE * URING_TEST_NUM_BLOCKS));
+	close(fd);
+
+	m_bdev = NULL;
+	m_n_done = 0;
+	m_n_failed = 0;
+	m_done_ctx.cb = io_done;
+	m_done_ctx.user_arg = this;
+}
+
+void SnapUringBlkTest::TearDown()
+{
+	if (m_bdev)
+		snap_uring_blk_dev_close(m_bdev);
+	unlink(m_path);
+}
+
+void SnapUringBlkTest::open_bdev(uint32_t queue_depth)
+{
+	struct snap_blk_dev_attrs attrs = {};
+
+	attrs.type = SNAP_BLOCK_DEVICE_URING;
+	attrs.blk_size = URING_TEST_BLK_SIZE;
+	attrs.path = m_path;
+	attrs.queue_depth = queue_depth;
+	m_bdev = snap_uring_blk_dev_open("uring_test", &attrs);
+	ASSERT_TRUE(m_bdev);
+	m_ops = &m_bdev->ops;
+}
+
+void SnapUringBlkTest::wait(int n_done, int thread_id)
+{
+	int i;
+
+	for (i = 0; i < 1000000 && m_n_done < n_done; i++)
+		m_ops->progress(m_bdev, thread_id);
+	ASSERT_EQ(n_done, m_n_done);
+}
+
+TEST_F(SnapUringBlkTest, geometry) {
+	open_bdev(0);
+	EXPECT_EQ(URING_TEST_BLK_SIZE, m_ops->get_block_size(m_bdev));
+	EXPECT_EQ(URING_TEST_NUM_BLOCKS, m_ops->get_num_blocks(m_bdev));
+	EXPECT_STREQ("uring_test", m_ops->get_bdev_name(m_bdev));
+}
+
+TEST_F(SnapUringBlkTest, read_write) {
+	char *wbuf, *rbuf;
+	char fbuf[4096];
+	int fd;
+
+	open_bdev(0);
+	wbuf = (char *)m_ops->dma_malloc(4096);
+	rbuf = (char *)m_ops->dma_malloc(4096);
+	ASSERT_TRUE(wbuf && rbuf);
+
+	memset(wbuf, 0xA5, 4096);
+	ASSERT_EQ(0, m_ops->write(m_bdev, wbuf, 8192, 4096, &m_done_ctx, 0));
+	/* operations are submitted and completed only by progress */
+	EXPECT_EQ(0, m_n_done);
+	wait(1, 0);
+
+	ASSERT_EQ(0, m_ops->read(m_bdev, rbuf, 8192, 4096, &m_done_ctx, 0));
+	wait(2, 0);
+	EXPECT_EQ(0, m_n_failed);
+	EXPECT_EQ(0, memcmp(wbuf, rbuf, 4096));
+
+	fd = open(m_path, O_RDONLY);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(4096, pread(fd, fbuf, sizeof(fbuf), 8192));
+	close(fd);
+	EXPECT_EQ(0, memcmp(wbuf, fbuf, 4096));
+
+	m_ops->dma_free(wbuf);
+	m_ops->dma_free(rbuf);
+}
+
+/*
+ * Same layout as the virtq command array without the block size padding:
+ * request data is followed by the command aux header and descriptors, so
+ * every buffer but the first one is not block aligned. With O_DIRECT such
+ * buffers must be bounced.
+ */
+TEST_F(SnapUringBlkTest, virtq_layout_unaligned) {
+	const size_t seg_max = 8, req_size = 4096;
+	const size_t aux_size = 16 + 16 * (seg_max + 2);
+	const size_t data_size = req_size + aux_size;
+	const int num = 4;
+	struct iovec iov[2];
+	char *data, *buf;
+	int i;
+
+	open_bdev(0);
+	data = (char *)m_ops->dma_malloc(data_size * 2 * num);
+	ASSERT_TRUE(data);
+
+	for (i = 0; i < num; i++) {
+		buf = data + i * data_size;
+		memset(buf, 0x10 + i, req_size);
+		ASSERT_EQ(0, m_ops->write(m_bdev, buf, i * req_size, req_size,
+					  &m_done_ctx, 0));
+	}
+	wait(num, 0);
+
+	for (i = 0; i < num; i++) {
+		buf = data + (num + i) * data_size;
+		ASSERT_EQ(0, m_ops->read(m_bdev, buf, i * req_size, req_size,
+					 &m_done_ctx, 0));
+	}
+	wait(2 * num, 0);
+	EXPECT_EQ(0, m_n_failed);
+	for (i = 0; i < num; i++)
+		EXPECT_EQ(0, memcmp(data + i * data_size,
+				    data + (num + i) * data_size, req_size));
+
+	/* unaligned zcopy like segments, split in the middle of a block */
+	iov[0].iov_base = data + data_size;
+	iov[0].iov_len = 1000;
+	iov[1].iov_base = data + 3 * data_size;
+	iov[1].iov_len = 2 * req_size - 1000;
+	ASSERT_EQ(0, m_ops->readv_blocks(m_bdev, iov, 2, 0,
+					 2 * req_size / URING_TEST_BLK_SIZE,
+					 &m_done_ctx, 0));
+	wait(2 * num + 1, 0);
+	EXPECT_EQ(0, m_n_failed);
+	for (i = 0; i < 1000; i++)
+		EXPECT_EQ(0x10, data[data_size + i]);
+	for (i = 0; i < (int)(2 * req_size - 1000); i++)
+		EXPECT_EQ(i + 1000 < (int)req_size ? 0x10 : 0x11,
+			  data[3 * data_size + i]);
+
+	m_ops->dma_free(data);
+}
+
+TEST_F(SnapUringBlkTest, readv_writev) {
+	struct iovec iov[2];
+	char *buf;
+	int i;
+
+	open_bdev(0);
+	buf = (char *)m_ops->dma_malloc(3 * 4096);
+	ASSERT_TRUE(buf);
+
+	memset(buf, 0x11, 4096);
+	memset(buf + 4096, 0x22, 4096);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 4096;
+	iov[1].iov_base = buf + 4096;
+	iov[1].iov_len = 4096;
+	ASSERT_EQ(0, m_ops->writev_blocks(m_bdev, iov, 2, 16, 16, &m_done_ctx, 0));
+	wait(1, 0);
+
+	/* read back in a different layout */
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf + 8192, 16 * URING_TEST_BLK_SIZE, 4096, &m_done_ctx, 0));
+	wait(2, 0);
+	for (i = 0; i < 4096; i++)
+		ASSERT_EQ(0x11, buf[8192 + i]);
+
+	iov[0].iov_base = buf + 8192;
+	iov[0].iov_len = 4096;
+	ASSERT_EQ(0, m_ops->readv_blocks(m_bdev, iov, 1, 24, 8, &m_done_ctx, 0));
+	wait(3, 0);
+	for (i = 0; i < 4096; i++)
+		ASSERT_EQ(0x22, buf[8192 + i]);
+	EXPECT_EQ(0, m_n_failed);
+
+	m_ops->dma_free(buf);
+}
+
+TEST_F(SnapUringBlkTest, flush_discard_write_zeroes) {
+	char *buf;
+	int i;
+
+	open_bdev(0);
+	buf = (char *)m_ops->dma_malloc(4096);
+	ASSERT_TRUE(buf);
+
+	memset(buf, 0xFF, 4096);
+	ASSERT_EQ(0, m_ops->write(m_bdev, buf, 0, 4096, &m_done_ctx, 0));
+	ASSERT_EQ(0, m_ops->write(m_bdev, buf, 4096, 4096, &m_done_ctx, 0));
+	wait(2, 0);
+	ASSERT_EQ(0, m_ops->flush(m_bdev, 0, URING_TEST_NUM_BLOCKS, &m_done_ctx, 0));
+	wait(3, 0);
+
+	ASSERT_EQ(0, m_ops->write_zeroes(m_bdev, 0, 8, &m_done_ctx, 0));
+	ASSERT_EQ(0, m_ops->discard(m_bdev, 8, 8, &m_done_ctx, 0));
+	wait(5, 0);
+	EXPECT_EQ(0, m_n_failed);
+
+	/* both ranges read back as zeroes */
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf, 0, 4096, &m_done_ctx, 0));
+	wait(6, 0);
+	for (i = 0; i < 8 * (int)URING_TEST_BLK_SIZE; i++)
+		ASSERT_EQ(0, buf[i]);
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf, 4096, 4096, &m_done_ctx, 0));
+	wait(7, 0);
+	for (i = 0; i < 8 * (int)URING_TEST_BLK_SIZE; i++)
+		ASSERT_EQ(0, buf[i]);
+
+	/* device size is not changed by discard */
+	EXPECT_EQ(URING_TEST_NUM_BLOCKS, m_ops->get_num_blocks(m_bdev));
+	m_ops->dma_free(buf);
+}
+
+TEST_F(SnapUringBlkTest, queue_full) {
+	char *buf;
+
+	open_bdev(2);
+	buf = (char *)m_ops->dma_malloc(4096);
+	ASSERT_TRUE(buf);
+
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf, 0, 512, &m_done_ctx, 0));
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf + 512, 512, 512, &m_done_ctx, 0));
+	/* request table is full, caller must retry after progress */
+	EXPECT_EQ(-EAGAIN, m_ops->read(m_bdev, buf + 1024, 1024, 512, &m_done_ctx, 0));
+	/* other threads have their own table */
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf + 1024, 1024, 512, &m_done_ctx, 1));
+
+	wait(2, 0);
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf + 1536, 1536, 512, &m_done_ctx, 0));
+	wait(3, 0);
+	wait(4, 1);
+	EXPECT_EQ(0, m_n_failed);
+
+	m_ops->dma_free(buf);
+}
+
+TEST_F(SnapUringBlkTest, thread_id) {
+	char *buf;
+	int i;
+
+	open_bdev(0);
+	buf = (char *)m_ops->dma_malloc(4096);
+	ASSERT_TRUE(buf);
+
+	/* completions are only reaped with the id the op was submitted with */
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf, 0, 4096, &m_done_ctx, 3));
+	for (i = 0; i < 1000; i++)
+		m_ops->progress(m_bdev, 0);
+	EXPECT_EQ(0, m_n_done);
+	wait(1, 3);
+
+	EXPECT_EQ(-ENOMEM, m_ops->read(m_bdev, buf, 0, 4096, &m_done_ctx, -1));
+	m_ops->dma_free(buf);
+}
+
+TEST_F(SnapUringBlkTest, io_error) {
+	char *buf;
+
+	open_bdev(0);
+	buf = (char *)m_ops->dma_malloc(4096);
+	ASSERT_TRUE(buf);
+
+	/* short read past the end of the file */
+	ASSERT_EQ(0, m_ops->read(m_bdev, buf, URING_TEST_NUM_BLOCKS * URING_TEST_BLK_SIZE - 512,
+				 4096, &m_done_ctx, 0));
+	wait(1, 0);
+	EXPECT_EQ(1, m_n_failed);
+	m_ops->dma_free(buf);
+}